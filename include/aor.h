@@ -18,6 +18,7 @@ extern "C" {
 #include <pjsip.h>
 }
 
+#include <atomic>
 #include <string>
 #include <list>
 #include <map>
@@ -59,6 +60,32 @@ static const char* const JSON_SCSCF_URI = "scscf-uri";
 class AoR
 {
 public:
+  /// @class AoR::RefCount
+  ///
+  /// Bindings and subscriptions are shared between copies of an AoR until a
+  /// copy changes them, so that copying an AoR to keep the original (as
+  /// AoRPair does) is cheap.  This counts the AoRs holding a binding or
+  /// subscription.  Copying a binding or subscription doesn't copy its count.
+  class RefCount
+  {
+  public:
+    RefCount() : _count(1) {}
+    RefCount(const RefCount&) : _count(1) {}
+    RefCount& operator=(const RefCount&) { return *this; }
+
+    /// Counts another AoR holding the binding or subscription.
+    void inc() { ++_count; }
+
+    /// Stops counting an AoR.  Returns true if no AoRs now hold it.
+    bool dec() { return (--_count == 0); }
+
+    /// Whether more than one AoR holds it.
+    bool shared() const { return (_count > 1); }
+
+  private:
+    std::atomic<int> _count;
+  };
+
   /// @class AoR::Binding
   ///
   /// A single registered address.
@@ -110,6 +137,9 @@ public:
     /// Whether this is an emergency registration.
     bool _emergency_registration;
 
+    /// The number of AoRs sharing this binding.
+    RefCount _refs;
+
     pjsip_sip_uri* pub_gruu(pj_pool_t* pool) const;
     std::string pub_gruu_str(pj_pool_t* pool) const;
     std::string pub_gruu_quoted_string(pj_pool_t* pool) const;
@@ -166,6 +196,9 @@ public:
     /// should expire.
     int _expires;
 
+    /// The number of AoRs sharing this subscription.
+    RefCount _refs;
+
     /// Serialize the subscription as a JSON object.
     ///
     /// @param writer - a rapidjson writer to write to.
@@ -200,6 +233,10 @@ public:
 
   /// Retrieve a binding by Binding ID, creating an empty one if necessary.
   /// The created binding is completely empty, even the Contact URI field.
+  ///
+  /// This is the only way to get a binding to change.  If the binding is
+  /// shared with a copy of this AoR, it is copied first.  Bindings reached
+  /// through bindings() must not be changed.
   Binding* get_binding(const std::string& binding_id);
 
   /// Removes any binding that had the given ID.  If there is no such binding,
@@ -207,15 +244,28 @@ public:
   void remove_binding(const std::string& binding_id);
 
   /// Retrieve a subscription by To tag, creating an empty one if necessary.
+  /// As with get_binding, this is the only way to get a subscription to
+  /// change.
   Subscription* get_subscription(const std::string& to_tag);
 
   /// Remove a subscription for the specified To tag.  If there is no
   /// corresponding subscription does nothing.
   void remove_subscription(const std::string& to_tag);
 
+  /// Add a binding or subscription held by another AoR, sharing it until
+  /// one of the AoRs changes it.  There must be no binding or subscription
+  /// with the same ID already.
+  void share_binding(const std::string& binding_id, Binding* binding);
+  void share_subscription(const std::string& to_tag, Subscription* subscription);
+
   // Remove the bindings from an AOR object
   void clear_bindings();
 
+  /// Release a binding or subscription that has been removed from an AoR,
+  /// deleting it if no other AoR holds it.
+  static void release(Binding* binding);
+  static void release(Subscription* subscription);
+
   /// Binding ID -> Binding.  First is sometimes the contact URI, but not always.
   /// Second is a pointer to an object owned by this object.
   typedef std::map<std::string, Binding*> Bindings;
@@ -277,6 +327,14 @@ public:
   /// Zero for a new record that has not yet been written to a store.
   uint64_t _cas;
 
+  /// Used by stores that write each binding and subscription as a separate
+  /// record.  The CAS of each binding and subscription record as read (keyed
+  /// by binding ID and To tag), and the index record that listed them.  All
+  /// empty if the AoR was read as a single record.
+  std::map<std::string, uint64_t> _binding_cas;
+  std::map<std::string, uint64_t> _subscription_cas;
+  std::string _delta_index;
+
   // SIP URI for this AoR
   std::string _uri;
 
@@ -343,6 +401,14 @@ private:
 
   /// The subscriber data manager is allowed to access the original AoR
   friend class SubscriberDataManager;
+
+  /// The AoR store uses the original AoR to work out which records to write
+  /// when writing deltas.
+  friend class AstaireAoRStore;
+
+  /// The replicator uses the original AoR to work out what to write to the
+  /// remote sites.
+  friend class AoRReplicator;
 };
 
 #endif
@@ -0,0 +1,87 @@
+/**
+ * @file aor_cache.h In-process cache of AoRs read from the AoR store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef AOR_CACHE_H__
+#define AOR_CACHE_H__
+
+#include <string>
+
+#include "aor.h"
+#include "sharded_cache.h"
+#include "snmp_counter_table.h"
+
+/// Read-through cache of AoRs, held in front of an AoR store so that
+/// repeated lookups of the same AoR (for example a PBX trunk receiving many
+/// calls) don't each need a store round trip and a deserialization.
+///
+/// Entries are held for a short TTL, so reads may see data up to that old if
+/// another node has updated the AoR.  Each entry records the CAS it was read
+/// with.  Writes invalidate the entry, so a write that fails on a stale CAS
+/// is retried against the store.  See ShardedCache for how reads that race
+/// with writes are kept out of the cache.
+class AoRCache
+{
+public:
+  /// Constructor.
+  ///
+  /// @param ttl_ms        - How long an entry may be served for.
+  /// @param max_bytes     - Approximate limit on the memory used by entries.
+  /// @param hits_tbl      - Statistics counters, all of which may be NULL.
+  /// @param misses_tbl
+  /// @param stale_tbl     - Counts writes that failed because the AoR they
+  ///                        were based on had been served from the cache with
+  ///                        an out of date CAS.
+  AoRCache(int ttl_ms,
+           size_t max_bytes,
+           SNMP::CounterTable* hits_tbl = NULL,
+           SNMP::CounterTable* misses_tbl = NULL,
+           SNMP::CounterTable* stale_tbl = NULL);
+
+  virtual ~AoRCache();
+
+  /// Returns a copy of the cached AoR (owned by the caller), or NULL if the
+  /// AoR isn't cached or its entry has expired.
+  AoR* get(const std::string& aor_id);
+
+  /// Returns the AoR's current generation.  Call this before reading the AoR
+  /// from the store, and pass the result to put().
+  uint64_t get_generation(const std::string& aor_id);
+
+  /// Caches a copy of an AoR just read from the store, unless the AoR has
+  /// been invalidated since the read started.
+  ///
+  /// @param generation - The AoR's generation when the read started.
+  void put(const std::string& aor_id, const AoR* aor, uint64_t generation);
+
+  /// Removes an AoR from the cache and bumps its generation, after an attempt
+  /// to write it.
+  ///
+  /// @param cas       - The CAS the write was based on.
+  /// @param contended - Whether the write failed because the CAS was stale.
+  void invalidate(const std::string& aor_id, uint64_t cas, bool contended);
+
+  /// Number of AoRs cached.
+  size_t size();
+
+  /// Estimate of the memory used by a cached AoR.
+  static size_t estimate_size(const std::string& aor_id, const AoR* aor);
+
+  static const int NUM_SHARDS = ShardedCache<AoR>::NUM_SHARDS;
+
+private:
+  ShardedCache<AoR> _cache;
+
+  SNMP::CounterTable* _hits_tbl;
+  SNMP::CounterTable* _misses_tbl;
+  SNMP::CounterTable* _stale_tbl;
+};
+
+#endif
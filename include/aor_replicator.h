@@ -0,0 +1,188 @@
+/**
+ * @file aor_replicator.h Writes AoR changes to remote sites asynchronously.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef AOR_REPLICATOR_H__
+#define AOR_REPLICATOR_H__
+
+#include <atomic>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+
+#include "threadpool.h"
+#include "exception_handler.h"
+#include "utils.h"
+#include "sas.h"
+#include "snmp_counter_table.h"
+#include "snmp_event_accumulator_table.h"
+#include "subscriber_data_manager.h"
+
+/// Writes changes made to AoRs at the local site to the stores of the remote
+/// sites, on its own pool of threads.  This takes the remote writes off the
+/// thread handling the request, which otherwise waits a WAN round trip per
+/// remote site before it can respond.
+///
+/// Each change is queued once per remote site, so a slow or failed site
+/// doesn't hold up the others.  Changes to the same AoR for the same site are
+/// always handled by the same worker thread, so they are written in order.
+/// The queue is bounded; changes that don't fit are dropped (and counted).
+/// If a change is dropped, or can't be written, the next change to the AoR
+/// for that site writes the complete AoR rather than just the change.
+///
+/// When the replicator is in use, all writes to the remote sites must go
+/// through it, as a write made directly isn't ordered against the changes
+/// queued for the AoR.
+class AoRReplicator
+{
+public:
+  /// Statistics tables for one remote site.
+  struct SiteStats
+  {
+    /// Time from the change being queued to it being written, in
+    /// microseconds.
+    SNMP::EventAccumulatorTable* lag_tbl;
+
+    /// Changes that couldn't be written.
+    SNMP::CounterTable* failures_tbl;
+  };
+
+  /// Constructor.
+  ///
+  /// @param remote_sdms       - The remote sites' SDMs.
+  /// @param site_stats        - Statistics for each remote site, in the same
+  ///                            order.
+  /// @param dropped_tbl       - Counts changes dropped as the queue was full.
+  /// @param exception_handler - Exception handler for the worker threads.
+  /// @param num_threads       - Number of worker threads.  Each has its own
+  ///                            queue, and changes are assigned to them by
+  ///                            AoR and site.
+  /// @param max_queue         - Maximum number of queued writes.
+  AoRReplicator(std::vector<SubscriberDataManager*> remote_sdms,
+                std::vector<SiteStats> site_stats,
+                SNMP::CounterTable* dropped_tbl,
+                ExceptionHandler* exception_handler,
+                unsigned int num_threads,
+                unsigned int max_queue);
+
+  /// Destructor.  Waits for queued writes to finish.
+  virtual ~AoRReplicator();
+
+  /// Queues a change to an AoR, which has been written to the local site, to
+  /// be written to each remote site.  The change is the difference between
+  /// the original and current AoRs in the pair.  These are copied, so the
+  /// caller keeps ownership of the pair.
+  virtual void replicate(const std::string& aor_id,
+                         const SubscriberDataManager::EventTrigger& event_trigger,
+                         AoRPair* aor_pair,
+                         SAS::TrailId trail);
+
+  /// Whether the remote site with the given SDM may have an older copy of an
+  /// AoR than the local site, as changes to it are queued or being written
+  /// for that site, or one has been lost.
+  virtual bool site_behind(const std::string& aor_id,
+                           const SubscriberDataManager* sdm);
+
+  /// Applies a change, made at the local site, to an AoR read from a remote
+  /// site.  Bindings and subscriptions that were added or changed locally
+  /// are copied to the remote AoR, and those that were removed locally are
+  /// removed.
+  static void apply_change(AoRPair* local_aor_pair, AoR* remote);
+
+  /// Makes an AoR read from a remote site match the local AoR, copying all
+  /// of its bindings and subscriptions and removing any that the local AoR
+  /// doesn't have.
+  static void apply_full(AoR* local, AoR* remote);
+
+  /// Number of attempts to write a change to a remote site.
+  static const int MAX_ATTEMPTS = 5;
+
+  /// Defaults for the options controlling the replicator.
+  static const unsigned int DEFAULT_MAX_QUEUE = 1000;
+
+private:
+  /// A change queued for one remote site.
+  struct Request
+  {
+    std::string aor_id;
+    SubscriberDataManager::EventTrigger event_trigger;
+    AoRPair* aor_pair;
+    size_t site;
+    SAS::TrailId trail;
+    Utils::StopWatch stop_watch;
+    AoRReplicator* replicator;
+
+    /// Orders the changes to each AoR.  A change with a higher sequence number
+    /// than a change that was dropped or failed includes that change.
+    uint64_t sequence;
+  };
+
+  /// Identifies an AoR at a remote site.
+  typedef std::pair<std::string, size_t> AoRSite;
+
+  /// @class Pool
+  /// A worker that writes to the remote sites.  Each pool has a single thread,
+  /// so the changes it is given are written in order.
+  class Pool : public ThreadPool<Request*>
+  {
+  public:
+    Pool(AoRReplicator* replicator,
+         ExceptionHandler* exception_handler);
+
+    virtual ~Pool();
+
+  private:
+    /// Called by worker threads when they pull work off the queue.
+    virtual void process_work(Request*& request);
+
+    AoRReplicator* _replicator;
+  };
+
+  friend class Pool;
+
+  static void exception_callback(Request* request);
+
+  /// Writes a change to a remote site, retrying on contention or error.
+  void write_to_site(Request* request);
+
+  /// Records that a change to an AoR couldn't be written to a site, so the
+  /// complete AoR must be written with the next change.
+  void resync_needed(const AoRSite& aor_site, uint64_t sequence);
+
+  /// Checks whether the given change must write the complete AoR, because
+  /// an earlier change was lost.  If so, the AoR is no longer marked.
+  bool take_resync(const AoRSite& aor_site, uint64_t sequence);
+
+  /// Called when a queued change has been handled, whether or not it was
+  /// written.
+  void change_done(Request* request);
+
+  std::vector<SubscriberDataManager*> _remote_sdms;
+  std::vector<SiteStats> _site_stats;
+  SNMP::CounterTable* _dropped_tbl;
+  unsigned int _max_queue;
+  std::atomic<unsigned int> _queue_depth;
+  std::atomic<uint64_t> _next_sequence;
+  std::vector<Pool*> _thread_pools;
+
+  /// AoRs that need a complete write to a site, and the sequence number of
+  /// the most recent change that was lost.
+  std::map<AoRSite, uint64_t> _resyncs;
+
+  /// The number of changes queued, or being written, for each AoR and site.
+  std::map<AoRSite, int> _pending;
+
+  /// Protects _resyncs and _pending.
+  pthread_mutex_t _lock;
+};
+
+#endif
@@ -15,18 +15,40 @@
 
 
 #include <string>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 
 
 #include "aor_store.h"
+#include "aor_cache.h"
 
 // Implementation of the AoRStore specific to our use of Memcached under Astaire
 class AstaireAoRStore: public AoRStore
 {
 public:
+  /// Format used to write AoRs to the store.  AoRs in either format can
+  /// always be read.
+  enum SerializationFormat
+  {
+    JSON,
+    BINARY
+  };
+
   /// Constructor.
-  AstaireAoRStore(Store* store);
+  ///
+  /// @param store     The underlying data store.
+  /// @param aor_cache Optional cache of AoRs read from the store.  Not owned
+  ///                  by the AstaireAoRStore.
+  /// @param format    The format to write AoRs in.
+  /// @param delta_writes Whether to write each binding and subscription as a
+  ///                  separate record, so that updates only write the
+  ///                  records that have changed.  AoRs written either way
+  ///                  can always be read.
+  AstaireAoRStore(Store* store,
+                  AoRCache* aor_cache = NULL,
+                  SerializationFormat format = JSON,
+                  bool delta_writes = false);
 
   /// Destructor.
   virtual ~AstaireAoRStore();
@@ -58,19 +80,19 @@ public:
                                      SAS::TrailId trail) override;
 
 
-  /// Class used by the AstaireAoRStore to serialize AoRs from C++
-  /// objects to the JSON format used in the store, and deserialize them.
-  class JsonSerializerDeserializer
+  /// Interface used by the AstaireAoRStore to serialize AoRs from C++
+  /// objects to a format used in the store, and deserialize them.
+  class SerializerDeserializer
   {
   public:
     /// Destructor.
-    ~JsonSerializerDeserializer() {}
+    virtual ~SerializerDeserializer() {}
 
     /// Serialize an AoR object to the format used in the store.
     ///
     /// @param aor_data - The AoR object to serialize.
     /// @return         - The serialized form.
-    std::string serialize_aor(AoR* aor_data);
+    virtual std::string serialize_aor(AoR* aor_data) = 0;
 
     /// Deserialize some data from the store into an AoR object.
     ///
@@ -80,8 +102,49 @@ public:
     ///
     /// @return       - An AoR object, or NULL if the data could not be
     ///                 deserialized (e.g. because it is corrupt).
+    virtual AoR* deserialize_aor(const std::string& aor_id,
+                                 const std::string& s) = 0;
+
+    /// Whether the data from the store is in this format.
+    virtual bool handles_data(const std::string& s) = 0;
+  };
+
+  /// (De)serializer for the JSON format.
+  class JsonSerializerDeserializer : public SerializerDeserializer
+  {
+  public:
+    /// Destructor.
+    ~JsonSerializerDeserializer() {}
+
+    std::string serialize_aor(AoR* aor_data) override;
+
     AoR* deserialize_aor(const std::string& aor_id,
-                         const std::string& s);
+                         const std::string& s) override;
+
+    /// Anything that isn't in the binary format is treated as JSON.
+    bool handles_data(const std::string& s) override;
+  };
+
+  /// (De)serializer for a compact binary format.  The data starts with a
+  /// magic byte (which can't start a JSON document) and a version byte,
+  /// followed by a table of every distinct string in the AoR.  Strings in the
+  /// rest of the data are indexes into that table, and all integers are
+  /// variable length.
+  class BinarySerializerDeserializer : public SerializerDeserializer
+  {
+  public:
+    /// Destructor.
+    ~BinarySerializerDeserializer() {}
+
+    std::string serialize_aor(AoR* aor_data) override;
+
+    AoR* deserialize_aor(const std::string& aor_id,
+                         const std::string& s) override;
+
+    bool handles_data(const std::string& s) override;
+
+    static const unsigned char MAGIC = 0xB1;
+    static const unsigned char VERSION = 1;
   };
 
   /// Provides the interface to the data store. This is responsible for
@@ -90,8 +153,11 @@ public:
   /// functions in case of failure.
   class Connector
   {
+    /// Takes ownership of the serializers.  The first is used to write AoRs,
+    /// and AoRs are read with the first that handles the data.
     Connector(Store* data_store,
-              JsonSerializerDeserializer*& serializer_deserializer);
+              std::vector<SerializerDeserializer*>& serializer_deserializers,
+              bool delta_writes = false);
 
     ~Connector();
 
@@ -102,6 +168,18 @@ public:
                                int expiry,
                                SAS::TrailId trail);
 
+    /// Writes only the parts of the AoR that have changed since it was read.
+    /// The AoR is held as an index record (under the AoR ID) listing the
+    /// bindings and subscriptions, each of which is held in its own record.
+    ///
+    /// @param orig_aor    The AoR as read from the store
+    /// @param aor_data    The AoR to write
+    Store::Status set_aor_data_delta(const std::string& aor_id,
+                                     AoR* orig_aor,
+                                     AoR* aor_data,
+                                     int expiry,
+                                     SAS::TrailId trail);
+
     bool underlying_store_has_servers() { return (_data_store != NULL) && _data_store->has_servers(); }
 
     Store* _data_store;
@@ -110,11 +188,57 @@ public:
     friend class AstaireAoRStore;
 
   private:
-    JsonSerializerDeserializer* _serializer_deserializer;
+    /// Deserializes a single AoR record with the first serializer that
+    /// handles it.  Returns NULL if it can't be deserialized.
+    AoR* deserialize_aor(const std::string& aor_id, const std::string& data);
+
+    /// Whether a record is an index record written by set_aor_data_delta.
+    static bool is_delta_index(const std::string& data);
+
+    /// Builds an AoR from an index record, reading each of the binding and
+    /// subscription records it lists.  If a record is missing the index is
+    /// read again (updating index_data and cas) and the AoR rebuilt.  Returns
+    /// an error if the records can't be read, and OK with a NULL AoR if the
+    /// index can't be deserialized.
+    Store::Status get_aor_data_from_index(const std::string& aor_id,
+                                          std::string& index_data,
+                                          uint64_t& cas,
+                                          AoR*& aor_data,
+                                          SAS::TrailId trail);
+
+    /// Makes a single attempt at building an AoR from an index record,
+    /// leaving out (and reporting) any records that aren't found.
+    Store::Status read_indexed_records(const std::string& aor_id,
+                                       const std::string& index_data,
+                                       AoR*& aor_data,
+                                       bool& records_missing,
+                                       SAS::TrailId trail);
+
+    /// Writes a binding or subscription record.  If the record isn't
+    /// expected to exist but does (left behind by an earlier write that
+    /// didn't complete), it is overwritten.
+    Store::Status set_record(const std::string& key,
+                             const std::string& data,
+                             uint64_t cas,
+                             int expiry,
+                             SAS::TrailId trail);
+
+    std::vector<SerializerDeserializer*> _serializer_deserializers;
+    bool _delta_writes;
+
+    static const unsigned char DELTA_MAGIC = 0xD1;
+    static const unsigned char DELTA_VERSION = 1;
+
+    /// The number of times the index is read while records it lists are
+    /// missing before the read is failed.
+    static const int MAX_INDEX_READ_ATTEMPTS = 3;
   };
 
 public:
   Connector* _connector;
+
+private:
+  AoRCache* _aor_cache;
 };
 
 #endif
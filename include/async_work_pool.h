@@ -0,0 +1,101 @@
+/**
+ * @file async_work_pool.h Runs work that would block a worker thread on a
+ * separate pool of threads.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ASYNC_WORK_POOL_H__
+#define ASYNC_WORK_POOL_H__
+
+#include "threadpool.h"
+#include "exception_handler.h"
+#include "pjutils.h"
+
+/// Work that would block the thread running it - typically a request to
+/// Homestead or another HTTP server.
+class AsyncWork
+{
+public:
+  virtual ~AsyncWork() {}
+
+  /// Does the blocking part of the work.  This is called on one of the
+  /// AsyncWorkPool's threads, so mustn't touch state belonging to whatever
+  /// requested the work; it should leave its results in the AsyncWork.
+  virtual void run() = 0;
+};
+
+/// Runs AsyncWork on a pool of threads, and then hands a callback to the
+/// worker threads to pick up the results.  While the work is outstanding,
+/// the worker thread that requested it is free to process other messages,
+/// so requests that wait on Homestead don't each tie up a worker thread.
+class AsyncWorkPool
+{
+public:
+  /// Function that queues a callback to be run on a worker thread.
+  typedef void (*QueueCallbackFn)(PJUtils::Callback* callback);
+
+  /// Constructor.
+  ///
+  /// @param exception_handler - Exception handler for the pool's threads.
+  /// @param num_threads       - Number of threads in the pool.  This bounds
+  ///                            the number of blocking requests in flight.
+  /// @param queue_callback    - Queues callbacks for the worker threads.
+  ///                            Overridden by the UTs.
+  AsyncWorkPool(ExceptionHandler* exception_handler,
+                unsigned int num_threads,
+                QueueCallbackFn queue_callback = NULL);
+
+  /// Destructor.
+  virtual ~AsyncWorkPool();
+
+  /// Runs some work on the pool.  Once it has run, the callback is queued
+  /// to run on a worker thread.  The callback is always queued, even if the
+  /// work hits an exception, so whatever is waiting for the work isn't left
+  /// waiting forever.
+  ///
+  /// @param work              - The work to run.  The caller keeps
+  ///                            ownership, and mustn't touch it until the
+  ///                            callback runs.
+  /// @param callback          - The callback.  Ownership passes to the
+  ///                            pool.
+  virtual void run(AsyncWork* work, PJUtils::Callback* callback);
+
+private:
+  /// A piece of work and the callback to queue once it has run.
+  struct Job
+  {
+    AsyncWork* work;
+    PJUtils::Callback* callback;
+    QueueCallbackFn queue_callback;
+  };
+
+  /// @class Pool
+  /// The thread pool that runs the work.
+  class Pool : public ThreadPool<Job*>
+  {
+  public:
+    Pool(ExceptionHandler* exception_handler, unsigned int num_threads);
+
+    virtual ~Pool();
+
+  private:
+    /// Called by worker threads when they pull work off the queue.
+    virtual void process_work(Job*& job);
+  };
+
+  /// Queues the callback for a job, and deletes the job.
+  static void complete_job(Job* job);
+
+  static void exception_callback(Job* job);
+
+  QueueCallbackFn _queue_callback;
+  Pool* _thread_pool;
+};
+
+#endif
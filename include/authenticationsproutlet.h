@@ -217,6 +217,10 @@ public:
   virtual void on_rx_initial_request(pjsip_msg* req) override;
   virtual void on_rx_response(pjsip_msg* rsp, int fork_id) override;
 
+  /// Many requests are rejected with a challenge, so only copy the request
+  /// if it is forwarded.
+  virtual bool copy_on_write() const override { return true; }
+
 protected:
   friend class AuthenticationSproutlet;
 
@@ -22,17 +22,32 @@
 #include "stack.h"
 #include "pjmodule.h"
 #include "acr.h"
+#include "utils.h"
+#include "async_work_pool.h"
+#include "snmp_event_accumulator_table.h"
 
 /// Class implementing basic SIP proxy functionality.  Various methods in
 /// this class can be overriden to implement different proxy behaviours.
 class BasicProxy
 {
 public:
+  /// Constructor.
+  ///
+  /// @param  resolver_pool       - Pool on which the next hops of forked
+  ///                               requests are resolved, so that the forks
+  ///                               are resolved concurrently.  If NULL, each
+  ///                               fork is resolved on the worker thread
+  ///                               before it is sent.
+  /// @param  fork_latency_tbl    - Statistics on the time taken from each fork
+  ///                               being created to its request being sent.
+  ///                               May be NULL.
   BasicProxy(pjsip_endpoint* endpt,
              std::string name,
              int priority,
              bool delay_trying,
-             const std::set<std::string>& stateless_proxies);
+             const std::set<std::string>& stateless_proxies,
+             AsyncWorkPool* resolver_pool=NULL,
+             SNMP::EventAccumulatorTable* fork_latency_tbl=NULL);
   virtual ~BasicProxy();
 
   virtual pj_bool_t on_rx_request(pjsip_rx_data* rdata);
@@ -257,6 +272,11 @@ protected:
     /// Reason header.
     virtual void cancel_pending_tsx(int st_code);
 
+    /// Called on a worker thread when the next hop of the request has been
+    /// resolved on the resolver pool.  Sends the request, unless the
+    /// transaction has been cancelled in the meantime.
+    void on_resolve_complete();
+
     /// Attempts a retry of the request.
     virtual bool retry_request();
 
@@ -280,6 +300,43 @@ protected:
                               struct pj_timer_entry *entry);
 
   protected:
+    /// Resolution of the next hop of the request, run on the resolver pool.
+    class ResolveWork : public AsyncWork
+    {
+    public:
+      ResolveWork(const std::string& name,
+                  int port,
+                  int transport,
+                  int allowed_host_state,
+                  int retries,
+                  SAS::TrailId trail);
+
+      void run() override;
+
+      std::string _name;
+      int _port;
+      int _transport;
+      int _allowed_host_state;
+      int _retries;
+      SAS::TrailId _trail;
+
+      /// The servers to try, in order.
+      std::vector<AddrInfo> _targets;
+    };
+
+    /// The callback run on a worker thread when the next hop has been
+    /// resolved.
+    class ResolveCallback : public PJUtils::Callback
+    {
+    public:
+      ResolveCallback(UACTsx* uac_tsx);
+
+      void run() override;
+
+    private:
+      UACTsx* _uac_tsx;
+    };
+
     /// Helper class to make sure that targets are blacklisted or whitelisted,
     /// even in the event the calling code does not make a definitive decision.
     class Target
@@ -338,6 +395,14 @@ protected:
     /// Called when timer C expires.
     void timer_c_expired();
 
+    /// Sends the request to the resolved next hop.  This must be called in the
+    /// transaction's context.
+    void dispatch_request();
+
+    /// Reports a 487 response upstream for a request that can't be CANCELled
+    /// downstream.
+    void report_request_terminated();
+
     /// Called to get the next server to try, which is stored in
     /// _current_server. Returns false if there are no servers or left, or if
     /// the maximum number of attempts has been attempted.
@@ -369,6 +434,17 @@ protected:
     /// Iterator to the list of available servers.
     BaseAddrIterator* _servers_iter;
 
+    /// Resolution of the next hop still to be done on the resolver pool, or
+    /// NULL if the next hop was resolved when the transaction was created.
+    ResolveWork* _resolve_work;
+
+    /// Whether the next hop is being resolved on the resolver pool.  While it
+    /// is, the transaction holds an extra context so it isn't destroyed.
+    bool _resolving;
+
+    /// Times from the fork being created to its request being sent.
+    Utils::StopWatch _fork_stopwatch;
+
     /// Current server target.
     Target _current_server;
 
@@ -450,6 +526,14 @@ protected:
   /// entry "pool.example.com", not one entry for each server.
   std::set<std::string> _stateless_proxies;
 
+  /// Pool on which the next hops of requests are resolved, or NULL if they
+  /// are resolved on the worker threads.
+  AsyncWorkPool* _resolver_pool;
+
+  /// Time taken from each fork being created to its request being sent,
+  /// including resolving the next hop, or NULL if this isn't recorded.
+  SNMP::EventAccumulatorTable* _fork_latency_tbl;
+
   friend class UASTsx; friend class UACTsx;
 };
 
@@ -23,6 +23,7 @@
 #include "enumservice.h"
 #include "exception_handler.h"
 #include "ralf_processor.h"
+#include "aor_replicator.h"
 #include "sproutlet_options.h"
 #include "impistore.h"
 #include "analyticslogger.h"
@@ -98,6 +99,7 @@ struct options
   int                                  memento_threads;
   int                                  call_list_ttl;
   int                                  worker_threads;
+  int                                  pjsip_threads;
   bool                                 log_to_file;
   std::string                          log_directory;
   int                                  log_level;
@@ -145,6 +147,27 @@ struct options
   int                                  request_on_queue_timeout;
   std::set<std::string>                blacklisted_scscfs;
   bool                                 enable_orig_sip_to_tel_coerce;
+  bool                                 sharded_worker_queues;
+  bool                                 deferred_rx_parse;
+  bool                                 predictive_queue_reject;
+  bool                                 fair_queueing;
+  int                                  max_queue_depth_per_source;
+  std::map<std::string, int>           fair_queueing_weights;
+  bool                                 method_aware_priorities;
+  std::map<int, int>                   message_priority_levels;
+  int                                  regex_cache_size;
+  int                                  aor_cache_ttl_ms;
+  int                                  aor_cache_max_kb;
+  bool                                 aor_binary_format;
+  bool                                 aor_delta_writes;
+  int                                  remote_write_threads;
+  int                                  remote_write_queue;
+  int                                  chronos_batch_window_ms;
+  int                                  hss_cache_ttl_ms;
+  int                                  hss_cache_max_kb;
+  int                                  async_http_threads;
+  bool                                 skip_local_sproutlet_selection_logs;
+  int                                  async_dns_threads;
 };
 
 // Objects that must be shared with dynamically linked sproutlets must be
@@ -157,6 +180,7 @@ extern Store* local_impi_data_store;
 extern std::vector<Store*> remote_impi_data_stores;
 extern SubscriberDataManager* local_sdm;
 extern std::vector<SubscriberDataManager*> remote_sdms;
+extern AoRReplicator* aor_replicator;
 extern ImpiStore* local_impi_store;
 extern std::vector<ImpiStore*> remote_impi_stores;
 extern RalfProcessor* ralf_processor;
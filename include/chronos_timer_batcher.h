@@ -0,0 +1,213 @@
+/**
+ * @file chronos_timer_batcher.h Sends AoR timer requests to Chronos in
+ * batches, off the thread handling the request.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CHRONOS_TIMER_BATCHER_H__
+#define CHRONOS_TIMER_BATCHER_H__
+
+#include <pthread.h>
+#include <map>
+#include <set>
+#include <string>
+
+#include "threadpool.h"
+#include "exception_handler.h"
+#include "chronosconnection.h"
+#include "utils.h"
+#include "sas.h"
+#include "snmp_event_accumulator_table.h"
+#include "aor_store.h"
+
+/// Collects the timers the SubscriberDataManager sets and deletes for AoRs,
+/// and sends them to Chronos on a pool of threads every batch window.  This
+/// takes the Chronos round trip off the thread handling the request, and
+/// requests for the same AoR within a window are coalesced into one.
+///
+/// Timers for an AoR are sent in the order they were requested; an AoR's
+/// timer isn't sent while an earlier request for it is still in flight.
+///
+/// When a new timer is created, Chronos chooses its ID, which is written
+/// back into the stored AoR once the timer has been created.  If the stored
+/// AoR has gained a different timer (or lost its bindings) in the meantime,
+/// the new timer is deleted again.
+class ChronosTimerBatcher
+{
+public:
+  /// Constructor.
+  ///
+  /// @param chronos_conn      - Connection to Chronos.
+  /// @param aor_store         - The store holding the AoRs the timers are for,
+  ///                            to write new timer IDs back to.
+  /// @param window_ms         - How long to collect requests for before
+  ///                            sending them.
+  /// @param batch_size_tbl    - Statistics for the number of timers sent in
+  ///                            each batch.
+  /// @param delay_tbl         - Statistics for the time timers wait before
+  ///                            being sent, in microseconds.
+  /// @param exception_handler - Exception handler for the sending threads.
+  /// @param num_threads       - Number of sending threads.
+  ChronosTimerBatcher(ChronosConnection* chronos_conn,
+                      AoRStore* aor_store,
+                      int window_ms,
+                      SNMP::EventAccumulatorTable* batch_size_tbl,
+                      SNMP::EventAccumulatorTable* delay_tbl,
+                      ExceptionHandler* exception_handler,
+                      unsigned int num_threads = NUM_THREADS);
+
+  /// Destructor.  Sends any timers still waiting.
+  virtual ~ChronosTimerBatcher();
+
+  /// Sets the timer for an AoR.
+  ///
+  /// @param aor_id       The AoR ID
+  /// @param timer_id     The ID of the AoR's current timer, or empty if it
+  ///                     doesn't have one
+  /// @param expiry       Timer length
+  /// @param tags         Any tags to add to the Chronos timer
+  /// @param trail        SAS trail
+  virtual void set_timer(const std::string& aor_id,
+                         const std::string& timer_id,
+                         int expiry,
+                         const std::map<std::string, uint32_t>& tags,
+                         SAS::TrailId trail);
+
+  /// Deletes the timer for an AoR.
+  ///
+  /// @param aor_id       The AoR ID
+  /// @param timer_id     The ID of the AoR's timer
+  /// @param trail        SAS trail
+  virtual void delete_timer(const std::string& aor_id,
+                            const std::string& timer_id,
+                            SAS::TrailId trail);
+
+  /// Sends everything waiting now, rather than at the end of the window.
+  void flush();
+
+  /// Number of attempts to write a new timer ID back to the AoR.
+  static const int MAX_WRITE_BACK_ATTEMPTS = 5;
+
+  /// Number of threads sending requests to Chronos.
+  static const unsigned int NUM_THREADS = 10;
+
+private:
+  /// The timer request waiting for an AoR.
+  struct TimerRequest
+  {
+    /// The batcher the request was made to, so that the request can be
+    /// completed if sending it fails with an exception.
+    ChronosTimerBatcher* batcher;
+
+    std::string aor_id;
+    std::string timer_id;
+
+    /// Whether the stored AoR needs the timer ID once the request is sent,
+    /// as the AoR didn't have one when it was written.
+    bool write_back;
+
+    bool is_delete;
+
+    /// Timer length, from when the request was made.  The time the request
+    /// waits to be sent is taken off this when it is sent.
+    int expiry;
+    std::map<std::string, uint32_t> tags;
+    SAS::TrailId trail;
+
+    /// Started when the first of any coalesced requests was made, for the
+    /// delay statistics.
+    Utils::StopWatch stop_watch;
+
+    /// Started when this request was made, to time how long it waits.
+    Utils::StopWatch expiry_watch;
+  };
+
+  /// @class Pool
+  /// The thread pool that sends timer requests to Chronos.
+  class Pool : public ThreadPool<TimerRequest*>
+  {
+  public:
+    Pool(ChronosTimerBatcher* batcher,
+         ExceptionHandler* exception_handler,
+         unsigned int num_threads);
+
+    virtual ~Pool();
+
+  private:
+    /// Called by worker threads when they pull work off the queue.
+    virtual void process_work(TimerRequest*& request);
+
+    ChronosTimerBatcher* _batcher;
+  };
+
+  friend class Pool;
+
+  static void exception_callback(TimerRequest* request);
+
+  /// Adds a request, replacing any waiting request for the same AoR.
+  void add_request(TimerRequest* request);
+
+  /// Sends a timer request to Chronos.
+  void send_request(TimerRequest* request);
+
+  /// Returns the time left until a requested timer should pop, in seconds.
+  static int remaining_expiry(TimerRequest* request);
+
+  /// Marks an AoR as no longer having a request in flight, and records the
+  /// ID of any timer created for it.
+  void request_complete(const std::string& aor_id,
+                        const std::string& created_timer_id);
+
+  /// Writes the ID of a timer back to the stored AoR, if the AoR still has
+  /// the timer ID it had when the request was made.  Otherwise the timer is
+  /// no longer needed, and is deleted.
+  ///
+  /// @return             Whether the stored AoR now has the timer.
+  bool write_timer_id(const std::string& aor_id,
+                      const std::string& old_timer_id,
+                      const std::string& new_timer_id,
+                      SAS::TrailId trail);
+
+  /// Moves waiting requests to the thread pool, other than those for AoRs
+  /// with a request in flight.  Requests without a timer ID use the ID of
+  /// a timer recently created for the AoR, if there is one.  Must be called
+  /// with the lock held.
+  void dispatch_requests();
+
+  /// Entry point for the thread that dispatches a batch every window.
+  static void* dispatch_thread_fn(void* batcher);
+  void dispatch_thread();
+
+  ChronosConnection* _chronos_conn;
+  AoRStore* _aor_store;
+  int _window_ms;
+  SNMP::EventAccumulatorTable* _batch_size_tbl;
+  SNMP::EventAccumulatorTable* _delay_tbl;
+
+  pthread_mutex_t _lock;
+  pthread_cond_t _cond;
+  bool _terminated;
+  pthread_t _dispatch_thread;
+
+  /// Requests waiting to be sent, by AoR ID.
+  std::map<std::string, TimerRequest*> _waiting;
+
+  /// AoRs with a request being sent.
+  std::set<std::string> _in_flight;
+
+  /// IDs of timers created for AoRs in this window and the last, by AoR ID.
+  /// Requests made before the ID was written back to the AoR don't have it,
+  /// and the writer retries with the ID within a window or so.
+  std::map<std::string, std::string> _new_timer_ids;
+  std::map<std::string, std::string> _prev_new_timer_ids;
+
+  Pool* _thread_pool;
+};
+
+#endif
@@ -17,9 +17,11 @@
 #include "chronosconnection.h"
 #include "hssconnection.h"
 #include "subscriber_data_manager.h"
+#include "aor_replicator.h"
 #include "sipresolver.h"
 #include "impistore.h"
 #include "fifcservice.h"
+#include "tsx_arena.h"
 
 /// Common factory for all handlers that deal with timer pops. This is
 /// a subclass of SpawningHandler that requests HTTP flows to be
@@ -52,14 +54,17 @@ public:
   {
     Config(SubscriberDataManager* sdm,
            std::vector<SubscriberDataManager*> remote_sdms,
-           HSSConnection* hss) :
+           HSSConnection* hss,
+           AoRReplicator* aor_replicator = NULL) :
       _sdm(sdm),
       _remote_sdms(remote_sdms),
-      _hss(hss)
+      _hss(hss),
+      _aor_replicator(aor_replicator)
     {}
     SubscriberDataManager* _sdm;
     std::vector<SubscriberDataManager*> _remote_sdms;
     HSSConnection* _hss;
+    AoRReplicator* _aor_replicator;
   };
 
   AoRTimeoutTask(HttpStack::Request& req,
@@ -118,7 +123,8 @@ public:
            IFCConfiguration ifc_configuration,
            SIPResolver* sipresolver,
            ImpiStore* local_impi_store,
-           std::vector<ImpiStore*> remote_impi_stores) :
+           std::vector<ImpiStore*> remote_impi_stores,
+           AoRReplicator* aor_replicator = NULL) :
       _sdm(sdm),
       _remote_sdms(remote_sdms),
       _hss(hss),
@@ -126,7 +132,8 @@ public:
       _ifc_configuration(ifc_configuration),
       _sipresolver(sipresolver),
       _local_impi_store(local_impi_store),
-      _remote_impi_stores(remote_impi_stores)
+      _remote_impi_stores(remote_impi_stores),
+      _aor_replicator(aor_replicator)
     {}
     SubscriberDataManager* _sdm;
     std::vector<SubscriberDataManager*> _remote_sdms;
@@ -136,6 +143,7 @@ public:
     SIPResolver* _sipresolver;
     ImpiStore* _local_impi_store;
     std::vector<ImpiStore*> _remote_impi_stores;
+    AoRReplicator* _aor_replicator;
   };
 
 
@@ -217,6 +225,30 @@ protected:
   std::string serialize_data(AoR* aor);
 };
 
+/// Task for reading statistics on the memory used by the arenas that hold
+/// the state of each SIP transaction.
+class GetTsxArenaStatsTask : public HttpStackUtils::Task
+{
+public:
+  struct Config
+  {
+    Config(const TsxArenaStats* stats) :
+      _stats(stats)
+    {}
+
+    const TsxArenaStats* _stats;
+  };
+
+  GetTsxArenaStatsTask(HttpStack::Request& req, const Config* cfg, SAS::TrailId trail) :
+    HttpStackUtils::Task(req, trail), _cfg(cfg)
+  {};
+
+  void run();
+
+private:
+  const Config* _cfg;
+};
+
 /// Task for performing an administrative deregistration at the S-CSCF. This
 ///
 /// -  Deletes subscriber data from the store (including all bindings and
@@ -269,15 +301,18 @@ public:
   {
     Config(SubscriberDataManager* sdm,
            std::vector<SubscriberDataManager*> remote_sdms,
-	   HSSConnection* hss):
+	   HSSConnection* hss,
+           AoRReplicator* aor_replicator = NULL):
       _sdm(sdm),
       _remote_sdms(remote_sdms),
-      _hss(hss)
+      _hss(hss),
+      _aor_replicator(aor_replicator)
     {}
 
     SubscriberDataManager* _sdm;
     std::vector<SubscriberDataManager*> _remote_sdms;
     HSSConnection* _hss;
+    AoRReplicator* _aor_replicator;
   };
 
   PushProfileTask(HttpStack::Request& req,
@@ -0,0 +1,103 @@
+/**
+ * @file hss_cache.h In-process cache of subscriber data read from Homestead.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef HSS_CACHE_H__
+#define HSS_CACHE_H__
+
+#include <string>
+
+#include "rapidxml/rapidxml.hpp"
+#include "hssconnection.h"
+#include "sharded_cache.h"
+#include "snmp_counter_table.h"
+#include "snmp_scalar.h"
+
+/// Cache of the parsed subscriber data (registration state, service profiles
+/// with their iFCs, associated URIs, aliases and charging addresses) that
+/// Homestead returns for a public ID.  This lets the S-CSCF handle initial
+/// requests for a subscriber without a Homestead round trip and an XML parse
+/// each time.
+///
+/// Entries are held for a TTL.  Changes made through this node (registration
+/// and deregistration, and pushed profile updates and deregistrations from
+/// Homestead) invalidate the entries they affect; changes made elsewhere may
+/// not be seen until the entry expires.
+///
+/// As with the AoR cache, data read from Homestead isn't cached if the public
+/// ID has been invalidated since the request was sent (see ShardedCache).
+class HSSCache
+{
+public:
+  /// Constructor.
+  ///
+  /// @param ttl_ms        - How long an entry may be served for.
+  /// @param max_bytes     - Approximate limit on the memory used by entries.
+  /// @param hits_tbl      - Statistics, all of which may be NULL.
+  /// @param misses_tbl
+  /// @param kb_scalar     - Set to the approximate memory used by entries, in
+  ///                        KB.
+  HSSCache(int ttl_ms,
+           size_t max_bytes,
+           SNMP::CounterTable* hits_tbl = NULL,
+           SNMP::CounterTable* misses_tbl = NULL,
+           SNMP::U32Scalar* kb_scalar = NULL);
+
+  virtual ~HSSCache();
+
+  /// Fills in the cached data for a public ID, returning false if it isn't
+  /// cached or its entry has expired.
+  bool get(const std::string& public_id, HSSConnection::irs_info& irs_info);
+
+  /// Returns the public ID's current generation.  Call this before sending
+  /// the request to Homestead, and pass the result to put().
+  uint64_t get_generation(const std::string& public_id);
+
+  /// Caches the data just read from Homestead for a public ID, unless the
+  /// public ID has been invalidated since the request was sent.
+  ///
+  /// @param xml        - The document the data was parsed from, which the
+  ///                     iFCs refer to.  Used to estimate the memory used.
+  /// @param generation - The public ID's generation when the request was
+  ///                     sent.
+  void put(const std::string& public_id,
+           const HSSConnection::irs_info& irs_info,
+           const rapidxml::xml_document<>* xml,
+           uint64_t generation);
+
+  /// Removes the data for a public ID from the cache and bumps its
+  /// generation.
+  void invalidate(const std::string& public_id);
+
+  /// Number of public IDs cached, and the approximate memory they use.
+  size_t size();
+  size_t bytes() { return _cache.bytes(); }
+
+  /// Estimate of the memory used by a cached entry.
+  static size_t estimate_size(const std::string& public_id,
+                              const HSSConnection::irs_info& irs_info,
+                              const rapidxml::xml_document<>* xml);
+
+  static const int NUM_SHARDS = ShardedCache<HSSConnection::irs_info>::NUM_SHARDS;
+
+private:
+  // Update the memory statistic.
+  void update_kb_scalar();
+
+  static size_t estimate_xml_size(const rapidxml::xml_node<>* node);
+
+  ShardedCache<HSSConnection::irs_info> _cache;
+
+  SNMP::CounterTable* _hits_tbl;
+  SNMP::CounterTable* _misses_tbl;
+  SNMP::U32Scalar* _kb_scalar;
+};
+
+#endif
@@ -13,6 +13,9 @@
 #define HSSCONNECTION_H__
 
 #include <curl/curl.h>
+#include <pthread.h>
+#include <memory>
+#include <unordered_map>
 #include "rapidjson/document.h"
 
 #include "httpconnection.h"
@@ -20,10 +23,13 @@
 #include "ifchandler.h"
 #include "sas.h"
 #include "snmp_event_accumulator_table.h"
+#include "snmp_counter_table.h"
 #include "load_monitor.h"
 #include "associated_uris.h"
 #include "sifcservice.h"
 
+class HSSCache;
+
 /// @class HSSConnection
 ///
 /// Provides a connection to the Homestead service for retrieving user
@@ -85,7 +91,9 @@ public:
                 SNMP::EventAccumulatorTable* homestead_lir_latency_tbl,
                 CommunicationMonitor* comm_monitor,
                 SIFCService* sifc_service,
-                long homestead_timeout_ms);
+                long homestead_timeout_ms,
+                HSSCache* cache = NULL,
+                SNMP::CounterTable* coalesced_tbl = NULL);
   virtual ~HSSConnection();
 
   HTTPCode get_auth_vector(const std::string& private_user_id,
@@ -108,6 +116,9 @@ public:
                              rapidjson::Document*& object,
                              SAS::TrailId trail);
 
+  /// Concurrent call lookups for the same query share a single request to
+  /// Homestead - the first sends the request, and the others wait for and
+  /// take a copy of its result.
   virtual HTTPCode update_registration_state(const irs_query& irs_query,
                                              irs_info& irs_info,
                                              SAS::TrailId trail);
@@ -115,7 +126,16 @@ public:
   virtual HTTPCode get_registration_data(const std::string& public_id,
                                          irs_info& irs_info,
                                          SAS::TrailId trail);
-  rapidxml::xml_document<>* parse_xml(std::string raw, const std::string& url);
+  rapidxml::xml_document<>* parse_xml(const std::string& raw, const std::string& url);
+
+  /// Flags for parsing the XML Homestead returns.  Nothing reads the text of
+  /// an element other than through the element's value, so there's no need
+  /// for rapidxml to allocate separate data nodes for it.
+  static const int XML_PARSE_FLAGS = rapidxml::parse_no_data_nodes;
+
+  /// Discards any cached subscriber data for a public ID, for use when the
+  /// subscriber's registration state or profile changes.
+  virtual void invalidate_cached_data(const std::string& public_id);
 
   static const std::string REG;
   static const std::string CALL;
@@ -126,6 +146,53 @@ public:
   static const std::string AUTH_FAIL;
 
 private:
+  /// A request to Homestead that other threads with the same query are
+  /// waiting on.
+  struct PendingQuery
+  {
+    PendingQuery();
+    ~PendingQuery();
+
+    pthread_cond_t cond;
+    bool complete;
+    int waiters;
+    HTTPCode http_code;
+    irs_info result;
+  };
+
+  /// Completes a pending query when it goes out of scope, so the threads
+  /// waiting on it are released even if the request to Homestead fails with
+  /// an exception.
+  class PendingQueryGuard
+  {
+  public:
+    PendingQueryGuard(HSSConnection* hss,
+                      const std::string& key,
+                      std::shared_ptr<PendingQuery> pending);
+    ~PendingQueryGuard();
+
+    /// Completes the query with the result of the request to Homestead.
+    void complete(HTTPCode http_code, const irs_info& irs_info);
+
+  private:
+    HSSConnection* _hss;
+    std::string _key;
+    std::shared_ptr<PendingQuery> _pending;
+    bool _complete;
+  };
+
+  /// Threads waiting on another's request to Homestead give up and send their
+  /// own after this many Homestead timeouts, in case the request was lost.
+  static const int PENDING_QUERY_WAIT_TIMEOUTS = 3;
+
+  /// Sends a registration state request to Homestead.
+  HTTPCode send_registration_state_request(const irs_query& irs_query,
+                                           irs_info& irs_info,
+                                           SAS::TrailId trail);
+
+  /// Key identifying the request Homestead is sent for a query.
+  static std::string pending_query_key(const irs_query& irs_query);
+
   virtual long get_json_object(const std::string& path,
                                rapidjson::Document*& object,
                                SAS::TrailId trail);
@@ -145,6 +212,21 @@ private:
   SNMP::EventAccumulatorTable* _uar_latency_tbl;
   SNMP::EventAccumulatorTable* _lir_latency_tbl;
   SIFCService* _sifc_service;
+
+  // Cache of subscriber data.  May be NULL.
+  HSSCache* _cache;
+
+  // Requests to Homestead that are in flight and can be shared, keyed by
+  // pending_query_key().
+  std::unordered_map<std::string, std::shared_ptr<PendingQuery> > _pending_queries;
+  pthread_mutex_t _pending_queries_lock;
+
+  // How long to wait for another thread's request to Homestead.
+  long _pending_query_wait_ms;
+
+  // Count of requests that shared another's request to Homestead.  May be
+  // NULL.
+  SNMP::CounterTable* _coalesced_tbl;
 };
 
 #endif
@@ -20,6 +20,7 @@ extern "C" {
 #include <string>
 #include <vector>
 #include <memory>
+#include <boost/regex.hpp>
 
 #include "rapidxml/rapidxml.hpp"
 #include "sessioncase.h"
@@ -69,11 +70,17 @@ struct AsInvocation
 };
 
 /// A single Initial Filter Criterion (iFC).
+//
+// The iFC XML is compiled into a tree of trigger predicates (with the
+// regular expressions prebuilt) when the Ifc is constructed, so matching a
+// message doesn't walk or re-parse the XML.  The compiled form is shared
+// between copies of the Ifc.
 class Ifc
 {
 public:
   Ifc(rapidxml::xml_node<>* ifc) :
-    _ifc(ifc)
+    _ifc(ifc),
+    _compiled(compile(ifc))
   {
   }
 
@@ -94,15 +101,123 @@ private:
 
 class ifc_error : public std::exception {};
 
+  /// A problem found while compiling the iFC.  Compiling never fails -
+  // problems are reported (with the same logs and SAS events as if the XML
+  // was being interpreted directly) when evaluation reaches them.
+  struct CompileError
+  {
+    enum Type {NONE, INVALID_IFC, INVALID_XML};
+
+    CompileError() : type(NONE) {}
+
+    void set(Type new_type, const std::string& new_text)
+    {
+      type = new_type;
+      text = new_text;
+    }
+
+    bool is_set() const { return (type != NONE); }
+
+    Type type;
+    std::string text;
+  };
+
+  /// A compiled Service Point Trigger.
+  struct Spt
+  {
+    enum Class {METHOD,
+                SIP_HEADER,
+                SESSION_CASE,
+                REQUEST_URI,
+                SESSION_DESCRIPTION,
+                UNKNOWN};
+
+    Spt() :
+      negated(false),
+      spt_class(UNKNOWN),
+      register_extension(false),
+      has_content(false),
+      session_case(0),
+      unusual_request_uri(false)
+    {}
+
+    // Reported before the SPT is evaluated.
+    CompileError error;
+    bool negated;
+    Class spt_class;
+    std::string class_name;
+
+    // Method class.  Any invalid RegistrationType is only reported if
+    // evaluation reaches it.
+    std::string method;
+    bool register_extension;
+    std::vector<int> reg_types;
+    CompileError reg_type_error;
+
+    // SIPHeader and SessionDescription classes.  A Header that is a plain
+    // header name is held lower-cased in header_name and matched without
+    // the regex engine.  An invalid Content regex is only reported the first
+    // time it's needed.
+    std::string header_name;
+    boost::regex name_regex;
+    bool has_content;
+    boost::regex content_regex;
+    CompileError content_error;
+
+    // SessionCase class.
+    int session_case;
+
+    // RequestURI class.
+    bool unusual_request_uri;
+    boost::regex request_uri_regex;
+
+    // Reported after the SPT is evaluated.
+    CompileError group_error;
+    std::vector<int32_t> groups;
+  };
+
+  struct CompiledIfc
+  {
+    CompiledIfc() :
+      profile_part_indicator(-1),
+      has_trigger(false),
+      cnf(false)
+    {}
+
+    // The printed iFC, for SAS.
+    std::string ifc_str;
+
+    // Problems with the ApplicationServer or ProfilePartIndicator.
+    CompileError error;
+    std::string server_name;
+    int profile_part_indicator;
+
+    bool has_trigger;
+
+    // Problems with the ConditionTypeCNF.
+    CompileError trigger_error;
+    bool cnf;
+    std::vector<Spt> spts;
+  };
+
+  static std::shared_ptr<const CompiledIfc> compile(rapidxml::xml_node<>* ifc);
+
+  static void compile_spt(rapidxml::xml_node<>* spt_node, Spt& spt);
+
   static bool spt_matches(const SessionCase& session_case,
                           const bool is_registered,
                           const bool is_initial_registration,
                           pjsip_msg *msg,
-                          rapidxml::xml_node<>* spt,
-                          std::string ifc_str,
-                          std::string server_name,
+                          const Spt& spt,
+                          const std::string& server_name,
                           SAS::TrailId trail);
 
+  static bool header_name_matches(const Spt& spt, const pj_str_t* name);
+
+  static void handle_compile_error(const CompileError& error,
+                                   std::string server_name,
+                                   SAS::TrailId trail);
+
   static void handle_invalid_ifc(std::string error,
                                  std::string server_name,
                                  int sas_event_id,
@@ -115,6 +230,19 @@ class ifc_error : public std::exception {};
                                  int instance_id,
                                  SAS::TrailId trail);
 
+  static void handle_invalid_xml(std::string error,
+                                 SAS::TrailId trail);
+
+  class compiled_xml_error : public std::exception
+  {
+  public:
+    compiled_xml_error(const std::string& what) : _what(what) {}
+    virtual ~compiled_xml_error() throw() {}
+    virtual const char* what() const throw() { return _what.c_str(); }
+  private:
+    std::string _what;
+  };
+
   rapidxml::xml_node<>* _ifc;
-  std::string _server_name;
+  std::shared_ptr<const CompiledIfc> _compiled;
 };
@@ -30,7 +30,10 @@ extern "C" {
 
 /// A set of iFCs.
 //
-// Owns the iFCs document, and provides access to each iFC within it.
+// Owns the iFCs document, and provides access to each iFC within it.  The
+// list of iFCs can't be changed once built, so copies of an Ifcs (one for
+// each public identity in a service profile, and more for each AS chain)
+// share it rather than copying it.
 class Ifcs
 {
 public:
@@ -43,22 +46,24 @@ public:
 
   size_t size() const
   {
-    return _ifcs.size();
+    return ifcs_list().size();
   }
 
   const Ifc& operator[](size_t index) const
   {
-    return _ifcs[index];
+    return ifcs_list()[index];
   }
 
-  const std::vector<Ifc> ifcs_list() const
+  const std::vector<Ifc>& ifcs_list() const
   {
-    return _ifcs;
+    return (_ifcs != NULL) ? *_ifcs : NO_IFCS;
   }
 
 private:
+  static const std::vector<Ifc> NO_IFCS;
+
   std::shared_ptr<rapidxml::xml_document<> > _ifc_doc;
-  std::vector<Ifc> _ifcs;
+  std::shared_ptr<const std::vector<Ifc> > _ifcs;
 };
 
 
@@ -0,0 +1,174 @@
+/**
+ * @file pjstr_index.h Read-mostly hash index that can be searched directly
+ * with a pj_str_t.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef PJSTR_INDEX_H__
+#define PJSTR_INDEX_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include <strings.h>
+
+/// Maps strings to values, and is searched with pj_str_t keys pointing into
+/// a parsed message, so finding an entry doesn't need to copy the key into a
+/// std::string first.  The index is built up front (for example, when
+/// Sproutlets are registered) and then only read, so lookups take no locks.
+///
+/// Entries are held in a vector, and an open-addressed table of buckets
+/// holds their positions.  The table is kept at most half full, so lookups
+/// usually touch a single bucket.
+template<class T>
+class PjStrIndex
+{
+public:
+  /// Constructor.
+  ///
+  /// @param case_insensitive  - Whether keys are matched ignoring case, as
+  ///                            hostnames are.
+  PjStrIndex(bool case_insensitive) :
+    _case_insensitive(case_insensitive),
+    _buckets((size_t)MIN_BUCKETS, (int)EMPTY)
+  {
+  }
+
+  /// Adds an entry to the index.
+  ///
+  /// @returns false if the key is already in the index, in which case the
+  ///          existing entry is left alone.
+  bool insert(const std::string& key, const T& value)
+  {
+    pj_str_t key_str = {(char*)key.data(), (pj_ssize_t)key.size()};
+    if (find(&key_str) != NULL)
+    {
+      return false;
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.hash = hash(key.data(), key.size());
+    entry.value = value;
+    _entries.push_back(entry);
+
+    if (_entries.size() * 2 > _buckets.size())
+    {
+      rebuild(_buckets.size() * 2);
+    }
+    else
+    {
+      add_to_buckets(_entries.size() - 1);
+    }
+
+    return true;
+  }
+
+  /// Finds the value for a key.
+  ///
+  /// @returns a pointer to the value, or NULL if the key isn't in the index.
+  const T* find(const pj_str_t* key) const
+  {
+    size_t key_hash = hash(key->ptr, key->slen);
+    size_t mask = _buckets.size() - 1;
+
+    for (size_t bucket = key_hash & mask;
+         _buckets[bucket] != EMPTY;
+         bucket = (bucket + 1) & mask)
+    {
+      const Entry& entry = _entries[_buckets[bucket]];
+      if ((entry.hash == key_hash) &&
+          (equal(entry.key, key->ptr, key->slen)))
+      {
+        return &entry.value;
+      }
+    }
+
+    return NULL;
+  }
+
+  size_t size() const
+  {
+    return _entries.size();
+  }
+
+private:
+  struct Entry
+  {
+    std::string key;
+    size_t hash;
+    T value;
+  };
+
+  enum { MIN_BUCKETS = 16, EMPTY = -1 };
+
+  /// FNV-1a hash of the key, folding case if the index is case insensitive.
+  size_t hash(const char* ptr, size_t len) const
+  {
+    size_t hash = 2166136261u;
+
+    for (size_t ii = 0; ii < len; ++ii)
+    {
+      unsigned char c = ptr[ii];
+      hash ^= _case_insensitive ? pj_tolower(c) : c;
+      hash *= 16777619u;
+    }
+
+    return hash;
+  }
+
+  bool equal(const std::string& key, const char* ptr, size_t len) const
+  {
+    if (key.size() != len)
+    {
+      return false;
+    }
+    else if (len == 0)
+    {
+      return true;
+    }
+
+    return (_case_insensitive ?
+              (strncasecmp(key.data(), ptr, len) == 0) :
+              (memcmp(key.data(), ptr, len) == 0));
+  }
+
+  void add_to_buckets(size_t index)
+  {
+    size_t mask = _buckets.size() - 1;
+    size_t bucket = _entries[index].hash & mask;
+
+    while (_buckets[bucket] != EMPTY)
+    {
+      bucket = (bucket + 1) & mask;
+    }
+
+    _buckets[bucket] = (int)index;
+  }
+
+  void rebuild(size_t num_buckets)
+  {
+    _buckets.assign(num_buckets, (int)EMPTY);
+
+    for (size_t ii = 0; ii < _entries.size(); ++ii)
+    {
+      add_to_buckets(ii);
+    }
+  }
+
+  bool _case_insensitive;
+  std::vector<Entry> _entries;
+  std::vector<int> _buckets;
+};
+
+#endif
@@ -167,6 +167,11 @@ void resolve(const std::string& name,
              std::vector<AddrInfo>& servers,
              int allowed_host_state);
 
+void get_next_hop_target(pjsip_tx_data* tdata,
+                         std::string& name,
+                         int& port,
+                         int& transport);
+
 BaseAddrIterator* resolve_next_hop_iter(pjsip_tx_data* tdata,
                                         int allowed_host_state,
                                         SAS::TrailId trail);
@@ -226,6 +231,18 @@ pj_status_t respond_stateful(pjsip_endpoint* endpt,
                              ACR* acr = NULL);
 
 pjsip_tx_data *clone_tdata(pjsip_tx_data* tdata);
+
+// Clones the raw bytes and addressing information of a received message,
+// without copying the parsed message.  This is much cheaper than
+// pjsip_rx_data_clone, but the clone must be passed to parse_rx_data_clone
+// before it is processed.  The clone is freed using
+// pjsip_rx_data_free_cloned.
+pj_status_t clone_rx_data_unparsed(pjsip_rx_data* src,
+                                   pjsip_rx_data** p_rdata);
+
+// Parses an rx_data cloned by clone_rx_data_unparsed, applying the same
+// received and rport parameters to the top Via as the transport manager.
+pj_status_t parse_rx_data_clone(pjsip_rx_data* rdata);
 void clone_header(const pj_str_t* hdr_name, pjsip_msg* old_msg, pjsip_msg* new_msg, pj_pool_t* pool);
 
 pjsip_via_hdr* add_top_via(pjsip_tx_data* tdata);
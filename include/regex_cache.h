@@ -0,0 +1,89 @@
+/**
+ * @file regex_cache.h A process-wide cache of compiled regular expressions.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef REGEX_CACHE_H_
+#define REGEX_CACHE_H_
+
+#include <pthread.h>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <boost/regex.hpp>
+
+#include "snmp_counter_table.h"
+
+/// Bounded, thread-safe, least-recently-used cache of compiled regular
+/// expressions, keyed by pattern and flags.  Used wherever regexes that come
+/// from configuration or the network (iFCs, ENUM NAPTR records) are compiled,
+/// so that patterns shared between subscribers or lookups are only compiled
+/// once.
+///
+/// A boost::regex shares its compiled state between copies, so the regex
+/// returned is cheap to copy and remains valid after it's evicted.
+class RegexCache
+{
+public:
+  /// Constructor.
+  ///
+  /// @param max_entries   - The maximum number of regexes to hold.
+  /// @param hits_tbl      - Statistics counters, all of which may be NULL.
+  /// @param misses_tbl
+  /// @param evictions_tbl
+  RegexCache(size_t max_entries,
+             SNMP::CounterTable* hits_tbl = NULL,
+             SNMP::CounterTable* misses_tbl = NULL,
+             SNMP::CounterTable* evictions_tbl = NULL);
+
+  virtual ~RegexCache();
+
+  /// Returns the compiled form of the pattern, compiling it if it's not in
+  /// the cache.  If the pattern is invalid this throws boost::regex_error,
+  /// unless the no_except flag is set in which case the returned regex has
+  /// a non-zero status() (and is cached like any other).
+  boost::regex get(const std::string& pattern,
+                   boost::regex::flag_type flags = boost::regex::normal);
+
+  /// Changes the size of the cache and the statistics counters.  Intended to
+  /// be called once at start of day.
+  void configure(size_t max_entries,
+                 SNMP::CounterTable* hits_tbl,
+                 SNMP::CounterTable* misses_tbl,
+                 SNMP::CounterTable* evictions_tbl);
+
+  size_t size();
+
+  /// The process-wide cache.
+  static RegexCache* instance();
+
+  static const size_t DEFAULT_MAX_ENTRIES = 1000;
+
+private:
+  typedef std::pair<std::string, boost::regex> Entry;
+  typedef std::list<Entry> EntryList;
+
+  static std::string make_key(const std::string& pattern,
+                              boost::regex::flag_type flags);
+
+  void evict_excess();
+
+  pthread_mutex_t _lock;
+  size_t _max_entries;
+
+  // Entries in order of use, most recent first, and an index into them.
+  EntryList _entries;
+  std::unordered_map<std::string, EntryList::iterator> _index;
+
+  SNMP::CounterTable* _hits_tbl;
+  SNMP::CounterTable* _misses_tbl;
+  SNMP::CounterTable* _evictions_tbl;
+};
+
+#endif
@@ -26,10 +26,16 @@ extern "C" {
 #include "snmp_success_fail_count_table.h"
 #include "fifcservice.h"
 
+class AoRReplicator;
+
 namespace RegistrationUtils {
 
+/// @param aor_replicator_arg - If not NULL, changes are written to the
+///                              remote sites by the replicator rather than
+///                              directly.
 void init(SNMP::RegistrationStatsTables* third_party_reg_stats_tables_arg,
-          bool force_third_party_register_body_arg);
+          bool force_third_party_register_body_arg,
+          AoRReplicator* aor_replicator_arg = NULL);
 
 bool remove_bindings(SubscriberDataManager* sdm,
                      std::vector<SubscriberDataManager*> remote_sdms,
@@ -38,6 +38,7 @@ extern "C" {
 #include "session_expires_helper.h"
 #include "as_communication_tracker.h"
 #include "compositesproutlet.h"
+#include "async_work_pool.h"
 
 class SCSCFSproutletTsx;
 
@@ -232,16 +233,53 @@ public:
   virtual void on_tx_response(pjsip_msg* rsp) override;
   virtual void on_rx_cancel(int status_code, pjsip_msg* req) override;
   virtual void on_timer_expiry(void* context) override;
+  virtual void on_async_complete(AsyncWork* work) override;
 
 private:
+  /// Reads a subscriber's data from Homestead on the asynchronous work pool,
+  /// so that the worker thread isn't blocked while Homestead responds.
+  class HssLookup : public AsyncWork
+  {
+  public:
+    HssLookup(HSSConnection* hss,
+              const HSSConnection::irs_query& irs_query,
+              SAS::TrailId trail);
+
+    void run() override;
+
+    HSSConnection::irs_query _irs_query;
+    HSSConnection::irs_info _irs_info;
+    long _http_code;
+
+  private:
+    HSSConnection* _hss;
+    SAS::TrailId _trail;
+  };
+
+  /// Processes an initial request once the session case and any AS chain
+  /// have been determined and, if required, the served user's data has been
+  /// read from Homestead.
+  void continue_initial_request(pjsip_msg* req);
+
+  /// Starts reading the served user's data from Homestead on the
+  /// asynchronous work pool.  Returns false if the data can't or needn't be
+  /// read asynchronously, in which case the request should be processed
+  /// straight away.
+  bool read_hss_data_async(pjsip_msg* req);
+
   /// Examines the top route header to determine the relevant AS chain
   /// (from the ODI token) and the session case (based on the presence of
   /// the 'orig' param), and sets those as member variables.
   void retrieve_odi_and_sesscase(pjsip_msg* req);
 
-  /// Determines the served user for the request.
+  /// Determines the served user for the request.  retrieve_odi_and_sesscase
+  /// must have been called first.
   pjsip_status_code determine_served_user(pjsip_msg* req);
 
+  /// Calculates the S-CSCF URI to use for a request that starts a new AS
+  /// chain.
+  void calculate_scscf_uri(pjsip_msg* req);
+
   /// Gets the served user indicated in the message.
   std::string served_user_from_msg(pjsip_msg* msg);
 
@@ -290,12 +328,20 @@ private:
   /// the HSS. Returns the HTTP result code received from homestead.
   long get_data_from_hss(std::string public_id);
 
+  /// Builds the query used to read data for a public user identity from the
+  /// HSS.
+  HSSConnection::irs_query build_irs_query(const std::string& public_id);
+
   /// Read data for a public user identity from the HSS. Returns the HTTP result
   /// code obtained from homestead.
   long read_hss_data(const HSSConnection::irs_query& irs_query,
                      HSSConnection::irs_info& irs_info,
                      SAS::TrailId trail);
 
+  /// Stores the fields the sproutlet needs from data read from the HSS.
+  void process_hss_data(const HSSConnection::irs_query& irs_query,
+                        HSSConnection::irs_info& irs_info);
+
   /// Look up the registration state for the given public ID, using the
   /// per-transaction cache if possible (and caching them and the iFC otherwise).
   bool is_user_registered(std::string public_id);
@@ -376,6 +422,16 @@ private:
   Ifcs _ifcs;
   HSSConnection::irs_info _irs_info;
 
+  /// The result of reading data from the HSS asynchronously.  If the read
+  /// failed, this is used rather than querying the HSS again for the same
+  /// public ID.
+  std::string _async_hss_public_id;
+  long _async_hss_http_code;
+
+  /// The initial request, while its processing is suspended waiting for
+  /// data from the HSS.
+  pjsip_msg* _suspended_req;
+
   /// ACRs used where the S-CSCF will only process a single transaction (no
   /// AsChain is created).  There are two cases where this might be true:
   ///
@@ -0,0 +1,304 @@
+/**
+ * @file sharded_cache.h In-process cache with a TTL, LRU eviction and
+ * generations.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef SHARDED_CACHE_H__
+#define SHARDED_CACHE_H__
+
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "log.h"
+
+/// Cache of values keyed by string, which the AoR and HSS caches are built
+/// on.
+///
+/// Entries are held for a TTL.  Invalidating a key removes its entry and bumps
+/// its generation.  A read from the backing store notes the generation before
+/// it starts, and its result isn't cached if the generation has changed by the
+/// time it completes, as a write may have raced with the read and left it out
+/// of date.
+///
+/// The cache is split into shards, each with its own lock and share of the
+/// memory limit, and evicts least recently used entries when a shard is full.
+template <class V>
+class ShardedCache
+{
+private:
+  struct Entry
+  {
+    std::string key;
+    V value;
+    size_t size;
+    uint64_t expiry_ms;
+
+    Entry(const std::string& key_arg, const V& value_arg) :
+      key(key_arg),
+      value(value_arg),
+      size(0),
+      expiry_ms(0)
+    {}
+  };
+
+public:
+  /// Constructor.
+  ///
+  /// @param name      - Describes the cached values in logs, for example
+  ///                    "AoR".
+  /// @param ttl_ms    - How long an entry may be served for.
+  /// @param max_bytes - Approximate limit on the memory used by entries.
+  ShardedCache(const std::string& name, int ttl_ms, size_t max_bytes) :
+    _name(name),
+    _ttl_ms(ttl_ms),
+    _max_bytes_per_shard(max_bytes / NUM_SHARDS),
+    _shards(NUM_SHARDS),
+    _bytes(0)
+  {
+    for (typename std::vector<Shard>::iterator shard = _shards.begin();
+         shard != _shards.end();
+         ++shard)
+    {
+      pthread_mutex_init(&shard->lock, NULL);
+      shard->bytes = 0;
+      shard->generations.resize(GENERATIONS_PER_SHARD, 0);
+    }
+  }
+
+  virtual ~ShardedCache()
+  {
+    for (typename std::vector<Shard>::iterator shard = _shards.begin();
+         shard != _shards.end();
+         ++shard)
+    {
+      pthread_mutex_destroy(&shard->lock);
+    }
+  }
+
+  /// If the key is cached and its entry hasn't expired, calls copy with the
+  /// cached value (with the shard's lock held) and returns true.
+  template <class Copy>
+  bool get(const std::string& key, Copy copy)
+  {
+    bool found = false;
+    Shard& shard = get_shard(key);
+
+    pthread_mutex_lock(&shard.lock);
+
+    typename Index::iterator it = shard.index.find(key);
+    if (it != shard.index.end())
+    {
+      if (it->second->expiry_ms > get_time_ms())
+      {
+        // Move the entry to the front of the list, as the most recently used.
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        copy(it->second->value);
+        found = true;
+      }
+      else
+      {
+        TRC_DEBUG("Cached %s %s has expired", _name.c_str(), key.c_str());
+        remove_entry(shard, it->second);
+      }
+    }
+
+    pthread_mutex_unlock(&shard.lock);
+
+    return found;
+  }
+
+  /// Returns the key's current generation.  Call this before reading the
+  /// value from the backing store, and pass the result to put().
+  uint64_t get_generation(const std::string& key)
+  {
+    Shard& shard = get_shard(key);
+
+    pthread_mutex_lock(&shard.lock);
+    uint64_t generation = shard_generation(shard, key);
+    pthread_mutex_unlock(&shard.lock);
+
+    return generation;
+  }
+
+  /// Caches a copy of a value just read from the backing store, unless the
+  /// key has been invalidated since the read started.
+  ///
+  /// @param size       - Estimate of the memory used by the entry.
+  /// @param generation - The key's generation when the read started.
+  void put(const std::string& key,
+           const V& value,
+           size_t size,
+           uint64_t generation)
+  {
+    if (size > _max_bytes_per_shard)
+    {
+      TRC_DEBUG("%s %s is too large to cache", _name.c_str(), key.c_str());
+      return;
+    }
+
+    // Copy the value before taking the lock.
+    EntryList new_entries;
+    new_entries.emplace_front(key, value);
+    new_entries.front().size = size;
+    new_entries.front().expiry_ms = get_time_ms() + _ttl_ms;
+
+    Shard& shard = get_shard(key);
+
+    pthread_mutex_lock(&shard.lock);
+
+    if (shard_generation(shard, key) != generation)
+    {
+      // The value has been written since it was read, so the copy we have may
+      // be out of date.
+      pthread_mutex_unlock(&shard.lock);
+      TRC_DEBUG("%s %s changed during read, not caching",
+                _name.c_str(), key.c_str());
+      return;
+    }
+
+    typename Index::iterator it = shard.index.find(key);
+    if (it != shard.index.end())
+    {
+      remove_entry(shard, it->second);
+    }
+
+    shard.entries.splice(shard.entries.begin(), new_entries);
+    shard.index[key] = shard.entries.begin();
+    shard.bytes += size;
+    _bytes += size;
+
+    // Evict the least recently used entries until the shard is within its
+    // share of the memory limit.
+    while (shard.bytes > _max_bytes_per_shard)
+    {
+      TRC_DEBUG("Evicting %s %s from cache",
+                _name.c_str(), shard.entries.back().key.c_str());
+      remove_entry(shard, --shard.entries.end());
+    }
+
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  /// Removes a key from the cache and bumps its generation.  If the key was
+  /// cached, returns the result of calling test with the value that was
+  /// removed (with the shard's lock held), and otherwise returns false.
+  template <class Test>
+  bool invalidate(const std::string& key, Test test)
+  {
+    bool rc = false;
+    Shard& shard = get_shard(key);
+
+    pthread_mutex_lock(&shard.lock);
+
+    // Stop any read that's in progress from caching what it read.
+    ++shard_generation(shard, key);
+
+    typename Index::iterator it = shard.index.find(key);
+    if (it != shard.index.end())
+    {
+      TRC_DEBUG("Invalidating cached %s %s", _name.c_str(), key.c_str());
+      rc = test(it->second->value);
+      remove_entry(shard, it->second);
+    }
+
+    pthread_mutex_unlock(&shard.lock);
+
+    return rc;
+  }
+
+  /// Number of keys cached, and the approximate memory their entries use.
+  size_t size()
+  {
+    size_t size = 0;
+
+    for (typename std::vector<Shard>::iterator shard = _shards.begin();
+         shard != _shards.end();
+         ++shard)
+    {
+      pthread_mutex_lock(&shard->lock);
+      size += shard->entries.size();
+      pthread_mutex_unlock(&shard->lock);
+    }
+
+    return size;
+  }
+
+  size_t bytes() { return _bytes; }
+
+  /// Memory used by an entry, on top of whatever its value refers to.
+  static const size_t ENTRY_SIZE = sizeof(Entry);
+
+  static const int NUM_SHARDS = 16;
+
+  /// Number of generations each shard tracks.  Keys are hashed onto these,
+  /// so keys that share a generation occasionally skip being cached, but the
+  /// memory used doesn't grow with the number of keys.
+  static const int GENERATIONS_PER_SHARD = 256;
+
+private:
+  typedef std::list<Entry> EntryList;
+  typedef std::unordered_map<std::string, typename EntryList::iterator> Index;
+
+  struct Shard
+  {
+    pthread_mutex_t lock;
+
+    // Entries in order of use, most recent first, and an index into them.
+    EntryList entries;
+    Index index;
+    size_t bytes;
+
+    std::vector<uint64_t> generations;
+  };
+
+  Shard& get_shard(const std::string& key)
+  {
+    return _shards[std::hash<std::string>()(key) % NUM_SHARDS];
+  }
+
+  // Get a key's generation.  Must be called with the shard's lock held.
+  static uint64_t& shard_generation(Shard& shard, const std::string& key)
+  {
+    // The low bits of the hash pick the shard, so use the rest to pick the
+    // generation within it.
+    size_t hash = std::hash<std::string>()(key) / NUM_SHARDS;
+    return shard.generations[hash % GENERATIONS_PER_SHARD];
+  }
+
+  // Remove an entry from a shard.  Must be called with the shard's lock held.
+  void remove_entry(Shard& shard, typename EntryList::iterator entry)
+  {
+    shard.bytes -= entry->size;
+    _bytes -= entry->size;
+    shard.index.erase(entry->key);
+    shard.entries.erase(entry);
+  }
+
+  static uint64_t get_time_ms()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+  }
+
+  std::string _name;
+  int _ttl_ms;
+  size_t _max_bytes_per_shard;
+  std::vector<Shard> _shards;
+  std::atomic<size_t> _bytes;
+};
+
+#endif
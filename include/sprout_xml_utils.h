@@ -40,8 +40,8 @@ void get_identities_and_barring_status(rapidxml::xml_node<>* public_id,
 // Adds a URI and its barring status to the set of associated URIs
 void add_uri_to_associated_uris(AssociatedURIs& associated_uris,
                                 bool barred,
-                                std::string associated_uri,
-                                std::string identity_uri);
+                                const std::string& associated_uri,
+                                const std::string& identity_uri);
 
 // Parses an IMS subscription to pull out the associated URIs
 bool get_uris_from_ims_subscription(rapidxml::xml_node<>* node,
@@ -50,8 +50,8 @@ bool get_uris_from_ims_subscription(rapidxml::xml_node<>* node,
 
 // Parse an IMS subscription to pull out the associated URIs, the IFCs and the
 // aliases
-bool parse_ims_subscription(const std::string public_user_identity,
-                            std::shared_ptr<rapidxml::xml_document<> > root,
+bool parse_ims_subscription(const std::string& public_user_identity,
+                            const std::shared_ptr<rapidxml::xml_document<> >& root,
                             rapidxml::xml_node<>* node,
                             std::map<std::string, Ifcs >& ifcs_map,
                             AssociatedURIs& associated_uris,
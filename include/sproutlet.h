@@ -31,6 +31,7 @@ class SproutletTsxHelper;
 class Sproutlet;
 class SproutletTsx;
 class SproutletProxy;
+class AsyncWork;
 
 
 /// Typedefs for Sproutlet-specific types
@@ -236,6 +237,16 @@ public:
   ///
   virtual pjsip_msg* clone_msg(pjsip_msg* msg) = 0;
 
+  /// Prepares a message to be modified.  If the message shares its contents
+  /// with the original request (see SproutletTsx::copy_on_write) it is
+  /// replaced with a copy that the Sproutlet owns outright, otherwise it is
+  /// left alone.
+  ///
+  /// @param  msg          - The message to be modified.  Updated to point to
+  ///                        the copy if one is made.
+  ///
+  virtual void modify_msg(pjsip_msg*& msg) = 0;
+
   /// Create a response from a given request, this response can be passed to
   /// send_response or stored for later.  It may be freed again by passing
   /// it to free_message.
@@ -353,6 +364,20 @@ public:
   ///
   virtual bool timer_running(TimerID id) = 0;
 
+  /// Runs work that would block the worker thread (such as a request to
+  /// Homestead) on a separate pool of threads, so the worker thread can get
+  /// on with other messages.  Once the work has run, on_async_complete is
+  /// called with it on a worker thread.  The transaction isn't destroyed
+  /// while it has work outstanding.
+  ///
+  /// @returns             - true if the work has been queued, or false if
+  ///                        there's no pool to run it on, in which case the
+  ///                        caller should run it itself.
+  /// @param  work         - The work to run.  If this returns true, the
+  ///                        work is deleted once on_async_complete returns.
+  ///
+  virtual bool run_async(AsyncWork* work) { return false; }
+
   /// Returns the SAS trail identifier that should be used for any SAS events
   /// related to this service invocation.
   ///
@@ -480,12 +505,25 @@ public:
   ///                        was scheduled.
   virtual void on_timer_expiry(void* context) {}
 
+  /// Called when work passed to run_async has run.
+  ///
+  /// @param  work         - The work, holding its results.
+  virtual void on_async_complete(AsyncWork* work) {}
+
   /// Called to determine the name of the Network Function to which this
   /// transaction belongs.  By default, this is just the service name of the
   /// owning Sproutlet.
   virtual std::string get_network_function()
     { return (_sproutlet != NULL) ? _sproutlet->network_function() : "noop"; }
 
+  /// Called to determine whether the request passed to on_rx_*_request should
+  /// be copied only when the SproutletTsx needs to modify it.  If this returns
+  /// true, the request shares its headers and body with the request received
+  /// from upstream, and the SproutletTsx must call modify_msg() on it before
+  /// changing it in any way.  This saves copying requests that are rejected
+  /// without being forwarded.
+  virtual bool copy_on_write() const { return false; }
+
 protected:
 
   /// Returns a mutable clone of the original request.  This can be modified
@@ -564,6 +602,16 @@ protected:
   pjsip_msg* clone_msg(pjsip_msg* msg)
     {return _helper->clone_msg(msg);}
 
+  /// Prepares a message to be modified, copying it first if it shares its
+  /// contents with the original request.  Any headers previously found in
+  /// the message must be found again in the copy before they are changed.
+  ///
+  /// @param  msg          - The message to be modified.  Updated to point to
+  ///                        the copy if one is made.
+  ///
+  void modify_msg(pjsip_msg*& msg)
+    {_helper->modify_msg(msg);}
+
   /// Create a response from a given request, this response can be passed to
   /// send_response or stored for later.  It may be freed again by passing
   /// it to free_message.
@@ -696,6 +744,16 @@ protected:
   bool timer_running(TimerID id)
     {return _helper->timer_running(id);}
 
+  /// Runs work that would block the worker thread on a separate pool of
+  /// threads, calling on_async_complete once it has run.
+  ///
+  /// @returns             - false if there's no pool to run the work on, in
+  ///                        which case the caller should run it itself.
+  /// @param  work         - The work to run.
+  ///
+  bool run_async(AsyncWork* work)
+    {return _helper->run_async(work);}
+
   /// Returns the SAS trail identifier that should be used for any SAS events
   /// related to this service invocation.
   ///
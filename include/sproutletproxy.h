@@ -21,7 +21,11 @@
 #include "pjutils.h"
 #include "sproutlet.h"
 #include "snmp_sip_request_types.h"
+#include "snmp_event_accumulator_table.h"
 #include "sproutlet_options.h"
+#include "async_work_pool.h"
+#include "pjstr_index.h"
+#include "tsx_arena.h"
 
 class SproutletWrapper;
 
@@ -40,17 +44,37 @@ public:
   ///                               stateless proxies.
   /// @param  max_sproutlet_depth - The maximum number of Sproutlets that can be
   ///                               invoked in a row before we break the loop.
+  /// @param  async_work_pool     - Pool on which Sproutlets can run blocking
+  ///                               work.  If NULL, Sproutlets must do such
+  ///                               work on the worker thread.
+  /// @param  log_local_selection - Whether to log to SAS how each request
+  ///                               passed between Sproutlets in this process
+  ///                               is routed.
+  /// @param  resolver_pool       - Pool on which the next hops of requests
+  ///                               sent out of this proxy are resolved.  If
+  ///                               NULL, they are resolved on the worker
+  ///                               threads.
+  /// @param  fork_latency_tbl    - Statistics on the time taken from each fork
+  ///                               being created to its request being sent.
+  ///                               May be NULL.
   SproutletProxy(pjsip_endpoint* endpt,
                  int priority,
                  const std::string& root_uri,
                  const std::unordered_set<std::string>& host_aliases,
                  const std::list<Sproutlet*>& sproutlets,
                  const std::set<std::string>& stateless_proxies,
-                 int max_sproutlet_depth=DEFAULT_MAX_SPROUTLET_DEPTH);
+                 int max_sproutlet_depth=DEFAULT_MAX_SPROUTLET_DEPTH,
+                 AsyncWorkPool* async_work_pool=NULL,
+                 bool log_local_selection=true,
+                 AsyncWorkPool* resolver_pool=NULL,
+                 SNMP::EventAccumulatorTable* fork_latency_tbl=NULL);
 
   /// Destructor.
   virtual ~SproutletProxy();
 
+  /// Statistics on the memory used by each transaction's arena.
+  const TsxArenaStats* arena_stats() const { return &_arena_stats; }
+
   /// Static callback for timers
   static void on_timer_pop(pj_timer_heap_t* th, pj_timer_entry* tentry);
 
@@ -79,11 +103,13 @@ protected:
   bool register_sproutlet(Sproutlet* sproutlet);
 
   /// Gets the next target Sproutlet for the message by analysing the top
-  /// Route header.
+  /// Route header.  The selection is only logged to SAS if log is set, but
+  /// failing to select a Sproutlet is always logged.
   Sproutlet* target_sproutlet(pjsip_msg* req,
                               int port,
                               std::string& alias,
-                              SAS::TrailId trail);
+                              SAS::TrailId trail,
+                              bool log=true);
 
   /// Return the sproutlet that matches the URI supplied.
   Sproutlet* match_sproutlet_from_uri(const pjsip_uri* uri,
@@ -181,6 +207,21 @@ protected:
       void run() override;
     };
 
+    // The callback run on a worker thread when asynchronous work requested
+    // by a sproutlet tsx has completed.
+    class AsyncCallback : public PJUtils::Callback
+    {
+      UASTsx* _uas_tsx;
+      SproutletWrapper* _sproutlet_wrapper;
+      AsyncWork* _work;
+
+    public:
+      AsyncCallback(UASTsx* uas_tsx,
+                    SproutletWrapper* sproutlet_wrapper,
+                    AsyncWork* work);
+      void run() override;
+    };
+
     void tx_request(SproutletWrapper* sproutlet,
                     int fork_id,
                     SendRequest req);
@@ -192,6 +233,13 @@ protected:
     bool cancel_timer(TimerID id);
     bool timer_running(TimerID id);
 
+    bool run_async(SproutletWrapper* tsx, AsyncWork* work);
+    void process_async_complete(SproutletWrapper* tsx, AsyncWork* work);
+
+    /// Records that a Sproutlet in this transaction has been given a copy of
+    /// a message, or a view of the original request if full_copy is false.
+    void record_msg_copy(pjsip_tx_data* clone, bool full_copy=true);
+
     void tx_response(SproutletWrapper* sproutlet,
                      pjsip_tx_data* rsp);
 
@@ -202,10 +250,17 @@ protected:
     /// Checks to see if it is safe to destroy the UASTsx.
     void check_destroy();
 
-    /// Finds a SproutletTsx willing to handle a request
+    /// Finds a SproutletTsx willing to handle a request.  The selection is
+    /// only logged to SAS if log_selection is set.
     SproutletTsx* get_sproutlet_tsx(pjsip_tx_data* req,
                                     int port,
-                                    std::string& alias);
+                                    std::string& alias,
+                                    bool log_selection=true);
+
+    /// Memory for the SproutletWrappers, timers and routing maps of this
+    /// transaction, all released together when the UASTsx is destroyed.
+    /// This must be declared before anything allocated from it.
+    TsxArena _arena;
 
     /// The root Sproutlet for this transaction.
     SproutletWrapper* _root;
@@ -215,8 +270,12 @@ protected:
     template<typename T>
     struct DMap
     {
-      typedef std::map<std::pair<SproutletWrapper*, int>, T> type;
-      typedef typename std::map<std::pair<SproutletWrapper*, int>, T>::iterator iterator;
+      typedef std::pair<SproutletWrapper*, int> key_type;
+      typedef std::map<key_type,
+                       T,
+                       std::less<key_type>,
+                       TsxArenaAllocator<std::pair<const key_type, T> > > type;
+      typedef typename type::iterator iterator;
     };
 
     /// Mapping from upstream Sproutlet/fork to downstream Sproutlet.
@@ -227,7 +286,11 @@ protected:
 
     /// Mapping from downstream Sproutlet or UAC transaction to upstream
     /// Sproutlet/fork.
-    typedef std::map<void*, std::pair<SproutletWrapper*, int> > UMap;
+    typedef std::map<void*,
+                     std::pair<SproutletWrapper*, int>,
+                     std::less<void*>,
+                     TsxArenaAllocator<std::pair<void* const,
+                                                 std::pair<SproutletWrapper*, int> > > > UMap;
     UMap _umap;
 
     /// Queue of pending requests to be scheduled.
@@ -244,17 +307,30 @@ protected:
     /// Parent proxy object
     SproutletProxy* _sproutlet_proxy;
 
-    /// This set holds all the timers created by sproutlet tsxs that are
-    /// children of this UASTsx. They are only freed when the UASTsx is freed
-    /// (they are not freed when a timer pops or is cancelled for example).
-    /// This prevents race conditions (such as a double free caused by one
-    /// thread popping a timer and another thread cancelling it).
-    std::set<pj_timer_entry*> _timers;
-
     /// This set holds all the timers created by sproutlet tsx that are
     /// children of this UASTsx that have not popped or been cancelled yet.
     /// The UASTsx will persist while there are pending timers.
-    std::set<pj_timer_entry*> _pending_timers;
+    ///
+    /// The timers themselves are allocated from the arena, so are only freed
+    /// when the UASTsx is freed (they are not freed when a timer pops or is
+    /// cancelled for example).  This prevents race conditions (such as a
+    /// double free caused by one thread popping a timer and another thread
+    /// cancelling it).
+    typedef std::set<pj_timer_entry*,
+                     std::less<pj_timer_entry*>,
+                     TsxArenaAllocator<pj_timer_entry*> > TimerSet;
+    TimerSet _pending_timers;
+
+    /// This set holds the asynchronous work requested by sproutlet tsxs that
+    /// are children of this UASTsx that has not yet completed.  The UASTsx
+    /// will persist while there is pending work.
+    std::set<AsyncWork*> _pending_async;
+
+    /// The number of copies made of messages passed between Sproutlets in
+    /// this transaction, and the memory allocated for them and for views of
+    /// requests passed to Sproutlets that copy on write.
+    int _msg_copies;
+    size_t _msg_copy_bytes;
 
     /// Count of the number of UASTsx objects currently active. Used for
     /// debugging purposes.
@@ -266,9 +342,12 @@ protected:
   pjsip_sip_uri* _root_uri;
   std::map<std::string, pjsip_sip_uri*> _root_uris;
 
-  std::unordered_set<std::string> _host_aliases;
+  /// The root hostname and its aliases, matched ignoring case.
+  PjStrIndex<bool> _local_hosts;
 
-  std::map<std::string, Sproutlet*> _services;
+  /// Service names and aliases of the registered Sproutlets.  This is
+  /// searched with the parts of each routing URI, so must not copy them.
+  PjStrIndex<Sproutlet*> _services;
 
   std::map<int, Sproutlet*> _ports;
 
@@ -276,6 +355,22 @@ protected:
 
   const int _max_sproutlet_depth;
 
+  AsyncWorkPool* _async_work_pool;
+
+  /// Whether the routing of requests passed between Sproutlets is logged to
+  /// SAS.  If not, the BEGIN_SPROUTLET_REQ event each Sproutlet logs still
+  /// records the path of the request.
+  bool _log_local_selection;
+
+  /// Statistics on the copies made of messages passed between Sproutlets,
+  /// updated once per transaction.
+  SNMP::EventAccumulatorTable* _msg_copies_tbl;
+  SNMP::EventAccumulatorTable* _msg_copy_bytes_tbl;
+
+  /// Statistics on the arenas of all transactions, which also size new
+  /// arenas.
+  TsxArenaStats _arena_stats;
+
   static const pj_str_t STR_SERVICE;
 
   friend class UASTsx;
@@ -303,6 +398,13 @@ public:
   /// Virtual destructor.
   virtual ~SproutletWrapper();
 
+  /// SproutletWrappers are allocated from the arena of the transaction they
+  /// belong to.  Deleting one runs its destructor, but its memory is only
+  /// released with the arena.
+  static void* operator new(size_t size, TsxArena* arena);
+  static void operator delete(void* ptr, TsxArena* arena);
+  static void operator delete(void* ptr);
+
   const std::string& service_name() const;
 
   /// This implementation has concrete implementations for all of the virtual
@@ -317,6 +419,7 @@ public:
   pjsip_msg* create_request();
   pjsip_msg* clone_request(pjsip_msg* req);
   pjsip_msg* clone_msg(pjsip_msg* msg);
+  void modify_msg(pjsip_msg*& msg);
   pjsip_msg* create_response(pjsip_msg* req,
                              pjsip_status_code status_code,
                              const std::string& status_text="");
@@ -330,6 +433,7 @@ public:
   bool schedule_timer(void* context, TimerID& id, int duration);
   void cancel_timer(TimerID id);
   bool timer_running(TimerID id);
+  bool run_async(AsyncWork* work);
   SAS::TrailId trail() const;
   bool is_uri_reflexive(const pjsip_uri*) const;
   pjsip_sip_uri* get_reflexive_uri(pj_pool_t*) const;
@@ -353,8 +457,10 @@ private:
   void rx_error(int status_code);
   void rx_fork_error(ForkErrorState fork_error, int fork_id);
   void on_timer_pop(TimerID id, void* context);
+  void on_async_complete(AsyncWork* work);
   void register_tdata(pjsip_tx_data* tdata);
   void deregister_tdata(pjsip_tx_data* tdata);
+  pjsip_msg* shared_original_request();
 
   void process_actions(bool complete_after_actions);
   void aggregate_response(pjsip_tx_data* rsp);
@@ -387,6 +493,13 @@ private:
   pjsip_tx_data* _req;
   SNMP::SIPRequestTypes _req_type;
 
+  /// View of the original request passed to a Sproutlet that copies requests
+  /// on write, or NULL.  The view's headers are shallow copies of those in
+  /// _req.  The view is kept until the wrapper is destroyed, even once the
+  /// Sproutlet has freed or copied it, as the Sproutlet may have allocated
+  /// from its pool.
+  pjsip_tx_data* _shared_req;
+
   // Immutable reference to the transport used by the original request.
   pjsip_transport* _original_transport;
 
@@ -399,6 +512,12 @@ private:
   // and decrementing the Max-Forwards counter.
   std::string _upstream_network_func;
 
+  // Whether this Sproutlet is at a boundary between Network Functions, and
+  // whether that boundary is internal to this process.  These are fixed when
+  // the wrapper is created, and are checked for every message it handles.
+  bool _network_func_boundary;
+  bool _internal_network_func_boundary;
+
   // The depth of this wrapper in the transaction tree.  Used to detect loops.
   int _depth;
 
@@ -442,6 +561,11 @@ private:
   /// until all these timers have popped or been cancelled.
   std::set<TimerID> _pending_timers;
 
+  /// Count of asynchronous work requested by this SproutletWrapper that has
+  /// not yet completed.  As with timers, the SproutletWrapper won't be
+  /// deleted until it has all completed.
+  int _pending_async;
+
   // The allowed host state for outbound requests from the sproutlet wrapped by
   // this wrapper.  If there are no addresses of the appropriate state (e.g.
   // whitelisted), then a 503 response will be internally generated, and the
@@ -231,6 +231,13 @@ namespace SASEvent
   const int MMF_INVOKE_AFTER_AS = SPROUT_BASE + 0x0161;
 
   const int SIP_TOO_LONG_IN_QUEUE = SPROUT_BASE + 0x0170;
+  const int SIP_PREDICTED_TOO_LONG_IN_QUEUE = SPROUT_BASE + 0x0171;
+  const int SIP_SOURCE_QUEUE_FULL = SPROUT_BASE + 0x0172;
+
+  const int REGSTORE_GET_CACHED = SPROUT_BASE + 0x0180;
+  const int REGSTORE_SET_DELTA = SPROUT_BASE + 0x0181;
+  const int HSS_PROFILE_CACHED = SPROUT_BASE + 0x0182;
+  const int HSS_REQUEST_COALESCED = SPROUT_BASE + 0x0183;
 } //namespace SASEvent
 
 #endif
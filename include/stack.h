@@ -18,6 +18,7 @@ extern "C" {
 }
 
 #include <string>
+#include <vector>
 #include <unordered_set>
 
 #include "sas.h"
@@ -37,6 +38,8 @@ struct stack_data_struct
   pj_pool_t           *pool;
   pjsip_endpoint      *endpt;
   pj_thread_t         *pjsip_transport_thread;
+  std::vector<pj_thread_t*> pjsip_transport_threads;
+  int                  num_pjsip_threads;
   int                  pcscf_untrusted_port;
   pjsip_tpfactory     *pcscf_untrusted_tcp_factory;
   int                  pcscf_trusted_port;
@@ -84,7 +87,19 @@ inline bool is_pjsip_transport_thread()
   // This check doesn't make sense in UT, where we use a different threading model
   return true;
 #else
-  return (pj_thread_this() == stack_data.pjsip_transport_thread);
+  pj_thread_t* this_thread = pj_thread_this();
+
+  for (std::vector<pj_thread_t*>::const_iterator ii = stack_data.pjsip_transport_threads.begin();
+       ii != stack_data.pjsip_transport_threads.end();
+       ++ii)
+  {
+    if (*ii == this_thread)
+    {
+      return true;
+    }
+  }
+
+  return false;
 #endif
 }
 
@@ -155,7 +170,8 @@ extern pj_status_t init_stack(const std::string& sas_system_name,
                               QuiescingManager *quiescing_mgr,
                               const std::string& cdf_domain,
                               std::vector<std::string> sproutlet_uris,
-                              bool enable_orig_sip_to_tel_coerce);
+                              bool enable_orig_sip_to_tel_coerce,
+                              int num_pjsip_threads = 1);
 extern pj_status_t start_pjsip_thread();
 extern pj_status_t stop_pjsip_thread();
 extern void stop_stack();
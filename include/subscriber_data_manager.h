@@ -21,6 +21,7 @@
 
 #include "astaire_aor_store.h"
 #include "chronosconnection.h"
+#include "chronos_timer_batcher.h"
 #include "sas.h"
 #include "analyticslogger.h"
 #include "associated_uris.h"
@@ -48,10 +49,13 @@ public:
   /// registration/subscription expiry
   ///
   /// @param chronos_conn    The underlying chronos connection
+  /// @param timer_batcher   If not NULL, requests are passed to this to send
+  ///                        in the background rather than sent directly
   class ChronosTimerRequestSender
   {
   public:
-    ChronosTimerRequestSender(ChronosConnection* chronos_conn);
+    ChronosTimerRequestSender(ChronosConnection* chronos_conn,
+                              ChronosTimerBatcher* timer_batcher = NULL);
 
     virtual ~ChronosTimerRequestSender();
 
@@ -72,6 +76,7 @@ public:
 
   private:
     ChronosConnection* _chronos_conn;
+    ChronosTimerBatcher* _timer_batcher;
 
     /// Build the tag info map from an AoR
     virtual void build_tag_info(AoR* aor,
@@ -155,10 +160,13 @@ public:
   /// @param analytics_logger   - AnalyticsLogger for reporting registration events.
   /// @param is_primary         - Whether the underlying data store is the local
   ///                             store or remote
+  /// @param timer_batcher      - If not NULL, Chronos timers are sent through
+  ///                             this in the background.
   SubscriberDataManager(AoRStore* aor_store,
                         ChronosConnection* chronos_connection,
                         AnalyticsLogger* analytics_logger,
-                        bool is_primary);
+                        bool is_primary,
+                        ChronosTimerBatcher* timer_batcher = NULL);
 
   /// Destructor.
   virtual ~SubscriberDataManager();
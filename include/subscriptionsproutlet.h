@@ -22,6 +22,7 @@
 #include "acr.h"
 #include "hssconnection.h"
 #include "subscriber_data_manager.h"
+#include "aor_replicator.h"
 #include "sproutlet.h"
 #include "snmp_counter_table.h"
 #include "session_expires_helper.h"
@@ -43,7 +44,8 @@ public:
                         HSSConnection* hss_connection,
                         ACRFactory* acr_factory,
                         AnalyticsLogger* analytics_logger,
-                        int cfg_max_expires);
+                        int cfg_max_expires,
+                        AoRReplicator* aor_replicator = NULL);
   ~SubscriptionSproutlet();
 
   bool init();
@@ -64,6 +66,10 @@ private:
   SubscriberDataManager* _sdm;
   std::vector<SubscriberDataManager*> _remote_sdms;
 
+  // Writes changes to the remote SDMs in the background.  If this is NULL,
+  // the remote SDMs are written to before responding.
+  AoRReplicator* _aor_replicator;
+
   // Connection to the HSS service for retrieving associated public URIs.
   HSSConnection* _hss;
 
@@ -17,6 +17,13 @@ extern "C" {
 #include <pjsip.h>
 }
 
+#include <time.h>
+#include <string.h>
+#include <deque>
+#include <vector>
+#include <map>
+#include <string>
+
 #include "pjutils.h"
 #include "load_monitor.h"
 #include "snmp_event_accumulator_table.h"
@@ -31,7 +38,20 @@ pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
                                    SNMP::CounterByScopeTable* overload_counter_arg,
                                    LoadMonitor* load_monitor_arg,
                                    ExceptionHandler* exception_handler_arg,
-                                   unsigned long request_on_queue_timeout);
+                                   unsigned long request_on_queue_timeout,
+                                   bool sharded_queues_arg = false,
+                                   bool deferred_rx_parse_arg = false,
+                                   bool queue_wait_reject_arg = false,
+                                   SNMP::CounterByScopeTable* queue_wait_reject_counter_arg = NULL,
+                                   bool fair_queueing_arg = false,
+                                   int max_queue_depth_per_source_arg = 0,
+                                   SNMP::EventAccumulatorByScopeTable* source_queue_depth_tbl_arg = NULL,
+                                   SNMP::CounterByScopeTable* source_reject_counter_arg = NULL,
+                                   const std::vector<int>& message_priorities_arg = std::vector<int>(),
+                                   const std::vector<SNMP::EventAccumulatorByScopeTable*>& class_latency_tbls_arg =
+                                     std::vector<SNMP::EventAccumulatorByScopeTable*>(),
+                                   const std::map<std::string, int>& source_weights_arg =
+                                     std::map<std::string, int>());
 
 void unregister_thread_dispatcher(void);
 
@@ -40,8 +60,10 @@ void stop_worker_threads();
 
 pjsip_module* get_mod_thread_dispatcher();
 
-// A SipEvent on the queue is either a SIP message or a callback
-enum SipEventType { MESSAGE, CALLBACK };
+// A SipEvent on the queue is either a SIP message or a callback, or (with
+// per-worker queues) a request for an idle worker to steal work queued for a
+// busy worker
+enum SipEventType { MESSAGE, CALLBACK, WAKE };
 
 // Allowable priority levels for SIP events. Levels with lower values correspond
 // to higher priorities.
@@ -49,14 +71,66 @@ namespace SipEventPriorityLevel
 {
   const int NORMAL_PRIORITY = 1;
   const int HIGH_PRIORITY = 0;
+
+  const int NUM_PRIORITY_LEVELS = 2;
 } //namespace SipPriorityLevel
 
+// Classes of received SIP message, each of which is queued at the priority
+// level configured for it.
+namespace SipMessageClass
+{
+  const int RESPONSE = 0;
+  const int OPTIONS = 1;
+  const int CANCEL_BYE_ACK = 2;
+  const int IN_DIALOG = 3;
+  const int INITIAL = 4;
+  const int REGISTRATION = 5;
+
+  const int NUM_CLASSES = 6;
+} //namespace SipMessageClass
+
+// The names of the message classes, as used in configuration and statistics.
+extern const char* const SIP_MESSAGE_CLASS_NAMES[SipMessageClass::NUM_CLASSES];
+
+// The priority level of each message class when method-aware priorities are
+// enabled.  Responses (and OPTIONS polls) come first, then requests that end
+// existing work, then other in-dialog requests, then requests that start new
+// work, with registrations and subscriptions last.
+extern const int METHOD_AWARE_MESSAGE_PRIORITIES[SipMessageClass::NUM_CLASSES];
+
 union SipEventData
 {
   pjsip_rx_data* rdata;
   PJUtils::Callback* callback;
 };
 
+// The address of the node that sent a received message, which identifies the
+// source of the message for fair queueing.  IPv4 addresses are held as
+// IPv4-mapped IPv6 addresses.  Callbacks all share the all-zeroes source.
+struct SipEventSource
+{
+  uint8_t addr[16];
+
+  SipEventSource()
+  {
+    memset(addr, 0, sizeof(addr));
+  }
+
+  // Sets the source from a textual IPv4 or IPv6 address.  Returns false if the
+  // address is not valid.
+  bool parse(const std::string& address);
+
+  bool operator==(const SipEventSource& other) const
+  {
+    return (memcmp(addr, other.addr, sizeof(addr)) == 0);
+  }
+
+  bool operator<(const SipEventSource& other) const
+  {
+    return (memcmp(addr, other.addr, sizeof(addr)) < 0);
+  }
+};
+
 struct SipEvent
 {
   // The type of the event
@@ -72,85 +146,180 @@ struct SipEvent
   // The event data itself
   SipEventData event_data;
 
-  SipEvent() : type(MESSAGE), priority(0) {}
+  // The time the event was queued (in microseconds since an arbitrary epoch).
+  // This is stamped once by stamp_enqueue_time and used to order events at the
+  // same priority level without reading the stop watch.
+  uint64_t enqueue_time_us;
+
+  // Identifies the source of the event, for fair queueing between sources.
+  SipEventSource source;
 
-  // Compares two SipEvents. Returns true if rhs is 'larger' than lhs, where
-  // 'larger' SipEvents are those that should be processed earlier.
-  static bool compare(SipEvent lhs, SipEvent rhs)
+  // The SipMessageClass of a received message.  Not used for callbacks.
+  int message_class;
+
+  SipEvent() :
+    type(MESSAGE),
+    priority(0),
+    enqueue_time_us(0),
+    source(),
+    message_class(SipMessageClass::INITIAL)
+  {}
+
+  void stamp_enqueue_time()
   {
-    if (lhs.priority != rhs.priority)
-    {
-      // Higher priority SipEvents, that is, SipEvents with a lower priority
-      // level, are 'larger'
-      return lhs.priority > rhs.priority;
-    }
-    else
-    {
-      // At the same priority level, older SipEvents are 'larger'
-      unsigned long lhs_us = 0;
-      unsigned long rhs_us = 0;
-
-      if (!lhs.stop_watch.read(lhs_us) || !rhs.stop_watch.read(rhs_us))
-      {
-        // We're extremely unlikely to end up in this case, but we try to cope
-        // with it as well as possible
-        TRC_ERROR("Failed to read stopwatch.");
-        return false;
-      }
-
-      return lhs_us < rhs_us;
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    enqueue_time_us = ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
   }
 };
 
 // Internal method exposed for testing purposes. Pops a single element off the
 // event queue and processes it. If the queue is empty, waits until either an
-// element is added to the queue or the queue is terminated.
+// element is added to the queue or the queue is terminated. If per-worker
+// queues are enabled, the element is taken from the queue owned by the
+// specified worker, or stolen from another worker's queue if that is empty.
 // Returns true if an element was processed, and false if the queue was
 // terminated.
-bool process_queue_element();
+bool process_queue_element(int worker_index = 0);
 
 // Add a Callback object to the queue, to be run on a worker thread.
-// This MUST be called from the main PJSIP transport thread.
+// This MUST be called from a PJSIP transport thread.
 void add_callback_to_queue(PJUtils::Callback*);
 
-// Implements eventq::Backend as a std::priority_queue of SipEvent structs.
-class PriorityEventQueueBackend : public eventq<SipEvent>::Backend
+// Implements eventq::Backend as one FIFO queue per priority level.  Events are
+// ordered by priority level and then by the time they were stamped with, but
+// as events are normally pushed in the order they were stamped, push and pop
+// are O(1) and never read a clock.  An event that is older than the newest
+// event at its level (which can only happen if events are stamped and pushed
+// on different threads) is inserted in time order.
+class MultiLevelEventQueueBackend : public eventq<SipEvent>::Backend
 {
 public:
 
-  PriorityEventQueueBackend() : _queue(SipEvent::compare) {}
-  virtual ~PriorityEventQueueBackend() {}
+  MultiLevelEventQueueBackend(int num_levels = SipEventPriorityLevel::NUM_PRIORITY_LEVELS) :
+    _levels(num_levels),
+    _size(0)
+  {}
+  virtual ~MultiLevelEventQueueBackend() {}
 
   virtual const SipEvent& front()
   {
-    return _queue.top();
+    return _levels[highest_level()].front();
   }
 
   virtual bool empty()
   {
-    return _queue.empty();
+    return (_size == 0);
   }
 
   virtual int size()
   {
-    return _queue.size();
+    return _size;
   }
 
-  virtual void push(const SipEvent& value)
+  virtual void push(const SipEvent& value);
+
+  virtual void pop()
   {
-    _queue.push(value);
+    _levels[highest_level()].pop_front();
+    --_size;
   }
 
-  virtual void pop()
+private:
+
+  // Returns the index of the highest priority non-empty level.  Must only be
+  // called if the queue is not empty.
+  size_t highest_level() const
   {
-    _queue.pop();
+    size_t level = 0;
+    while (_levels[level].empty())
+    {
+      ++level;
+    }
+    return level;
+  }
+
+  std::vector<std::deque<SipEvent>> _levels;
+  int _size;
+};
+
+// Implements eventq::Backend with fair queueing between the sources of events.
+// Events are ordered by priority level as in MultiLevelEventQueueBackend, but
+// within a level the sources with queued events take it in turns, so a source
+// that floods the queue only delays its own events.  Each turn is as many
+// events as the source's weight (by default 1), so sources get shares of the
+// worker threads in proportion to their weights.  Each source's events are
+// kept in time order.
+class FairEventQueueBackend : public eventq<SipEvent>::Backend
+{
+public:
+
+  FairEventQueueBackend(int num_levels = SipEventPriorityLevel::NUM_PRIORITY_LEVELS,
+                        const std::map<SipEventSource, int>& weights =
+                          std::map<SipEventSource, int>()) :
+    _levels(num_levels),
+    _weights(weights),
+    _size(0)
+  {}
+  virtual ~FairEventQueueBackend() {}
+
+  virtual const SipEvent& front()
+  {
+    Level& level = _levels[highest_level()];
+    return level.flows[level.active.front()].events.front();
+  }
+
+  virtual bool empty()
+  {
+    return (_size == 0);
+  }
+
+  virtual int size()
+  {
+    return _size;
+  }
+
+  virtual void push(const SipEvent& value);
+
+  virtual void pop();
+
+private:
+
+  struct Flow
+  {
+    // The queued events from the source, in time order.
+    std::deque<SipEvent> events;
+
+    // The number of events the source may have in each turn, and the number
+    // it has had so far in its current turn.
+    int weight;
+    int turn_events;
+  };
+
+  struct Level
+  {
+    // The queued events from each source.
+    std::map<SipEventSource, Flow> flows;
+
+    // The sources with queued events, in the order they take their turns.
+    std::deque<SipEventSource> active;
+  };
+
+  // Returns the index of the highest priority non-empty level.  Must only be
+  // called if the queue is not empty.
+  size_t highest_level() const
+  {
+    size_t level = 0;
+    while (_levels[level].active.empty())
+    {
+      ++level;
+    }
+    return level;
   }
 
-  // SipEvents are compared using operator()
-  std::priority_queue<SipEvent,
-                      std::deque<SipEvent>,
-                      std::function<bool(SipEvent, SipEvent)> > _queue;
+  std::vector<Level> _levels;
+  std::map<SipEventSource, int> _weights;
+  int _size;
 };
 
 #endif
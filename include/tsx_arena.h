@@ -0,0 +1,153 @@
+/**
+ * @file tsx_arena.h Arena for the state of a single SIP transaction.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef TSX_ARENA_H__
+#define TSX_ARENA_H__
+
+extern "C" {
+#include <pjlib.h>
+}
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+/// Statistics on the arenas used by transactions, shared by all the arenas
+/// of a proxy.  These also decide how big to make each new arena, based on
+/// how much recent transactions have used.
+class TsxArenaStats
+{
+public:
+  /// Smallest and largest size new arenas are created with.
+  static const size_t MIN_INITIAL_SIZE = 1024;
+  static const size_t MAX_INITIAL_SIZE = 16384;
+
+  TsxArenaStats();
+
+  /// The size to create the next arena with.  This is a little more than the
+  /// moving average of the memory recent arenas used, so most transactions
+  /// fit in the first block of their arena.
+  size_t initial_size() const;
+
+  /// Records the use made of an arena when it is released.
+  ///
+  /// @param allocations       - Number of allocations made from the arena.
+  /// @param used_bytes        - Memory used from the arena.
+  /// @param overflowed        - Whether the arena had to grow beyond its
+  ///                            initial size.
+  void record(int allocations, size_t used_bytes, bool overflowed);
+
+  uint64_t arenas() const { return _arenas; }
+  uint64_t allocations() const { return _allocations; }
+  uint64_t bytes() const { return _bytes; }
+  uint64_t overflows() const { return _overflows; }
+  size_t high_water_bytes() const { return _high_water_bytes; }
+
+private:
+  std::atomic<uint64_t> _arenas;
+  std::atomic<uint64_t> _allocations;
+  std::atomic<uint64_t> _bytes;
+  std::atomic<uint64_t> _overflows;
+  std::atomic<size_t> _high_water_bytes;
+
+  /// Moving average of the memory used by each arena.  Updates from
+  /// different threads can race and lose a sample, which doesn't matter for
+  /// an estimate.
+  std::atomic<size_t> _average_bytes;
+};
+
+/// Memory for the state belonging to a single transaction, carved out of a
+/// PJSIP pool.  Nothing allocated from the arena is freed individually; all
+/// of it is released in one go when the arena is destroyed with the
+/// transaction.  Objects that need destructors running must still be
+/// destroyed explicitly.
+class TsxArena
+{
+public:
+  /// Constructor.
+  ///
+  /// @param stats             - Statistics to record the arena's use in.  The
+  ///                            initial size of the arena is taken from them.
+  TsxArena(TsxArenaStats* stats);
+
+  /// Destructor.  Releases everything allocated from the arena.
+  ~TsxArena();
+
+  /// Allocates memory from the arena, suitably aligned for any type.
+  void* alloc(size_t size);
+
+  /// Creates a value-initialized object in the arena.
+  template<class T>
+  T* create()
+  {
+    return new (alloc(sizeof(T))) T();
+  }
+
+  int allocations() const { return _allocations; }
+  size_t used_bytes() const;
+
+private:
+  TsxArenaStats* _stats;
+  size_t _initial_size;
+  pj_pool_t* _pool;
+  int _allocations;
+};
+
+/// Standard library allocator that takes memory from a TsxArena, so that the
+/// nodes of a transaction's maps and sets are released with its arena.
+template<class T>
+class TsxArenaAllocator
+{
+public:
+  typedef T value_type;
+  typedef T* pointer;
+  typedef const T* const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template<class U>
+  struct rebind
+  {
+    typedef TsxArenaAllocator<U> other;
+  };
+
+  TsxArenaAllocator(TsxArena* arena) : _arena(arena) {}
+
+  template<class U>
+  TsxArenaAllocator(const TsxArenaAllocator<U>& other) : _arena(other._arena) {}
+
+  T* allocate(size_t n)
+  {
+    return (T*)_arena->alloc(n * sizeof(T));
+  }
+
+  void deallocate(T*, size_t)
+  {
+    // The memory is released with the arena.
+  }
+
+  bool operator==(const TsxArenaAllocator& other) const
+  {
+    return _arena == other._arena;
+  }
+
+  bool operator!=(const TsxArenaAllocator& other) const
+  {
+    return _arena != other._arena;
+  }
+
+  TsxArena* _arena;
+};
+
+#endif
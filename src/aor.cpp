@@ -28,6 +28,9 @@ AoR::AoR(std::string sip_uri) :
   _subscriptions(),
   _associated_uris(),
   _cas(0),
+  _binding_cas(),
+  _subscription_cas(),
+  _delta_index(),
   _uri(sip_uri)
 {
 }
@@ -64,22 +67,23 @@ void AoR::common_constructor(const AoR& other)
        i != other._bindings.end();
        ++i)
   {
-    Binding* bb = new Binding(*i->second);
-    _bindings.insert(std::make_pair(i->first, bb));
+    share_binding(i->first, i->second);
   }
 
   for (Subscriptions::const_iterator i = other._subscriptions.begin();
        i != other._subscriptions.end();
        ++i)
   {
-    Subscription* ss = new Subscription(*i->second);
-    _subscriptions.insert(std::make_pair(i->first, ss));
+    share_subscription(i->first, i->second);
   }
 
   _associated_uris = AssociatedURIs(other._associated_uris);
   _notify_cseq = other._notify_cseq;
   _timer_id = other._timer_id;
   _cas = other._cas;
+  _binding_cas = other._binding_cas;
+  _subscription_cas = other._subscription_cas;
+  _delta_index = other._delta_index;
   _uri = other._uri;
   _scscf_uri = other._scscf_uri;
 }
@@ -93,7 +97,7 @@ void AoR::clear(bool clear_emergency_bindings)
   {
     if ((clear_emergency_bindings) || (!i->second->_emergency_registration))
     {
-      delete i->second;
+      release(i->second);
       _bindings.erase(i++);
     }
     else
@@ -111,7 +115,7 @@ void AoR::clear(bool clear_emergency_bindings)
        i != _subscriptions.end();
        ++i)
   {
-    delete i->second;
+    release(i->second);
   }
 
   _subscriptions.clear();
@@ -125,10 +129,18 @@ void AoR::clear(bool clear_emergency_bindings)
 AoR::Binding* AoR::get_binding(const std::string& binding_id)
 {
   AoR::Binding* b;
-  AoR::Bindings::const_iterator i = _bindings.find(binding_id);
+  AoR::Bindings::iterator i = _bindings.find(binding_id);
   if (i != _bindings.end())
   {
     b = i->second;
+
+    if (b->_refs.shared())
+    {
+      // The binding is shared with another AoR, so take a copy to change.
+      i->second = new Binding(*b);
+      release(b);
+      b = i->second;
+    }
   }
   else
   {
@@ -148,7 +160,7 @@ void AoR::remove_binding(const std::string& binding_id)
   AoR::Bindings::iterator i = _bindings.find(binding_id);
   if (i != _bindings.end())
   {
-    delete i->second;
+    release(i->second);
     _bindings.erase(i);
   }
 }
@@ -158,10 +170,19 @@ void AoR::remove_binding(const std::string& binding_id)
 AoR::Subscription* AoR::get_subscription(const std::string& to_tag)
 {
   AoR::Subscription* s;
-  AoR::Subscriptions::const_iterator i = _subscriptions.find(to_tag);
+  AoR::Subscriptions::iterator i = _subscriptions.find(to_tag);
   if (i != _subscriptions.end())
   {
     s = i->second;
+
+    if (s->_refs.shared())
+    {
+      // The subscription is shared with another AoR, so take a copy to
+      // change.
+      i->second = new Subscription(*s);
+      release(s);
+      s = i->second;
+    }
   }
   else
   {
@@ -180,11 +201,24 @@ void AoR::remove_subscription(const std::string& to_tag)
   AoR::Subscriptions::iterator i = _subscriptions.find(to_tag);
   if (i != _subscriptions.end())
   {
-    delete i->second;
+    release(i->second);
     _subscriptions.erase(i);
   }
 }
 
+void AoR::share_binding(const std::string& binding_id, Binding* binding)
+{
+  binding->_refs.inc();
+  _bindings.insert(std::make_pair(binding_id, binding));
+}
+
+void AoR::share_subscription(const std::string& to_tag,
+                             Subscription* subscription)
+{
+  subscription->_refs.inc();
+  _subscriptions.insert(std::make_pair(to_tag, subscription));
+}
+
 /// Remove all the bindings from an AOR object
 void AoR::clear_bindings()
 {
@@ -192,13 +226,29 @@ void AoR::clear_bindings()
        i != _bindings.end();
        ++i)
   {
-    delete i->second;
+    release(i->second);
   }
 
   // Clear the bindings map.
   _bindings.clear();
 }
 
+void AoR::release(Binding* binding)
+{
+  if (binding->_refs.dec())
+  {
+    delete binding;
+  }
+}
+
+void AoR::release(Subscription* subscription)
+{
+  if (subscription->_refs.dec())
+  {
+    delete subscription;
+  }
+}
+
 // Generates the public GRUU for this binding from the address of record and
 // instance-id. Returns NULL if this binding has no valid GRUU.
 pjsip_sip_uri* AoR::Binding::pub_gruu(pj_pool_t* pool) const
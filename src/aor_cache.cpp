@@ -0,0 +1,103 @@
+/**
+ * @file aor_cache.cpp In-process cache of AoRs read from the AoR store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "aor_cache.h"
+
+// Rough sizes of a serialized binding and subscription, used to estimate the
+// memory used by a cached AoR.
+static const size_t BINDING_SIZE_ESTIMATE = 1024;
+static const size_t SUBSCRIPTION_SIZE_ESTIMATE = 512;
+
+AoRCache::AoRCache(int ttl_ms,
+                   size_t max_bytes,
+                   SNMP::CounterTable* hits_tbl,
+                   SNMP::CounterTable* misses_tbl,
+                   SNMP::CounterTable* stale_tbl) :
+  _cache("AoR", ttl_ms, max_bytes),
+  _hits_tbl(hits_tbl),
+  _misses_tbl(misses_tbl),
+  _stale_tbl(stale_tbl)
+{
+}
+
+AoRCache::~AoRCache()
+{
+}
+
+uint64_t AoRCache::get_generation(const std::string& aor_id)
+{
+  return _cache.get_generation(aor_id);
+}
+
+size_t AoRCache::estimate_size(const std::string& aor_id, const AoR* aor)
+{
+  return ShardedCache<AoR>::ENTRY_SIZE +
+         (2 * aor_id.size()) +
+         (aor->get_bindings_count() * BINDING_SIZE_ESTIMATE) +
+         (aor->get_subscriptions_count() * SUBSCRIPTION_SIZE_ESTIMATE);
+}
+
+AoR* AoRCache::get(const std::string& aor_id)
+{
+  AoR* aor = NULL;
+
+  _cache.get(aor_id, [&aor](const AoR& cached) { aor = new AoR(cached); });
+
+  if (aor != NULL)
+  {
+    TRC_DEBUG("Found AoR %s in cache, CAS = %ld", aor_id.c_str(), aor->_cas);
+    if (_hits_tbl != NULL)
+    {
+      _hits_tbl->increment();
+    }
+  }
+  else if (_misses_tbl != NULL)
+  {
+    _misses_tbl->increment();
+  }
+
+  return aor;
+}
+
+void AoRCache::put(const std::string& aor_id,
+                   const AoR* aor,
+                   uint64_t generation)
+{
+  _cache.put(aor_id, *aor, estimate_size(aor_id, aor), generation);
+}
+
+void AoRCache::invalidate(const std::string& aor_id,
+                          uint64_t cas,
+                          bool contended)
+{
+  // If the write failed on the CAS that we had cached, then we served out of
+  // date data.
+  bool stale = _cache.invalidate(aor_id,
+                                 [contended, cas](const AoR& cached)
+                                 {
+                                   return (contended && (cached._cas == cas));
+                                 });
+
+  if (stale)
+  {
+    TRC_DEBUG("Cached AoR %s was stale", aor_id.c_str());
+    if (_stale_tbl != NULL)
+    {
+      _stale_tbl->increment();
+    }
+  }
+}
+
+size_t AoRCache::size()
+{
+  return _cache.size();
+}
@@ -0,0 +1,363 @@
+/**
+ * @file aor_replicator.cpp Writes AoR changes to remote sites asynchronously.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <functional>
+
+#include "aor_replicator.h"
+#include "registration_utils.h"
+#include "log.h"
+
+AoRReplicator::AoRReplicator(std::vector<SubscriberDataManager*> remote_sdms,
+                             std::vector<SiteStats> site_stats,
+                             SNMP::CounterTable* dropped_tbl,
+                             ExceptionHandler* exception_handler,
+                             unsigned int num_threads,
+                             unsigned int max_queue) :
+  _remote_sdms(remote_sdms),
+  _site_stats(site_stats),
+  _dropped_tbl(dropped_tbl),
+  _max_queue(max_queue),
+  _queue_depth(0),
+  _next_sequence(0),
+  _thread_pools(),
+  _resyncs(),
+  _pending()
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  for (unsigned int ii = 0; ii < std::max(num_threads, 1u); ++ii)
+  {
+    Pool* pool = new Pool(this, exception_handler);
+    pool->start();
+    _thread_pools.push_back(pool);
+  }
+}
+
+AoRReplicator::~AoRReplicator()
+{
+  for (std::vector<Pool*>::iterator it = _thread_pools.begin();
+       it != _thread_pools.end();
+       ++it)
+  {
+    (*it)->stop();
+  }
+
+  for (std::vector<Pool*>::iterator it = _thread_pools.begin();
+       it != _thread_pools.end();
+       ++it)
+  {
+    (*it)->join();
+    delete *it;
+  }
+
+  _thread_pools.clear();
+  pthread_mutex_destroy(&_lock);
+}
+
+void AoRReplicator::replicate(const std::string& aor_id,
+                              const SubscriberDataManager::EventTrigger& event_trigger,
+                              AoRPair* aor_pair,
+                              SAS::TrailId trail)
+{
+  uint64_t sequence = ++_next_sequence;
+  size_t aor_hash = std::hash<std::string>()(aor_id);
+
+  for (size_t site = 0; site < _remote_sdms.size(); ++site)
+  {
+    if (!_remote_sdms[site]->has_servers())
+    {
+      continue;
+    }
+
+    if (++_queue_depth > _max_queue)
+    {
+      // The remote sites aren't keeping up.  Drop this change rather than
+      // queue without limit, and write the complete AoR to the remote site
+      // with the next change that does get through.
+      --_queue_depth;
+      TRC_WARNING("Remote write queue full, dropping change to %s for remote site %zu",
+                  aor_id.c_str(), site + 1);
+      resync_needed(AoRSite(aor_id, site), sequence);
+
+      if (_dropped_tbl != NULL)
+      {
+        _dropped_tbl->increment();
+      }
+
+      continue;
+    }
+
+    // Copying the AoRs is cheap, as the copies share bindings and
+    // subscriptions with the caller's AoRs.
+    Request* request = new Request();
+    request->aor_id = aor_id;
+    request->event_trigger = event_trigger;
+    request->aor_pair = new AoRPair(new AoR(*aor_pair->get_orig()),
+                                    new AoR(*aor_pair->get_current()));
+    request->site = site;
+    request->trail = trail;
+    request->stop_watch.start();
+    request->replicator = this;
+    request->sequence = sequence;
+
+    pthread_mutex_lock(&_lock);
+    ++_pending[AoRSite(aor_id, site)];
+    pthread_mutex_unlock(&_lock);
+
+    // Changes to the same AoR for the same site always go to the same
+    // worker, so they are written in the order they were made.
+    _thread_pools[(aor_hash + site) % _thread_pools.size()]->add_work(request);
+  }
+}
+
+bool AoRReplicator::site_behind(const std::string& aor_id,
+                                const SubscriberDataManager* sdm)
+{
+  std::vector<SubscriberDataManager*>::const_iterator it =
+                         std::find(_remote_sdms.begin(), _remote_sdms.end(), sdm);
+
+  if (it == _remote_sdms.end())
+  {
+    return false;
+  }
+
+  AoRSite aor_site(aor_id, it - _remote_sdms.begin());
+
+  pthread_mutex_lock(&_lock);
+  bool behind = ((_pending.find(aor_site) != _pending.end()) ||
+                 (_resyncs.find(aor_site) != _resyncs.end()));
+  pthread_mutex_unlock(&_lock);
+
+  return behind;
+}
+
+void AoRReplicator::change_done(Request* request)
+{
+  pthread_mutex_lock(&_lock);
+  std::map<AoRSite, int>::iterator it =
+                       _pending.find(AoRSite(request->aor_id, request->site));
+
+  if ((it != _pending.end()) && (--it->second == 0))
+  {
+    _pending.erase(it);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void AoRReplicator::resync_needed(const AoRSite& aor_site, uint64_t sequence)
+{
+  pthread_mutex_lock(&_lock);
+  uint64_t& lost_sequence = _resyncs[aor_site];
+  lost_sequence = std::max(lost_sequence, sequence);
+  pthread_mutex_unlock(&_lock);
+}
+
+bool AoRReplicator::take_resync(const AoRSite& aor_site, uint64_t sequence)
+{
+  bool resync = false;
+
+  pthread_mutex_lock(&_lock);
+  std::map<AoRSite, uint64_t>::iterator it = _resyncs.find(aor_site);
+
+  // Only a change made after the lost change includes it.  Earlier changes
+  // still in the queue are written as normal, and leave the AoR marked.
+  if ((it != _resyncs.end()) && (sequence > it->second))
+  {
+    _resyncs.erase(it);
+    resync = true;
+  }
+
+  pthread_mutex_unlock(&_lock);
+  return resync;
+}
+
+void AoRReplicator::apply_change(AoRPair* local_aor_pair, AoR* remote)
+{
+  AoR* orig = local_aor_pair->get_orig();
+  AoR* current = local_aor_pair->get_current();
+
+  // Bindings and subscriptions that haven't changed are still shared between
+  // the original and current AoRs, so anything not shared has been added or
+  // changed.
+  for (AoR::Bindings::const_iterator i = current->bindings().begin();
+       i != current->bindings().end();
+       ++i)
+  {
+    AoR::Bindings::const_iterator j = orig->bindings().find(i->first);
+
+    if ((j == orig->bindings().end()) || (j->second != i->second))
+    {
+      *remote->get_binding(i->first) = *i->second;
+    }
+  }
+
+  for (AoR::Bindings::const_iterator i = orig->bindings().begin();
+       i != orig->bindings().end();
+       ++i)
+  {
+    if (current->bindings().find(i->first) == current->bindings().end())
+    {
+      remote->remove_binding(i->first);
+    }
+  }
+
+  for (AoR::Subscriptions::const_iterator i = current->subscriptions().begin();
+       i != current->subscriptions().end();
+       ++i)
+  {
+    AoR::Subscriptions::const_iterator j = orig->subscriptions().find(i->first);
+
+    if ((j == orig->subscriptions().end()) || (j->second != i->second))
+    {
+      *remote->get_subscription(i->first) = *i->second;
+    }
+  }
+
+  for (AoR::Subscriptions::const_iterator i = orig->subscriptions().begin();
+       i != orig->subscriptions().end();
+       ++i)
+  {
+    if (current->subscriptions().find(i->first) == current->subscriptions().end())
+    {
+      remote->remove_subscription(i->first);
+    }
+  }
+
+  remote->_associated_uris = current->_associated_uris;
+  remote->_scscf_uri = current->_scscf_uri;
+}
+
+void AoRReplicator::apply_full(AoR* local, AoR* remote)
+{
+  remote->clear(true);
+
+  for (AoR::Bindings::const_iterator i = local->bindings().begin();
+       i != local->bindings().end();
+       ++i)
+  {
+    *remote->get_binding(i->first) = *i->second;
+  }
+
+  for (AoR::Subscriptions::const_iterator i = local->subscriptions().begin();
+       i != local->subscriptions().end();
+       ++i)
+  {
+    *remote->get_subscription(i->first) = *i->second;
+  }
+
+  remote->_associated_uris = local->_associated_uris;
+  remote->_scscf_uri = local->_scscf_uri;
+}
+
+void AoRReplicator::write_to_site(Request* request)
+{
+  SubscriberDataManager* sdm = _remote_sdms[request->site];
+  AoRSite aor_site(request->aor_id, request->site);
+  bool full = take_resync(aor_site, request->sequence);
+  AoRPair* remote_aor_pair = NULL;
+  Store::Status rc = Store::ERROR;
+
+  if (full)
+  {
+    TRC_DEBUG("Writing all of %s to remote site %zu as an earlier change was lost",
+              request->aor_id.c_str(), request->site + 1);
+  }
+
+  for (int attempt = 0;
+       (attempt < MAX_ATTEMPTS) && (rc != Store::OK);
+       ++attempt)
+  {
+    // If the remote site has no bindings for the AoR, this fills it in from
+    // the local AoR, so the change is applied on top of the full AoR.
+    if (!RegistrationUtils::get_aor_data(&remote_aor_pair,
+                                         request->aor_id,
+                                         sdm,
+                                         {},
+                                         request->aor_pair,
+                                         request->trail))
+    {
+      rc = Store::ERROR;
+      continue;
+    }
+
+    if (full)
+    {
+      apply_full(request->aor_pair->get_current(),
+                 remote_aor_pair->get_current());
+    }
+    else
+    {
+      apply_change(request->aor_pair, remote_aor_pair->get_current());
+    }
+
+    rc = sdm->set_aor_data(request->aor_id,
+                           request->event_trigger,
+                           remote_aor_pair,
+                           request->trail);
+  }
+
+  delete remote_aor_pair; remote_aor_pair = NULL;
+
+  SiteStats& stats = _site_stats[request->site];
+
+  if (rc == Store::OK)
+  {
+    unsigned long lag_us;
+
+    if ((stats.lag_tbl != NULL) && (request->stop_watch.read(lag_us)))
+    {
+      stats.lag_tbl->accumulate(lag_us);
+    }
+  }
+  else
+  {
+    TRC_WARNING("Failed to write %s to remote site %zu",
+                request->aor_id.c_str(), request->site + 1);
+    resync_needed(aor_site, request->sequence);
+
+    if (stats.failures_tbl != NULL)
+    {
+      stats.failures_tbl->increment();
+    }
+  }
+}
+
+void AoRReplicator::exception_callback(Request* request)
+{
+  request->replicator->resync_needed(AoRSite(request->aor_id, request->site),
+                                     request->sequence);
+  request->replicator->change_done(request);
+  delete request->aor_pair; request->aor_pair = NULL;
+  delete request; request = NULL;
+}
+
+void AoRReplicator::Pool::process_work(Request*& request)
+{
+  --_replicator->_queue_depth;
+  _replicator->write_to_site(request);
+  _replicator->change_done(request);
+  delete request->aor_pair; request->aor_pair = NULL;
+  delete request; request = NULL;
+}
+
+AoRReplicator::Pool::Pool(AoRReplicator* replicator,
+                          ExceptionHandler* exception_handler) :
+  ThreadPool<Request*>(1,
+                       exception_handler,
+                       &AoRReplicator::exception_callback,
+                       0),
+  _replicator(replicator)
+{}
+
+AoRReplicator::Pool::~Pool()
+{}
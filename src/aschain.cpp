@@ -283,7 +283,7 @@ void AsChainLink::get_next_application_server(pjsip_msg* msg,
                                               bool& got_dummy_as,
                                               SAS::TrailId msg_trail)
 {
-  std::vector<Ifc> ifcs = _as_chain->_using_standard_ifcs ?
+  const std::vector<Ifc>& ifcs = _as_chain->_using_standard_ifcs ?
                           _as_chain->_ifcs.ifcs_list() :
                           _as_chain->_fallback_ifcs;
   got_dummy_as = false;
@@ -11,31 +11,83 @@
 
 
 // Common STL includes.
+#include <algorithm>
+#include <time.h>
+#include <unordered_map>
+
 #include "astaire_aor_store.h"
 #include "json_parse_utils.h"
 #include "rapidjson/error/en.h"
 #include "sproutsasevent.h"
 
 
-AstaireAoRStore::AstaireAoRStore(Store* store) : AoRStore()
+AstaireAoRStore::AstaireAoRStore(Store* store,
+                                 AoRCache* aor_cache,
+                                 SerializationFormat format,
+                                 bool delta_writes) :
+  AoRStore(),
+  _aor_cache(aor_cache)
 {
-  JsonSerializerDeserializer* serializer_deserializer = new JsonSerializerDeserializer();
-  _connector = new Connector(store, serializer_deserializer); // Takes ownership of serializer_deserializer
+  // The serializer for the configured format comes first, so is used for
+  // writes.  Both are always available for reads, so that a deployment can
+  // move between formats.
+  std::vector<SerializerDeserializer*> serializer_deserializers;
+
+  if (format == BINARY)
+  {
+    serializer_deserializers.push_back(new BinarySerializerDeserializer());
+    serializer_deserializers.push_back(new JsonSerializerDeserializer());
+  }
+  else
+  {
+    serializer_deserializers.push_back(new JsonSerializerDeserializer());
+    serializer_deserializers.push_back(new BinarySerializerDeserializer());
+  }
+
+  _connector = new Connector(store,
+                             serializer_deserializers, // Takes ownership of serializer_deserializers
+                             delta_writes);
 }
 
 AstaireAoRStore::~AstaireAoRStore()
 {
-  // Ownership of serializer_deserializer passed to _connector
+  // Ownership of serializer_deserializers passed to _connector
   delete _connector; _connector = NULL;
 }
 
 /// AstaireAoRStore methods
 
-/// Calls through into the connector get and set commands
+/// Calls through into the connector get and set commands, reading through
+/// the AoR cache if there is one.
 AoR* AstaireAoRStore::get_aor_data(const std::string& aor_id,
                                    SAS::TrailId trail)
 {
-  return _connector->get_aor_data(aor_id, trail);
+  AoR* aor_data = NULL;
+  uint64_t generation = 0;
+
+  if (_aor_cache != NULL)
+  {
+    generation = _aor_cache->get_generation(aor_id);
+    aor_data = _aor_cache->get(aor_id);
+
+    if (aor_data != NULL)
+    {
+      SAS::Event event(trail, SASEvent::REGSTORE_GET_CACHED, 0);
+      event.add_var_param(aor_id);
+      SAS::report_event(event);
+
+      return aor_data;
+    }
+  }
+
+  aor_data = _connector->get_aor_data(aor_id, trail);
+
+  if ((_aor_cache != NULL) && (aor_data != NULL))
+  {
+    _aor_cache->put(aor_id, aor_data, generation);
+  }
+
+  return aor_data;
 }
 
 
@@ -44,26 +96,59 @@ Store::Status AstaireAoRStore::set_aor_data(const std::string& aor_id,
                                             int expiry,
                                             SAS::TrailId trail)
 {
-  return _connector->set_aor_data(aor_id,
-                                  aor_data->get_current(),
-                                  expiry,
-                                  trail);
+  Store::Status status;
+
+  if (_connector->_delta_writes)
+  {
+    status = _connector->set_aor_data_delta(aor_id,
+                                            aor_data->get_orig(),
+                                            aor_data->get_current(),
+                                            expiry,
+                                            trail);
+  }
+  else
+  {
+    status = _connector->set_aor_data(aor_id,
+                                      aor_data->get_current(),
+                                      expiry,
+                                      trail);
+  }
+
+  if (_aor_cache != NULL)
+  {
+    // The write has changed the CAS (or failed because the cached CAS was out
+    // of date), so the cached AoR can't be used for further writes.
+    _aor_cache->invalidate(aor_id,
+                           aor_data->get_current()->_cas,
+                           (status == Store::Status::DATA_CONTENTION));
+  }
+
+  return status;
 }
 
 /// AstaireAoRStore::Connector Methods
 
 AstaireAoRStore::Connector::Connector(Store* data_store,
-                            JsonSerializerDeserializer*& serializer_deserializer) :
+                            std::vector<SerializerDeserializer*>& serializer_deserializers,
+                            bool delta_writes) :
   _data_store(data_store),
-  _serializer_deserializer(serializer_deserializer)
+  _serializer_deserializers(serializer_deserializers),
+  _delta_writes(delta_writes)
 {
-  // We have taken ownership of the serializer_deserializer.
-  serializer_deserializer = NULL;
+  // We have taken ownership of the serializer_deserializers.
+  serializer_deserializers.clear();
 }
 
 AstaireAoRStore::Connector::~Connector()
 {
-  delete _serializer_deserializer; _serializer_deserializer = NULL;
+  for (std::vector<SerializerDeserializer*>::iterator it = _serializer_deserializers.begin();
+       it != _serializer_deserializers.end();
+       ++it)
+  {
+    delete *it;
+  }
+
+  _serializer_deserializers.clear();
 }
 
 /// Retrieve the registration data for a given SIP Address of Record, creating
@@ -83,11 +168,26 @@ AoR* AstaireAoRStore::Connector::get_aor_data(
 
   if (status == Store::Status::OK)
   {
-    // Retrieved the data, so deserialize it.
+    // Retrieved the data, so deserialize it.  This is either the whole AoR,
+    // or an index of the records that hold its bindings and subscriptions.
     TRC_DEBUG("Data store returned a record, CAS = %ld", cas);
-    aor_data = _serializer_deserializer->deserialize_aor(aor_id, data);
 
-    if (aor_data != NULL)
+    if (is_delta_index(data))
+    {
+      status = get_aor_data_from_index(aor_id, data, cas, aor_data, trail);
+    }
+    else
+    {
+      aor_data = deserialize_aor(aor_id, data);
+    }
+
+    if (status != Store::Status::OK)
+    {
+      SAS::Event event(trail, SASEvent::REGSTORE_GET_FAILURE, 0);
+      event.add_var_param(aor_id);
+      SAS::report_event(event);
+    }
+    else if (aor_data != NULL)
     {
       aor_data->_cas = cas;
 
@@ -127,13 +227,29 @@ AoR* AstaireAoRStore::Connector::get_aor_data(
   return aor_data;
 }
 
+AoR* AstaireAoRStore::Connector::deserialize_aor(const std::string& aor_id,
+                                                 const std::string& data)
+{
+  for (std::vector<SerializerDeserializer*>::iterator it = _serializer_deserializers.begin();
+       it != _serializer_deserializers.end();
+       ++it)
+  {
+    if ((*it)->handles_data(data))
+    {
+      return (*it)->deserialize_aor(aor_id, data);
+    }
+  }
+
+  return NULL;
+}
+
 Store::Status AstaireAoRStore::Connector::set_aor_data(
                                             const std::string& aor_id,
                                             AoR* aor_data,
                                             int expiry,
                                             SAS::TrailId trail)
 {
-  std::string data = _serializer_deserializer->serialize_aor(aor_data);
+  std::string data = _serializer_deserializers.front()->serialize_aor(aor_data);
 
   SAS::Event event(trail, SASEvent::REGSTORE_SET_START, 0);
   event.add_var_param(aor_id);
@@ -169,6 +285,12 @@ Store::Status AstaireAoRStore::Connector::set_aor_data(
 // (De)serializer for the JSON SubscriberDataManager format.
 //
 
+bool AstaireAoRStore::JsonSerializerDeserializer::handles_data(const std::string& s)
+{
+  return (s.empty() ||
+          ((unsigned char)s[0] != BinarySerializerDeserializer::MAGIC));
+}
+
 AoR* AstaireAoRStore::JsonSerializerDeserializer::
   deserialize_aor(const std::string& aor_id, const std::string& s)
 {
@@ -299,3 +421,939 @@ std::string AstaireAoRStore::JsonSerializerDeserializer::serialize_aor(AoR* aor_
 
   return sb.GetString();
 }
+
+
+//
+// (De)serializer for the binary SubscriberDataManager format.
+//
+
+namespace
+{
+
+/// Thrown when binary AoR data can't be decoded.
+class BinaryFormatError : public std::exception {};
+
+/// Writes the binary format, building the table of strings as it goes.
+class BinaryWriter
+{
+public:
+  void write_uint(uint64_t value)
+  {
+    // Little-endian base 128.
+    while (value >= 0x80)
+    {
+      _body.push_back((char)((value & 0x7F) | 0x80));
+      value >>= 7;
+    }
+    _body.push_back((char)value);
+  }
+
+  void write_int(int value)
+  {
+    // Zig-zag encode, so small negative numbers are short too.
+    int64_t v = value;
+    write_uint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+  }
+
+  void write_bool(bool value)
+  {
+    _body.push_back(value ? 1 : 0);
+  }
+
+  void write_string(const std::string& value)
+  {
+    std::pair<std::unordered_map<std::string, uint32_t>::iterator, bool> ret =
+                 _string_ids.insert(std::make_pair(value, (uint32_t)_strings.size()));
+    if (ret.second)
+    {
+      _strings.push_back(&ret.first->first);
+    }
+    write_uint(ret.first->second);
+  }
+
+  /// Returns the complete data - header, string table and then body.
+  std::string data(unsigned char magic = AstaireAoRStore::BinarySerializerDeserializer::MAGIC,
+                   unsigned char version = AstaireAoRStore::BinarySerializerDeserializer::VERSION)
+  {
+    std::string body;
+    body.swap(_body);
+
+    write_uint(_strings.size());
+    for (std::vector<const std::string*>::const_iterator it = _strings.begin();
+         it != _strings.end();
+         ++it)
+    {
+      write_uint((*it)->size());
+      _body.append(**it);
+    }
+
+    std::string data;
+    data.reserve(2 + _body.size() + body.size());
+    data.push_back((char)magic);
+    data.push_back((char)version);
+    data.append(_body);
+    data.append(body);
+    return data;
+  }
+
+private:
+  std::string _body;
+  std::unordered_map<std::string, uint32_t> _string_ids;
+  std::vector<const std::string*> _strings;
+};
+
+/// Reads the binary format.
+class BinaryReader
+{
+public:
+  BinaryReader(const std::string& data) :
+    _data(data),
+    _pos(2)
+  {
+    uint64_t num_strings = read_uint();
+
+    // Every string takes at least one byte, which bounds how many there can
+    // be in valid data.
+    if (num_strings > _data.size())
+    {
+      throw BinaryFormatError();
+    }
+
+    _strings.reserve(num_strings);
+    for (uint64_t ii = 0; ii < num_strings; ++ii)
+    {
+      uint64_t length = read_uint();
+      if (length > _data.size() - _pos)
+      {
+        throw BinaryFormatError();
+      }
+      _strings.push_back(_data.substr(_pos, length));
+      _pos += length;
+    }
+  }
+
+  uint64_t read_uint()
+  {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+      if (_pos >= _data.size())
+      {
+        throw BinaryFormatError();
+      }
+      unsigned char byte = (unsigned char)_data[_pos++];
+      value |= ((uint64_t)(byte & 0x7F)) << shift;
+      if ((byte & 0x80) == 0)
+      {
+        return value;
+      }
+    }
+    throw BinaryFormatError();
+  }
+
+  int read_int()
+  {
+    uint64_t v = read_uint();
+    return (int)((int64_t)(v >> 1) ^ -(int64_t)(v & 1));
+  }
+
+  bool read_bool()
+  {
+    return (read_uint() != 0);
+  }
+
+  const std::string& read_string()
+  {
+    uint64_t id = read_uint();
+    if (id >= _strings.size())
+    {
+      throw BinaryFormatError();
+    }
+    return _strings[id];
+  }
+
+  /// Reads a count of items, each of which takes at least one byte.
+  uint64_t read_count()
+  {
+    uint64_t count = read_uint();
+    if (count > _data.size() - _pos)
+    {
+      throw BinaryFormatError();
+    }
+    return count;
+  }
+
+  bool at_end() const { return (_pos == _data.size()); }
+
+private:
+  const std::string& _data;
+  size_t _pos;
+  std::vector<std::string> _strings;
+};
+
+} // namespace
+
+bool AstaireAoRStore::BinarySerializerDeserializer::handles_data(const std::string& s)
+{
+  return ((!s.empty()) && ((unsigned char)s[0] == MAGIC));
+}
+
+std::string AstaireAoRStore::BinarySerializerDeserializer::serialize_aor(AoR* aor_data)
+{
+  BinaryWriter writer;
+
+  writer.write_uint(aor_data->bindings().size());
+  for (AoR::Bindings::const_iterator it = aor_data->bindings().begin();
+       it != aor_data->bindings().end();
+       ++it)
+  {
+    const AoR::Binding* b = it->second;
+    writer.write_string(it->first);
+    writer.write_string(b->_uri);
+    writer.write_string(b->_cid);
+    writer.write_int(b->_cseq);
+    writer.write_int(b->_expires);
+    writer.write_int(b->_priority);
+
+    writer.write_uint(b->_params.size());
+    for (std::map<std::string, std::string>::const_iterator p = b->_params.begin();
+         p != b->_params.end();
+         ++p)
+    {
+      writer.write_string(p->first);
+      writer.write_string(p->second);
+    }
+
+    writer.write_uint(b->_path_headers.size());
+    for (std::list<std::string>::const_iterator p = b->_path_headers.begin();
+         p != b->_path_headers.end();
+         ++p)
+    {
+      writer.write_string(*p);
+    }
+
+    writer.write_uint(b->_path_uris.size());
+    for (std::list<std::string>::const_iterator p = b->_path_uris.begin();
+         p != b->_path_uris.end();
+         ++p)
+    {
+      writer.write_string(*p);
+    }
+
+    writer.write_string(b->_private_id);
+    writer.write_bool(b->_emergency_registration);
+  }
+
+  writer.write_uint(aor_data->subscriptions().size());
+  for (AoR::Subscriptions::const_iterator it = aor_data->subscriptions().begin();
+       it != aor_data->subscriptions().end();
+       ++it)
+  {
+    const AoR::Subscription* s = it->second;
+    writer.write_string(it->first);
+    writer.write_string(s->_req_uri);
+    writer.write_string(s->_from_uri);
+    writer.write_string(s->_from_tag);
+    writer.write_string(s->_to_uri);
+    writer.write_string(s->_to_tag);
+    writer.write_string(s->_cid);
+
+    writer.write_uint(s->_route_uris.size());
+    for (std::list<std::string>::const_iterator r = s->_route_uris.begin();
+         r != s->_route_uris.end();
+         ++r)
+    {
+      writer.write_string(*r);
+    }
+
+    writer.write_int(s->_expires);
+  }
+
+  std::vector<std::string> uris = aor_data->_associated_uris.get_all_uris();
+  writer.write_uint(uris.size());
+  for (std::vector<std::string>::const_iterator it = uris.begin();
+       it != uris.end();
+       ++it)
+  {
+    writer.write_string(*it);
+    writer.write_bool(aor_data->_associated_uris.is_impu_barred(*it));
+  }
+
+  std::map<std::string, std::string> wildcards =
+                                aor_data->_associated_uris.get_wildcard_mapping();
+  writer.write_uint(wildcards.size());
+  for (std::map<std::string, std::string>::const_iterator it = wildcards.begin();
+       it != wildcards.end();
+       ++it)
+  {
+    writer.write_string(it->first);
+    writer.write_string(it->second);
+  }
+
+  writer.write_int(aor_data->_notify_cseq);
+  writer.write_string(aor_data->_timer_id);
+  writer.write_string(aor_data->_scscf_uri);
+
+  return writer.data();
+}
+
+AoR* AstaireAoRStore::BinarySerializerDeserializer::
+  deserialize_aor(const std::string& aor_id, const std::string& s)
+{
+  TRC_DEBUG("Deserialize binary AoR of %zu bytes", s.size());
+
+  if ((s.size() < 2) ||
+      ((unsigned char)s[0] != MAGIC) ||
+      ((unsigned char)s[1] != VERSION))
+  {
+    TRC_INFO("Unsupported binary AoR format");
+    return NULL;
+  }
+
+  AoR* aor = new AoR(aor_id);
+
+  try
+  {
+    BinaryReader reader(s);
+
+    for (uint64_t num_bindings = reader.read_count(); num_bindings > 0; --num_bindings)
+    {
+      AoR::Binding* b = aor->get_binding(reader.read_string());
+      b->_uri = reader.read_string();
+      b->_cid = reader.read_string();
+      b->_cseq = reader.read_int();
+      b->_expires = reader.read_int();
+      b->_priority = reader.read_int();
+
+      for (uint64_t num_params = reader.read_count(); num_params > 0; --num_params)
+      {
+        const std::string& name = reader.read_string();
+        b->_params[name] = reader.read_string();
+      }
+
+      for (uint64_t num_paths = reader.read_count(); num_paths > 0; --num_paths)
+      {
+        b->_path_headers.push_back(reader.read_string());
+      }
+
+      for (uint64_t num_paths = reader.read_count(); num_paths > 0; --num_paths)
+      {
+        b->_path_uris.push_back(reader.read_string());
+      }
+
+      b->_private_id = reader.read_string();
+      b->_emergency_registration = reader.read_bool();
+    }
+
+    for (uint64_t num_subscriptions = reader.read_count();
+         num_subscriptions > 0;
+         --num_subscriptions)
+    {
+      AoR::Subscription* sub = aor->get_subscription(reader.read_string());
+      sub->_req_uri = reader.read_string();
+      sub->_from_uri = reader.read_string();
+      sub->_from_tag = reader.read_string();
+      sub->_to_uri = reader.read_string();
+      sub->_to_tag = reader.read_string();
+      sub->_cid = reader.read_string();
+
+      for (uint64_t num_routes = reader.read_count(); num_routes > 0; --num_routes)
+      {
+        sub->_route_uris.push_back(reader.read_string());
+      }
+
+      sub->_expires = reader.read_int();
+    }
+
+    for (uint64_t num_uris = reader.read_count(); num_uris > 0; --num_uris)
+    {
+      const std::string& uri = reader.read_string();
+      aor->_associated_uris.add_uri(uri, reader.read_bool());
+    }
+
+    for (uint64_t num_wildcards = reader.read_count();
+         num_wildcards > 0;
+         --num_wildcards)
+    {
+      const std::string& distinct = reader.read_string();
+      aor->_associated_uris.add_wildcard_mapping(distinct, reader.read_string());
+    }
+
+    aor->_notify_cseq = reader.read_int();
+    aor->_timer_id = reader.read_string();
+    aor->_scscf_uri = reader.read_string();
+
+    if (!reader.at_end())
+    {
+      throw BinaryFormatError();
+    }
+  }
+  catch (BinaryFormatError err)
+  {
+    TRC_INFO("Failed to deserialize binary AoR");
+    delete aor; aor = NULL;
+  }
+
+  return aor;
+}
+
+
+//
+// Delta writes.  The AoR is held as an index record under the AoR ID, and a
+// record per binding and subscription.  The index lists the binding IDs and
+// To tags, and holds the rest of the AoR (serialized without its bindings and
+// subscriptions).  Each binding and subscription record is serialized as an
+// AoR holding just that binding or subscription.
+//
+
+namespace
+{
+
+/// Decoded form of an index record.
+struct DeltaIndex
+{
+  /// The time at which the index record expires.
+  int expires;
+
+  /// The AoR's notify CSeq when the index was written.  The CSeq is
+  /// incremented on every write, but the index isn't rewritten on every
+  /// write, so the AoR's CSeq is the highest of this and the CSeqs of its
+  /// records.
+  int notify_cseq;
+
+  std::vector<std::string> binding_ids;
+  std::vector<std::string> subscription_ids;
+
+  /// The rest of the AoR, serialized.
+  std::string header;
+};
+
+std::string encode_delta_index(const DeltaIndex& index,
+                               unsigned char magic,
+                               unsigned char version)
+{
+  BinaryWriter writer;
+  writer.write_int(index.expires);
+  writer.write_int(index.notify_cseq);
+
+  writer.write_uint(index.binding_ids.size());
+  for (std::vector<std::string>::const_iterator it = index.binding_ids.begin();
+       it != index.binding_ids.end();
+       ++it)
+  {
+    writer.write_string(*it);
+  }
+
+  writer.write_uint(index.subscription_ids.size());
+  for (std::vector<std::string>::const_iterator it = index.subscription_ids.begin();
+       it != index.subscription_ids.end();
+       ++it)
+  {
+    writer.write_string(*it);
+  }
+
+  writer.write_string(index.header);
+
+  return writer.data(magic, version);
+}
+
+bool decode_delta_index(const std::string& data,
+                        unsigned char version,
+                        DeltaIndex& index)
+{
+  if ((data.size() < 2) || ((unsigned char)data[1] != version))
+  {
+    TRC_INFO("Unsupported AoR index format");
+    return false;
+  }
+
+  try
+  {
+    BinaryReader reader(data);
+    index.expires = reader.read_int();
+    index.notify_cseq = reader.read_int();
+
+    for (uint64_t num_ids = reader.read_count(); num_ids > 0; --num_ids)
+    {
+      index.binding_ids.push_back(reader.read_string());
+    }
+
+    for (uint64_t num_ids = reader.read_count(); num_ids > 0; --num_ids)
+    {
+      index.subscription_ids.push_back(reader.read_string());
+    }
+
+    index.header = reader.read_string();
+
+    if (!reader.at_end())
+    {
+      throw BinaryFormatError();
+    }
+  }
+  catch (BinaryFormatError err)
+  {
+    TRC_INFO("Failed to deserialize AoR index");
+    return false;
+  }
+
+  return true;
+}
+
+/// Returns the key of a binding or subscription record.  The ID is hashed
+/// (64-bit FNV-1a) as binding IDs can be long, and can contain characters
+/// that aren't valid in memcached keys.  The record holds the ID, so
+/// collisions are detected when it's read.
+std::string record_key(const std::string& aor_id,
+                       const char* type,
+                       const std::string& id)
+{
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (std::string::const_iterator it = id.begin(); it != id.end(); ++it)
+  {
+    hash ^= (unsigned char)*it;
+    hash *= 0x100000001b3ULL;
+  }
+
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016lx", (unsigned long)hash);
+  return aor_id + "\\" + type + "\\" + buf;
+}
+
+bool bindings_equal(const AoR::Binding* b1, const AoR::Binding* b2)
+{
+  return ((b1->_uri == b2->_uri) &&
+          (b1->_cid == b2->_cid) &&
+          (b1->_path_headers == b2->_path_headers) &&
+          (b1->_path_uris == b2->_path_uris) &&
+          (b1->_cseq == b2->_cseq) &&
+          (b1->_expires == b2->_expires) &&
+          (b1->_priority == b2->_priority) &&
+          (b1->_params == b2->_params) &&
+          (b1->_private_id == b2->_private_id) &&
+          (b1->_emergency_registration == b2->_emergency_registration));
+}
+
+bool subscriptions_equal(const AoR::Subscription* s1, const AoR::Subscription* s2)
+{
+  return ((s1->_req_uri == s2->_req_uri) &&
+          (s1->_from_uri == s2->_from_uri) &&
+          (s1->_from_tag == s2->_from_tag) &&
+          (s1->_to_uri == s2->_to_uri) &&
+          (s1->_to_tag == s2->_to_tag) &&
+          (s1->_cid == s2->_cid) &&
+          (s1->_route_uris == s2->_route_uris) &&
+          (s1->_expires == s2->_expires));
+}
+
+/// A binding or subscription record to write.
+struct DeltaRecord
+{
+  std::string key;
+  std::string data;
+  uint64_t cas;
+};
+
+} // namespace
+
+bool AstaireAoRStore::Connector::is_delta_index(const std::string& data)
+{
+  return ((!data.empty()) && ((unsigned char)data[0] == DELTA_MAGIC));
+}
+
+Store::Status AstaireAoRStore::Connector::get_aor_data_from_index(
+                                                const std::string& aor_id,
+                                                std::string& index_data,
+                                                uint64_t& cas,
+                                                AoR*& aor_data,
+                                                SAS::TrailId trail)
+{
+  // Records are written before the index that lists them, and only deleted
+  // once an index that doesn't list them has been written.  A listed record
+  // that is missing has therefore either expired, or been removed by an
+  // update that has rewritten the index since we read it.  Treat it as a
+  // failed read and read the index again: if the index hasn't changed the
+  // record has expired and the AoR is complete without it.
+  for (int attempt = 1; ; ++attempt)
+  {
+    bool records_missing;
+    Store::Status status = read_indexed_records(aor_id,
+                                                index_data,
+                                                aor_data,
+                                                records_missing,
+                                                trail);
+
+    if ((status != Store::Status::OK) || (!records_missing))
+    {
+      return status;
+    }
+
+    std::string new_index_data;
+    uint64_t new_cas;
+    status = _data_store->get_data("reg", aor_id, new_index_data, new_cas, trail);
+
+    if ((status == Store::Status::OK) && (new_cas == cas))
+    {
+      TRC_DEBUG("Index for %s unchanged, so missing records have expired",
+                aor_id.c_str());
+      return status;
+    }
+
+    delete aor_data; aor_data = NULL;
+
+    if (status != Store::Status::OK)
+    {
+      return status;
+    }
+    else if (attempt >= MAX_INDEX_READ_ATTEMPTS)
+    {
+      TRC_DEBUG("AoR %s still changing after %d reads", aor_id.c_str(), attempt);
+      return Store::Status::ERROR;
+    }
+
+    index_data = new_index_data;
+    cas = new_cas;
+
+    if (!is_delta_index(index_data))
+    {
+      // The AoR has been rewritten as a single record.
+      aor_data = deserialize_aor(aor_id, index_data);
+      return Store::Status::OK;
+    }
+  }
+}
+
+Store::Status AstaireAoRStore::Connector::read_indexed_records(
+                                                const std::string& aor_id,
+                                                const std::string& index_data,
+                                                AoR*& aor_data,
+                                                bool& records_missing,
+                                                SAS::TrailId trail)
+{
+  records_missing = false;
+
+  DeltaIndex index;
+
+  if (!decode_delta_index(index_data, DELTA_VERSION, index))
+  {
+    return Store::Status::OK;
+  }
+
+  aor_data = deserialize_aor(aor_id, index.header);
+
+  if (aor_data == NULL)
+  {
+    return Store::Status::OK;
+  }
+
+  aor_data->_notify_cseq = index.notify_cseq;
+  aor_data->_delta_index = index_data;
+
+  // Read each binding and subscription record.  A record that isn't found
+  // is left out of the AoR, and the caller told about it.
+  for (std::vector<std::string>::const_iterator it = index.binding_ids.begin();
+       it != index.binding_ids.end();
+       ++it)
+  {
+    std::string data;
+    uint64_t cas;
+    Store::Status status = _data_store->get_data("reg",
+                                                 record_key(aor_id, "b", *it),
+                                                 data,
+                                                 cas,
+                                                 trail);
+
+    if (status == Store::Status::NOT_FOUND)
+    {
+      TRC_DEBUG("Binding %s not found", it->c_str());
+      records_missing = true;
+      continue;
+    }
+    else if (status != Store::Status::OK)
+    {
+      TRC_DEBUG("Failed to read binding %s", it->c_str());
+      delete aor_data; aor_data = NULL;
+      return status;
+    }
+
+    AoR* record = deserialize_aor(aor_id, data);
+    AoR::Bindings::iterator b;
+
+    if ((record != NULL) &&
+        ((b = record->_bindings.find(*it)) != record->_bindings.end()))
+    {
+      aor_data->_bindings.insert(std::make_pair(*it, b->second));
+      record->_bindings.erase(b);
+      aor_data->_binding_cas[*it] = cas;
+      aor_data->_notify_cseq = std::max(aor_data->_notify_cseq,
+                                        record->_notify_cseq);
+    }
+    else
+    {
+      TRC_INFO("Failed to deserialize binding %s", it->c_str());
+    }
+
+    delete record;
+  }
+
+  for (std::vector<std::string>::const_iterator it = index.subscription_ids.begin();
+       it != index.subscription_ids.end();
+       ++it)
+  {
+    std::string data;
+    uint64_t cas;
+    Store::Status status = _data_store->get_data("reg",
+                                                 record_key(aor_id, "s", *it),
+                                                 data,
+                                                 cas,
+                                                 trail);
+
+    if (status == Store::Status::NOT_FOUND)
+    {
+      TRC_DEBUG("Subscription %s not found", it->c_str());
+      records_missing = true;
+      continue;
+    }
+    else if (status != Store::Status::OK)
+    {
+      TRC_DEBUG("Failed to read subscription %s", it->c_str());
+      delete aor_data; aor_data = NULL;
+      return status;
+    }
+
+    AoR* record = deserialize_aor(aor_id, data);
+    AoR::Subscriptions::iterator s;
+
+    if ((record != NULL) &&
+        ((s = record->_subscriptions.find(*it)) != record->_subscriptions.end()))
+    {
+      aor_data->_subscriptions.insert(std::make_pair(*it, s->second));
+      record->_subscriptions.erase(s);
+      aor_data->_subscription_cas[*it] = cas;
+      aor_data->_notify_cseq = std::max(aor_data->_notify_cseq,
+                                        record->_notify_cseq);
+    }
+    else
+    {
+      TRC_INFO("Failed to deserialize subscription %s", it->c_str());
+    }
+
+    delete record;
+  }
+
+  return Store::Status::OK;
+}
+
+Store::Status AstaireAoRStore::Connector::set_record(const std::string& key,
+                                                     const std::string& data,
+                                                     uint64_t cas,
+                                                     int expiry,
+                                                     SAS::TrailId trail)
+{
+  Store::Status status = _data_store->set_data("reg", key, data, cas, expiry, trail);
+
+  if ((status == Store::Status::DATA_CONTENTION) && (cas == 0))
+  {
+    // The record isn't in the index we read, but exists.  The index is the
+    // authority on which records are part of the AoR, so this record was
+    // left behind by an earlier update and can be overwritten.
+    std::string old_data;
+    uint64_t old_cas;
+
+    if (_data_store->get_data("reg", key, old_data, old_cas, trail) ==
+                                                          Store::Status::OK)
+    {
+      TRC_DEBUG("Overwriting old record %s", key.c_str());
+      status = _data_store->set_data("reg", key, data, old_cas, expiry, trail);
+    }
+  }
+
+  return status;
+}
+
+Store::Status AstaireAoRStore::Connector::set_aor_data_delta(
+                                            const std::string& aor_id,
+                                            AoR* orig_aor,
+                                            AoR* aor_data,
+                                            int expiry,
+                                            SAS::TrailId trail)
+{
+  SerializerDeserializer* serializer = _serializer_deserializers.front();
+  int now = time(NULL);
+
+  SAS::Event event(trail, SASEvent::REGSTORE_SET_START, 0);
+  event.add_var_param(aor_id);
+  SAS::report_event(event);
+
+  // Work out which binding and subscription records have changed since the
+  // AoR was read.  Records that weren't read (including all of them if the
+  // AoR was read as a single record) are written without a CAS.
+  //
+  // Every write increments the notify CSeq, and NOTIFYs are sent to each
+  // subscription with it, so if the CSeq has changed every subscription
+  // record is rewritten to carry it.  Writes that would send NOTIFYs to the
+  // same subscriptions therefore contend on the subscription records.
+  bool notify_cseq_changed = (aor_data->_notify_cseq != orig_aor->_notify_cseq);
+  std::vector<DeltaRecord> records;
+  DeltaIndex index;
+
+  for (AoR::Bindings::const_iterator it = aor_data->bindings().begin();
+       it != aor_data->bindings().end();
+       ++it)
+  {
+    index.binding_ids.push_back(it->first);
+
+    std::map<std::string, uint64_t>::const_iterator cas =
+                                          orig_aor->_binding_cas.find(it->first);
+    AoR::Bindings::const_iterator orig = orig_aor->bindings().find(it->first);
+
+    if ((cas == orig_aor->_binding_cas.end()) ||
+        (orig == orig_aor->bindings().end()) ||
+        (!bindings_equal(orig->second, it->second)))
+    {
+      AoR record(aor_id);
+      record.share_binding(it->first, it->second);
+      record._notify_cseq = aor_data->_notify_cseq;
+
+      DeltaRecord delta_record;
+      delta_record.key = record_key(aor_id, "b", it->first);
+      delta_record.data = serializer->serialize_aor(&record);
+      delta_record.cas = (cas != orig_aor->_binding_cas.end()) ? cas->second : 0;
+      records.push_back(delta_record);
+    }
+  }
+
+  for (AoR::Subscriptions::const_iterator it = aor_data->subscriptions().begin();
+       it != aor_data->subscriptions().end();
+       ++it)
+  {
+    index.subscription_ids.push_back(it->first);
+
+    std::map<std::string, uint64_t>::const_iterator cas =
+                                     orig_aor->_subscription_cas.find(it->first);
+    AoR::Subscriptions::const_iterator orig =
+                                     orig_aor->subscriptions().find(it->first);
+
+    if ((cas == orig_aor->_subscription_cas.end()) ||
+        (orig == orig_aor->subscriptions().end()) ||
+        (notify_cseq_changed) ||
+        (!subscriptions_equal(orig->second, it->second)))
+    {
+      AoR record(aor_id);
+      record.share_subscription(it->first, it->second);
+      record._notify_cseq = aor_data->_notify_cseq;
+
+      DeltaRecord delta_record;
+      delta_record.key = record_key(aor_id, "s", it->first);
+      delta_record.data = serializer->serialize_aor(&record);
+      delta_record.cas = (cas != orig_aor->_subscription_cas.end()) ? cas->second : 0;
+      records.push_back(delta_record);
+    }
+  }
+
+  // Build the new index.
+  AoR header(aor_id);
+  header._associated_uris = aor_data->_associated_uris;
+  header._timer_id = aor_data->_timer_id;
+  header._scscf_uri = aor_data->_scscf_uri;
+  header._notify_cseq = 0;
+  index.header = serializer->serialize_aor(&header);
+  index.notify_cseq = aor_data->_notify_cseq;
+
+  // The index only needs rewriting if bindings or subscriptions have been
+  // added or removed, the rest of the AoR has changed, or it would expire
+  // before the AoR.  It is written with twice the expiry needed so that
+  // refreshes don't have to rewrite it each time.
+  DeltaIndex orig_index;
+  bool write_index =
+         ((orig_aor->_delta_index.empty()) ||
+          (!decode_delta_index(orig_aor->_delta_index, DELTA_VERSION, orig_index)) ||
+          (orig_index.binding_ids != index.binding_ids) ||
+          (orig_index.subscription_ids != index.subscription_ids) ||
+          (orig_index.header != index.header) ||
+          (orig_index.expires < now + expiry));
+  index.expires = now + 2 * expiry;
+
+  // Write the changed records, and then the index (if needed) with the CAS
+  // of the AoR.
+  //
+  // Each record's CAS serializes changes to that binding or subscription,
+  // and a changed record is seen by readers as soon as it is written.  The
+  // index serializes adding and removing bindings and subscriptions: a new
+  // record is only seen once an index listing it has been written, and a
+  // removed record is only deleted once an index that doesn't list it has
+  // been written.  If the index write fails the changes to existing records
+  // have still been made, and the caller retries the update against them.
+  Store::Status status = Store::Status::OK;
+
+  for (std::vector<DeltaRecord>::const_iterator it = records.begin();
+       (status == Store::Status::OK) && (it != records.end());
+       ++it)
+  {
+    status = set_record(it->key, it->data, it->cas, expiry, trail);
+  }
+
+  if ((status == Store::Status::OK) && (write_index))
+  {
+    std::string index_data = encode_delta_index(index, DELTA_MAGIC, DELTA_VERSION);
+    status = _data_store->set_data("reg",
+                                   aor_id,
+                                   index_data,
+                                   aor_data->_cas,
+                                   2 * expiry,
+                                   trail);
+  }
+
+  TRC_DEBUG("Wrote %d of %d records%s for %s, status %d",
+            (int)records.size(),
+            (int)(index.binding_ids.size() + index.subscription_ids.size()),
+            write_index ? " and the index" : "",
+            aor_id.c_str(),
+            status);
+
+  if (status != Store::Status::OK)
+  {
+    SAS::Event event2(trail, SASEvent::REGSTORE_SET_FAILURE, 0);
+    event2.add_var_param(aor_id);
+    SAS::report_event(event2);
+    return status;
+  }
+
+  // Delete the records of any bindings and subscriptions that have been
+  // removed.  These are no longer listed in the committed index, so it
+  // doesn't matter if this fails.
+  int records_deleted = 0;
+
+  for (std::map<std::string, uint64_t>::const_iterator it = orig_aor->_binding_cas.begin();
+       it != orig_aor->_binding_cas.end();
+       ++it)
+  {
+    if (aor_data->bindings().find(it->first) == aor_data->bindings().end())
+    {
+      _data_store->delete_data("reg", record_key(aor_id, "b", it->first), trail);
+      ++records_deleted;
+    }
+  }
+
+  for (std::map<std::string, uint64_t>::const_iterator it = orig_aor->_subscription_cas.begin();
+       it != orig_aor->_subscription_cas.end();
+       ++it)
+  {
+    if (aor_data->subscriptions().find(it->first) == aor_data->subscriptions().end())
+    {
+      _data_store->delete_data("reg", record_key(aor_id, "s", it->first), trail);
+      ++records_deleted;
+    }
+  }
+
+  SAS::Event event2(trail, SASEvent::REGSTORE_SET_SUCCESS, 0);
+  event2.add_var_param(aor_id);
+  SAS::report_event(event2);
+
+  SAS::Event event3(trail, SASEvent::REGSTORE_SET_DELTA, 0);
+  event3.add_var_param(aor_id);
+  event3.add_static_param(records.size());
+  event3.add_static_param(records_deleted);
+  SAS::report_event(event3);
+
+  return status;
+}
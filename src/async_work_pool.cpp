@@ -0,0 +1,74 @@
+/**
+ * @file async_work_pool.cpp Runs work that would block a worker thread on a
+ * separate pool of threads.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "async_work_pool.h"
+#include "thread_dispatcher.h"
+#include "log.h"
+
+AsyncWorkPool::AsyncWorkPool(ExceptionHandler* exception_handler,
+                             unsigned int num_threads,
+                             QueueCallbackFn queue_callback) :
+  _queue_callback((queue_callback != NULL) ? queue_callback :
+                                             &add_callback_to_queue),
+  _thread_pool(new Pool(exception_handler, num_threads))
+{
+  _thread_pool->start();
+}
+
+AsyncWorkPool::~AsyncWorkPool()
+{
+  _thread_pool->stop();
+  _thread_pool->join();
+  delete _thread_pool; _thread_pool = NULL;
+}
+
+void AsyncWorkPool::run(AsyncWork* work, PJUtils::Callback* callback)
+{
+  Job* job = new Job();
+  job->work = work;
+  job->callback = callback;
+  job->queue_callback = _queue_callback;
+  _thread_pool->add_work(job);
+}
+
+void AsyncWorkPool::complete_job(Job* job)
+{
+  // This relinquishes ownership of the callback.
+  job->queue_callback(job->callback);
+  delete job; job = NULL;
+}
+
+void AsyncWorkPool::exception_callback(Job* job)
+{
+  // LCOV_EXCL_START
+  TRC_ERROR("Exception running asynchronous work %p", job->work);
+  complete_job(job);
+  // LCOV_EXCL_STOP
+}
+
+void AsyncWorkPool::Pool::process_work(Job*& job)
+{
+  job->work->run();
+  complete_job(job);
+  job = NULL;
+}
+
+AsyncWorkPool::Pool::Pool(ExceptionHandler* exception_handler,
+                          unsigned int num_threads) :
+  ThreadPool<Job*>(num_threads,
+                   exception_handler,
+                   &AsyncWorkPool::exception_callback,
+                   0)
+{}
+
+AsyncWorkPool::Pool::~Pool()
+{}
@@ -1182,6 +1182,7 @@ void AuthenticationSproutletTsx::on_rx_initial_request(pjsip_msg* req)
           // passed to downstream devices. We can't do this for Authorization
           // headers, as these may need to be included in 3rd party REGISTER
           // messages.
+          modify_msg(req);
           while (pjsip_msg_find_remove_hdr(req,
                                            PJSIP_H_PROXY_AUTHORIZATION,
                                            NULL) != NULL);
@@ -35,12 +35,16 @@ BasicProxy::BasicProxy(pjsip_endpoint* endpt,
                        std::string name,
                        int priority,
                        bool delay_trying,
-                       const std::set<std::string>& stateless_proxies) :
+                       const std::set<std::string>& stateless_proxies,
+                       AsyncWorkPool* resolver_pool,
+                       SNMP::EventAccumulatorTable* fork_latency_tbl) :
   _mod_proxy(this, endpt, name, priority, PJMODULE_MASK_PROXY),
   _mod_tu(this, endpt, name + "-tu", priority, PJMODULE_MASK_TU),
   _delay_trying(delay_trying),
   _endpt(endpt),
-  _stateless_proxies(stateless_proxies)
+  _stateless_proxies(stateless_proxies),
+  _resolver_pool(resolver_pool),
+  _fork_latency_tbl(fork_latency_tbl)
 {
 }
 
@@ -439,9 +443,10 @@ BasicProxy::UASTsx::UASTsx(BasicProxy* proxy) :
 
 void BasicProxy::UASTsx::unbind_from_pjsip_tsx()
 {
-  // We expect to only be called on the PJSIP transport thread, and our data
-  // race/locking safety is based on this assumption. Raise an error log if
-  // this is not the case.
+  // We expect to only be called on a PJSIP transport thread.  There may be
+  // several of these, so our data race/locking safety is based on also
+  // holding the PJSIP transaction's group lock.  Raise an error log if we
+  // are called on any other thread.
   CHECK_PJ_TRANSPORT_THREAD();
 
   if (_tsx != NULL)
@@ -1509,9 +1514,10 @@ void BasicProxy::UASTsx::trying_timer_expired()
 {
   enter_context();
 
-  // We expect to only be called on the PJSIP transport thread, and our data
-  // race/locking safety is based on this assumption. Raise an error log if
-  // this is not the case.
+  // We expect to only be called on a PJSIP transport thread.  There may be
+  // several of these, so our data race/locking safety is based on also
+  // holding the PJSIP transaction's group lock.  Raise an error log if we
+  // are called on any other thread.
   CHECK_PJ_TRANSPORT_THREAD();
 
   TRC_DEBUG("Trying timer expired for %s, transaction state = %s",
@@ -1544,6 +1550,47 @@ void BasicProxy::UASTsx::trying_timer_callback(pj_timer_heap_t *timer_heap, stru
 }
 
 
+BasicProxy::UACTsx::ResolveWork::ResolveWork(const std::string& name,
+                                             int port,
+                                             int transport,
+                                             int allowed_host_state,
+                                             int retries,
+                                             SAS::TrailId trail) :
+  _name(name),
+  _port(port),
+  _transport(transport),
+  _allowed_host_state(allowed_host_state),
+  _retries(retries),
+  _trail(trail),
+  _targets()
+{
+}
+
+void BasicProxy::UACTsx::ResolveWork::run()
+{
+  // Take all the servers the request may be tried on now, so that any DNS
+  // queries the iterator would make lazily are also done on this thread.
+  BaseAddrIterator* targets_iter = stack_data.sipresolver->resolve_iter(_name,
+                                                                        stack_data.addr_family,
+                                                                        _port,
+                                                                        _transport,
+                                                                        _allowed_host_state,
+                                                                        _trail);
+  _targets = targets_iter->take(_retries);
+  delete targets_iter; targets_iter = nullptr;
+}
+
+BasicProxy::UACTsx::ResolveCallback::ResolveCallback(UACTsx* uac_tsx) :
+  _uac_tsx(uac_tsx)
+{
+}
+
+void BasicProxy::UACTsx::ResolveCallback::run()
+{
+  _uac_tsx->on_resolve_complete();
+}
+
+
 /// UACTsx constructor
 BasicProxy::UACTsx::UACTsx(BasicProxy* proxy,
                            UASTsx* uas_tsx,
@@ -1555,6 +1602,9 @@ BasicProxy::UACTsx::UACTsx(BasicProxy* proxy,
   _tsx(NULL),
   _tdata(NULL),
   _servers_iter(NULL),
+  _resolve_work(NULL),
+  _resolving(false),
+  _fork_stopwatch(),
   _current_server(),
   _cancel_tsx(NULL),
   _timer_c(),
@@ -1616,6 +1666,7 @@ BasicProxy::UACTsx::~UACTsx()
   }
 
   delete _servers_iter; _servers_iter = nullptr;
+  delete _resolve_work; _resolve_work = nullptr;
 }
 
 
@@ -1626,6 +1677,7 @@ pj_status_t BasicProxy::UACTsx::init(pjsip_tx_data* tdata,
   pj_status_t status;
 
   _trail = _uas_tsx->trail();
+  _fork_stopwatch.start();
 
   // Add a new top Via header to the request.  This must be done before creating
   // the PJSIP UAC transaction as otherwise response correlation won't work.
@@ -1667,10 +1719,35 @@ pj_status_t BasicProxy::UACTsx::init(pjsip_tx_data* tdata,
 
   if (tdata->tp_sel.type != PJSIP_TPSELECTOR_TRANSPORT)
   {
-    // Resolve the next hop destination for this request to a set of target
-    // servers (IP address/port/transport tuples). The maximum number of times
-    // to attempt the call is stored in _num_attempts.
-    _servers_iter = PJUtils::resolve_next_hop_iter(tdata, allowed_host_state, trail());
+    std::string name;
+    int port;
+    int transport;
+    PJUtils::get_next_hop_target(tdata, name, port, transport);
+    IP46Address ip_address;
+
+    if ((_proxy->_resolver_pool != NULL) &&
+        (_tsx != NULL) &&
+        (!Utils::parse_ip_target(name, ip_address)))
+    {
+      // Resolving the next hop needs DNS queries, which may block, so leave
+      // them to the resolver pool when the request is sent.  This means all
+      // the forks of a request are resolved at the same time rather than one
+      // after another.  (ACKs are never resolved on the pool, as they have
+      // no transaction to keep them alive in the meantime.)
+      _resolve_work = new ResolveWork(name,
+                                      port,
+                                      transport,
+                                      allowed_host_state,
+                                      _num_attempts_left,
+                                      trail());
+    }
+    else
+    {
+      // Resolve the next hop destination for this request to a set of target
+      // servers (IP address/port/transport tuples). The maximum number of
+      // times to attempt the call is stored in _num_attempts.
+      _servers_iter = PJUtils::resolve_next_hop_iter(tdata, allowed_host_state, trail());
+    }
   }
 
   // Work out whether this UAC transaction is to a stateless proxy.
@@ -1692,6 +1769,67 @@ void BasicProxy::UACTsx::send_request()
 {
   enter_context();
 
+  if (_resolve_work != NULL)
+  {
+    // The next hop still needs resolving, so do that on the resolver pool and
+    // send the request once it completes.  Hold an extra context until then
+    // so this transaction isn't destroyed while the resolution is running.
+    TRC_DEBUG("Resolve %s on the resolver pool", _resolve_work->_name.c_str());
+    _resolving = true;
+    _context_count++;
+    _proxy->_resolver_pool->run(_resolve_work, new ResolveCallback(this));
+  }
+  else
+  {
+    dispatch_request();
+  }
+
+  exit_context();
+}
+
+
+/// Handles the next hop of the request being resolved on the resolver pool.
+void BasicProxy::UACTsx::on_resolve_complete()
+{
+  enter_context();
+
+  // Release the context held while the resolution was running.
+  _context_count--;
+  _resolving = false;
+
+  TRC_DEBUG("Resolved %s to %zu servers",
+            _resolve_work->_name.c_str(), _resolve_work->_targets.size());
+  _servers_iter = new SimpleAddrIterator(_resolve_work->_targets);
+  delete _resolve_work; _resolve_work = NULL;
+
+  if ((_tsx != NULL) &&
+      (_tsx->state == PJSIP_TSX_STATE_NULL))
+  {
+    if (_uas_tsx != NULL)
+    {
+      dispatch_request();
+    }
+    else
+    {
+      // The UAS transaction has gone away while the next hop was being
+      // resolved, so there's no point sending the request.
+      TRC_DEBUG("UAS transaction gone - terminate unsent request");
+      pjsip_tsx_terminate(_tsx, PJSIP_SC_REQUEST_TERMINATED);
+    }
+  }
+  else
+  {
+    // The transaction was cancelled while the next hop was being resolved.
+    TRC_DEBUG("Request cancelled while resolving next hop");
+  }
+
+  exit_context();
+}
+
+
+/// Sends the request to the resolved next hop.
+void BasicProxy::UACTsx::dispatch_request()
+{
   pj_status_t status = PJ_SUCCESS;
 
   TRC_DEBUG("Sending request for %s",
@@ -1724,6 +1862,13 @@ void BasicProxy::UACTsx::send_request()
 
   if (status == PJ_SUCCESS)
   {
+    unsigned long latency_us = 0;
+    if ((_proxy->_fork_latency_tbl != NULL) &&
+        (_fork_stopwatch.read(latency_us)))
+    {
+      _proxy->_fork_latency_tbl->accumulate(latency_us);
+    }
+
     // Notify the UASTsx the request is being sent and send it.
     _uas_tsx->on_tx_client_request(_tdata, this);
 
@@ -1796,8 +1941,6 @@ void BasicProxy::UACTsx::send_request()
 
     _pending_destroy = true;
   }
-
-  exit_context();
 }
 
 
@@ -1812,7 +1955,21 @@ void BasicProxy::UACTsx::cancel_pending_tsx(int st_code)
     TRC_DEBUG("Found transaction %s status=%d", name(), _tsx->status_code);
     if (_tsx->status_code < 200)
     {
-      if (_tdata->msg->line.req.method.id == PJSIP_INVITE_METHOD)
+      if (_resolving)
+      {
+        // The request hasn't been sent yet as the next hop is still being
+        // resolved, so there's nothing to CANCEL downstream.  Terminate the
+        // transaction so the request isn't sent when the resolution
+        // completes, and report a 487 for an INVITE as the downstream node
+        // would have done.
+        TRC_DEBUG("Terminate transaction before request is sent");
+        if (_tdata->msg->line.req.method.id == PJSIP_INVITE_METHOD)
+        {
+          report_request_terminated();
+        }
+        pjsip_tsx_terminate(_tsx, PJSIP_SC_REQUEST_TERMINATED);
+      }
+      else if (_tdata->msg->line.req.method.id == PJSIP_INVITE_METHOD)
       {
         TRC_DEBUG("Sending CANCEL request");
 
@@ -1892,6 +2049,29 @@ void BasicProxy::UACTsx::cancel_pending_tsx(int st_code)
 }
 
 
+/// Reports a 487 response upstream for a request that can't be CANCELled
+/// downstream.
+void BasicProxy::UACTsx::report_request_terminated()
+{
+  if (_uas_tsx != NULL)
+  {
+    pjsip_tx_data* rsp;
+    pj_status_t status = PJUtils::create_response(stack_data.endpt,
+                                                  _tdata,
+                                                  PJSIP_SC_REQUEST_TERMINATED,
+                                                  NULL,
+                                                  &rsp);
+    if (status == PJ_SUCCESS)
+    {
+      // Remove the top Via header (we must do this as we built the response
+      // from a request where we've added an extra Via).
+      pjsip_msg_find_remove_hdr(rsp->msg, PJSIP_H_VIA, NULL);
+      _uas_tsx->on_new_client_response(this, rsp);
+    }
+  }
+}
+
+
 /// Notification that the underlying PJSIP transaction has changed state.
 ///
 /// After calling this, the caller must not assume that the UACTsx still
@@ -2065,19 +2245,7 @@ void BasicProxy::UACTsx::on_tsx_state(pjsip_event* event)
         // CANCEL failed for a transaction which is still active, so terminate
         // the transaction immediately and send a 487 response upstream.
         //pjsip_tsx_terminate(_tsx, PJSIP_SC_REQUEST_TERMINATED);
-        pjsip_tx_data* rsp;
-        pj_status_t status = PJUtils::create_response(stack_data.endpt,
-                                                      _tdata,
-                                                      PJSIP_SC_REQUEST_TERMINATED,
-                                                      NULL,
-                                                      &rsp);
-        if (status == PJ_SUCCESS)
-        {
-          // Remove the top Via header (we must do this as we built the response
-          // from a request where we've added an extra Via).
-          pjsip_msg_find_remove_hdr(rsp->msg, PJSIP_H_VIA, NULL);
-          _uas_tsx->on_new_client_response(this, rsp);
-        }
+        report_request_terminated();
       }
     }
   }
@@ -0,0 +1,449 @@
+/**
+ * @file chronos_timer_batcher.cpp Sends AoR timer requests to Chronos in
+ * batches, off the thread handling the request.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "chronos_timer_batcher.h"
+#include "log.h"
+
+ChronosTimerBatcher::ChronosTimerBatcher(ChronosConnection* chronos_conn,
+                                         AoRStore* aor_store,
+                                         int window_ms,
+                                         SNMP::EventAccumulatorTable* batch_size_tbl,
+                                         SNMP::EventAccumulatorTable* delay_tbl,
+                                         ExceptionHandler* exception_handler,
+                                         unsigned int num_threads) :
+  _chronos_conn(chronos_conn),
+  _aor_store(aor_store),
+  _window_ms(window_ms),
+  _batch_size_tbl(batch_size_tbl),
+  _delay_tbl(delay_tbl),
+  _terminated(false),
+  _thread_pool(new Pool(this, exception_handler, num_threads))
+{
+  pthread_mutex_init(&_lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&_cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  _thread_pool->start();
+
+  int rc = pthread_create(&_dispatch_thread,
+                          NULL,
+                          &dispatch_thread_fn,
+                          (void*)this);
+
+  if (rc != 0)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to start Chronos timer batching thread: %d", rc);
+    assert(0);
+    // LCOV_EXCL_STOP
+  }
+}
+
+ChronosTimerBatcher::~ChronosTimerBatcher()
+{
+  // Tell the dispatch thread to send everything that's waiting, and wait for
+  // it to finish.
+  pthread_mutex_lock(&_lock);
+  _terminated = true;
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+
+  pthread_join(_dispatch_thread, NULL);
+
+  _thread_pool->stop();
+  _thread_pool->join();
+  delete _thread_pool; _thread_pool = NULL;
+
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_lock);
+}
+
+void ChronosTimerBatcher::set_timer(const std::string& aor_id,
+                                    const std::string& timer_id,
+                                    int expiry,
+                                    const std::map<std::string, uint32_t>& tags,
+                                    SAS::TrailId trail)
+{
+  TimerRequest* request = new TimerRequest();
+  request->batcher = this;
+  request->aor_id = aor_id;
+  request->timer_id = timer_id;
+  request->write_back = timer_id.empty();
+  request->is_delete = false;
+  request->expiry = expiry;
+  request->tags = tags;
+  request->trail = trail;
+  request->stop_watch.start();
+  request->expiry_watch.start();
+  add_request(request);
+}
+
+void ChronosTimerBatcher::delete_timer(const std::string& aor_id,
+                                       const std::string& timer_id,
+                                       SAS::TrailId trail)
+{
+  TimerRequest* request = new TimerRequest();
+  request->batcher = this;
+  request->aor_id = aor_id;
+  request->timer_id = timer_id;
+  request->write_back = false;
+  request->is_delete = true;
+  request->expiry = 0;
+  request->trail = trail;
+  request->stop_watch.start();
+  add_request(request);
+}
+
+void ChronosTimerBatcher::flush()
+{
+  pthread_mutex_lock(&_lock);
+  dispatch_requests();
+  pthread_mutex_unlock(&_lock);
+}
+
+void ChronosTimerBatcher::add_request(TimerRequest* request)
+{
+  pthread_mutex_lock(&_lock);
+
+  std::map<std::string, TimerRequest*>::iterator i =
+                                                _waiting.find(request->aor_id);
+
+  if (i != _waiting.end())
+  {
+    // There's already a request waiting for this AoR, which this one
+    // replaces.  If the AoR didn't know its timer ID, carry over the ID the
+    // waiting request would have used, so the timer is updated rather than
+    // a second one created.
+    TimerRequest* old_request = i->second;
+
+    if (request->timer_id.empty())
+    {
+      request->timer_id = old_request->timer_id;
+    }
+
+    // Report the delay from when the first of the coalesced requests was
+    // made.
+    request->stop_watch = old_request->stop_watch;
+
+    delete old_request;
+    i->second = request;
+  }
+  else
+  {
+    _waiting[request->aor_id] = request;
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void ChronosTimerBatcher::dispatch_requests()
+{
+  unsigned int batch_size = 0;
+  std::map<std::string, TimerRequest*>::iterator i = _waiting.begin();
+
+  while (i != _waiting.end())
+  {
+    if (_in_flight.find(i->first) != _in_flight.end())
+    {
+      // Leave this until the request in flight completes, so that timers for
+      // an AoR are sent in order.
+      ++i;
+    }
+    else
+    {
+      TimerRequest* request = i->second;
+
+      if (request->timer_id.empty())
+      {
+        std::map<std::string, std::string>::iterator j =
+                                              _new_timer_ids.find(i->first);
+
+        if (j != _new_timer_ids.end())
+        {
+          request->timer_id = j->second;
+        }
+        else if ((j = _prev_new_timer_ids.find(i->first)) !=
+                 _prev_new_timer_ids.end())
+        {
+          request->timer_id = j->second;
+        }
+      }
+
+      _in_flight.insert(i->first);
+      _thread_pool->add_work(request);
+      ++batch_size;
+      i = _waiting.erase(i);
+    }
+  }
+
+  if ((batch_size > 0) && (_batch_size_tbl != NULL))
+  {
+    _batch_size_tbl->accumulate(batch_size);
+  }
+}
+
+int ChronosTimerBatcher::remaining_expiry(TimerRequest* request)
+{
+  int expiry = request->expiry;
+  unsigned long waited_us;
+
+  if (request->expiry_watch.read(waited_us))
+  {
+    // Only take off whole seconds, so the time left is rounded up and the
+    // timer doesn't pop before the bindings it is for expire.
+    expiry -= (int)(waited_us / 1000000);
+  }
+
+  return std::max(expiry, 0);
+}
+
+void ChronosTimerBatcher::send_request(TimerRequest* request)
+{
+  unsigned long delay_us;
+
+  if ((_delay_tbl != NULL) && (request->stop_watch.read(delay_us)))
+  {
+    _delay_tbl->accumulate(delay_us);
+  }
+
+  std::string created_timer_id;
+
+  if (request->is_delete)
+  {
+    _chronos_conn->send_delete(request->timer_id, request->trail);
+  }
+  else
+  {
+    std::string timer_id = request->timer_id;
+    std::string opaque = "{\"aor_id\": \"" + request->aor_id + "\"}";
+    std::string callback_uri = "/timers";
+    int expiry = remaining_expiry(request);
+    HTTPCode status;
+
+    // If a timer has been previously set for this AoR, send a PUT.
+    // Otherwise send a POST.
+    if (timer_id == "")
+    {
+      status = _chronos_conn->send_post(timer_id,
+                                        expiry,
+                                        callback_uri,
+                                        opaque,
+                                        request->trail,
+                                        request->tags);
+    }
+    else
+    {
+      status = _chronos_conn->send_put(timer_id,
+                                       expiry,
+                                       callback_uri,
+                                       opaque,
+                                       request->trail,
+                                       request->tags);
+    }
+
+    // If the update to Chronos failed, that's OK - the AoR keeps the timer
+    // ID it has.
+    if (status == HTTP_OK)
+    {
+      std::string old_timer_id = request->write_back ? "" : request->timer_id;
+
+      if ((timer_id == old_timer_id) ||
+          (write_timer_id(request->aor_id,
+                          old_timer_id,
+                          timer_id,
+                          request->trail)))
+      {
+        created_timer_id = timer_id;
+      }
+    }
+  }
+
+  request_complete(request->aor_id, created_timer_id);
+}
+
+void ChronosTimerBatcher::request_complete(const std::string& aor_id,
+                                           const std::string& created_timer_id)
+{
+  pthread_mutex_lock(&_lock);
+
+  _in_flight.erase(aor_id);
+
+  if (!created_timer_id.empty())
+  {
+    _new_timer_ids[aor_id] = created_timer_id;
+  }
+
+  // The dispatch thread may be waiting for requests in flight to finish.
+  pthread_cond_signal(&_cond);
+  pthread_mutex_unlock(&_lock);
+}
+
+bool ChronosTimerBatcher::write_timer_id(const std::string& aor_id,
+                                         const std::string& old_timer_id,
+                                         const std::string& new_timer_id,
+                                         SAS::TrailId trail)
+{
+  for (int attempt = 0; attempt < MAX_WRITE_BACK_ATTEMPTS; ++attempt)
+  {
+    AoR* aor = _aor_store->get_aor_data(aor_id, trail);
+
+    if (aor == NULL)
+    {
+      // Store error - try again.
+      continue;
+    }
+
+    if (aor->_timer_id == new_timer_id)
+    {
+      delete aor;
+      return true;
+    }
+
+    if ((aor->bindings().empty()) || (aor->_timer_id != old_timer_id))
+    {
+      // The AoR has gone, or has moved on to a different timer, so this one
+      // isn't needed.
+      TRC_DEBUG("AoR %s no longer needs timer %s",
+                aor_id.c_str(), new_timer_id.c_str());
+      delete aor;
+      _chronos_conn->send_delete(new_timer_id, trail);
+      return false;
+    }
+
+    // Write the AoR back with the new timer ID, keeping the record for as
+    // long as its longest lived binding or subscription.
+    int now = time(NULL);
+    int max_expires = now;
+
+    for (AoR::Bindings::const_iterator b = aor->bindings().begin();
+         b != aor->bindings().end();
+         ++b)
+    {
+      max_expires = std::max(max_expires, b->second->_expires);
+    }
+
+    for (AoR::Subscriptions::const_iterator s = aor->subscriptions().begin();
+         s != aor->subscriptions().end();
+         ++s)
+    {
+      max_expires = std::max(max_expires, s->second->_expires);
+    }
+
+    AoRPair aor_pair(aor, new AoR(*aor));
+    aor_pair.get_current()->_timer_id = new_timer_id;
+
+    if (_aor_store->set_aor_data(aor_id,
+                                 &aor_pair,
+                                 max_expires - now,
+                                 trail) == Store::OK)
+    {
+      return true;
+    }
+  }
+
+  TRC_WARNING("Failed to write timer ID %s to AoR %s",
+              new_timer_id.c_str(), aor_id.c_str());
+  return false;
+}
+
+void* ChronosTimerBatcher::dispatch_thread_fn(void* batcher)
+{
+  ((ChronosTimerBatcher*)batcher)->dispatch_thread();
+  return NULL;
+}
+
+void ChronosTimerBatcher::dispatch_thread()
+{
+  pthread_mutex_lock(&_lock);
+
+  while (true)
+  {
+    if (_terminated)
+    {
+      // Send everything that's left.  Requests for AoRs with a request in
+      // flight have to wait for it to complete.
+      dispatch_requests();
+
+      if ((_waiting.empty()) && (_in_flight.empty()))
+      {
+        break;
+      }
+
+      pthread_cond_wait(&_cond, &_lock);
+      continue;
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += _window_ms / 1000;
+    end.tv_nsec += (_window_ms % 1000) * 1000000;
+
+    if (end.tv_nsec >= 1000000000)
+    {
+      end.tv_sec += 1;
+      end.tv_nsec -= 1000000000;
+    }
+
+    // Wait for the end of the window.  Requests completing signal the
+    // condition too, so keep waiting until the window is up.
+    int rc = 0;
+
+    while ((!_terminated) && (rc != ETIMEDOUT))
+    {
+      rc = pthread_cond_timedwait(&_cond, &_lock, &end);
+    }
+
+    dispatch_requests();
+
+    _prev_new_timer_ids.clear();
+    _prev_new_timer_ids.swap(_new_timer_ids);
+  }
+
+  pthread_mutex_unlock(&_lock);
+}
+
+void ChronosTimerBatcher::exception_callback(TimerRequest* request)
+{
+  // The request didn't complete, so mark it as no longer in flight.
+  // Otherwise no more timers would be sent for the AoR, and the batcher
+  // couldn't be destroyed.
+  request->batcher->request_complete(request->aor_id, "");
+  delete request; request = NULL;
+}
+
+void ChronosTimerBatcher::Pool::process_work(TimerRequest*& request)
+{
+  _batcher->send_request(request);
+  delete request; request = NULL;
+}
+
+ChronosTimerBatcher::Pool::Pool(ChronosTimerBatcher* batcher,
+                                ExceptionHandler* exception_handler,
+                                unsigned int num_threads) :
+  ThreadPool<TimerRequest*>(num_threads,
+                            exception_handler,
+                            &ChronosTimerBatcher::exception_callback,
+                            0),
+  _batcher(batcher)
+{}
+
+ChronosTimerBatcher::Pool::~Pool()
+{}
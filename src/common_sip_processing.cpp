@@ -104,6 +104,22 @@ static void local_log_tx_msg(pjsip_tx_data* tdata)
 }
 
 // LCOV_EXCL_START - can't meaningfully test SAS in UT
+// Gets the SAS trail of the transaction with the given key, or 0 if there is
+// no such transaction.  The transaction is locked while the trail is read.
+static SAS::TrailId get_tsx_trail(pj_str_t* key)
+{
+  SAS::TrailId trail = 0;
+  pjsip_transaction* tsx = pjsip_tsx_layer_find_tsx(key, PJ_TRUE);
+
+  if (tsx != NULL)
+  {
+    trail = get_trail(tsx);
+    pj_grp_lock_release(tsx->grp_lock);
+  }
+
+  return trail;
+}
+
 static void sas_log_rx_msg(pjsip_rx_data* rdata)
 {
   bool first_message_in_trail = false;
@@ -111,26 +127,13 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
 
   // Look for the SAS Trail ID for the corresponding transaction object.
   //
-  // Note that we are NOT locking the transaction object before we fetch the
-  // trail ID from it.  This is deliberate - we cannot get a group lock from
-  // this routine as we may already have obtained the IO lock (which is lower
-  // in the locking hierarchy) higher up the stack.
-  // (e.g. from ioqueue_common_abs::ioqueue_dispatch_read_event) and grabbing
-  // the group lock here may cause us to deadlock with a thread using the locks
-  // in the right order.
-  //
-  // This is safe for the following reasons
-  // - The transaction objects are only ever invalidated by the current thread
-  //   (i.e. the transport thread), so we don't need to worry about the tsx
-  //   pointers being invalid.
-  // - In principle, the trail IDs (which are 64 bit numbers stored as void*s
-  //   since thats the format of the generic PJSIP user data area) might be
-  //   being written to as we are reading them, thereby invalidating them.
-  //   However, the chances of this happening are exceedingly remote and, if it
-  //   ever happened, the worst that could happen is that the trail ID would be
-  //   invalid and the log we're about to make unreachable by SAS.  This is
-  //   assumed to be sufficiently low impact as to be ignorable for practical
-  //   purposes.
+  // The transaction is locked while the trail ID is read from it.  There may
+  // be several transport threads, and another one (or a worker thread) may
+  // destroy the transaction while this thread is looking at it, so the
+  // transaction pointer is only safe to use with the group lock held.  The
+  // transaction layer takes the same group lock further along this receive
+  // path (when it passes the message to the transaction), so taking it here
+  // doesn't introduce a new lock ordering.
   if (rdata->msg_info.msg->type == PJSIP_RESPONSE_MSG)
   {
     // Message is a response, so try to correlate to an existing UAC
@@ -138,12 +141,7 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
     pj_str_t key;
     pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_ROLE_UAC,
                          &rdata->msg_info.cseq->method, rdata);
-    pjsip_transaction* tsx = pjsip_tsx_layer_find_tsx(&key, PJ_FALSE);
-    if (tsx)
-    {
-      // Found the UAC transaction, so get the trail if there is one.
-      trail = get_trail(tsx);
-    }
+    trail = get_tsx_trail(&key);
   }
   else if (rdata->msg_info.msg->line.req.method.id == PJSIP_ACK_METHOD)
   {
@@ -152,12 +150,7 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
     pj_str_t key;
     pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_UAS_ROLE,
                          &rdata->msg_info.cseq->method, rdata);
-    pjsip_transaction* tsx = pjsip_tsx_layer_find_tsx(&key, PJ_FALSE);
-    if (tsx)
-    {
-      // Found the UAS transaction, so get the trail if there is one.
-      trail = get_trail(tsx);
-    }
+    trail = get_tsx_trail(&key);
   }
   else if (rdata->msg_info.msg->line.req.method.id == PJSIP_CANCEL_METHOD)
   {
@@ -166,12 +159,7 @@ static void sas_log_rx_msg(pjsip_rx_data* rdata)
     pj_str_t key;
     pjsip_tsx_create_key(rdata->tp_info.pool, &key, PJSIP_UAS_ROLE,
                          pjsip_get_invite_method(), rdata);
-    pjsip_transaction* tsx = pjsip_tsx_layer_find_tsx(&key, PJ_FALSE);
-    if (tsx)
-    {
-      // Found the INVITE UAS transaction, so get the trail if there is one.
-      trail = get_trail(tsx);
-    }
+    trail = get_tsx_trail(&key);
   }
   else if ((rdata->msg_info.msg->line.req.method.id == PJSIP_OPTIONS_METHOD) &&
            (URIClassifier::classify_uri(rdata->msg_info.msg->line.req.uri) == NODE_LOCAL_SIP_URI))
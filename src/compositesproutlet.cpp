@@ -30,6 +30,7 @@ int CompositeSproutletTsx::send_request(pjsip_msg*& req,
   {
     // This is a standalone or dialog-creating request, and we have a next hop
     // configured - use it.
+    modify_msg(req);
     pjsip_sip_uri* base_uri = get_routing_uri(req);
 
     if (!PJSIP_URI_SCHEME_IS_SIP(base_uri))
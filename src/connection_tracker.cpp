@@ -67,9 +67,9 @@ void ConnectionTracker::connection_state_update(pjsip_transport *tp,
     TRC_DEBUG("Connection %p has been destroyed", tp);
 
     pthread_mutex_lock(&_lock);
-    // We expect to only be called on the PJSIP transport thread, and our data
-    // race/locking safety is based on this assumption. Raise an error log if
-    // this is not the case.
+    // We expect to only be called on a PJSIP transport thread.  There may be
+    // several of these, so our data race/locking safety is based on holding
+    // _lock.  Raise an error log if we are called on any other thread.
     CHECK_PJ_TRANSPORT_THREAD();
 
     _connection_listeners.erase(tp);
@@ -109,7 +109,7 @@ void ConnectionTracker::connection_active(pjsip_transport *tp)
     pthread_mutex_lock(&_lock);
 
     // We expect to be called by only websocket transport threads, or the PJSIP
-    // transport thread. We must NOT be called by the PJSIP worker thread.
+    // transport threads. We must NOT be called by the PJSIP worker thread.
     // Race/locking safety is based on the above assumption. Raise an error log
     // if the above is not the case.
     if ((strcmp(pj_thread_get_name(pj_thread_this()), "websockets")) != 0)
@@ -162,9 +162,9 @@ void ConnectionTracker::quiesce()
   TRC_STATUS("Start quiescing connections");
 
   pthread_mutex_lock(&_lock);
-  // We expect to only be called on the PJSIP transport thread, and our data
-  // race/locking safety is based on this assumption. Raise an error log if
-  // this is not the case.
+  // We expect to only be called on a PJSIP transport thread.  There may be
+  // several of these, so our data race/locking safety is based on holding
+  // _lock.  Raise an error log if we are called on any other thread.
   CHECK_PJ_TRANSPORT_THREAD();
 
   // Flag that we're now quiescing. It is illegal to call this method if we're
@@ -217,9 +217,9 @@ void ConnectionTracker::unquiesce()
   TRC_DEBUG("Unquiesce connections");
 
   pthread_mutex_lock(&_lock);
-  // We expect to only be called on the PJSIP transport thread, and our data
-  // race/locking safety is based on this assumption. Raise an error log if
-  // this is not the case.
+  // We expect to only be called on a PJSIP transport thread.  There may be
+  // several of these, so our data race/locking safety is based on holding
+  // _lock.  Raise an error log if we are called on any other thread.
   CHECK_PJ_TRANSPORT_THREAD();
 
   // It is not possible to "un-shutdown" a pjsip transport.  All connections
@@ -23,6 +23,7 @@
 
 #include "pjutils.h"
 #include "enumservice.h"
+#include "regex_cache.h"
 #include "dnsresolver.h"
 #include "utils.h"
 #include "log.h"
@@ -75,7 +76,7 @@ bool EnumService::parse_regex_replace(const std::string& regex_replace, boost::r
     TRC_DEBUG("Split regex into match=%s, replace=%s", match_replace[0].c_str(), match_replace[1].c_str());
     try
     {
-      regex.assign(match_replace[0], boost::regex::extended);
+      regex = RegexCache::instance()->get(match_replace[0], boost::regex::extended);
       replace = match_replace[1];
       success = true;
     }
@@ -77,11 +77,19 @@ static void set_remote_aor_data(std::string aor_id,
                                 AssociatedURIs* associated_uris,
                                 AoRPair* previous_aor_pair,
                                 std::vector<SubscriberDataManager*> remote_sdms,
+                                AoRReplicator* aor_replicator,
                                 HSSConnection* hss,
                                 SAS::TrailId trail)
 {
   bool ignored = false;
 
+  if (aor_replicator != NULL)
+  {
+    // Leave the replicator to write the change to the remote stores.
+    aor_replicator->replicate(aor_id, event_trigger, previous_aor_pair, trail);
+    return;
+  }
+
   // If we have any remote stores, try to store this in them too.  We don't worry
   // about failures in this case.
   for (SubscriberDataManager* sdm : remote_sdms)
@@ -252,6 +260,7 @@ void AoRTimeoutTask::process_aor_timeout(std::string aor_id)
                         &(irs_info._associated_uris),
                         aor_pair,
                         _cfg->_remote_sdms,
+                        _cfg->_aor_replicator,
                         _cfg->_hss,
                         trail());
 
@@ -339,6 +348,10 @@ HTTPCode DeregistrationTask::handle_request()
        it!=_bindings.end();
        ++it)
   {
+    // The HSS has deregistered the subscriber, so any cached profile is out
+    // of date.
+    _cfg->_hss->invalidate_cached_data(it->first);
+
     AoRPair* aor_pair = deregister_bindings(_cfg->_sdm,
                                             _cfg->_hss,
                                             _cfg->_fifc_service,
@@ -353,24 +366,36 @@ HTTPCode DeregistrationTask::handle_request()
     if ((aor_pair != NULL) &&
         (aor_pair->get_current() != NULL))
     {
-      // If we have any remote stores, try to store this in them too.  We don't worry
-      // about failures in this case.
-      for (std::vector<SubscriberDataManager*>::const_iterator sdm = _cfg->_remote_sdms.begin();
-           sdm != _cfg->_remote_sdms.end();
-           ++sdm)
+      if (_cfg->_aor_replicator != NULL)
       {
-        if ((*sdm)->has_servers())
+        // Leave the replicator to write the change to the remote stores,
+        // after any changes to the AoR that it has already queued.
+        _cfg->_aor_replicator->replicate(it->first,
+                                         SubscriberDataManager::EventTrigger::ADMIN,
+                                         aor_pair,
+                                         trail());
+      }
+      else
+      {
+        // If we have any remote stores, try to store this in them too.  We
+        // don't worry about failures in this case.
+        for (std::vector<SubscriberDataManager*>::const_iterator sdm = _cfg->_remote_sdms.begin();
+             sdm != _cfg->_remote_sdms.end();
+             ++sdm)
         {
-          AoRPair* remote_aor_pair = deregister_bindings(*sdm,
-                                                         _cfg->_hss,
-                                                         _cfg->_fifc_service,
-                                                         _cfg->_ifc_configuration,
-                                                         it->first,
-                                                         it->second,
-                                                         aor_pair,
-                                                         {},
-                                                         impis_to_delete);
-          delete remote_aor_pair;
+          if ((*sdm)->has_servers())
+          {
+            AoRPair* remote_aor_pair = deregister_bindings(*sdm,
+                                                           _cfg->_hss,
+                                                           _cfg->_fifc_service,
+                                                           _cfg->_ifc_configuration,
+                                                           it->first,
+                                                           it->second,
+                                                           aor_pair,
+                                                           {},
+                                                           impis_to_delete);
+            delete remote_aor_pair;
+          }
         }
       }
     }
@@ -737,6 +762,51 @@ std::string GetSubscriptionsTask::serialize_data(AoR* aor)
   return sb.GetString();
 }
 
+void GetTsxArenaStatsTask::run()
+{
+  // This interface is read only so reject any non-GETs.
+  if (_req.method() != htp_method_GET)
+  {
+    send_http_reply(HTTP_BADMETHOD);
+    delete this;
+    return;
+  }
+
+  const TsxArenaStats* stats = _cfg->_stats;
+  if (stats == NULL)
+  {
+    // There's no SproutletProxy, so no transaction arenas.
+    send_http_reply(HTTP_NOT_FOUND);
+    delete this;
+    return;
+  }
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+  writer.StartObject();
+  {
+    writer.String("arenas");
+    writer.Uint64(stats->arenas());
+    writer.String("allocations");
+    writer.Uint64(stats->allocations());
+    writer.String("bytes");
+    writer.Uint64(stats->bytes());
+    writer.String("high_water_bytes");
+    writer.Uint64(stats->high_water_bytes());
+    writer.String("overflows");
+    writer.Uint64(stats->overflows());
+    writer.String("initial_size");
+    writer.Uint64(stats->initial_size());
+  }
+  writer.EndObject();
+
+  _req.add_content(sb.GetString());
+  send_http_reply(HTTP_OK);
+
+  delete this;
+}
+
 void DeleteImpuTask::run()
 {
   TRC_DEBUG("Request to delete an IMPU");
@@ -762,6 +832,8 @@ void DeleteImpuTask::run()
   HTTPCode hss_sc;
   int sc;
 
+  _cfg->_hss->invalidate_cached_data(impu);
+
   // Expire all the bindings. This will handle deregistering with the HSS and
   // sending NOTIFYs and 3rd party REGISTERs.
   bool all_bindings_expired =
@@ -909,6 +981,14 @@ HTTPCode PushProfileTask::update_associated_uris(SAS::TrailId trail)
   HTTPCode rc = HTTP_OK;
   bool all_bindings_expired = false;
 
+  // The subscriber's profile has changed, so discard any cached copy of it.
+  _cfg->_hss->invalidate_cached_data(_default_public_id);
+
+  for (const std::string& uri : _associated_uris.get_all_uris())
+  {
+    _cfg->_hss->invalidate_cached_data(uri);
+  }
+
   AoRPair* aor_pair = get_and_set_local_aor_data(_cfg->_sdm,
                                                  _default_public_id,
                                                  SubscriberDataManager::EventTrigger::ADMIN,
@@ -925,6 +1005,7 @@ HTTPCode PushProfileTask::update_associated_uris(SAS::TrailId trail)
                         &_associated_uris,
                         aor_pair,
                         _cfg->_remote_sdms,
+                        _cfg->_aor_replicator,
                         _cfg->_hss,
                         trail);
 
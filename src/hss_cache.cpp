@@ -0,0 +1,145 @@
+/**
+ * @file hss_cache.cpp In-process cache of subscriber data read from
+ * Homestead.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "hss_cache.h"
+
+// Rough size of the parsed form of a service profile, on top of the XML it
+// refers to.
+static const size_t SERVICE_PROFILE_SIZE_ESTIMATE = 256;
+
+HSSCache::HSSCache(int ttl_ms,
+                   size_t max_bytes,
+                   SNMP::CounterTable* hits_tbl,
+                   SNMP::CounterTable* misses_tbl,
+                   SNMP::U32Scalar* kb_scalar) :
+  _cache("subscriber data for", ttl_ms, max_bytes),
+  _hits_tbl(hits_tbl),
+  _misses_tbl(misses_tbl),
+  _kb_scalar(kb_scalar)
+{
+}
+
+HSSCache::~HSSCache()
+{
+}
+
+uint64_t HSSCache::get_generation(const std::string& public_id)
+{
+  return _cache.get_generation(public_id);
+}
+
+size_t HSSCache::estimate_xml_size(const rapidxml::xml_node<>* node)
+{
+  size_t size = sizeof(rapidxml::xml_node<>) +
+                node->name_size() +
+                node->value_size();
+
+  for (const rapidxml::xml_attribute<>* attr = node->first_attribute();
+       attr != NULL;
+       attr = attr->next_attribute())
+  {
+    size += sizeof(rapidxml::xml_attribute<>) +
+            attr->name_size() +
+            attr->value_size();
+  }
+
+  for (const rapidxml::xml_node<>* child = node->first_node();
+       child != NULL;
+       child = child->next_sibling())
+  {
+    size += estimate_xml_size(child);
+  }
+
+  return size;
+}
+
+size_t HSSCache::estimate_size(const std::string& public_id,
+                               const HSSConnection::irs_info& irs_info,
+                               const rapidxml::xml_document<>* xml)
+{
+  size_t size = ShardedCache<HSSConnection::irs_info>::ENTRY_SIZE +
+                (2 * public_id.size());
+
+  // The XML holds the text of the service profiles, associated URIs and so
+  // on; the parsed data refers to it or copies it.
+  if (xml != NULL)
+  {
+    size += 2 * estimate_xml_size(xml);
+  }
+
+  size += irs_info._service_profiles.size() * SERVICE_PROFILE_SIZE_ESTIMATE;
+
+  return size;
+}
+
+void HSSCache::update_kb_scalar()
+{
+  if (_kb_scalar != NULL)
+  {
+    _kb_scalar->value = _cache.bytes() / 1024;
+  }
+}
+
+bool HSSCache::get(const std::string& public_id,
+                   HSSConnection::irs_info& irs_info)
+{
+  // The copy shares the XML document with the cached entry.
+  bool found = _cache.get(public_id,
+                          [&irs_info](const HSSConnection::irs_info& cached)
+                          {
+                            irs_info = cached;
+                          });
+
+  if (found)
+  {
+    TRC_DEBUG("Found subscriber data for %s in cache", public_id.c_str());
+    if (_hits_tbl != NULL)
+    {
+      _hits_tbl->increment();
+    }
+  }
+  else
+  {
+    if (_misses_tbl != NULL)
+    {
+      _misses_tbl->increment();
+    }
+    update_kb_scalar();
+  }
+
+  return found;
+}
+
+void HSSCache::put(const std::string& public_id,
+                   const HSSConnection::irs_info& irs_info,
+                   const rapidxml::xml_document<>* xml,
+                   uint64_t generation)
+{
+  _cache.put(public_id,
+             irs_info,
+             estimate_size(public_id, irs_info, xml),
+             generation);
+  update_kb_scalar();
+}
+
+void HSSCache::invalidate(const std::string& public_id)
+{
+  _cache.invalidate(public_id,
+                    [](const HSSConnection::irs_info&) { return true; });
+  update_kb_scalar();
+}
+
+size_t HSSCache::size()
+{
+  return _cache.size();
+}
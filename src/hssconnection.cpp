@@ -13,6 +13,8 @@
 #include <string>
 #include <memory>
 #include <map>
+#include <errno.h>
+#include <time.h>
 
 #include "utils.h"
 #include "wildcard_utils.h"
@@ -26,6 +28,7 @@
 #include "snmp_continuous_accumulator_table.h"
 #include "xml_utils.h"
 #include "sprout_xml_utils.h"
+#include "hss_cache.h"
 
 const std::string HSSConnection::REG = "reg";
 const std::string HSSConnection::CALL = "call";
@@ -46,7 +49,9 @@ HSSConnection::HSSConnection(const std::string& server,
                              SNMP::EventAccumulatorTable* homestead_lir_latency_tbl,
                              CommunicationMonitor* comm_monitor,
                              SIFCService* sifc_service,
-                             long homestead_timeout_ms) :
+                             long homestead_timeout_ms,
+                             HSSCache* cache,
+                             SNMP::CounterTable* coalesced_tbl) :
   _http(new HttpConnection(server,
                            false,
                            resolver,
@@ -63,17 +68,95 @@ HSSConnection::HSSConnection(const std::string& server,
   _sar_latency_tbl(homestead_sar_latency_tbl),
   _uar_latency_tbl(homestead_uar_latency_tbl),
   _lir_latency_tbl(homestead_lir_latency_tbl),
-  _sifc_service(sifc_service)
+  _sifc_service(sifc_service),
+  _cache(cache),
+  _pending_queries(),
+  _pending_query_wait_ms(PENDING_QUERY_WAIT_TIMEOUTS * homestead_timeout_ms),
+  _coalesced_tbl(coalesced_tbl)
 {
+  pthread_mutex_init(&_pending_queries_lock, NULL);
 }
 
 
 HSSConnection::~HSSConnection()
 {
+  pthread_mutex_destroy(&_pending_queries_lock);
   delete _http;
   _http = NULL;
 }
 
+
+HSSConnection::PendingQuery::PendingQuery() :
+  complete(false),
+  waiters(0),
+  http_code(HTTP_SERVER_ERROR),
+  result()
+{
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+
+HSSConnection::PendingQuery::~PendingQuery()
+{
+  pthread_cond_destroy(&cond);
+}
+
+
+HSSConnection::PendingQueryGuard::PendingQueryGuard(HSSConnection* hss,
+                                                    const std::string& key,
+                                                    std::shared_ptr<PendingQuery> pending) :
+  _hss(hss),
+  _key(key),
+  _pending(pending),
+  _complete(false)
+{
+}
+
+
+HSSConnection::PendingQueryGuard::~PendingQueryGuard()
+{
+  if (!_complete)
+  {
+    // The request didn't complete normally, so release the waiters with an
+    // error.
+    complete(HTTP_SERVER_ERROR, irs_info());
+  }
+}
+
+
+void HSSConnection::PendingQueryGuard::complete(HTTPCode http_code,
+                                                const irs_info& irs_info)
+{
+  pthread_mutex_lock(&_hss->_pending_queries_lock);
+
+  // Only copy the result if another thread is waiting for it.
+  if ((_pending->waiters > 0) && (http_code == HTTP_OK))
+  {
+    _pending->result = irs_info;
+  }
+
+  _pending->http_code = http_code;
+  _pending->complete = true;
+
+  // A waiter that gave up on this query may have replaced it with its own.
+  std::unordered_map<std::string, std::shared_ptr<PendingQuery> >::iterator it =
+                                                _hss->_pending_queries.find(_key);
+  if ((it != _hss->_pending_queries.end()) && (it->second == _pending))
+  {
+    _hss->_pending_queries.erase(it);
+  }
+
+  pthread_cond_broadcast(&_pending->cond);
+
+  pthread_mutex_unlock(&_hss->_pending_queries_lock);
+
+  _complete = true;
+}
+
 /// Get an Authentication Vector as JSON object. Caller is responsible for deleting.
 HTTPCode HSSConnection::get_auth_vector(const std::string& private_user_identity,
                                         const std::string& public_user_identity,
@@ -172,12 +255,16 @@ HTTPCode HSSConnection::get_json_object(const std::string& path,
   return rc;
 }
 
-rapidxml::xml_document<>* HSSConnection::parse_xml(std::string raw_data, const std::string& url = "")
+rapidxml::xml_document<>* HSSConnection::parse_xml(const std::string& raw_data, const std::string& url = "")
 {
   rapidxml::xml_document<>* root = new rapidxml::xml_document<>;
   try
   {
-    root->parse<0>(root->allocate_string(raw_data.c_str()));
+    // Copy the body into the document's memory pool (which, for all but very
+    // large bodies, is part of the document itself) and parse it in place, so
+    // the names and values of the nodes point into that copy.
+    root->parse<XML_PARSE_FLAGS>(root->allocate_string(raw_data.c_str(),
+                                                       raw_data.size() + 1));
   }
   catch (rapidxml::parse_error& err)
   {
@@ -412,15 +499,162 @@ HTTPCode HSSConnection::update_registration_state(const irs_query& irs_query,
                                                   irs_info& irs_info,
                                                   SAS::TrailId trail)
 {
-  Utils::StopWatch stopWatch;
-  stopWatch.start();
-
   SAS::Event event(trail, SASEvent::HTTP_HOMESTEAD_CHECK_STATE, 0);
   event.add_var_param(irs_query._public_id);
   event.add_var_param(irs_query._private_id);
   event.add_var_param(irs_query._req_type);
   SAS::report_event(event);
 
+  // Requests for call processing don't change the registration state, so
+  // can be answered from the cache.
+  bool cacheable = ((_cache != NULL) &&
+                    (irs_query._req_type == CALL));
+
+  if ((cacheable) &&
+      (irs_query._cache_allowed) &&
+      (_cache->get(irs_query._public_id, irs_info)))
+  {
+    SAS::Event cached(trail, SASEvent::HSS_PROFILE_CACHED, 0);
+    cached.add_var_param(irs_query._public_id);
+    SAS::report_event(cached);
+    return HTTP_OK;
+  }
+
+  if (irs_query._req_type != CALL)
+  {
+    // This request may change the registration state, so must always be
+    // sent.
+    return send_registration_state_request(irs_query, irs_info, trail);
+  }
+
+  // See if there's already an identical request to Homestead in flight.  If
+  // so, wait for its result rather than sending another.
+  std::string key = pending_query_key(irs_query);
+  std::shared_ptr<PendingQuery> pending;
+  bool send = false;
+
+  pthread_mutex_lock(&_pending_queries_lock);
+
+  std::unordered_map<std::string, std::shared_ptr<PendingQuery> >::iterator it =
+                                                     _pending_queries.find(key);
+  if (it != _pending_queries.end())
+  {
+    pending = it->second;
+    pending->waiters++;
+
+    if (_coalesced_tbl != NULL)
+    {
+      _coalesced_tbl->increment();
+    }
+
+    TRC_DEBUG("Waiting for in-flight Homestead request for %s",
+              irs_query._public_id.c_str());
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    end.tv_sec += _pending_query_wait_ms / 1000;
+    end.tv_nsec += (_pending_query_wait_ms % 1000) * 1000000;
+
+    if (end.tv_nsec >= 1000000000)
+    {
+      end.tv_sec += 1;
+      end.tv_nsec -= 1000000000;
+    }
+
+    int rc = 0;
+
+    while ((!pending->complete) && (rc != ETIMEDOUT))
+    {
+      rc = pthread_cond_timedwait(&pending->cond, &_pending_queries_lock, &end);
+    }
+
+    if (!pending->complete)
+    {
+      // The request has taken far longer than Homestead should, so it may
+      // have been lost.  Stop later queries waiting on it, and send our own
+      // request.
+      TRC_WARNING("Gave up waiting for in-flight Homestead request for %s",
+                  irs_query._public_id.c_str());
+      pending->waiters--;
+
+      it = _pending_queries.find(key);
+      if ((it != _pending_queries.end()) && (it->second == pending))
+      {
+        _pending_queries.erase(it);
+      }
+
+      pthread_mutex_unlock(&_pending_queries_lock);
+
+      return send_registration_state_request(irs_query, irs_info, trail);
+    }
+  }
+  else
+  {
+    pending = std::make_shared<PendingQuery>();
+    _pending_queries[key] = pending;
+    send = true;
+  }
+
+  pthread_mutex_unlock(&_pending_queries_lock);
+
+  if (!send)
+  {
+    // The result doesn't change once the request is complete, so can be
+    // copied without the lock.
+    SAS::Event coalesced(trail, SASEvent::HSS_REQUEST_COALESCED, 0);
+    coalesced.add_var_param(irs_query._public_id);
+    SAS::report_event(coalesced);
+
+    if (pending->http_code == HTTP_OK)
+    {
+      irs_info = pending->result;
+    }
+
+    return pending->http_code;
+  }
+
+  PendingQueryGuard guard(this, key, pending);
+  HTTPCode http_code = send_registration_state_request(irs_query,
+                                                       irs_info,
+                                                       trail);
+  guard.complete(http_code, irs_info);
+
+  return http_code;
+}
+
+
+std::string HSSConnection::pending_query_key(const irs_query& irs_query)
+{
+  // The request sent to Homestead depends on all these fields.
+  std::string key;
+  key.reserve(irs_query._public_id.size() +
+              irs_query._private_id.size() +
+              irs_query._req_type.size() +
+              irs_query._server_name.size() +
+              irs_query._wildcard.size() +
+              6);
+  key.append(irs_query._public_id).push_back('\0');
+  key.append(irs_query._private_id).push_back('\0');
+  key.append(irs_query._req_type).push_back('\0');
+  key.append(irs_query._server_name).push_back('\0');
+  key.append(irs_query._wildcard).push_back('\0');
+  key.push_back(irs_query._cache_allowed ? '1' : '0');
+  return key;
+}
+
+
+HTTPCode HSSConnection::send_registration_state_request(const irs_query& irs_query,
+                                                        irs_info& irs_info,
+                                                        SAS::TrailId trail)
+{
+  Utils::StopWatch stopWatch;
+  stopWatch.start();
+
+  bool cacheable = ((_cache != NULL) &&
+                    (irs_query._req_type == CALL));
+  uint64_t generation = (cacheable) ?
+                          _cache->get_generation(irs_query._public_id) : 0;
+
   std::string path = "/impu/" +
                      Utils::url_escape(irs_query._public_id) +
                      "/reg-data";
@@ -478,12 +712,40 @@ HTTPCode HSSConnection::update_registration_state(const irs_query& irs_query,
     TRC_ERROR("Could not get subscriber data from HSS");
     return http_code;
   }
-  return decode_homestead_xml(irs_query._public_id,
-                              irs_info,
-                              root,
-                              _sifc_service,
-                              false,
-                              trail) ? HTTP_OK : HTTP_SERVER_ERROR;
+
+  if (!decode_homestead_xml(irs_query._public_id,
+                            irs_info,
+                            root,
+                            _sifc_service,
+                            false,
+                            trail))
+  {
+    return HTTP_SERVER_ERROR;
+  }
+
+  if (_cache != NULL)
+  {
+    if (cacheable)
+    {
+      if (irs_info._regstate != RegDataXMLUtils::STATE_NOT_REGISTERED)
+      {
+        _cache->put(irs_query._public_id, irs_info, root.get(), generation);
+      }
+    }
+    else
+    {
+      // The registration state has changed, so any cached data for this
+      // subscriber is out of date.
+      invalidate_cached_data(irs_query._public_id);
+
+      for (const std::string& uri : irs_info._associated_uris.get_all_uris())
+      {
+        invalidate_cached_data(uri);
+      }
+    }
+  }
+
+  return HTTP_OK;
 }
 
 
@@ -494,6 +756,21 @@ HTTPCode HSSConnection::get_registration_data(const std::string& public_id,
   Utils::StopWatch stopWatch;
   stopWatch.start();
 
+  uint64_t generation = 0;
+
+  if (_cache != NULL)
+  {
+    generation = _cache->get_generation(public_id);
+  }
+
+  if ((_cache != NULL) && (_cache->get(public_id, irs_info)))
+  {
+    SAS::Event cached(trail, SASEvent::HSS_PROFILE_CACHED, 0);
+    cached.add_var_param(public_id);
+    SAS::report_event(cached);
+    return HTTP_OK;
+  }
+
   SAS::Event event(trail, SASEvent::HTTP_HOMESTEAD_GET_REG, 0);
   event.add_var_param(public_id);
   SAS::report_event(event);
@@ -534,12 +811,33 @@ HTTPCode HSSConnection::get_registration_data(const std::string& public_id,
   // Return whether the XML was successfully decoded. The XML can be decoded and
   // not return any iFCs (when the subscriber isn't registered), so a successful
   // response shouldn't be taken as a guarantee of iFCs.
-  return decode_homestead_xml(public_id,
-                              irs_info,
-                              root,
-                              _sifc_service,
-                              true,
-                              trail) ? HTTP_OK : HTTP_SERVER_ERROR;
+  if (!decode_homestead_xml(public_id,
+                            irs_info,
+                            root,
+                            _sifc_service,
+                            true,
+                            trail))
+  {
+    return HTTP_SERVER_ERROR;
+  }
+
+  // Only cache full data - if the subscriber isn't registered, this only has
+  // the registration state.
+  if ((_cache != NULL) &&
+      (irs_info._regstate != RegDataXMLUtils::STATE_NOT_REGISTERED))
+  {
+    _cache->put(public_id, irs_info, root.get(), generation);
+  }
+
+  return HTTP_OK;
+}
+
+void HSSConnection::invalidate_cached_data(const std::string& public_id)
+{
+  if (_cache != NULL)
+  {
+    _cache->invalidate(public_id);
+  }
 }
 
 
@@ -10,7 +10,9 @@
  */
 
 #include <boost/regex.hpp>
+#include <algorithm>
 #include <cassert>
+#include <ctype.h>
 
 extern "C" {
 #include <pjlib-util.h>
@@ -28,6 +30,7 @@ extern "C" {
 #include "sas.h"
 #include "sproutsasevent.h"
 #include "uri_classifier.h"
+#include "regex_cache.h"
 
 #include "rapidxml/rapidxml_print.hpp"
 using namespace rapidxml;
@@ -57,6 +60,7 @@ Ifc::Ifc(std::string ifc_str,
   char* xml_str = ifc_doc->allocate_string(ifc_str.c_str());
   new_document->parse<0>(xml_str);
   _ifc = ifc_doc->clone_node(new_document->first_node());
+  _compiled = compile(_ifc);
 
   delete new_document;
 }
@@ -92,21 +96,164 @@ void Ifc::handle_unusual_ifc(std::string error,
   SAS::report_event(event);
 }
 
-// Test if the SPT matches. Ignores grouping and negation, and just
-// evaluates the service point trigger in the node.
-// @return true if the SPT matches, false if not
-// @throw xml_error if there is a problem evaluating the trigger.
-bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
-                      const bool is_registered,               //< The registration state
-                      const bool is_initial_registration,
-                      pjsip_msg* msg,                   //< The message being matched
-                      xml_node<>* spt,                  //< The Service Point Trigger node
-                      std::string ifc_str,
-                      std::string server_name,
-                      SAS::TrailId trail)
+void Ifc::handle_invalid_xml(std::string error,
+                             SAS::TrailId trail)
+{
+  // Generic SAS event to log skipping iFC due to syntactic error in parsing
+  // XML, most likely thrown by utility libraries.
+  std::string err_str = "iFC XML is syntactically invalid: " + error;
+  TRC_ERROR(err_str.c_str());
+  SAS::Event event(trail, SASEvent::INVALID_XML_IGNORED, 0);
+  event.add_var_param(error);
+  SAS::report_event(event);
+}
+
+// Report a problem found when compiling the iFC.
+// @throw ifc_error or compiled_xml_error, depending on the problem.
+void Ifc::handle_compile_error(const CompileError& error,
+                               std::string server_name,
+                               SAS::TrailId trail)
+{
+  if (error.type == CompileError::INVALID_IFC)
+  {
+    handle_invalid_ifc(error.text, server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
+  }
+  else
+  {
+    throw compiled_xml_error(error.text);
+  }
+}
+
+// Returns whether a Header element is a plain header name, rather than
+// something that needs the regex engine to match it.
+static bool is_plain_header_name(const std::string& header)
+{
+  if (header.empty())
+  {
+    return false;
+  }
+
+  for (std::string::const_iterator c = header.begin(); c != header.end(); ++c)
+  {
+    if (!isalnum((unsigned char)*c) && (*c != '-') && (*c != '_'))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool chars_match_icase(char msg_char, char lower_char)
+{
+  return (tolower((unsigned char)msg_char) == lower_char);
+}
+
+// Compile the iFC XML into its evaluation form.  This never throws - any
+// problems are recorded in the compiled iFC, and reported when it is
+// evaluated.
+std::shared_ptr<const Ifc::CompiledIfc> Ifc::compile(xml_node<>* ifc)
+{
+  std::shared_ptr<CompiledIfc> compiled = std::make_shared<CompiledIfc>();
+  rapidxml::print(std::back_inserter(compiled->ifc_str), *ifc, 0);
+
+  xml_node<>* as = ifc->first_node(RegDataXMLUtils::APPLICATION_SERVER);
+  if (as == NULL)
+  {
+    compiled->error.set(CompileError::INVALID_IFC,
+                        "iFC missing ApplicationServer element");
+    return compiled;
+  }
+
+  compiled->server_name = XMLUtils::get_first_node_value(as, RegDataXMLUtils::SERVER_NAME);
+  if (compiled->server_name.empty())
+  {
+    compiled->error.set(CompileError::INVALID_IFC, "iFC has no ServerName");
+    return compiled;
+  }
+
+  xml_node<>* profile_part_indicator = ifc->first_node(RegDataXMLUtils::PROFILE_PART_INDICATOR);
+  if (profile_part_indicator)
+  {
+    try
+    {
+      compiled->profile_part_indicator =
+                            XMLUtils::parse_integer(profile_part_indicator,
+                                                    "ProfilePartIndicator",
+                                                    0,
+                                                    1);
+    }
+    catch (xml_error err)
+    {
+      compiled->error.set(CompileError::INVALID_XML, err.what());
+      return compiled;
+    }
+  }
+
+  xml_node<>* trigger = ifc->first_node(RegDataXMLUtils::TRIGGER_POINT);
+  if (!trigger)
+  {
+    return compiled;
+  }
+
+  compiled->has_trigger = true;
+
+  try
+  {
+    compiled->cnf = XMLUtils::parse_bool(trigger->first_node(RegDataXMLUtils::CONDITION_TYPE_CNF),
+                                         RegDataXMLUtils::CONDITION_TYPE_CNF);
+  }
+  catch (xml_error err)
+  {
+    compiled->trigger_error.set(CompileError::INVALID_XML, err.what());
+    return compiled;
+  }
+
+  for (xml_node<>* spt = trigger->first_node(RegDataXMLUtils::SPT);
+       spt;
+       spt = spt->next_sibling(RegDataXMLUtils::SPT))
+  {
+    compiled->spts.push_back(Spt());
+    compile_spt(spt, compiled->spts.back());
+  }
+
+  return compiled;
+}
+
+// Compile a single SPT.  Any problems are recorded so that they are reported
+// at the same point in evaluation as they would be when interpreting the XML.
+void Ifc::compile_spt(xml_node<>* spt_node, Spt& spt)
 {
+  try
+  {
+    for (xml_node<>* group_node = spt_node->first_node(RegDataXMLUtils::GROUP);
+         group_node;
+         group_node = group_node->next_sibling(RegDataXMLUtils::GROUP))
+    {
+      spt.groups.push_back(XMLUtils::parse_integer(group_node,
+                                                   "Group ID",
+                                                   0,
+                                                   std::numeric_limits<int32_t>::max()));
+    }
+  }
+  catch (xml_error err)
+  {
+    spt.group_error.set(CompileError::INVALID_XML, err.what());
+  }
+
+  try
+  {
+    xml_node<>* neg_node = spt_node->first_node(RegDataXMLUtils::CONDITION_NEGATED);
+    spt.negated = neg_node && XMLUtils::parse_bool(neg_node, RegDataXMLUtils::CONDITION_NEGATED);
+  }
+  catch (xml_error err)
+  {
+    spt.error.set(CompileError::INVALID_XML, err.what());
+    return;
+  }
+
   // Find the class node.
-  xml_node<>* node = spt->first_node();
+  xml_node<>* node = spt_node->first_node();
   const char* name = NULL;
 
   for (; node; node = node->next_sibling())
@@ -118,132 +265,257 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
     {
       if (strcmp(name, RegDataXMLUtils::EXTENSION) == 0)
       {
-        handle_invalid_ifc("Missing class for service point trigger", server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-      }
-      else
-      {
-        break;
+        node = NULL;
       }
+      break;
     }
   }
 
   if (!node)
   {
-    handle_invalid_ifc("Missing class for service point trigger", server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
+    spt.error.set(CompileError::INVALID_IFC, "Missing class for service point trigger");
+    return;
   }
 
-  // Now interpret the node depending on its class.
-  bool ret = false;
+  spt.class_name = name;
 
   if (strcmp(RegDataXMLUtils::METHOD, name) == 0)
   {
+    spt.spt_class = Spt::METHOD;
+    spt.method = node->value();
+
     // If we have a REGISTER we may need to match on RegistrationType.
-    if ((strcmp("REGISTER", node->value()) == 0) &&
-        (pj_strcmp2(&msg->line.req.method.name, node->value()) == 0))
+    xml_node<>* ext_node = node->next_sibling();
+    if ((spt.method == "REGISTER") &&
+        (ext_node) &&
+        (strcmp(ext_node->name(), RegDataXMLUtils::EXTENSION) == 0))
     {
-      ret = true;
-      node = node->next_sibling();
-      if (node)
+      spt.register_extension = true;
+
+      try
       {
-        name = node->name();
-        if (strcmp(name, RegDataXMLUtils::EXTENSION) == 0)
+        for (xml_node<>* reg_type_node = ext_node->first_node(RegDataXMLUtils::REGISTRATION_TYPE);
+             reg_type_node;
+             reg_type_node = reg_type_node->next_sibling(RegDataXMLUtils::REGISTRATION_TYPE))
         {
-          for (xml_node<>* reg_type_node = node->first_node(RegDataXMLUtils::REGISTRATION_TYPE);
-               reg_type_node;
-               reg_type_node = reg_type_node->next_sibling(RegDataXMLUtils::REGISTRATION_TYPE))
-          {
-            name = reg_type_node->name();
-            int reg_type = XMLUtils::parse_integer(reg_type_node,
-                                                   "registration type",
-                                                   0,
-                                                   2);
+          spt.reg_types.push_back(XMLUtils::parse_integer(reg_type_node,
+                                                          "registration type",
+                                                          0,
+                                                          2));
+        }
+      }
+      catch (xml_error err)
+      {
+        spt.reg_type_error.set(CompileError::INVALID_XML, err.what());
+      }
+    }
+  }
+  else if ((strcmp(RegDataXMLUtils::SIP_HEADER, name) == 0) ||
+           (strcmp(RegDataXMLUtils::SESSION_DESCRIPTION, name) == 0))
+  {
+    bool sip_header = (strcmp(RegDataXMLUtils::SIP_HEADER, name) == 0);
+    xml_node<>* spt_name = node->first_node(sip_header ? RegDataXMLUtils::HEADER :
+                                                         RegDataXMLUtils::LINE);
+    xml_node<>* spt_content = node->first_node(RegDataXMLUtils::CONTENT);
+    spt.spt_class = sip_header ? Spt::SIP_HEADER : Spt::SESSION_DESCRIPTION;
 
-            // Find expiry value from SIP message if it is present to determine
-            // whether we have a de-registration.  Set an arbitrary default value of
-            // an hour.
-            pj_bool_t dereg = PJUtils::is_deregistration(msg);
+    if (!spt_name)
+    {
+      spt.error.set(CompileError::INVALID_IFC,
+                    sip_header ?
+                      "Missing Header element for SIPHeader service point trigger" :
+                      "Missing Line element for SessionDescription service point trigger");
+      return;
+    }
 
-            switch (reg_type)
-            {
-            case INITIAL_REGISTRATION:
-              ret = (is_initial_registration && !dereg);
-              break;
-            case REREGISTRATION:
-              ret = (!is_initial_registration && !dereg);
-              break;
-            case DEREGISTRATION:
-              ret = dereg;
-              break;
-            default:
-              // LCOV_EXCL_START Unreachable
-              TRC_WARNING("Impossible case %d", reg_type);
-              ret = false;
-              break;
-              // LCOV_EXCL_STOP
-            }
+    // Header names are matched case-insensitively, SDP line types aren't.
+    std::string name_str = XMLUtils::get_text_or_cdata(spt_name);
+    spt.name_regex = RegexCache::instance()->get(name_str,
+                                                 sip_header ?
+                                                   (boost::regex_constants::icase |
+                                                    boost::regex_constants::no_except) :
+                                                   boost::regex_constants::no_except);
+    if (spt.name_regex.status())
+    {
+      spt.error.set(CompileError::INVALID_IFC,
+                    sip_header ?
+                      "Invalid regular expression in Header element for SIPHeader service point trigger" :
+                      "Invalid regular expression in Line element for Session Description service point trigger");
+      return;
+    }
 
-            // If we've found a match, break out of the for loop.
-            if (ret)
-            {
-              break;
-            }
-          }
-        }
+    if ((sip_header) && (is_plain_header_name(name_str)))
+    {
+      std::transform(name_str.begin(), name_str.end(), name_str.begin(), ::tolower);
+      spt.header_name = name_str;
+    }
+
+    if (spt_content)
+    {
+      spt.has_content = true;
+      spt.content_regex = RegexCache::instance()->get(XMLUtils::get_text_or_cdata(spt_content),
+                                                      boost::regex_constants::no_except);
+      if (spt.content_regex.status())
+      {
+        spt.content_error.set(CompileError::INVALID_IFC,
+                              sip_header ?
+                                "Invalid regular expression in Content element for SIPHeader service point trigger" :
+                                "Invalid regular expression in Content element for Session Description service point trigger");
       }
     }
-    else
+  }
+  else if (strcmp(RegDataXMLUtils::SESSION_CASE, name) == 0)
+  {
+    spt.spt_class = Spt::SESSION_CASE;
+
+    try
     {
-      ret = (pj_strcmp2(&msg->line.req.method.name, node->value()) == 0);
+      spt.session_case = XMLUtils::parse_integer(node, "session case", 0, 4);
+    }
+    catch (xml_error err)
+    {
+      spt.error.set(CompileError::INVALID_XML, err.what());
     }
   }
-  else if (strcmp(RegDataXMLUtils::SIP_HEADER, name) == 0)
+  else if (strcmp(RegDataXMLUtils::REQUEST_URI, name) == 0)
   {
-    xml_node<>* spt_header = node->first_node(RegDataXMLUtils::HEADER);
-    xml_node<>* spt_content = node->first_node(RegDataXMLUtils::CONTENT);
-    boost::regex header_regex;
-    boost::regex content_regex;
-    pjsip_hdr* header = NULL;
+    spt.spt_class = Spt::REQUEST_URI;
 
-    if (!spt_header)
+    std::string req_uri = XMLUtils::get_text_or_cdata(node);
+    spt.unusual_request_uri = ((req_uri.compare(0, 4, "sip:") == 0) ||
+                               (req_uri.compare(0, 4, "tel:") == 0));
+
+    spt.request_uri_regex = RegexCache::instance()->get(req_uri,
+                                                        boost::regex_constants::no_except);
+    if (spt.request_uri_regex.status())
     {
-      handle_invalid_ifc("Missing Header element for SIPHeader service point trigger",
-                         server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
+      spt.error.set(CompileError::INVALID_IFC,
+                    "Invalid regular expression in Request URI service point trigger");
     }
+  }
+}
+
+// Check whether a header name matches a SIPHeader SPT.
+bool Ifc::header_name_matches(const Spt& spt, const pj_str_t* name)
+{
+  const char* begin = name->ptr;
+  const char* end = name->ptr + name->slen;
+
+  if (!spt.header_name.empty())
+  {
+    // Case-insensitive substring search - the same as the regex would do.
+    return (std::search(begin,
+                        end,
+                        spt.header_name.begin(),
+                        spt.header_name.end(),
+                        chars_match_icase) != end);
+  }
+
+  return boost::regex_search(begin, end, spt.name_regex);
+}
+
+// Test if the SPT matches. Ignores grouping and negation, and just
+// evaluates the compiled service point trigger.
+// @return true if the SPT matches, false if not
+// @throw ifc_error or compiled_xml_error if the trigger is invalid.
+bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
+                      const bool is_registered,               //< The registration state
+                      const bool is_initial_registration,
+                      pjsip_msg* msg,                   //< The message being matched
+                      const Spt& spt,                   //< The compiled Service Point Trigger
+                      const std::string& server_name,
+                      SAS::TrailId trail)
+{
+  if ((spt.spt_class == Spt::REQUEST_URI) && (spt.unusual_request_uri))
+  {
+    handle_unusual_ifc("Request URI should be a regex that matches either on "
+                       "the hostport of a SIP URI or a telephone number.",
+                       server_name, SASEvent::IFC_UNUSUAL, 0, trail);
+  }
+
+  if (spt.error.is_set())
+  {
+    handle_compile_error(spt.error, server_name, trail);
+  }
 
-    header_regex = boost::regex(XMLUtils::get_text_or_cdata(spt_header),
-                                boost::regex_constants::icase |
-                                boost::regex_constants::no_except);
-    if (header_regex.status())
+  bool ret = false;
+
+  switch (spt.spt_class)
+  {
+  case Spt::METHOD:
+    // If we have a REGISTER we may need to match on RegistrationType.
+    if ((spt.register_extension) &&
+        (pj_strcmp2(&msg->line.req.method.name, spt.method.c_str()) == 0))
     {
-      handle_invalid_ifc("Invalid regular expression in Header element for SIPHeader service point trigger",
-                         server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
+      ret = true;
+
+      if ((!spt.reg_types.empty()) || (spt.reg_type_error.is_set()))
+      {
+        // Find expiry value from SIP message if it is present to determine
+        // whether we have a de-registration.
+        pj_bool_t dereg = PJUtils::is_deregistration(msg);
+
+        for (std::vector<int>::const_iterator reg_type = spt.reg_types.begin();
+             reg_type != spt.reg_types.end();
+             ++reg_type)
+        {
+          switch (*reg_type)
+          {
+          case INITIAL_REGISTRATION:
+            ret = (is_initial_registration && !dereg);
+            break;
+          case REREGISTRATION:
+            ret = (!is_initial_registration && !dereg);
+            break;
+          case DEREGISTRATION:
+            ret = dereg;
+            break;
+          default:
+            // LCOV_EXCL_START Unreachable
+            TRC_WARNING("Impossible case %d", *reg_type);
+            ret = false;
+            break;
+            // LCOV_EXCL_STOP
+          }
+
+          // If we've found a match, stop checking registration types.
+          if (ret)
+          {
+            break;
+          }
+        }
+
+        if ((!ret) && (spt.reg_type_error.is_set()))
+        {
+          handle_compile_error(spt.reg_type_error, server_name, trail);
+        }
+      }
     }
+    else
+    {
+      ret = (pj_strcmp2(&msg->line.req.method.name, spt.method.c_str()) == 0);
+    }
+    break;
 
-    for (header = msg->hdr.next; header != &msg->hdr; header = header->next)
+  case Spt::SIP_HEADER:
+    for (pjsip_hdr* header = msg->hdr.next; header != &msg->hdr; header = header->next)
     {
-      if (boost::regex_search(PJUtils::pj_str_to_string(&(header->name)), header_regex))
+      if (header_name_matches(spt, &header->name))
       {
-        if (!spt_content)
+        if (!spt.has_content)
         {
           // We've found a matching header, and don't have to match on content
           ret = true;
         }
         else
         {
-          std::string header_value = PJUtils::get_header_value(header);
-          // status() is nonzero for an uninitialised regex, so we check this in order to only compile it once
-          if (content_regex.status())
+          if (spt.content_error.is_set())
           {
-            content_regex = boost::regex(XMLUtils::get_text_or_cdata(spt_content),
-                                         boost::regex_constants::no_except);
-            if (content_regex.status())
-            {
-              handle_invalid_ifc("Invalid regular expression in Content element for SIPHeader service point trigger",
-                                 server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-            }
+            handle_compile_error(spt.content_error, server_name, trail);
           }
 
-          if (boost::regex_search(header_value, content_regex))
+          std::string header_value = PJUtils::get_header_value(header);
+          if (boost::regex_search(header_value, spt.content_regex))
           {
             // We've found a matching header, and have matching content in one field
             ret = true;
@@ -256,11 +528,10 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
         break;
       }
     }
-  }
-  else if (strcmp(RegDataXMLUtils::SESSION_CASE, name) == 0)
-  {
-    int direction = XMLUtils::parse_integer(node, "session case", 0, 4);
-    switch (direction)
+    break;
+
+  case Spt::SESSION_CASE:
+    switch (spt.session_case)
     {
     case ORIGINATING_REGISTERED:
       ret = (session_case == SessionCase::Originating) && is_registered;
@@ -279,90 +550,55 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
       break;
     default:
       // LCOV_EXCL_START Unreachable
-      TRC_WARNING("Impossible case %d", direction);
+      TRC_WARNING("Impossible case %d", spt.session_case);
       ret = false;
       break;
     // LCOV_EXCL_STOP
     }
-  }
-  else if (strcmp(RegDataXMLUtils::REQUEST_URI, name) == 0)
-  {
-    boost::regex req_uri_regex;
-    std::string test_string;
+    break;
 
-    if (PJSIP_URI_SCHEME_IS_TEL(msg->line.req.uri))
-    {
-      pjsip_tel_uri* req_uri =  (pjsip_tel_uri*)pjsip_uri_get_uri(msg->line.req.uri);
-
-      // Match against the telephone-subscriber part of the Req URI, as per Table F.1
-      // of 3GPP TS 29.228.
-      test_string = PJUtils::pj_str_to_string(&req_uri->number);
-    }
-    else if (PJSIP_URI_SCHEME_IS_URN(msg->line.req.uri))
+  case Spt::REQUEST_URI:
     {
-      pjsip_other_uri* req_uri = (pjsip_other_uri*)pjsip_uri_get_uri(msg->line.req.uri);
+      std::string test_string;
 
-      // There is nothing in TS 29.228 about what to match against in the case
-      // of a urn URI. So just pull out the entire content (which is everything
-      // after "urn:").
-      test_string = PJUtils::pj_str_to_string(&req_uri->content);
-    }
-    else
-    {
-      pjsip_sip_uri* req_uri = (pjsip_sip_uri*)pjsip_uri_get_uri(msg->line.req.uri);
-
-      // Compare against the hostport part of the Req URI, as per Table F.1
-      // of 3GPP TS 29.228.
-      std::string hostport = PJUtils::pj_str_to_string(&req_uri->host);
+      if (PJSIP_URI_SCHEME_IS_TEL(msg->line.req.uri))
+      {
+        pjsip_tel_uri* req_uri =  (pjsip_tel_uri*)pjsip_uri_get_uri(msg->line.req.uri);
 
-      if (req_uri->port != 0)
+        // Match against the telephone-subscriber part of the Req URI, as per Table F.1
+        // of 3GPP TS 29.228.
+        test_string = PJUtils::pj_str_to_string(&req_uri->number);
+      }
+      else if (PJSIP_URI_SCHEME_IS_URN(msg->line.req.uri))
       {
-        hostport += ":" + std::to_string(req_uri->port);
+        pjsip_other_uri* req_uri = (pjsip_other_uri*)pjsip_uri_get_uri(msg->line.req.uri);
+
+        // There is nothing in TS 29.228 about what to match against in the case
+        // of a urn URI. So just pull out the entire content (which is everything
+        // after "urn:").
+        test_string = PJUtils::pj_str_to_string(&req_uri->content);
       }
+      else
+      {
+        pjsip_sip_uri* req_uri = (pjsip_sip_uri*)pjsip_uri_get_uri(msg->line.req.uri);
 
-      test_string = hostport;
-    }
+        // Compare against the hostport part of the Req URI, as per Table F.1
+        // of 3GPP TS 29.228.
+        std::string hostport = PJUtils::pj_str_to_string(&req_uri->host);
 
-    std::string req_uri = XMLUtils::get_text_or_cdata(node);
-    if ((req_uri.compare(0, 4, "sip:") == 0) ||
-        (req_uri.compare(0, 4, "tel:") == 0))
-    {
-      handle_unusual_ifc("Request URI should be a regex that matches either on "
-                         "the hostport of a SIP URI or a telephone number.",
-                         server_name, SASEvent::IFC_UNUSUAL, 0, trail);
-    }
-    
-    req_uri_regex = boost::regex(req_uri,
-                                 boost::regex_constants::no_except);
-    if (req_uri_regex.status())
-    {
-      handle_invalid_ifc("Invalid regular expression in Request URI service point trigger",
-                         server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-    }
-      ret = boost::regex_search(test_string, req_uri_regex);
-  }
-  else if (strcmp(RegDataXMLUtils::SESSION_DESCRIPTION, name) == 0)
-  {
-    xml_node<>* spt_line = node->first_node(RegDataXMLUtils::LINE);
-    xml_node<>* spt_content = node->first_node(RegDataXMLUtils::CONTENT);
-    boost::regex line_regex;
-    boost::regex content_regex;
-    char newline = '\n';
+        if (req_uri->port != 0)
+        {
+          hostport += ":" + std::to_string(req_uri->port);
+        }
 
-    if (!spt_line)
-    {
-      handle_invalid_ifc("Missing Line element for SessionDescription service point trigger",
-                         server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-    }
+        test_string = hostport;
+      }
 
-    line_regex = boost::regex(XMLUtils::get_text_or_cdata(spt_line),
-                              boost::regex_constants::no_except);
-    if (line_regex.status())
-    {
-      handle_invalid_ifc("Invalid regular expression in Line element for Session Description service point trigger",
-                         server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
+      ret = boost::regex_search(test_string, spt.request_uri_regex);
     }
+    break;
 
+  case Spt::SESSION_DESCRIPTION:
     // Check if the message body is SDP.
     if (msg->body &&
         (!pj_stricmp2(&msg->body->content_type.type, "application")) &&
@@ -373,29 +609,22 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
         // Split the message body into each SDP line.
         std::stringstream sdp((char *)msg->body->data);
         std::string sdp_line;
-        while((std::getline(sdp, sdp_line, newline)) && (ret == false))
+        while((std::getline(sdp, sdp_line, '\n')) && (ret == false))
         {
           // Match the line regex on the first character of the SDP line.
           std::string sdp_identifier(1, sdp_line[0]);
-          if (boost::regex_search(sdp_identifier, line_regex))
+          if (boost::regex_search(sdp_identifier, spt.name_regex))
           {
-            if (!spt_content)
+            if (!spt.has_content)
             {
               // We've found a matching line type, and don't have to match on content.
               ret = true;
             }
             else
             {
-              // status() is nonzero for an uninitialised regex, so we check this in order to only compile it once.
-              if (content_regex.status())
+              if (spt.content_error.is_set())
               {
-                content_regex = boost::regex(XMLUtils::get_text_or_cdata(spt_content),
-                                             boost::regex_constants::no_except);
-                if (content_regex.status())
-                {
-                  handle_invalid_ifc("Invalid regular expression in Content element for Session Description service point trigger",
-                                     server_name, SASEvent::INVALID_IFC_IGNORED, 0, trail);
-                }
+                handle_compile_error(spt.content_error, server_name, trail);
               }
 
               // Check the second character of the line is an equals sign, and then
@@ -403,7 +632,7 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
               if (sdp_line.find_first_of("=") == 1)
               {
                 sdp_line.erase(0,2);
-                if (boost::regex_search(sdp_line, content_regex))
+                if (boost::regex_search(sdp_line, spt.content_regex))
                 {
                   // We've found a matching line.
                   ret = true;
@@ -418,14 +647,15 @@ bool Ifc::spt_matches(const SessionCase& session_case,  //< The session case
         }
       }
     }
-  }
-  else
-  {
-    TRC_WARNING("Unimplemented iFC service point trigger class: %s", name);
+    break;
+
+  default:
+    TRC_WARNING("Unimplemented iFC service point trigger class: %s", spt.class_name.c_str());
     ret = false;
+    break;
   }
 
-  TRC_DEBUG("SPT class %s: result %s", name, ret ? "true" : "false");
+  TRC_DEBUG("SPT class %s: result %s", spt.class_name.c_str(), ret ? "true" : "false");
   return ret;
 }
 
@@ -440,37 +670,23 @@ bool Ifc::filter_matches(const SessionCase& session_case,
                          pjsip_msg* msg,
                          SAS::TrailId trail) const
 {
-  std::string ifc_str;
-  rapidxml::print(std::back_inserter(ifc_str), *_ifc, 0);
+  const CompiledIfc& ifc = *_compiled;
 
   SAS::Event event(trail, SASEvent::IFC_TESTING, 0);
-  event.add_compressed_param(ifc_str, &SASEvent::PROFILE_SERVICE_PROFILE);
+  event.add_compressed_param(ifc.ifc_str, &SASEvent::PROFILE_SERVICE_PROFILE);
   SAS::report_event(event);
-  std::string server_name;
+  const std::string& server_name = ifc.server_name;
 
   try
   {
-    xml_node<>* as = _ifc->first_node(RegDataXMLUtils::APPLICATION_SERVER);
-    if (as == NULL)
+    if (ifc.error.is_set())
     {
-      handle_invalid_ifc("iFC missing ApplicationServer element", server_name, 
-                         SASEvent::INVALID_IFC_IGNORED, 0, trail);
+      handle_compile_error(ifc.error, server_name, trail);
     }
 
-    server_name = XMLUtils::get_first_node_value(as, RegDataXMLUtils::SERVER_NAME);
-    if (server_name.empty())
+    if (ifc.profile_part_indicator != -1)
     {
-      handle_invalid_ifc("iFC has no ServerName", server_name, 
-                         SASEvent::INVALID_IFC_IGNORED, 0, trail);
-    }
-
-    xml_node<>* profile_part_indicator = _ifc->first_node(RegDataXMLUtils::PROFILE_PART_INDICATOR);
-    if (profile_part_indicator)
-    {
-      bool reg = XMLUtils::parse_integer(profile_part_indicator,
-                                         "ProfilePartIndicator",
-                                         0,
-                                         1) == 0;
+      bool reg = (ifc.profile_part_indicator == 0);
       if (reg != is_registered)
       {
         std::string reg_state = reg ? "reg" : "unreg";
@@ -492,8 +708,7 @@ bool Ifc::filter_matches(const SessionCase& session_case,
     // That means each AsInvocation would have to belong to a pool,
     // though, and that's not easy in the current architecture.
 
-    xml_node<>* trigger = _ifc->first_node(RegDataXMLUtils::TRIGGER_POINT);
-    if (!trigger)
+    if (!ifc.has_trigger)
     {
       TRC_DEBUG("iFC has no trigger point - unconditional match");  // 3GPP TS 29.228 sB.2.2
 
@@ -504,8 +719,12 @@ bool Ifc::filter_matches(const SessionCase& session_case,
       return true;
     }
 
-    bool cnf = XMLUtils::parse_bool(trigger->first_node(RegDataXMLUtils::CONDITION_TYPE_CNF),
-                                    RegDataXMLUtils::CONDITION_TYPE_CNF);
+    if (ifc.trigger_error.is_set())
+    {
+      handle_compile_error(ifc.trigger_error, server_name, trail);
+    }
+
+    bool cnf = ifc.cnf;
 
     // In CNF (conjunct-of-disjuncts, i.e., big-AND of ORs), as we
     // work through each SPT we OR it into its group(s). At the end,
@@ -518,40 +737,38 @@ bool Ifc::filter_matches(const SessionCase& session_case,
     ifc_match.append(spt_relation).append(" each SPT match result to determine group result.\n");
     ifc_match.append(group_relation).append(" each group result to determine overall iFC match.\n\n");
 
-    for (xml_node<>* spt = trigger->first_node(RegDataXMLUtils::SPT);
-         spt;
-         spt = spt->next_sibling(RegDataXMLUtils::SPT))
+    for (std::vector<Spt>::const_iterator spt = ifc.spts.begin();
+         spt != ifc.spts.end();
+         ++spt)
     {
-      xml_node<>* neg_node = spt->first_node(RegDataXMLUtils::CONDITION_NEGATED);
-      bool neg = neg_node && XMLUtils::parse_bool(neg_node, RegDataXMLUtils::CONDITION_NEGATED);
       bool spt_matched = spt_matches(session_case,
                                      is_registered,
                                      is_initial_registration,
                                      msg,
-                                     spt,
-                                     ifc_str,
+                                     *spt,
                                      server_name,
-                                     trail) != neg;
+                                     trail) != spt->negated;
 
-      for (xml_node<>* group_node = spt->first_node(RegDataXMLUtils::GROUP);
-           group_node;
-           group_node = group_node->next_sibling(RegDataXMLUtils::GROUP))
+      if (spt->group_error.is_set())
       {
-        int32_t group_id = XMLUtils::parse_integer(group_node,
-                                                   "Group ID",
-                                                   0,
-                                                   std::numeric_limits<int32_t>::max());
-        if (groups.find(group_id) == groups.end())
+        handle_compile_error(spt->group_error, server_name, trail);
+      }
+
+      for (std::vector<int32_t>::const_iterator group_id = spt->groups.begin();
+           group_id != spt->groups.end();
+           ++group_id)
+      {
+        if (groups.find(*group_id) == groups.end())
         {
-          groups[group_id] = spt_matched;
+          groups[*group_id] = spt_matched;
         }
         else
         {
-          groups[group_id] = cnf ? (groups[group_id] || spt_matched) : 
-            (groups[group_id] && spt_matched);
+          groups[*group_id] = cnf ? (groups[*group_id] || spt_matched) :
+            (groups[*group_id] && spt_matched);
         }
 
-        ifc_match.append("SPT in group ").append(std::to_string(group_id))
+        ifc_match.append("SPT in group ").append(std::to_string(*group_id))
           .append(" is ").append(spt_matched ? "matched.\n" : "not matched.\n");
       }
     }
@@ -589,16 +806,9 @@ bool Ifc::filter_matches(const SessionCase& session_case,
     TRC_DEBUG("%s", ifc_match.c_str());
     return ret;
   }
-  catch (xml_error err)
+  catch (compiled_xml_error err)
   {
-    // Generic SAS event to log skipping iFC due to syntactic error in parsing
-    // XML, most likely thrown by utility libraries. 
-    std::string err_str = "iFC XML is syntactically invalid: " 
-      + std::string(err.what());
-    TRC_ERROR(err_str.c_str());
-    SAS::Event event(trail, SASEvent::INVALID_XML_IGNORED, 0);
-    event.add_var_param(std::string(err.what()));
-    SAS::report_event(event);
+    handle_invalid_xml(err.what(), trail);
     return false;
   }
   catch (ifc_error err)
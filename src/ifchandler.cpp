@@ -43,9 +43,12 @@ IfcHandler::~IfcHandler()
   // nothing to do
 }
 
+const std::vector<Ifc> Ifcs::NO_IFCS;
+
 /// Construct an empty set of iFCs.
 Ifcs::Ifcs() :
-  _ifc_doc(NULL)
+  _ifc_doc(NULL),
+  _ifcs(NULL)
 {
 }
 
@@ -120,12 +123,17 @@ Ifcs::Ifcs(std::shared_ptr<xml_document<> > ifc_doc,
       }
     }
 
+    std::shared_ptr<std::vector<Ifc> > ifcs(new std::vector<Ifc>());
+    ifcs->reserve(ifc_map.size());
+
     for (std::multimap<int32_t, Ifc>::iterator it = ifc_map.begin();
          it != ifc_map.end();
          ++it)
     {
-      _ifcs.push_back(it->second);
+      ifcs->push_back(it->second);
     }
+
+    _ifcs = ifcs;
   }
   else
   {
@@ -71,6 +71,10 @@ extern "C" {
 #include "communicationmonitor.h"
 #include "common_sip_processing.h"
 #include "thread_dispatcher.h"
+#include "regex_cache.h"
+#include "aor_cache.h"
+#include "hss_cache.h"
+#include "async_work_pool.h"
 #include "exception_handler.h"
 #include "scscfsproutlet.h"
 #include "snmp_continuous_accumulator_table.h"
@@ -84,6 +88,8 @@ extern "C" {
 #include "snmp_success_fail_count_table.h"
 #include "snmp_agent.h"
 #include "ralf_processor.h"
+#include "aor_replicator.h"
+#include "chronos_timer_batcher.h"
 #include "sprout_alarmdefinition.h"
 #include "sproutlet_options.h"
 #include "astaire_impistore.h"
@@ -144,7 +150,28 @@ enum OptionTypes
   OPT_HOMESTEAD_TIMEOUT,
   OPT_ORIG_SIP_TO_TEL_COERCE,
   OPT_REQUEST_ON_QUEUE_TIMEOUT,
-  OPT_BLACKLISTED_SCSCFS
+  OPT_BLACKLISTED_SCSCFS,
+  OPT_SHARDED_WORKER_QUEUES,
+  OPT_DEFERRED_RX_PARSE,
+  OPT_PREDICTIVE_QUEUE_REJECT,
+  OPT_FAIR_QUEUEING,
+  OPT_MAX_QUEUE_DEPTH_PER_SOURCE,
+  OPT_FAIR_QUEUEING_WEIGHTS,
+  OPT_METHOD_AWARE_PRIORITIES,
+  OPT_MESSAGE_PRIORITY_LEVELS,
+  OPT_REGEX_CACHE_SIZE,
+  OPT_AOR_CACHE_TTL_MS,
+  OPT_AOR_CACHE_MAX_KB,
+  OPT_AOR_BINARY_FORMAT,
+  OPT_AOR_DELTA_WRITES,
+  OPT_REMOTE_WRITE_THREADS,
+  OPT_REMOTE_WRITE_QUEUE,
+  OPT_CHRONOS_BATCH_WINDOW_MS,
+  OPT_HSS_CACHE_TTL_MS,
+  OPT_HSS_CACHE_MAX_KB,
+  OPT_ASYNC_HTTP_THREADS,
+  OPT_SKIP_LOCAL_SPROUTLET_SELECTION_LOGS,
+  OPT_ASYNC_DNS_THREADS
 };
 
 
@@ -238,6 +265,27 @@ const static struct pj_getopt_option long_opt[] =
   { "request-on-queue-timeout",     required_argument, 0, OPT_REQUEST_ON_QUEUE_TIMEOUT},
   { "blacklisted-scscfs",           required_argument, 0, OPT_BLACKLISTED_SCSCFS},
   { "enable-orig-sip-to-tel-coerce",no_argument,       0, OPT_ORIG_SIP_TO_TEL_COERCE},
+  { "sharded-worker-queues",        no_argument,       0, OPT_SHARDED_WORKER_QUEUES},
+  { "deferred-rx-parse",            no_argument,       0, OPT_DEFERRED_RX_PARSE},
+  { "predictive-queue-reject",      no_argument,       0, OPT_PREDICTIVE_QUEUE_REJECT},
+  { "fair-queueing",                no_argument,       0, OPT_FAIR_QUEUEING},
+  { "max-queue-depth-per-source",   required_argument, 0, OPT_MAX_QUEUE_DEPTH_PER_SOURCE},
+  { "fair-queueing-weights",        required_argument, 0, OPT_FAIR_QUEUEING_WEIGHTS},
+  { "method-aware-priorities",      no_argument,       0, OPT_METHOD_AWARE_PRIORITIES},
+  { "message-priority-levels",      required_argument, 0, OPT_MESSAGE_PRIORITY_LEVELS},
+  { "regex-cache-size",             required_argument, 0, OPT_REGEX_CACHE_SIZE},
+  { "aor-cache-ttl-ms",             required_argument, 0, OPT_AOR_CACHE_TTL_MS},
+  { "aor-cache-max-kb",             required_argument, 0, OPT_AOR_CACHE_MAX_KB},
+  { "aor-binary-format",            no_argument,       0, OPT_AOR_BINARY_FORMAT},
+  { "aor-delta-writes",             no_argument,       0, OPT_AOR_DELTA_WRITES},
+  { "remote-write-threads",         required_argument, 0, OPT_REMOTE_WRITE_THREADS},
+  { "remote-write-queue",           required_argument, 0, OPT_REMOTE_WRITE_QUEUE},
+  { "chronos-batch-window-ms",      required_argument, 0, OPT_CHRONOS_BATCH_WINDOW_MS},
+  { "hss-cache-ttl-ms",             required_argument, 0, OPT_HSS_CACHE_TTL_MS},
+  { "hss-cache-max-kb",             required_argument, 0, OPT_HSS_CACHE_MAX_KB},
+  { "async-http-threads",           required_argument, 0, OPT_ASYNC_HTTP_THREADS},
+  { "skip-local-sproutlet-selection-logs", no_argument, 0, OPT_SKIP_LOCAL_SPROUTLET_SELECTION_LOGS},
+  { "async-dns-threads",            required_argument, 0, OPT_ASYNC_DNS_THREADS},
   { NULL,                           0,                 0, 0}
 };
 
@@ -359,9 +407,91 @@ static void usage(void)
        "                            Specify the HTTP bind address\n"
        " -o  --http-port <port>     Specify the HTTP bind port\n"
        " -q  --http-threads N       Number of HTTP threads (default: 1)\n"
-       " -P, --pjsip-threads N      Number of PJSIP threads (default: 1)\n"
+       " -P, --pjsip-threads N      Number of PJSIP transport threads (default: 1).  If more than\n"
+       "                            one, each UDP listening port is opened with one SO_REUSEPORT\n"
+       "                            socket per thread so received messages are read in parallel\n"
        " -B, --billing-cdf <server> Billing CDF server\n"
        " -W, --worker-threads N     Number of worker threads (default: 1)\n"
+       "     --sharded-worker-queues\n"
+       "                            Give each worker thread its own event queue, with messages assigned\n"
+       "                            to queues by Call-ID and idle workers stealing work from busy ones.\n"
+       "                            Intended for deployments with roughly one worker thread per core.\n"
+       "     --deferred-rx-parse\n"
+       "                            Hand received messages to the worker threads as raw bytes, and\n"
+       "                            parse them on the worker thread rather than cloning the parsed\n"
+       "                            message on the transport thread\n"
+       "     --predictive-queue-reject\n"
+       "                            Reject new requests with a 503 as soon as they are received if the\n"
+       "                            predicted wait for a worker thread (from the queue depth and recent\n"
+       "                            processing times) exceeds the request-on-queue timeout\n"
+       "     --fair-queueing        Share the worker threads fairly between the nodes sending SIP\n"
+       "                            messages, so that one node flooding the queue only delays its\n"
+       "                            own messages.  Queue depth and rejection statistics are\n"
+       "                            reported across all nodes, not for each node\n"
+       "     --max-queue-depth-per-source N\n"
+       "                            With fair queueing, reject new requests with a 503 if N messages\n"
+       "                            from the same node are already queued (default: 0, no limit)\n"
+       "     --fair-queueing-weights <address>=<weight>[,<address>=<weight>...]\n"
+       "                            With fair queueing, give the node with each IP address a share of\n"
+       "                            the worker threads in proportion to its weight, where nodes not\n"
+       "                            listed have weight 1\n"
+       "     --method-aware-priorities\n"
+       "                            Queue messages at a priority based on their method and dialog\n"
+       "                            state, so that work on existing dialogs takes precedence over new\n"
+       "                            work.  From highest to lowest priority: responses and OPTIONS,\n"
+       "                            CANCEL/BYE/ACK, other in-dialog requests, other new requests,\n"
+       "                            REGISTER/SUBSCRIBE\n"
+       "     --message-priority-levels <class>:<level>[,<class>:<level>...]\n"
+       "                            With method-aware priorities, override the priority level (0 is\n"
+       "                            highest, 5 lowest) of the message classes response, options,\n"
+       "                            cancel_bye_ack, in_dialog, initial and registration.  Ignored\n"
+       "                            without --method-aware-priorities\n"
+       "     --regex-cache-size N   Maximum number of compiled regular expressions (from iFCs and ENUM\n"
+       "                            records) to cache (default: 1000)\n"
+       "     --aor-cache-ttl-ms N   Cache registration data read from the local registration store\n"
+       "                            for up to N milliseconds, so repeated lookups of the same AoR\n"
+       "                            don't each go to the store.  Lookups may see data up to N ms out\n"
+       "                            of date if another node updates it (default: 0, no cache)\n"
+       "     --aor-cache-max-kb N   Approximate memory limit on the registration data cache\n"
+       "                            (default: 65536)\n"
+       "     --aor-binary-format    Write registration data to the registration stores in a compact\n"
+       "                            binary format rather than JSON.  Data in either format is always\n"
+       "                            read, so this can be changed on a running deployment\n"
+       "     --aor-delta-writes     Store each binding and subscription in the registration stores\n"
+       "                            as a separate record, so that updates only write the bindings\n"
+       "                            and subscriptions that have changed.  Data written either way is\n"
+       "                            always read, so this can be changed on a running deployment\n"
+       "     --remote-write-threads N\n"
+       "                            Write registration changes to the remote sites' registration\n"
+       "                            stores on a pool of N threads, rather than waiting for each\n"
+       "                            remote site before responding (default: 0, write synchronously)\n"
+       "     --remote-write-queue N Maximum number of registration changes queued for writing to\n"
+       "                            remote sites.  Further changes are dropped, and the whole AoR\n"
+       "                            written with its next change (default: 1000)\n"
+       "     --chronos-batch-window-ms N\n"
+       "                            Collect registration timer requests for N milliseconds and send\n"
+       "                            them to Chronos together, in the background, coalescing requests\n"
+       "                            for the same registration (default: 0, send each request\n"
+       "                            before responding)\n"
+       "     --hss-cache-ttl-ms N   Cache subscriber data read from Homestead for up to N\n"
+       "                            milliseconds, so initial requests for a subscriber don't each\n"
+       "                            query Homestead.  Registrations and changes pushed by Homestead\n"
+       "                            refresh the cache; other changes may not be seen for up to N ms\n"
+       "                            (default: 0, no cache)\n"
+       "     --hss-cache-max-kb N   Approximate memory limit on the subscriber data cache\n"
+       "                            (default: 65536)\n"
+       "     --async-http-threads N Number of threads on which the S-CSCF reads subscriber data from\n"
+       "                            Homestead, leaving the worker threads free to process other\n"
+       "                            messages while it waits for a response (default: 0, read\n"
+       "                            subscriber data on the worker threads)\n"
+       "     --skip-local-sproutlet-selection-logs\n"
+       "                            Don't log to SAS how each request passed between Sproutlets in\n"
+       "                            this process is routed.  Each Sproutlet the request reaches, and\n"
+       "                            requests that no Sproutlet takes, are still logged\n"
+       "     --async-dns-threads N  Number of threads on which the next hops of forwarded requests\n"
+       "                            are resolved, so that all the forks of a request are resolved\n"
+       "                            at once (default: 0, resolve each fork on the worker thread\n"
+       "                            before sending it)\n"
        " -a, --analytics <directory>\n"
        "                            Generate analytics logs in specified directory\n"
        " -A, --authentication       Enable authentication\n"
@@ -542,6 +672,21 @@ bool parse_port(const std::string& port_str, int& port)
     return -1;                                                                 \
   }
 
+#define VALIDATE_INT_PARAM_NON_NEGATIVE(PARAMETER, PARAMETER_NAME, TRC_STATEMENT) \
+  int parameter;                                                               \
+  bool rc = validated_atoi(pj_optarg, parameter);                              \
+                                                                               \
+  if ((rc) && (parameter >= 0))                                                \
+  {                                                                            \
+    PARAMETER = parameter;                                                     \
+    TRC_INFO(""#TRC_STATEMENT" set to %d", parameter);                         \
+  }                                                                            \
+  else                                                                         \
+  {                                                                            \
+    TRC_ERROR("Invalid value for "#PARAMETER_NAME": %s", pj_optarg);           \
+    return -1;                                                                 \
+  }
+
 static pj_status_t init_logging_options(int argc, char* argv[], struct options* options)
 {
   int c;
@@ -903,6 +1048,14 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       TRC_INFO("Maximum token rate set to %s", pj_optarg);
       break;
 
+    case 'P':
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->pjsip_threads,
+                                    pjsip_threads,
+                                    Number of PJSIP transport threads);
+      }
+      break;
+
     case 'W':
       {
         VALIDATE_INT_PARAM_NON_ZERO(options->worker_threads,
@@ -1330,6 +1483,203 @@ static pj_status_t init_options(int argc, char* argv[], struct options* options)
       }
       break;
 
+    case OPT_SHARDED_WORKER_QUEUES:
+      options->sharded_worker_queues = true;
+      TRC_INFO("Per-worker event queues enabled");
+      break;
+
+    case OPT_DEFERRED_RX_PARSE:
+      options->deferred_rx_parse = true;
+      TRC_INFO("Deferred parsing of received messages enabled");
+      break;
+
+    case OPT_PREDICTIVE_QUEUE_REJECT:
+      options->predictive_queue_reject = true;
+      TRC_INFO("Predictive rejection of requests on the queue enabled");
+      break;
+
+    case OPT_FAIR_QUEUEING:
+      options->fair_queueing = true;
+      TRC_INFO("Fair queueing between message sources enabled");
+      break;
+
+    case OPT_MAX_QUEUE_DEPTH_PER_SOURCE:
+      {
+        VALIDATE_INT_PARAM(options->max_queue_depth_per_source,
+                           max_queue_depth_per_source,
+                           Maximum number of queued messages from a single source);
+      }
+      break;
+
+    case OPT_FAIR_QUEUEING_WEIGHTS:
+      {
+        std::vector<std::string> source_weights;
+        Utils::split_string(std::string(pj_optarg), ',', source_weights, 0, true);
+
+        for (std::vector<std::string>::iterator it = source_weights.begin();
+             it != source_weights.end();
+             ++it)
+        {
+          size_t equals = it->find('=');
+          std::string address = it->substr(0, equals);
+          SipEventSource source;
+          int weight = -1;
+
+          if ((equals == std::string::npos) ||
+              (!source.parse(address)) ||
+              (!validated_atoi(it->substr(equals + 1).c_str(), weight)) ||
+              (weight < 1))
+          {
+            TRC_ERROR("Invalid fair queueing weight %s", it->c_str());
+            return -1;
+          }
+
+          options->fair_queueing_weights[address] = weight;
+          TRC_INFO("Fair queueing weight of %s set to %d",
+                   address.c_str(), weight);
+        }
+      }
+      break;
+
+    case OPT_METHOD_AWARE_PRIORITIES:
+      options->method_aware_priorities = true;
+      TRC_INFO("Method-aware message priorities enabled");
+      break;
+
+    case OPT_MESSAGE_PRIORITY_LEVELS:
+      {
+        std::vector<std::string> class_levels;
+        Utils::split_string(std::string(pj_optarg), ',', class_levels, 0, true);
+
+        for (std::vector<std::string>::iterator it = class_levels.begin();
+             it != class_levels.end();
+             ++it)
+        {
+          size_t colon = it->find(':');
+          std::string class_name = it->substr(0, colon);
+          int message_class = -1;
+          int level = -1;
+
+          for (int ii = 0; ii < SipMessageClass::NUM_CLASSES; ++ii)
+          {
+            if (class_name == SIP_MESSAGE_CLASS_NAMES[ii])
+            {
+              message_class = ii;
+            }
+          }
+
+          if ((colon == std::string::npos) ||
+              (message_class < 0) ||
+              (!validated_atoi(it->substr(colon + 1).c_str(), level)) ||
+              (level < 0) ||
+              (level >= SipMessageClass::NUM_CLASSES))
+          {
+            TRC_ERROR("Invalid message priority level %s", it->c_str());
+            return -1;
+          }
+
+          options->message_priority_levels[message_class] = level;
+          TRC_INFO("Priority level of %s messages set to %d",
+                   class_name.c_str(), level);
+        }
+      }
+      break;
+
+    case OPT_REGEX_CACHE_SIZE:
+      {
+        VALIDATE_INT_PARAM_NON_NEGATIVE(options->regex_cache_size,
+                                        regex_cache_size,
+                                        Maximum number of cached regular expressions);
+      }
+      break;
+
+    case OPT_AOR_CACHE_TTL_MS:
+      {
+        VALIDATE_INT_PARAM_NON_NEGATIVE(options->aor_cache_ttl_ms,
+                                        aor_cache_ttl_ms,
+                                        Time for which cached registration data is used);
+      }
+      break;
+
+    case OPT_AOR_CACHE_MAX_KB:
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->aor_cache_max_kb,
+                                    aor_cache_max_kb,
+                                    Memory limit on the registration data cache);
+      }
+      break;
+
+    case OPT_AOR_BINARY_FORMAT:
+      options->aor_binary_format = true;
+      TRC_INFO("Binary registration data format enabled");
+      break;
+
+    case OPT_AOR_DELTA_WRITES:
+      options->aor_delta_writes = true;
+      TRC_INFO("Delta writes of registration data enabled");
+      break;
+
+    case OPT_REMOTE_WRITE_THREADS:
+      {
+        VALIDATE_INT_PARAM(options->remote_write_threads,
+                           remote_write_threads,
+                           Number of threads writing to remote sites);
+      }
+      break;
+
+    case OPT_REMOTE_WRITE_QUEUE:
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->remote_write_queue,
+                                    remote_write_queue,
+                                    Maximum queued writes to remote sites);
+      }
+      break;
+
+    case OPT_CHRONOS_BATCH_WINDOW_MS:
+      {
+        VALIDATE_INT_PARAM_NON_NEGATIVE(options->chronos_batch_window_ms,
+                                        chronos_batch_window_ms,
+                                        Chronos timer batching window);
+      }
+      break;
+
+    case OPT_HSS_CACHE_TTL_MS:
+      {
+        VALIDATE_INT_PARAM_NON_NEGATIVE(options->hss_cache_ttl_ms,
+                                        hss_cache_ttl_ms,
+                                        Subscriber data cache TTL);
+      }
+      break;
+
+    case OPT_HSS_CACHE_MAX_KB:
+      {
+        VALIDATE_INT_PARAM_NON_ZERO(options->hss_cache_max_kb,
+                                    hss_cache_max_kb,
+                                    Memory limit on the subscriber data cache);
+      }
+      break;
+
+    case OPT_ASYNC_HTTP_THREADS:
+      {
+        VALIDATE_INT_PARAM_NON_NEGATIVE(options->async_http_threads,
+                                        async_http_threads,
+                                        Asynchronous HTTP threads);
+      }
+      break;
+
+    case OPT_SKIP_LOCAL_SPROUTLET_SELECTION_LOGS:
+      options->skip_local_sproutlet_selection_logs = true;
+      TRC_INFO("SAS logging of Sproutlet selection between local Sproutlets disabled");
+      break;
+
+    case OPT_ASYNC_DNS_THREADS:
+      {
+        VALIDATE_INT_PARAM_NON_NEGATIVE(options->async_dns_threads,
+                                        async_dns_threads,
+                                        Asynchronous DNS threads);
+      }
+      break;
+
     SPROUTLET_MACRO(SPROUTLET_OPTIONS)
 
     case 'h':
@@ -1442,6 +1792,7 @@ AoRStore* local_aor_store = NULL;
 std::vector<AoRStore*> remote_aor_stores;
 SubscriberDataManager* local_sdm = NULL;
 std::vector<SubscriberDataManager*> remote_sdms;
+AoRReplicator* aor_replicator = NULL;
 ImpiStore* local_impi_store = NULL;
 std::vector<ImpiStore*> remote_impi_stores;
 RalfProcessor* ralf_processor = NULL;
@@ -1453,8 +1804,13 @@ ExceptionHandler* exception_handler = NULL;
 AlarmManager* alarm_manager = NULL;
 AnalyticsLogger* analytics_logger = NULL;
 ChronosConnection* chronos_connection = NULL;
+ChronosTimerBatcher* chronos_timer_batcher = NULL;
 SIFCService* sifc_service = NULL;
 FIFCService* fifc_service = NULL;
+AoRCache* aor_cache = NULL;
+HSSCache* hss_cache = NULL;
+AsyncWorkPool* async_work_pool = NULL;
+AsyncWorkPool* async_dns_pool = NULL;
 
 int create_astaire_stores(struct options opt,
                           AstaireResolver*& astaire_resolver,
@@ -1555,13 +1911,22 @@ int create_astaire_stores(struct options opt,
     return 1;
   }
 
-  local_aor_store = new AstaireAoRStore(local_data_store);
+  AstaireAoRStore::SerializationFormat aor_format = opt.aor_binary_format ?
+                                                      AstaireAoRStore::BINARY :
+                                                      AstaireAoRStore::JSON;
+  local_aor_store = new AstaireAoRStore(local_data_store,
+                                        aor_cache,
+                                        aor_format,
+                                        opt.aor_delta_writes);
 
   for (std::vector<Store*>::iterator it = remote_data_stores.begin();
        it != remote_data_stores.end();
        ++it)
   {
-    AoRStore* remote_aor_store = new AstaireAoRStore(*it);
+    AoRStore* remote_aor_store = new AstaireAoRStore(*it,
+                                                     NULL,
+                                                     aor_format,
+                                                     opt.aor_delta_writes);
     remote_aor_stores.push_back(remote_aor_store);
   }
 
@@ -1713,6 +2078,7 @@ int main(int argc, char* argv[])
   opt.default_session_expires = 10 * 60;
   opt.max_session_expires = 10 * 60;
   opt.worker_threads = 1;
+  opt.pjsip_threads = 1;
   opt.analytics_enabled = PJ_FALSE;
   opt.http_address = "127.0.0.1";
   opt.http_port = 9888;
@@ -1761,6 +2127,25 @@ int main(int argc, char* argv[])
   opt.homestead_timeout = 750;
   opt.enable_orig_sip_to_tel_coerce = false;
   opt.request_on_queue_timeout = 4000;
+  opt.sharded_worker_queues = false;
+  opt.deferred_rx_parse = false;
+  opt.predictive_queue_reject = false;
+  opt.fair_queueing = false;
+  opt.max_queue_depth_per_source = 0;
+  opt.method_aware_priorities = false;
+  opt.regex_cache_size = RegexCache::DEFAULT_MAX_ENTRIES;
+  opt.aor_cache_ttl_ms = 0;
+  opt.aor_cache_max_kb = 65536;
+  opt.aor_binary_format = false;
+  opt.aor_delta_writes = false;
+  opt.remote_write_threads = 0;
+  opt.remote_write_queue = AoRReplicator::DEFAULT_MAX_QUEUE;
+  opt.chronos_batch_window_ms = 0;
+  opt.hss_cache_ttl_ms = 0;
+  opt.hss_cache_max_kb = 65536;
+  opt.async_http_threads = 0;
+  opt.skip_local_sproutlet_selection_logs = false;
+  opt.async_dns_threads = 0;
 
   status = init_logging_options(argc, argv, &opt);
 
@@ -1915,6 +2300,18 @@ int main(int argc, char* argv[])
     TRC_WARNING("Both ENUM server and ENUM file lookup enabled - ignoring ENUM file");
   }
 
+  if ((!opt.message_priority_levels.empty()) &&
+      (!opt.method_aware_priorities))
+  {
+    TRC_WARNING("Message priority levels configured without --method-aware-priorities, ignoring");
+  }
+
+  if ((!opt.fair_queueing_weights.empty()) &&
+      (!opt.fair_queueing))
+  {
+    TRC_WARNING("Fair queueing weights configured without --fair-queueing, ignoring");
+  }
+
 
 
   // Ensure our random numbers are unpredictable.
@@ -1937,6 +2334,14 @@ int main(int argc, char* argv[])
   SNMP::EventAccumulatorByScopeTable* queue_size_table;
   SNMP::CounterByScopeTable* requests_counter;
   SNMP::CounterByScopeTable* overload_counter;
+  SNMP::CounterByScopeTable* queue_wait_reject_counter;
+  // Fair queueing statistics.  These are totals across all sources, not
+  // broken down by source: the depth of the sending node's queue, sampled as
+  // each message is queued, and the number of requests rejected because
+  // their node's queue was full.
+  SNMP::EventAccumulatorByScopeTable* source_queue_depth_table;
+  SNMP::CounterByScopeTable* source_reject_counter;
+  std::vector<SNMP::EventAccumulatorByScopeTable*> class_latency_tables;
 
   SNMP::IPCountTable* homestead_cxn_count = NULL;
 
@@ -1946,6 +2351,19 @@ int main(int argc, char* argv[])
   SNMP::EventAccumulatorTable* homestead_uar_latency_table = NULL;
   SNMP::EventAccumulatorTable* homestead_lir_latency_table = NULL;
   SNMP::CounterTable* no_shared_ifcs_set_table = NULL;
+  SNMP::CounterTable* regex_cache_hits_table = NULL;
+  SNMP::CounterTable* regex_cache_misses_table = NULL;
+  SNMP::CounterTable* regex_cache_evictions_table = NULL;
+  SNMP::CounterTable* aor_cache_hits_table = NULL;
+  SNMP::CounterTable* aor_cache_misses_table = NULL;
+  SNMP::CounterTable* aor_cache_stale_table = NULL;
+  SNMP::EventAccumulatorTable* chronos_batch_size_table = NULL;
+  SNMP::EventAccumulatorTable* chronos_batch_delay_table = NULL;
+  SNMP::CounterTable* hss_cache_hits_table = NULL;
+  SNMP::CounterTable* hss_cache_misses_table = NULL;
+  SNMP::U32Scalar* hss_cache_kb_scalar = NULL;
+  SNMP::CounterTable* hss_coalesced_table = NULL;
+  SNMP::EventAccumulatorTable* fork_latency_table = NULL;
 
   SNMP::ContinuousAccumulatorByScopeTable* token_rate_table = NULL;
   SNMP::ScalarByScopeTable* smoothed_latency_scalar = NULL;
@@ -1963,6 +2381,12 @@ int main(int argc, char* argv[])
                                                          ".1.2.826.0.1.1578918.9.2.4");
     overload_counter = SNMP::CounterByScopeTable::create("bono_rejected_overload",
                                                          ".1.2.826.0.1.1578918.9.2.5");
+    queue_wait_reject_counter = SNMP::CounterByScopeTable::create("bono_rejected_queue_wait",
+                                                                  ".1.2.826.0.1.1578918.9.2.7");
+    source_queue_depth_table = SNMP::EventAccumulatorByScopeTable::create("bono_source_queue_size",
+                                                                          ".1.2.826.0.1.1578918.9.2.8");
+    source_reject_counter = SNMP::CounterByScopeTable::create("bono_rejected_source_queue_full",
+                                                              ".1.2.826.0.1.1578918.9.2.9");
   }
   else
   {
@@ -1974,6 +2398,12 @@ int main(int argc, char* argv[])
                                                          ".1.2.826.0.1.1578918.9.3.6");
     overload_counter = SNMP::CounterByScopeTable::create("sprout_rejected_overload",
                                                          ".1.2.826.0.1.1578918.9.3.7");
+    queue_wait_reject_counter = SNMP::CounterByScopeTable::create("sprout_rejected_queue_wait",
+                                                                  ".1.2.826.0.1.1578918.9.3.43");
+    source_queue_depth_table = SNMP::EventAccumulatorByScopeTable::create("sprout_source_queue_size",
+                                                                          ".1.2.826.0.1.1578918.9.3.44");
+    source_reject_counter = SNMP::CounterByScopeTable::create("sprout_rejected_source_queue_full",
+                                                              ".1.2.826.0.1.1578918.9.3.45");
 
     homestead_cxn_count = SNMP::IPCountTable::create("sprout_homestead_cxn_count",
                                                      ".1.2.826.0.1.1578918.9.3.3.1");
@@ -1989,6 +2419,32 @@ int main(int argc, char* argv[])
                                                                  ".1.2.826.0.1.1578918.9.3.3.6");
     no_shared_ifcs_set_table = SNMP::CounterTable::create("no_shared_ifcs_set",
                                                           ".1.2.826.0.1.1578918.9.3.40");
+    regex_cache_hits_table = SNMP::CounterTable::create("sprout_regex_cache_hits",
+                                                        ".1.2.826.0.1.1578918.9.3.47");
+    regex_cache_misses_table = SNMP::CounterTable::create("sprout_regex_cache_misses",
+                                                          ".1.2.826.0.1.1578918.9.3.48");
+    regex_cache_evictions_table = SNMP::CounterTable::create("sprout_regex_cache_evictions",
+                                                             ".1.2.826.0.1.1578918.9.3.49");
+    aor_cache_hits_table = SNMP::CounterTable::create("sprout_aor_cache_hits",
+                                                      ".1.2.826.0.1.1578918.9.3.50");
+    aor_cache_misses_table = SNMP::CounterTable::create("sprout_aor_cache_misses",
+                                                        ".1.2.826.0.1.1578918.9.3.51");
+    aor_cache_stale_table = SNMP::CounterTable::create("sprout_aor_cache_stale",
+                                                       ".1.2.826.0.1.1578918.9.3.52");
+    chronos_batch_size_table = SNMP::EventAccumulatorTable::create("sprout_chronos_timer_batch_size",
+                                                                   ".1.2.826.0.1.1578918.9.3.56");
+    chronos_batch_delay_table = SNMP::EventAccumulatorTable::create("sprout_chronos_timer_batch_delay",
+                                                                    ".1.2.826.0.1.1578918.9.3.57");
+    hss_cache_hits_table = SNMP::CounterTable::create("sprout_hss_cache_hits",
+                                                      ".1.2.826.0.1.1578918.9.3.58");
+    hss_cache_misses_table = SNMP::CounterTable::create("sprout_hss_cache_misses",
+                                                        ".1.2.826.0.1.1578918.9.3.59");
+    hss_cache_kb_scalar = new SNMP::U32Scalar("sprout_hss_cache_kb",
+                                              ".1.2.826.0.1.1578918.9.3.60");
+    hss_coalesced_table = SNMP::CounterTable::create("sprout_hss_coalesced_requests",
+                                                     ".1.2.826.0.1.1578918.9.3.61");
+    fork_latency_table = SNMP::EventAccumulatorTable::create("sprout_fork_latency",
+                                                             ".1.2.826.0.1.1578918.9.3.64");
     token_rate_table = SNMP::ContinuousAccumulatorByScopeTable::create("sprout_token_rate",
                                                                        ".1.2.826.0.1.1578918.9.3.27");
     smoothed_latency_scalar = SNMP::ScalarByScopeTable::create("sprout_smoothed_latency",
@@ -2001,6 +2457,27 @@ int main(int argc, char* argv[])
                                                          ".1.2.826.0.1.1578918.9.3.31");
   }
 
+  // Create a latency table for each class of message the thread dispatcher
+  // prioritises.
+  for (int ii = 0; ii < SipMessageClass::NUM_CLASSES; ++ii)
+  {
+    std::string table_name = std::string(opt.pcscf_enabled ? "bono" : "sprout") +
+                             "_latency_" + SIP_MESSAGE_CLASS_NAMES[ii];
+    std::string table_oid = std::string(opt.pcscf_enabled ?
+                                          ".1.2.826.0.1.1578918.9.2.10." :
+                                          ".1.2.826.0.1.1578918.9.3.46.") +
+                            std::to_string(ii + 1);
+    class_latency_tables.push_back(
+               SNMP::EventAccumulatorByScopeTable::create(table_name, table_oid));
+  }
+
+  // Size the process-wide regex cache, before anything that compiles regexes
+  // from configuration is created.
+  RegexCache::instance()->configure(opt.regex_cache_size,
+                                    regex_cache_hits_table,
+                                    regex_cache_misses_table,
+                                    regex_cache_evictions_table);
+
   // Create Sprout's alarm objects.
   alarm_manager = new AlarmManager();
 
@@ -2087,7 +2564,8 @@ int main(int argc, char* argv[])
                       quiescing_mgr,
                       opt.billing_cdf,
                       sproutlet_uris,
-                      opt.enable_orig_sip_to_tel_coerce);
+                      opt.enable_orig_sip_to_tel_coerce,
+                      opt.pjsip_threads);
 
   if (status != PJ_SUCCESS)
   {
@@ -2139,6 +2617,17 @@ int main(int argc, char* argv[])
 
   if (opt.hss_server != "")
   {
+    if (opt.hss_cache_ttl_ms > 0)
+    {
+      TRC_STATUS("Caching subscriber data for %dms, up to %dkB",
+                 opt.hss_cache_ttl_ms, opt.hss_cache_max_kb);
+      hss_cache = new HSSCache(opt.hss_cache_ttl_ms,
+                               (size_t)opt.hss_cache_max_kb * 1024,
+                               hss_cache_hits_table,
+                               hss_cache_misses_table,
+                               hss_cache_kb_scalar);
+    }
+
     // Create a connection to the HSS.
     TRC_STATUS("Creating connection to HSS %s with HTTP timeout %d",
                opt.hss_server.c_str(), opt.homestead_timeout);
@@ -2158,7 +2647,9 @@ int main(int argc, char* argv[])
                                        homestead_lir_latency_table,
                                        hss_comm_monitor,
                                        sifc_service,
-                                       opt.homestead_timeout);
+                                       opt.homestead_timeout,
+                                       hss_cache,
+                                       hss_coalesced_table);
   }
 
   // Create FIFC service
@@ -2238,6 +2729,17 @@ int main(int argc, char* argv[])
                     (ACRFactory*)new RalfACRFactory(ralf_processor, ACR::SCSCF) :
                     new ACRFactory();
 
+  if (opt.aor_cache_ttl_ms > 0)
+  {
+    TRC_STATUS("Caching registration data for %dms, up to %dkB",
+               opt.aor_cache_ttl_ms, opt.aor_cache_max_kb);
+    aor_cache = new AoRCache(opt.aor_cache_ttl_ms,
+                             (size_t)opt.aor_cache_max_kb * 1024,
+                             aor_cache_hits_table,
+                             aor_cache_misses_table,
+                             aor_cache_stale_table);
+  }
+
   // Create the SDM and IMPI stores
   int rc = create_astaire_stores(opt,
                                  astaire_resolver,
@@ -2248,12 +2750,24 @@ int main(int argc, char* argv[])
     return rc;
   }
 
+  // If configured, send the local SDM's timers to Chronos in batches.
+  if (opt.chronos_batch_window_ms > 0)
+  {
+    chronos_timer_batcher = new ChronosTimerBatcher(chronos_connection,
+                                                    local_aor_store,
+                                                    opt.chronos_batch_window_ms,
+                                                    chronos_batch_size_table,
+                                                    chronos_batch_delay_table,
+                                                    exception_handler);
+  }
+
   // Use the AOR stores we've create to create the local (and optionally remote)
   // SDMs.
   local_sdm = new SubscriberDataManager(local_aor_store,
                                         chronos_connection,
                                         analytics_logger,
-                                        true);
+                                        true,
+                                        chronos_timer_batcher);
 
   for (std::vector<AoRStore*>::iterator it = remote_aor_stores.begin();
        it != remote_aor_stores.end();
@@ -2266,6 +2780,38 @@ int main(int argc, char* argv[])
     remote_sdms.push_back(remote_sdm);
   }
 
+  // If configured, write to the remote SDMs on a separate pool of threads,
+  // with statistics for each remote site.
+  std::vector<AoRReplicator::SiteStats> remote_site_stats;
+  SNMP::CounterTable* remote_write_dropped_table = NULL;
+
+  if ((opt.remote_write_threads > 0) && (!remote_sdms.empty()))
+  {
+    for (size_t ii = 0; ii < remote_sdms.size(); ++ii)
+    {
+      std::string site = std::to_string(ii + 1);
+      AoRReplicator::SiteStats stats;
+      stats.lag_tbl = SNMP::EventAccumulatorTable::create(
+                        "sprout_remote_site_" + site + "_replication_lag",
+                        ".1.2.826.0.1.1578918.9.3.53." + site);
+      stats.failures_tbl = SNMP::CounterTable::create(
+                        "sprout_remote_site_" + site + "_replication_failures",
+                        ".1.2.826.0.1.1578918.9.3.54." + site);
+      remote_site_stats.push_back(stats);
+    }
+
+    remote_write_dropped_table = SNMP::CounterTable::create(
+                                        "sprout_remote_writes_dropped",
+                                        ".1.2.826.0.1.1578918.9.3.55");
+
+    aor_replicator = new AoRReplicator(remote_sdms,
+                                       remote_site_stats,
+                                       remote_write_dropped_table,
+                                       exception_handler,
+                                       opt.remote_write_threads,
+                                       opt.remote_write_queue);
+  }
+
   // Start the HTTP stack early as plugins might need to register handlers
   // with it.
   HttpStack* http_stack_sig = new HttpStack(opt.http_threads,
@@ -2333,13 +2879,33 @@ int main(int argc, char* argv[])
     host_aliases.insert(stack_data.aliases.begin(),
                         stack_data.aliases.end());
 
+    if (opt.async_http_threads > 0)
+    {
+      TRC_STATUS("Running blocking HTTP requests on %d threads",
+                 opt.async_http_threads);
+      async_work_pool = new AsyncWorkPool(exception_handler,
+                                          opt.async_http_threads);
+    }
+
+    if (opt.async_dns_threads > 0)
+    {
+      TRC_STATUS("Resolving next hops of forwarded requests on %d threads",
+                 opt.async_dns_threads);
+      async_dns_pool = new AsyncWorkPool(exception_handler,
+                                         opt.async_dns_threads);
+    }
+
     sproutlet_proxy = new SproutletProxy(stack_data.endpt,
                                          PJSIP_MOD_PRIORITY_UA_PROXY_LAYER+3,
                                          opt.sprout_hostname,
                                          host_aliases,
                                          sproutlets,
                                          opt.stateless_proxies,
-                                         opt.max_sproutlet_depth);
+                                         opt.max_sproutlet_depth,
+                                         async_work_pool,
+                                         !opt.skip_local_sproutlet_selection_logs,
+                                         async_dns_pool,
+                                         fork_latency_table);
     if (sproutlet_proxy == NULL)
     {
       TRC_ERROR("Failed to create SproutletProxy. Aborting startup");
@@ -2350,13 +2916,40 @@ int main(int argc, char* argv[])
   init_common_sip_processing(requests_counter,
                              hc);
 
+  // Work out the priority level of each message class.  An empty table
+  // leaves the dispatcher with its default of only prioritising OPTIONS.
+  std::vector<int> message_priorities;
+  if (opt.method_aware_priorities)
+  {
+    message_priorities.assign(METHOD_AWARE_MESSAGE_PRIORITIES,
+                              METHOD_AWARE_MESSAGE_PRIORITIES + SipMessageClass::NUM_CLASSES);
+
+    for (std::map<int, int>::const_iterator it = opt.message_priority_levels.begin();
+         it != opt.message_priority_levels.end();
+         ++it)
+    {
+      message_priorities[it->first] = it->second;
+    }
+  }
+
   init_thread_dispatcher(opt.worker_threads,
                          latency_table,
                          queue_size_table,
                          overload_counter,
                          load_monitor,
                          exception_handler,
-                         opt.request_on_queue_timeout);
+                         opt.request_on_queue_timeout,
+                         opt.sharded_worker_queues,
+                         opt.deferred_rx_parse,
+                         opt.predictive_queue_reject,
+                         queue_wait_reject_counter,
+                         opt.fair_queueing,
+                         opt.max_queue_depth_per_source,
+                         source_queue_depth_table,
+                         source_reject_counter,
+                         message_priorities,
+                         class_latency_tables,
+                         opt.fair_queueing_weights);
 
   // Create worker threads first as they take work from the PJSIP threads so
   // need to be ready.
@@ -2391,11 +2984,15 @@ int main(int argc, char* argv[])
                                                                     NULL),
                                                    sip_resolver,
                                                    local_impi_store,
-                                                   remote_impi_stores);
+                                                   remote_impi_stores,
+                                                   aor_replicator);
   PushProfileTask::Config push_profile_config(local_sdm,
                                               remote_sdms,
-                                              hss_connection);
+                                              hss_connection,
+                                              aor_replicator);
   GetCachedDataTask::Config get_cached_data_config(local_sdm, remote_sdms);
+  GetTsxArenaStatsTask::Config tsx_arena_stats_config(
+                  (sproutlet_proxy != NULL) ? sproutlet_proxy->arena_stats() : NULL);
   DeleteImpuTask::Config delete_impu_config(local_sdm,
                                             remote_sdms,
                                             hss_connection,
@@ -2408,7 +3005,8 @@ int main(int argc, char* argv[])
 
   AoRTimeoutTask::Config aor_timeout_config(local_sdm,
                                             remote_sdms,
-                                            hss_connection);
+                                            hss_connection,
+                                            aor_replicator);
   AuthTimeoutTask::Config auth_timeout_config(local_impi_store,
                                               hss_connection);
 
@@ -2420,6 +3018,7 @@ int main(int argc, char* argv[])
   HttpStackUtils::SpawningHandler<GetBindingsTask, GetCachedDataTask::Config> get_bindings_handler(&get_cached_data_config);
   HttpStackUtils::SpawningHandler<GetSubscriptionsTask, GetCachedDataTask::Config> get_subscriptions_handler(&get_cached_data_config);
   HttpStackUtils::SpawningHandler<DeleteImpuTask, DeleteImpuTask::Config> delete_impu_handler(&delete_impu_config);
+  HttpStackUtils::SpawningHandler<GetTsxArenaStatsTask, GetTsxArenaStatsTask::Config> tsx_arena_stats_handler(&tsx_arena_stats_config);
 
   if (opt.enabled_scscf)
   {
@@ -2455,6 +3054,8 @@ int main(int argc, char* argv[])
                                         &get_subscriptions_handler);
       http_stack_mgmt->register_handler("^/impu/[^/]+$",
                                         &delete_impu_handler);
+      http_stack_mgmt->register_handler("^/tsx-arenas$",
+                                        &tsx_arena_stats_handler);
       http_stack_mgmt->bind_unix_socket(SPROUT_HTTP_MGMT_SOCKET_PATH);
       http_stack_mgmt->start(&reg_httpthread_with_pjsip);
     }
@@ -2510,6 +3111,12 @@ int main(int argc, char* argv[])
   // rx_msg_q will stop getting serviced so could fill up blocking
   // the PJSIP thread, causing a deadlock.
   stop_pjsip_thread();
+
+  // Wait for any outstanding blocking work, so its callbacks are queued to
+  // the worker threads before they stop.
+  delete async_work_pool; async_work_pool = NULL;
+  delete async_dns_pool; async_dns_pool = NULL;
+
   stop_worker_threads();
 
   // We must call stop_stack here because this terminates the
@@ -2542,15 +3149,19 @@ int main(int argc, char* argv[])
 
   delete http_stack_sig; http_stack_sig = NULL;
   delete http_stack_mgmt; http_stack_mgmt = NULL;
+  delete chronos_timer_batcher; chronos_timer_batcher = NULL;
   delete chronos_connection;
   delete hss_connection;
+  delete hss_cache;
   delete fifc_service;
   delete sifc_service;
   delete quiescing_mgr;
+  delete aor_replicator; aor_replicator = NULL;
   delete exception_handler;
   delete load_monitor;
   delete local_sdm;
   delete local_aor_store;
+  delete aor_cache;
   delete local_data_store;
 
   for (std::vector<SubscriberDataManager*>::iterator it = remote_sdms.begin();
@@ -2611,6 +3222,14 @@ int main(int argc, char* argv[])
   delete queue_size_table;
   delete requests_counter;
   delete overload_counter;
+  delete queue_wait_reject_counter;
+  delete source_queue_depth_table;
+  delete source_reject_counter;
+
+  for (size_t ii = 0; ii < class_latency_tables.size(); ++ii)
+  {
+    delete class_latency_tables[ii];
+  }
 
   delete homestead_cxn_count;
 
@@ -2621,6 +3240,31 @@ int main(int argc, char* argv[])
   delete homestead_lir_latency_table;
   delete no_shared_ifcs_set_table;
 
+  // The regex cache outlives main, so stop it using its statistics tables
+  // before they are deleted.
+  RegexCache::instance()->configure(opt.regex_cache_size, NULL, NULL, NULL);
+  delete regex_cache_hits_table;
+  delete regex_cache_misses_table;
+  delete regex_cache_evictions_table;
+  delete aor_cache_hits_table;
+  delete aor_cache_misses_table;
+  delete aor_cache_stale_table;
+  delete chronos_batch_size_table;
+  delete chronos_batch_delay_table;
+  delete hss_cache_hits_table;
+  delete hss_cache_misses_table;
+  delete hss_cache_kb_scalar;
+  delete hss_coalesced_table;
+  delete fork_latency_table;
+  delete remote_write_dropped_table;
+
+  for (AoRReplicator::SiteStats& stats : remote_site_stats)
+  {
+    delete stats.lag_tbl;
+    delete stats.failures_tbl;
+  }
+  remote_site_stats.clear();
+
   delete token_rate_table;
   delete smoothed_latency_scalar;
   delete target_latency_scalar;
@@ -950,17 +950,18 @@ void PJUtils::resolve(const std::string& name,
 }
 
 
-/// Resolves the next hop target of the SIP message.
-BaseAddrIterator* PJUtils::resolve_next_hop_iter(pjsip_tx_data* tdata,
-                                                 int allowed_host_state,
-                                                 SAS::TrailId trail)
+/// Parses the destination, port and transport to resolve out of the next hop
+/// URI of the SIP message.  The port is zero and the transport -1 if the URI
+/// doesn't specify them.
+void PJUtils::get_next_hop_target(pjsip_tx_data* tdata,
+                                  std::string& name,
+                                  int& port,
+                                  int& transport)
 {
-  // Get the next hop URI from the message and parse out the destination, port
-  // and transport.
   pjsip_sip_uri* next_hop = (pjsip_sip_uri*)PJUtils::next_hop(tdata->msg);
-  std::string name = std::string(next_hop->host.ptr, next_hop->host.slen);
-  int port = next_hop->port;
-  int transport = -1;
+  name = std::string(next_hop->host.ptr, next_hop->host.slen);
+  port = next_hop->port;
+  transport = -1;
   if (pj_stricmp2(&next_hop->transport_param, "TCP") == 0)
   {
     transport = IPPROTO_TCP;
@@ -969,6 +970,20 @@ BaseAddrIterator* PJUtils::resolve_next_hop_iter(pjsip_tx_data* tdata,
   {
     transport = IPPROTO_UDP;
   }
+}
+
+
+/// Resolves the next hop target of the SIP message.
+BaseAddrIterator* PJUtils::resolve_next_hop_iter(pjsip_tx_data* tdata,
+                                                 int allowed_host_state,
+                                                 SAS::TrailId trail)
+{
+  // Get the next hop URI from the message and parse out the destination, port
+  // and transport.
+  std::string name;
+  int port;
+  int transport;
+  get_next_hop_target(tdata, name, port, transport);
 
   BaseAddrIterator* targets_iter = stack_data.sipresolver->resolve_iter(name,
                                                                         stack_data.addr_family,
@@ -979,7 +994,7 @@ BaseAddrIterator* PJUtils::resolve_next_hop_iter(pjsip_tx_data* tdata,
 
   TRC_INFO("Resolved destination URI %s",
            PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
-                                  (pjsip_uri*)next_hop).c_str());
+                                  PJUtils::next_hop(tdata->msg)).c_str());
 
   return targets_iter;
 }
@@ -1650,6 +1665,85 @@ pjsip_tx_data* PJUtils::clone_tdata(pjsip_tx_data* tdata)
   return cloned_tdata;
 }
 
+pj_status_t PJUtils::clone_rx_data_unparsed(pjsip_rx_data* src,
+                                            pjsip_rx_data** p_rdata)
+{
+  pj_pool_t* pool = pj_pool_create(src->tp_info.pool->factory,
+                                   "rtd%p",
+                                   PJSIP_POOL_RDATA_LEN,
+                                   PJSIP_POOL_RDATA_INC,
+                                   NULL);
+  if (pool == NULL)
+  {
+    return PJ_ENOMEM; // LCOV_EXCL_LINE
+  }
+
+  pjsip_rx_data* dst = PJ_POOL_ZALLOC_T(pool, pjsip_rx_data);
+  dst->tp_info.pool = pool;
+  dst->tp_info.transport = src->tp_info.transport;
+  pjsip_transport_add_ref(dst->tp_info.transport);
+
+  // Only copy the bytes of this message.  For stream transports the receive
+  // buffer may also hold the start of the next message.
+  const char* msg_buf = (src->msg_info.msg_buf != NULL) ?
+                          src->msg_info.msg_buf : src->pkt_info.packet;
+  pj_ssize_t len = (src->msg_info.msg_buf != NULL) ?
+                     src->msg_info.len : src->pkt_info.len;
+
+  dst->pkt_info.timestamp = src->pkt_info.timestamp;
+  dst->pkt_info.packet = (char*)pj_pool_alloc(pool, len + 1);
+  pj_memcpy(dst->pkt_info.packet, msg_buf, len);
+  dst->pkt_info.packet[len] = '\0';
+  dst->pkt_info.len = len;
+  dst->pkt_info.src_addr = src->pkt_info.src_addr;
+  dst->pkt_info.src_addr_len = src->pkt_info.src_addr_len;
+  pj_memcpy(dst->pkt_info.src_name,
+            src->pkt_info.src_name,
+            sizeof(dst->pkt_info.src_name));
+  dst->pkt_info.src_port = src->pkt_info.src_port;
+
+  // Carry across any module data, such as the SAS trail.
+  dst->endpt_info = src->endpt_info;
+
+  *p_rdata = dst;
+
+  return PJ_SUCCESS;
+}
+
+pj_status_t PJUtils::parse_rx_data_clone(pjsip_rx_data* rdata)
+{
+  rdata->msg_info.msg_buf = rdata->pkt_info.packet;
+  rdata->msg_info.len = rdata->pkt_info.len;
+  pj_list_init(&rdata->msg_info.parse_err);
+
+  pjsip_msg* msg = pjsip_parse_rdata(rdata->pkt_info.packet,
+                                     rdata->pkt_info.len,
+                                     rdata);
+  rdata->msg_info.msg = msg;
+
+  if ((msg == NULL) ||
+      (!pj_list_empty(&rdata->msg_info.parse_err)) ||
+      (rdata->msg_info.via == NULL))
+  {
+    return PJSIP_EINVALIDMSG;
+  }
+
+  if (msg->type == PJSIP_REQUEST_MSG)
+  {
+    // Match what the transport manager does when it first parses a request.
+    pj_strdup2(rdata->tp_info.pool,
+               &rdata->msg_info.via->recvd_param,
+               rdata->pkt_info.src_name);
+
+    if (rdata->msg_info.via->rport_param == 0)
+    {
+      rdata->msg_info.via->rport_param = rdata->pkt_info.src_port;
+    }
+  }
+
+  return PJ_SUCCESS;
+}
+
 pjsip_via_hdr* PJUtils::add_top_via(pjsip_tx_data* tdata)
 {
   // Add a new Via header with a unique branch identifier.
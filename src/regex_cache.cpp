@@ -0,0 +1,135 @@
+/**
+ * @file regex_cache.cpp A process-wide cache of compiled regular expressions.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "regex_cache.h"
+
+RegexCache::RegexCache(size_t max_entries,
+                       SNMP::CounterTable* hits_tbl,
+                       SNMP::CounterTable* misses_tbl,
+                       SNMP::CounterTable* evictions_tbl) :
+  _max_entries(max_entries),
+  _entries(),
+  _index(),
+  _hits_tbl(hits_tbl),
+  _misses_tbl(misses_tbl),
+  _evictions_tbl(evictions_tbl)
+{
+  pthread_mutex_init(&_lock, NULL);
+}
+
+RegexCache::~RegexCache()
+{
+  pthread_mutex_destroy(&_lock);
+}
+
+RegexCache* RegexCache::instance()
+{
+  static RegexCache cache(DEFAULT_MAX_ENTRIES);
+  return &cache;
+}
+
+void RegexCache::configure(size_t max_entries,
+                           SNMP::CounterTable* hits_tbl,
+                           SNMP::CounterTable* misses_tbl,
+                           SNMP::CounterTable* evictions_tbl)
+{
+  pthread_mutex_lock(&_lock);
+  _max_entries = max_entries;
+  _hits_tbl = hits_tbl;
+  _misses_tbl = misses_tbl;
+  _evictions_tbl = evictions_tbl;
+  evict_excess();
+  pthread_mutex_unlock(&_lock);
+
+  TRC_STATUS("Regex cache holds up to %lu regular expressions", max_entries);
+}
+
+size_t RegexCache::size()
+{
+  pthread_mutex_lock(&_lock);
+  size_t size = _entries.size();
+  pthread_mutex_unlock(&_lock);
+  return size;
+}
+
+std::string RegexCache::make_key(const std::string& pattern,
+                                 boost::regex::flag_type flags)
+{
+  return std::to_string((unsigned int)flags) + ":" + pattern;
+}
+
+boost::regex RegexCache::get(const std::string& pattern,
+                             boost::regex::flag_type flags)
+{
+  std::string key = make_key(pattern, flags);
+
+  pthread_mutex_lock(&_lock);
+
+  std::unordered_map<std::string, EntryList::iterator>::iterator it = _index.find(key);
+  if (it != _index.end())
+  {
+    // Move the entry to the front of the list, as the most recently used.
+    _entries.splice(_entries.begin(), _entries, it->second);
+    boost::regex regex = it->second->second;
+    SNMP::CounterTable* hits_tbl = _hits_tbl;
+    pthread_mutex_unlock(&_lock);
+
+    if (hits_tbl != NULL)
+    {
+      hits_tbl->increment();
+    }
+
+    return regex;
+  }
+
+  SNMP::CounterTable* misses_tbl = _misses_tbl;
+  pthread_mutex_unlock(&_lock);
+
+  if (misses_tbl != NULL)
+  {
+    misses_tbl->increment();
+  }
+
+  // Compile the regex without holding the lock.  This throws if the regex is
+  // invalid and no_except isn't set, in which case nothing is cached.
+  boost::regex regex(pattern, flags);
+
+  pthread_mutex_lock(&_lock);
+
+  if ((_max_entries > 0) && (_index.find(key) == _index.end()))
+  {
+    _entries.push_front(Entry(key, regex));
+    _index[key] = _entries.begin();
+    evict_excess();
+  }
+
+  pthread_mutex_unlock(&_lock);
+
+  return regex;
+}
+
+// Evict the least recently used entries until the cache is within its size.
+// Must be called with the lock held.
+void RegexCache::evict_excess()
+{
+  while (_entries.size() > _max_entries)
+  {
+    TRC_DEBUG("Evicting regex %s from cache", _entries.back().first.c_str());
+    _index.erase(_entries.back().first);
+    _entries.pop_back();
+
+    if (_evictions_tbl != NULL)
+    {
+      _evictions_tbl->increment();
+    }
+  }
+}
@@ -60,10 +60,12 @@ RegistrarSproutlet::RegistrarSproutlet(const std::string& name,
                                        SNMP::RegistrationStatsTables* reg_stats_tbls,
                                        SNMP::RegistrationStatsTables* third_party_reg_stats_tbls,
                                        FIFCService* fifc_service,
-                                       IFCConfiguration ifc_configuration) :
+                                       IFCConfiguration ifc_configuration,
+                                       AoRReplicator* aor_replicator) :
   Sproutlet(name, port, uri, "", aliases, NULL, NULL, network_function),
   _sdm(reg_sdm),
   _remote_sdms(reg_remote_sdms),
+  _aor_replicator(aor_replicator),
   _hss(hss_connection),
   _acr_factory(rfacr_factory),
   _max_expires(cfg_max_expires),
@@ -85,7 +87,9 @@ bool RegistrarSproutlet::init()
 {
   bool init_success = true;
 
-  RegistrationUtils::init(_third_party_reg_stats_tbls, _force_original_register_inclusion);
+  RegistrationUtils::init(_third_party_reg_stats_tbls,
+                          _force_original_register_inclusion,
+                          _aor_replicator);
 
   // Construct a Service-Route header pointing at the S-CSCF ready to be added
   // to REGISTER 200 OK response.
@@ -483,27 +487,37 @@ void RegistrarSproutletTsx::process_register_request(pjsip_msg *req)
 
     // If we have any remote stores, try to store this in them too. We don't worry
     // about failures in this case.
-    for (std::vector<SubscriberDataManager*>::iterator it = _registrar->_remote_sdms.begin();
-         it != _registrar->_remote_sdms.end();
-         ++it)
+    if (_registrar->_aor_replicator != NULL)
     {
-      if ((*it)->has_servers())
+      _registrar->_aor_replicator->replicate(aor,
+                                             SubscriberDataManager::EventTrigger::USER,
+                                             aor_pair,
+                                             trail());
+    }
+    else
+    {
+      for (std::vector<SubscriberDataManager*>::iterator it = _registrar->_remote_sdms.begin();
+           it != _registrar->_remote_sdms.end();
+           ++it)
       {
-        int tmp_expiry = 0;
-        bool ignored;
-        AoRPair* remote_aor_pair = write_to_store(*it,
-                                                  aor,
-                                                  &(irs_info._associated_uris),
-                                                  req,
-                                                  now,
-                                                  tmp_expiry,
-                                                  false,
-                                                  ignored,
-                                                  aor_pair,
-                                                  {},
-                                                  private_id_for_binding,
-                                                  ignored);
-        delete remote_aor_pair;
+        if ((*it)->has_servers())
+        {
+          int tmp_expiry = 0;
+          bool ignored;
+          AoRPair* remote_aor_pair = write_to_store(*it,
+                                                    aor,
+                                                    &(irs_info._associated_uris),
+                                                    req,
+                                                    now,
+                                                    tmp_expiry,
+                                                    false,
+                                                    ignored,
+                                                    aor_pair,
+                                                    {},
+                                                    private_id_for_binding,
+                                                    ignored);
+          delete remote_aor_pair;
+        }
       }
     }
   }
@@ -30,11 +30,15 @@ extern "C" {
 #include "sproutsasevent.h"
 #include "snmp_success_fail_count_table.h"
 #include "hssconnection.h"
+#include "aor_replicator.h"
 
 #define MAX_SIP_MSG_SIZE 65535
 
 static SNMP::RegistrationStatsTables* third_party_reg_stats_tables;
 
+// Writes changes to the remote sites, if remote writes are asynchronous.
+static AoRReplicator* aor_replicator;
+
 // Should we always send the access-side REGISTER and 200 OK in the body
 // of third-party REGISTER messages to application servers, even if the
 // iFCs don't tell us to?
@@ -155,10 +159,12 @@ static void send_register_to_as(SubscriberDataManager* sdm,
                                 SAS::TrailId);
 
 void RegistrationUtils::init(SNMP::RegistrationStatsTables* third_party_reg_stats_tables_arg,
-                             bool force_third_party_register_body_arg)
+                             bool force_third_party_register_body_arg,
+                             AoRReplicator* aor_replicator_arg)
 {
   third_party_reg_stats_tables = third_party_reg_stats_tables_arg;
   force_third_party_register_body = force_third_party_register_body_arg;
+  aor_replicator = aor_replicator_arg;
 }
 
 void RegistrationUtils::interpret_ifcs(Ifcs& ifcs,
@@ -620,13 +626,16 @@ static void notify_application_servers()
   // TODO: implement as part of reg events package
 }
 
+// If written_aor_pair is given, it is set to the AoR that was written (which
+// the caller must delete), or NULL if the write failed.
 static bool expire_bindings(SubscriberDataManager *sdm,
                             const std::string& aor,
                             const SubscriberDataManager::EventTrigger& event_trigger,
                             AssociatedURIs* associated_uris,
                             const std::string& binding_id,
                             std::string& scscf_uri,
-                            SAS::TrailId trail)
+                            SAS::TrailId trail,
+                            AoRPair** written_aor_pair = NULL)
 {
   // We need the retry loop to handle the store's compare-and-swap.
   bool all_bindings_expired = false;
@@ -665,7 +674,16 @@ static bool expire_bindings(SubscriberDataManager *sdm,
                                aor_pair, 
                                trail, 
                                all_bindings_expired);
-    delete aor_pair; aor_pair = NULL;
+
+    if ((written_aor_pair != NULL) && (set_rc == Store::OK))
+    {
+      *written_aor_pair = aor_pair;
+    }
+    else
+    {
+      delete aor_pair;
+    }
+    aor_pair = NULL;
 
     // We can only say for sure that the bindings were expired if we were able
     // to update the store.
@@ -717,8 +735,16 @@ bool RegistrationUtils::remove_bindings(SubscriberDataManager* sdm,
   }
 
   std::string scscf_uri;
-
-  if (expire_bindings(sdm, aor, event_trigger, &(irs_info._associated_uris), binding_id, scscf_uri, trail))
+  AoRPair* aor_pair = NULL;
+
+  if (expire_bindings(sdm,
+                      aor,
+                      event_trigger,
+                      &(irs_info._associated_uris),
+                      binding_id,
+                      scscf_uri,
+                      trail,
+                      (aor_replicator != NULL) ? &aor_pair : NULL))
   {
     // All bindings have been expired, so do deregistration processing for the
     // IMPU.
@@ -755,18 +781,32 @@ bool RegistrationUtils::remove_bindings(SubscriberDataManager* sdm,
     }
   }
 
-  // Now go through the remote SDMs and remove bindings there too.  We don't
-  // make any effort to check whether the local and remote stores are in sync --
-  // we'll do this next time we get the data from the store and before we do
-  // anything with it.
-  for (std::vector<SubscriberDataManager*>::const_iterator remote_sdm =
-       remote_sdms.begin();
-       remote_sdm != remote_sdms.end();
-       ++remote_sdm)
+  if (aor_replicator != NULL)
   {
-    (void) expire_bindings(*remote_sdm, aor, event_trigger, &(irs_info._associated_uris), binding_id, scscf_uri, trail);
+    // Leave the replicator to write the change to the remote stores, after
+    // any changes to the AoR that it has already queued.
+    if (aor_pair != NULL)
+    {
+      aor_replicator->replicate(aor, event_trigger, aor_pair, trail);
+    }
+  }
+  else
+  {
+    // Now go through the remote SDMs and remove bindings there too.  We don't
+    // make any effort to check whether the local and remote stores are in
+    // sync -- we'll do this next time we get the data from the store and
+    // before we do anything with it.
+    for (std::vector<SubscriberDataManager*>::const_iterator remote_sdm =
+         remote_sdms.begin();
+         remote_sdm != remote_sdms.end();
+         ++remote_sdm)
+    {
+      (void) expire_bindings(*remote_sdm, aor, event_trigger, &(irs_info._associated_uris), binding_id, scscf_uri, trail);
+    }
   }
 
+  delete aor_pair; aor_pair = NULL;
+
   return all_bindings_expired;
 }
 
@@ -188,7 +188,8 @@ bool SCSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
                                                         hss_connection,
                                                         scscf_acr_factory,
                                                         analytics_logger,
-                                                        opt.sub_max_expires);
+                                                        opt.sub_max_expires,
+                                                        aor_replicator);
     ok = ok && _subscription_sproutlet->init();
     sproutlets.push_front(_subscription_sproutlet);
 
@@ -225,7 +226,8 @@ bool SCSCFPlugin::load(struct options& opt, std::list<Sproutlet*>& sproutlets)
                                                                    opt.reject_if_no_matching_ifcs,
                                                                    opt.dummy_app_server,
                                                                    _no_matching_ifcs_tbl,
-                                                                   _no_matching_fallback_ifcs_tbl));
+                                                                   _no_matching_fallback_ifcs_tbl),
+                                                  aor_replicator);
 
 
     ok = ok && _registrar_sproutlet->init();
@@ -306,21 +306,47 @@ long SCSCFSproutletTsx::read_hss_data(const HSSConnection::irs_query& irs_query,
 
   if (http_code == HTTP_OK)
   {
-    _ifcs = irs_info._service_profiles[irs_query._public_id];
-
-    // Get the default URI. This should always succeed.
-    irs_info._associated_uris.get_default_impu(_default_uri, true);
-
-    // We may want to route to bindings that are barred (in case of an
-    // emergency), so get all the URIs.
-    _registered = (irs_info._regstate == RegDataXMLUtils::STATE_REGISTERED);
-    _barred = irs_info._associated_uris.is_impu_barred(irs_query._public_id);
+    process_hss_data(irs_query, irs_info);
   }
 
   return http_code;
 }
 
 
+/// Store the fields needed from data read from the HSS.
+void SCSCFSproutletTsx::process_hss_data(const HSSConnection::irs_query& irs_query,
+                                         HSSConnection::irs_info& irs_info)
+{
+  _ifcs = irs_info._service_profiles[irs_query._public_id];
+
+  // Get the default URI. This should always succeed.
+  irs_info._associated_uris.get_default_impu(_default_uri, true);
+
+  // We may want to route to bindings that are barred (in case of an
+  // emergency), so get all the URIs.
+  _registered = (irs_info._regstate == RegDataXMLUtils::STATE_REGISTERED);
+  _barred = irs_info._associated_uris.is_impu_barred(irs_query._public_id);
+}
+
+
+SCSCFSproutletTsx::HssLookup::HssLookup(HSSConnection* hss,
+                                        const HSSConnection::irs_query& irs_query,
+                                        SAS::TrailId trail) :
+  _irs_query(irs_query),
+  _irs_info(),
+  _http_code(HTTP_SERVER_ERROR),
+  _hss(hss),
+  _trail(trail)
+{
+}
+
+
+void SCSCFSproutletTsx::HssLookup::run()
+{
+  _http_code = _hss->update_registration_state(_irs_query, _irs_info, _trail);
+}
+
+
 /// Attempt ENUM lookup if appropriate.
 void SCSCFSproutlet::translate_request_uri(pjsip_msg* req,
                                            pj_pool_t* pool,
@@ -403,6 +429,9 @@ SCSCFSproutletTsx::SCSCFSproutletTsx(SCSCFSproutlet* scscf,
   _barred(false),
   _default_uri(""),
   _ifcs(),
+  _async_hss_public_id(),
+  _async_hss_http_code(HTTP_OK),
+  _suspended_req(NULL),
   _in_dialog_acr(NULL),
   _failed_ood_acr(NULL),
   _target_aor(),
@@ -470,8 +499,6 @@ void SCSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
 {
   TRC_INFO("S-CSCF received initial request");
 
-  pjsip_status_code status_code = PJSIP_SC_OK;
-
   // Work out if we should be auto-registering the user based on this
   // request and if we are, also work out the IMPI to register them with.
   const pjsip_route_hdr* top_route = route_hdr();
@@ -517,11 +544,27 @@ void SCSCFSproutletTsx::on_rx_initial_request(pjsip_msg* req)
     }
   }
 
-  // Determine the session case and the served user.  This will link to
-  // an AsChain object (creating it if necessary), if we need to provide
-  // services.
+  // Determine the session case, and the AS chain if the request has come
+  // back from an application server.
+  retrieve_odi_and_sesscase(req);
+
+  if (read_hss_data_async(req))
+  {
+    // Processing continues in on_async_complete once the served user's data
+    // has been read.
+    return;
+  }
+
+  continue_initial_request(req);
+}
+
+
+void SCSCFSproutletTsx::continue_initial_request(pjsip_msg* req)
+{
+  // Determine the served user.  This will link to an AsChain object
+  // (creating it if necessary), if we need to provide services.
   // It will also set the S-CSCF URI
-  status_code = determine_served_user(req);
+  pjsip_status_code status_code = determine_served_user(req);
 
   // Pass the received request to the ACR.
   // @TODO - request timestamp???
@@ -998,6 +1041,53 @@ void SCSCFSproutletTsx::retrieve_odi_and_sesscase(pjsip_msg* req)
   }
 }
 
+void SCSCFSproutletTsx::calculate_scscf_uri(pjsip_msg* req)
+{
+  // Use the configured S-CSCF URI as a starting point.
+  pjsip_sip_uri* scscf_uri = (pjsip_sip_uri*)pjsip_uri_clone(get_pool(req), _scscf->_scscf_cluster_uri);
+  pjsip_sip_uri* routing_uri = get_routing_uri(req);
+  SCSCFUtils::get_scscf_uri(get_pool(req),
+                            get_local_hostname(routing_uri),
+                            get_local_hostname(scscf_uri),
+                            scscf_uri);
+  _scscf_uri = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, (pjsip_uri*)scscf_uri);
+}
+
+bool SCSCFSproutletTsx::read_hss_data_async(pjsip_msg* req)
+{
+  if (_as_chain_link.is_set())
+  {
+    // The request has come back from an application server.  We only need
+    // the HSS if the request has been retargeted, which is rare, so leave
+    // that to be read synchronously.
+    return false;
+  }
+
+  std::string served_user = served_user_from_msg(req);
+  if (served_user.empty())
+  {
+    // No served user, so no need for the HSS.
+    return false;
+  }
+
+  // The query needs the S-CSCF URI, so calculate it now.
+  calculate_scscf_uri(req);
+
+  HssLookup* lookup = new HssLookup(_scscf->_hss,
+                                    build_irs_query(served_user),
+                                    trail());
+  if (!run_async(lookup))
+  {
+    delete lookup; lookup = NULL;
+    return false;
+  }
+
+  TRC_DEBUG("Reading subscriber data for %s asynchronously",
+            served_user.c_str());
+  _suspended_req = req;
+  return true;
+}
+
 bool SCSCFSproutletTsx::is_retarget(std::string new_served_user)
 {
   std::string old_served_user = _as_chain_link.served_user();
@@ -1039,8 +1129,6 @@ pjsip_status_code SCSCFSproutletTsx::determine_served_user(pjsip_msg* req)
 {
   pjsip_status_code status_code = PJSIP_SC_OK;
 
-  retrieve_odi_and_sesscase(req);
-
   if (_as_chain_link.is_set())
   {
     // Set the S-CSCF URI to the one we stored in the AsChain
@@ -1215,14 +1303,8 @@ pjsip_status_code SCSCFSproutletTsx::determine_served_user(pjsip_msg* req)
       }
 
       // Before looking up the iFCs, calculate the S-CSCF URI to use for this
-      // transaction, using the configured S-CSCF URI as a starting point.
-      pjsip_sip_uri* scscf_uri = (pjsip_sip_uri*)pjsip_uri_clone(get_pool(req), _scscf->_scscf_cluster_uri);
-      pjsip_sip_uri* routing_uri = get_routing_uri(req);
-      SCSCFUtils::get_scscf_uri(get_pool(req),
-                                get_local_hostname(routing_uri),
-                                get_local_hostname(scscf_uri),
-                                scscf_uri);
-      _scscf_uri = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, (pjsip_uri*)scscf_uri);
+      // transaction.
+      calculate_scscf_uri(req);
 
       TRC_DEBUG("Looking up iFCs for %s for new AS chain", served_user.c_str());
 
@@ -1872,17 +1954,17 @@ long SCSCFSproutletTsx::get_data_from_hss(std::string public_id)
   long http_code = HTTP_OK;
 
   // Read IRS information from HSS if not previously cached.
-  if (!_hss_data_cached)
+  if ((!_hss_data_cached) &&
+      (public_id == _async_hss_public_id) &&
+      (_async_hss_http_code != HTTP_OK))
   {
-    HSSConnection::irs_query irs_query;
-    irs_query._public_id = public_id;
-    irs_query._private_id =_impi;
-    irs_query._req_type = _auto_reg ? HSSConnection::REG : HSSConnection::CALL;
-    irs_query._server_name = _scscf_uri;
-    irs_query._wildcard = _wildcard;
-    irs_query._cache_allowed = !_auto_reg;
-
-    http_code = read_hss_data(irs_query,
+    // We've already failed to read the data asynchronously, so don't try
+    // again.
+    http_code = _async_hss_http_code;
+  }
+  else if (!_hss_data_cached)
+  {
+    http_code = read_hss_data(build_irs_query(public_id),
                               _irs_info,
                               trail());
 
@@ -1896,6 +1978,20 @@ long SCSCFSproutletTsx::get_data_from_hss(std::string public_id)
 }
 
 
+/// Builds the query used to read a public ID's data from the HSS.
+HSSConnection::irs_query SCSCFSproutletTsx::build_irs_query(const std::string& public_id)
+{
+  HSSConnection::irs_query irs_query;
+  irs_query._public_id = public_id;
+  irs_query._private_id =_impi;
+  irs_query._req_type = _auto_reg ? HSSConnection::REG : HSSConnection::CALL;
+  irs_query._server_name = _scscf_uri;
+  irs_query._wildcard = _wildcard;
+  irs_query._cache_allowed = !_auto_reg;
+  return irs_query;
+}
+
+
 /// Look up the registration state for the given public ID, using the
 /// per-transaction cache, which will be present at this point
 bool SCSCFSproutletTsx::is_user_registered(std::string public_id)
@@ -2165,6 +2261,39 @@ void SCSCFSproutletTsx::on_timer_expiry(void* context)
   }
 }
 
+void SCSCFSproutletTsx::on_async_complete(AsyncWork* work)
+{
+  HssLookup* lookup = (HssLookup*)work;
+
+  // Store the data read from the HSS so that it's used when processing the
+  // request continues.
+  _async_hss_public_id = lookup->_irs_query._public_id;
+  _async_hss_http_code = lookup->_http_code;
+
+  if (lookup->_http_code == HTTP_OK)
+  {
+    _irs_info = lookup->_irs_info;
+    process_hss_data(lookup->_irs_query, _irs_info);
+    _hss_data_cached = true;
+  }
+
+  pjsip_msg* req = _suspended_req;
+  _suspended_req = NULL;
+
+  if (_cancelled)
+  {
+    // The transaction was cancelled while we were waiting for the HSS, so
+    // there's no point continuing.
+    TRC_DEBUG("Request cancelled while reading subscriber data");
+    pjsip_msg* rsp = create_response(req, PJSIP_SC_REQUEST_TERMINATED);
+    send_response(rsp);
+    free_msg(req);
+    return;
+  }
+
+  continue_initial_request(req);
+}
+
 /// Adds a second P-Asserted-Identity header to a message when required.
 ///
 /// We only add the header to messages for which all of the following is true:
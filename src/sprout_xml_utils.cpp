@@ -54,7 +54,7 @@ void get_identities_and_barring_status(rapidxml::xml_node<>* public_id,
   // non-distinct IMPU (an IMPU that is part of a wildcard range, but is
   // explicitly included in the XML), where the identity_uri is the
   // distinct IMPU, and the associated_uri is the wildcard IMPU.
-  identity_uri = std::string(identity->value());
+  identity_uri.assign(identity->value(), identity->value_size());
   associated_uri = identity_uri;
   rapidxml::xml_node<>* extension =
                         public_id->first_node(RegDataXMLUtils::EXTENSION);
@@ -81,8 +81,8 @@ void get_identities_and_barring_status(rapidxml::xml_node<>* public_id,
 
 void add_uri_to_associated_uris(AssociatedURIs& associated_uris,
                                 bool barred,
-                                std::string associated_uri,
-                                std::string identity_uri)
+                                const std::string& associated_uri,
+                                const std::string& identity_uri)
 {
   if (associated_uri != identity_uri)
   {
@@ -149,8 +149,8 @@ bool get_uris_from_ims_subscription(rapidxml::xml_node<>* node,
   return true;
 }
 
-bool parse_ims_subscription(const std::string public_user_identity,
-                            std::shared_ptr<rapidxml::xml_document<> > root,
+bool parse_ims_subscription(const std::string& public_user_identity,
+                            const std::shared_ptr<rapidxml::xml_document<> >& root,
                             rapidxml::xml_node<>* node,
                             std::map<std::string, Ifcs >& ifcs_map,
                             AssociatedURIs& associated_uris,
@@ -208,7 +208,6 @@ bool parse_ims_subscription(const std::string public_user_identity,
   std::string wildcard_uri;
   associated_uris.clear_uris();
   rapidxml::xml_node<>* sp = NULL;
-  Ifcs ifc;
 
   if (!validate_service_profile(node))
   {
@@ -36,23 +36,49 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
                                const std::unordered_set<std::string>& host_aliases,
                                const std::list<Sproutlet*>& sproutlets,
                                const std::set<std::string>& stateless_proxies,
-                               int max_sproutlet_depth) :
+                               int max_sproutlet_depth,
+                               AsyncWorkPool* async_work_pool,
+                               bool log_local_selection,
+                               AsyncWorkPool* resolver_pool,
+                               SNMP::EventAccumulatorTable* fork_latency_tbl) :
   BasicProxy(endpt,
              "mod-sproutlet-controller",
              priority,
              false,
-             stateless_proxies),
+             stateless_proxies,
+             resolver_pool,
+             fork_latency_tbl),
   _root_uri(NULL),
-  _host_aliases(host_aliases),
+  _local_hosts(true),
+  _services(false),
   _sproutlets(sproutlets),
-  _max_sproutlet_depth(max_sproutlet_depth)
+  _max_sproutlet_depth(max_sproutlet_depth),
+  _async_work_pool(async_work_pool),
+  _log_local_selection(log_local_selection)
 {
+  _msg_copies_tbl = SNMP::EventAccumulatorTable::create("sprout_sproutlet_msg_copies",
+                                                        ".1.2.826.0.1.1578918.9.3.62");
+  _msg_copy_bytes_tbl = SNMP::EventAccumulatorTable::create("sprout_sproutlet_msg_copy_bytes",
+                                                            ".1.2.826.0.1.1578918.9.3.63");
+
   /// Store the URI of this SproutletProxy - this is used for Record-Routing.
   TRC_DEBUG("Root Record-Route URI = %s", root_uri.c_str());
   _root_uri = (pjsip_sip_uri*)PJUtils::uri_from_string("sip:" + root_uri + ";transport=tcp",
                                                        stack_data.pool,
                                                        false);
 
+  if (_root_uri != NULL)
+  {
+    _local_hosts.insert(PJUtils::pj_str_to_string(&_root_uri->host), true);
+  }
+
+  for (std::unordered_set<std::string>::const_iterator it = host_aliases.begin();
+       it != host_aliases.end();
+       ++it)
+  {
+    _local_hosts.insert(*it, true);
+  }
+
   for (std::list<Sproutlet*>::iterator it = _sproutlets.begin();
        it != _sproutlets.end();
        ++it)
@@ -74,6 +100,8 @@ SproutletProxy::SproutletProxy(pjsip_endpoint* endpt,
 /// Destructor.
 SproutletProxy::~SproutletProxy()
 {
+  delete _msg_copies_tbl; _msg_copies_tbl = NULL;
+  delete _msg_copy_bytes_tbl; _msg_copy_bytes_tbl = NULL;
 }
 
 
@@ -89,45 +117,37 @@ bool SproutletProxy::register_sproutlet(Sproutlet* sproutlet)
   bool ok = true;
   std::string service_name = sproutlet->service_name();
 
-  // Add the service name and any aliases into a map of
+  // Add the service name and any aliases into the index of
   // service names to sproutlets.
-  std::map<std::string, Sproutlet*>::const_iterator i;
-  i = _services.find(service_name);
-  if (i != _services.end())
+  if (!_services.insert(service_name, sproutlet))
   {
-    std::string sproutlet_name = i->second->service_name();
+    pj_str_t service_name_str = {(char*)service_name.data(),
+                                 (pj_ssize_t)service_name.size()};
+    std::string sproutlet_name =
+                         (*_services.find(&service_name_str))->service_name();
     TRC_ERROR("Can't assign service name \"%s\" to sproutlet \"%s\" because it is taken by sproutlet \"%s\"",
               service_name.c_str(),
               service_name.c_str(),
               sproutlet_name.c_str());
     ok = false;
   }
-  else
-  {
-    _services.insert(std::make_pair(sproutlet->service_name(), sproutlet));
-  }
 
   std::list<std::string> aliases = sproutlet->aliases();
   for (std::list<std::string>::const_iterator j = aliases.begin();
        j != aliases.end();
        ++j)
   {
-    std::map<std::string, Sproutlet*>::const_iterator k;
-    k = _services.find(*j);
-    if (k != _services.end())
+    if (!_services.insert(*j, sproutlet))
     {
       std::string alias = *j;
-      std::string sproutlet_name = k->second->service_name();
+      pj_str_t alias_str = {(char*)alias.data(), (pj_ssize_t)alias.size()};
+      std::string sproutlet_name = (*_services.find(&alias_str))->service_name();
       TRC_ERROR("Can't assign alias \"%s\" to sproutlet \"%s\" because it is taken by sproutlet \"%s\"",
                 alias.c_str(),
                 service_name.c_str(),
                 sproutlet_name.c_str());
       ok = false;
     }
-    else
-    {
-      _services.insert(std::make_pair(*j, sproutlet));
-    }
   }
 
   // If the sproutlet owns a port, add that to the map of ports to
@@ -160,7 +180,8 @@ bool SproutletProxy::register_sproutlet(Sproutlet* sproutlet)
 Sproutlet* SproutletProxy::target_sproutlet(pjsip_msg* req,
                                             int port,
                                             std::string& alias,
-                                            SAS::TrailId trail)
+                                            SAS::TrailId trail,
+                                            bool log)
 {
   TRC_DEBUG("Find target Sproutlet for request");
 
@@ -188,15 +209,27 @@ Sproutlet* SproutletProxy::target_sproutlet(pjsip_msg* req,
     }
   }
 
+  // Printing the URI is a significant part of the cost of routing a hop, so
+  // only do it if the selection is being logged or debug logging is on, and
+  // then only once.
+  bool log_uri = ((log) || (Log::enabled(Log::DEBUG_LEVEL)));
+  std::string uri_str;
+
   if (uri != NULL)
   {
-    std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
-                                                 (pjsip_uri*)uri);
-    SAS::Event event(trail, SASEvent::STARTING_SPROUTLET_SELECTION_URI, 0);
-    event.add_var_param(uri_str);
-    SAS::report_event(event);
+    if (log_uri)
+    {
+      uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR,
+                                       (pjsip_uri*)uri);
+      TRC_DEBUG("Found next routable URI: %s", uri_str.c_str());
+    }
 
-    TRC_DEBUG("Found next routable URI: %s", uri_str.c_str());
+    if (log)
+    {
+      SAS::Event event(trail, SASEvent::STARTING_SPROUTLET_SELECTION_URI, 0);
+      event.add_var_param(uri_str);
+      SAS::report_event(event);
+    }
 
     std::string local_hostname_unused;
     SPROUTLET_SELECTION_TYPES selection_type = NONE_SELECTED;
@@ -205,7 +238,7 @@ Sproutlet* SproutletProxy::target_sproutlet(pjsip_msg* req,
                                          local_hostname_unused,
                                          selection_type);
 
-    if (selection_type != NONE_SELECTED)
+    if ((log) && (selection_type != NONE_SELECTED))
     {
       SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_URI, 0);
       event.add_static_param(selection_type);
@@ -241,21 +274,27 @@ Sproutlet* SproutletProxy::target_sproutlet(pjsip_msg* req,
          (is_host_local(&((pjsip_sip_uri*)route->name_addr.uri)->host))))
     {
       TRC_DEBUG("Find default service for port %d", port);
-      SAS::Event event(trail, SASEvent::STARTING_SPROUTLET_SELECTION_PORT, 0);
-      event.add_static_param(port);
-      SAS::report_event(event);
+      if (log)
+      {
+        SAS::Event event(trail, SASEvent::STARTING_SPROUTLET_SELECTION_PORT, 0);
+        event.add_static_param(port);
+        SAS::report_event(event);
+      }
 
       std::map<int, Sproutlet*>::const_iterator it = _ports.find(port);
       if (it != _ports.end())
       {
         sproutlet = it->second;
         alias = sproutlet->service_name();
-        std::string uri_str = PJUtils::uri_to_string(PJSIP_URI_IN_ROUTING_HDR, (pjsip_uri*)uri);
-        SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_PORT, 0);
-        event.add_var_param(alias);
-        event.add_static_param(port);
-        event.add_var_param(uri_str);
-        SAS::report_event(event);
+
+        if (log)
+        {
+          SAS::Event event(trail, SASEvent::SPROUTLET_SELECTION_PORT, 0);
+          event.add_var_param(alias);
+          event.add_static_param(port);
+          event.add_var_param(uri_str);
+          SAS::report_event(event);
+        }
       }
     }
   }
@@ -288,8 +327,9 @@ Sproutlet* SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
   // Now we know we have a SIP URI, cast to one.
   pjsip_sip_uri* sip_uri = (pjsip_sip_uri*)uri;
 
-  std::string service_name;
-  std::map<std::string, Sproutlet*>::const_iterator it;
+  // The index is searched with the parts of the URI directly, and strings are
+  // only built once a Sproutlet has matched, as this runs on every hop.
+  Sproutlet* const* match;
 
   // First check if there is a services parameter, and if it matches a
   // sproutlet.
@@ -304,12 +344,11 @@ Sproutlet* SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
     if (is_host_local(&sip_uri->host))
     {
       // Check if this service matches a sproutlet.
-      service_name = PJUtils::pj_str_to_string(&services_param->value);
-      it = _services.find(service_name);
-      if (it != _services.end())
+      match = _services.find(&services_param->value);
+      if (match != NULL)
       {
-        sproutlet = it->second;
-        alias = service_name;
+        sproutlet = *match;
+        alias = PJUtils::pj_str_to_string(&services_param->value);
         local_hostname = PJUtils::pj_str_to_string(&sip_uri->host);
         selection_type = SERVICE_NAME;
       }
@@ -330,14 +369,15 @@ Sproutlet* SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
     if (sep != NULL)
     {
       // Extract the possible service name
-      service_name = std::string(hostname.ptr, sep - hostname.ptr);
+      pj_str_t service_name = {hostname.ptr, sep - hostname.ptr};
 
       // Remove the service name part and the period from the hostname.
       hostname.slen -= (sep - hostname.ptr + 1);
       hostname.ptr = sep + 1;
 
-      TRC_DEBUG("Possible service name %s will be used if %.*s is a local hostname",
-                service_name.c_str(),
+      TRC_DEBUG("Possible service name %.*s will be used if %.*s is a local hostname",
+                service_name.slen,
+                service_name.ptr,
                 hostname.slen,
                 hostname.ptr);
 
@@ -345,11 +385,11 @@ Sproutlet* SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
       {
         // Check if the part of the hostname before the first '.' matches
         // a sproutlet.
-        it = _services.find(service_name);
-        if (it != _services.end())
+        match = _services.find(&service_name);
+        if (match != NULL)
         {
-          sproutlet = it->second;
-          alias = service_name;
+          sproutlet = *match;
+          alias = PJUtils::pj_str_to_string(&service_name);
           local_hostname = PJUtils::pj_str_to_string(&hostname);
           selection_type = DOMAIN_PART;
         }
@@ -367,12 +407,11 @@ Sproutlet* SproutletProxy::match_sproutlet_from_uri(const pjsip_uri* uri,
     if (is_host_local(&sip_uri->host))
     {
       // Check if the user part matches a sproutlet.
-      service_name = PJUtils::pj_str_to_string(&sip_uri->user);
-      it = _services.find(service_name);
-      if (it != _services.end())
+      match = _services.find(&sip_uri->user);
+      if (match != NULL)
       {
-        sproutlet = it->second;
-        alias = service_name;
+        sproutlet = *match;
+        alias = PJUtils::pj_str_to_string(&sip_uri->user);
         local_hostname = PJUtils::pj_str_to_string(&sip_uri->host);
         selection_type = USER_PART;
       }
@@ -521,24 +560,7 @@ std::string SproutletProxy::get_local_hostname(const pjsip_sip_uri* uri) const
 
 bool SproutletProxy::is_host_local(const pj_str_t* host) const
 {
-  bool rc = false;
-
-  if (!pj_stricmp(host, &_root_uri->host))
-  {
-    rc = true;
-  }
-
-  for (std::unordered_set<std::string>::const_iterator it = _host_aliases.begin();
-       (rc != true) && (it != _host_aliases.end());
-       ++it)
-  {
-    if (!pj_stricmp2(host, it->c_str()))
-    {
-      rc = true;
-    }
-  }
-
-  return rc;
+  return (_local_hosts.find(host) != NULL);
 }
 
 bool SproutletProxy::is_uri_reflexive(const pjsip_uri* uri,
@@ -605,16 +627,35 @@ void SproutletProxy::UASTsx::TimerCallback::run()
   ((TimerCallbackData*)_timer_entry->user_data)->uas_tsx->process_timer_pop(_timer_entry);
 }
 
+SproutletProxy::UASTsx::AsyncCallback::AsyncCallback(UASTsx* uas_tsx,
+                                                     SproutletWrapper* sproutlet_wrapper,
+                                                     AsyncWork* work) :
+  _uas_tsx(uas_tsx),
+  _sproutlet_wrapper(sproutlet_wrapper),
+  _work(work)
+{
+}
+
+void SproutletProxy::UASTsx::AsyncCallback::run()
+{
+  _uas_tsx->process_async_complete(_sproutlet_wrapper, _work);
+}
+
 SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
   BasicProxy::UASTsx(proxy),
+  _arena(&proxy->_arena_stats),
   _root(NULL),
-  _dmap_sproutlet(),
-  _dmap_uac(),
-  _umap(),
+  _dmap_sproutlet(DMap<SproutletWrapper*>::type::key_compare(),
+                  DMap<SproutletWrapper*>::type::allocator_type(&_arena)),
+  _dmap_uac(DMap<UACTsx*>::type::key_compare(),
+            DMap<UACTsx*>::type::allocator_type(&_arena)),
+  _umap(UMap::key_compare(), UMap::allocator_type(&_arena)),
   _pending_req_q(),
   _sproutlet_proxy(proxy),
-  _timers(),
-  _pending_timers()
+  _pending_timers(TimerSet::key_compare(), TimerSet::allocator_type(&_arena)),
+  _pending_async(),
+  _msg_copies(0),
+  _msg_copy_bytes(0)
 {
   int instances = ++_num_instances;
   TRC_DEBUG("Sproutlet Proxy transaction (%p) created. There are now %d instances",
@@ -624,16 +665,8 @@ SproutletProxy::UASTsx::UASTsx(SproutletProxy* proxy) :
 
 SproutletProxy::UASTsx::~UASTsx()
 {
-  for (std::set<pj_timer_entry*>::const_iterator timer = _timers.begin();
-       timer != _timers.end();
-       ++timer)
-  {
-    TimerCallbackData* tdata = (TimerCallbackData*)(*timer)->user_data;
-    delete tdata;
-    delete *timer;
-  }
-  _timers.clear();
-
+  // The timers, SproutletWrappers and routing maps of this transaction are
+  // all released with the arena, after this destructor has run.
   if (_trail != 0)
   {
     // Flush the trail so it appears promptly in SAS. Note that we also log an
@@ -649,12 +682,28 @@ SproutletProxy::UASTsx::~UASTsx()
     SAS::report_marker(flush);
   }
 
+  TRC_DEBUG("Sproutlet Proxy transaction (%p) made %d message copies using %zu bytes",
+            this, _msg_copies, _msg_copy_bytes);
+  _sproutlet_proxy->_msg_copies_tbl->accumulate(_msg_copies);
+  _sproutlet_proxy->_msg_copy_bytes_tbl->accumulate(_msg_copy_bytes);
+
   int instances = --_num_instances;
   TRC_DEBUG("Sproutlet Proxy transaction (%p) destroyed. There are now %d instances",
             this, instances);
 }
 
 
+void SproutletProxy::UASTsx::record_msg_copy(pjsip_tx_data* clone,
+                                             bool full_copy)
+{
+  if (full_copy)
+  {
+    ++_msg_copies;
+  }
+  _msg_copy_bytes += pj_pool_get_used_size(clone->pool);
+}
+
+
 /// Initialise the UAS transaction object.
 pj_status_t SproutletProxy::UASTsx::init(pjsip_rx_data* rdata)
 {
@@ -694,16 +743,16 @@ pj_status_t SproutletProxy::UASTsx::init(pjsip_rx_data* rdata)
 
     if (status == PJ_SUCCESS)
     {
-      _root = new SproutletWrapper(_sproutlet_proxy,
-                                   this,
-                                   sproutlet,
-                                   sproutlet_tsx,
-                                   alias,
-                                   _req,
-                                   _original_transport,
-                                   SproutletWrapper::EXTERNAL_NETWORK_FUNCTION,
-                                   _sproutlet_proxy->_max_sproutlet_depth,
-                                   trail());
+      _root = new (&_arena) SproutletWrapper(_sproutlet_proxy,
+                                             this,
+                                             sproutlet,
+                                             sproutlet_tsx,
+                                             alias,
+                                             _req,
+                                             _original_transport,
+                                             SproutletWrapper::EXTERNAL_NETWORK_FUNCTION,
+                                             _sproutlet_proxy->_max_sproutlet_depth,
+                                             trail());
     }
   }
 
@@ -935,24 +984,29 @@ void SproutletProxy::UASTsx::schedule_requests()
     }
     else
     {
+      // Every request on the queue was sent by a Sproutlet in this process.
       std::string alias;
-      SproutletTsx* sproutlet_tsx = get_sproutlet_tsx(req.req, 0, alias);
+      SproutletTsx* sproutlet_tsx =
+                      get_sproutlet_tsx(req.req,
+                                        0,
+                                        alias,
+                                        _sproutlet_proxy->_log_local_selection);
 
       if (sproutlet_tsx != NULL)
       {
         // Found a local Sproutlet and SproutletTsx to handle the request, so
         // create a SproutletWrapper. Since the Tsx is non-NULL, there is
         // guaranteed to be a sproutlet to handle the request.
-        SproutletWrapper* downstream = new SproutletWrapper(_sproutlet_proxy,
-                                                            this,
-                                                            sproutlet_tsx->_sproutlet,
-                                                            sproutlet_tsx,
-                                                            alias,
-                                                            req.req,
-                                                            _original_transport,
-                                                            req.upstream_network_func,
-                                                            req.sproutlet_depth,
-                                                            trail());
+        SproutletWrapper* downstream = new (&_arena) SproutletWrapper(_sproutlet_proxy,
+                                                                      this,
+                                                                      sproutlet_tsx->_sproutlet,
+                                                                      sproutlet_tsx,
+                                                                      alias,
+                                                                      req.req,
+                                                                      _original_transport,
+                                                                      req.upstream_network_func,
+                                                                      req.sproutlet_depth,
+                                                                      trail());
 
         // Set up the mappings.
         if (req.req->msg->line.req.method.id != PJSIP_ACK_METHOD)
@@ -1019,16 +1073,14 @@ bool SproutletProxy::UASTsx::schedule_timer(SproutletWrapper* tsx,
                                             TimerID& id,
                                             int duration)
 {
-  TimerCallbackData* tdata = new TimerCallbackData;
+  TimerCallbackData* tdata = _arena.create<TimerCallbackData>();
   tdata->uas_tsx = this;
   tdata->sproutlet_wrapper = tsx;
   tdata->context = context;
 
-  pj_timer_entry* tentry = new pj_timer_entry();
+  pj_timer_entry* tentry = _arena.create<pj_timer_entry>();
   pj_timer_entry_init(tentry, 0, tdata, &SproutletProxy::UASTsx::on_timer_pop);
 
-  _timers.insert(tentry);
-
   id = (TimerID)tentry;
 
   bool scheduled = _sproutlet_proxy->schedule_timer(tentry, duration);
@@ -1086,6 +1138,43 @@ void SproutletProxy::UASTsx::process_timer_pop(pj_timer_entry* tentry)
 }
 
 
+bool SproutletProxy::UASTsx::run_async(SproutletWrapper* tsx,
+                                       AsyncWork* work)
+{
+  AsyncWorkPool* pool = _sproutlet_proxy->_async_work_pool;
+  if (pool == NULL)
+  {
+    // There is no pool, so the Sproutlet must do the work itself.
+    return false;
+  }
+
+  _pending_async.insert(work);
+
+  // The callback is queued to a worker thread once the work has run.  This
+  // UASTsx won't be destroyed until then, as the work is pending.
+  pool->run(work, new AsyncCallback(this, tsx, work));
+
+  return true;
+}
+
+
+void SproutletProxy::UASTsx::process_async_complete(SproutletWrapper* tsx,
+                                                    AsyncWork* work)
+{
+  enter_context();
+
+  if (_pending_async.erase(work) != 0)
+  {
+    tsx->on_async_complete(work);
+    schedule_requests();
+  }
+
+  delete work; work = NULL;
+
+  exit_context();
+}
+
+
 void SproutletProxy::UASTsx::tx_response(SproutletWrapper* downstream,
                                          pjsip_tx_data* rsp)
 {
@@ -1203,6 +1292,7 @@ void SproutletProxy::UASTsx::check_destroy()
       (_umap.empty()) &&
       (_pending_req_q.empty()) &&
       (_pending_timers.empty()) &&
+      (_pending_async.empty()) &&
       (_tsx == NULL))
   {
     // UAS transaction has been destroyed and all Sproutlets are complete.
@@ -1213,7 +1303,8 @@ void SproutletProxy::UASTsx::check_destroy()
 
 SproutletTsx* SproutletProxy::UASTsx::get_sproutlet_tsx(pjsip_tx_data* req,
                                                         int port,
-                                                        std::string& alias)
+                                                        std::string& alias,
+                                                        bool log_selection)
 {
   SproutletTsx* sproutlet_tsx = NULL;
 
@@ -1221,7 +1312,8 @@ SproutletTsx* SproutletProxy::UASTsx::get_sproutlet_tsx(pjsip_tx_data* req,
   Sproutlet* sproutlet = _sproutlet_proxy->target_sproutlet(req->msg,
                                                             port,
                                                             alias,
-                                                            trail());
+                                                            trail(),
+                                                            log_selection);
 
   // Keep cycling though sproutlets until we either find a sproutlet that
   // wants to handle the request or run out of sproutlets.
@@ -1265,7 +1357,8 @@ SproutletTsx* SproutletProxy::UASTsx::get_sproutlet_tsx(pjsip_tx_data* req,
     sproutlet = _sproutlet_proxy->target_sproutlet(req->msg,
                                                    0,
                                                    alias,
-                                                   trail());
+                                                   trail(),
+                                                   log_selection);
   }
 
   return sproutlet_tsx;
@@ -1294,9 +1387,12 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
   _id(""),
   _req(req),
   _req_type(),
+  _shared_req(NULL),
   _original_transport(original_transport),
   _this_network_func(""),
   _upstream_network_func(upstream_network_func),
+  _network_func_boundary(false),
+  _internal_network_func_boundary(false),
   _depth(depth),
   _packets(),
   _send_requests(),
@@ -1308,6 +1404,7 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
   _process_actions_entered(0),
   _forks(),
   _pending_timers(),
+  _pending_async(0),
   _allowed_host_state(BaseResolver::ALL_LISTS),
   _trail_id(trail_id)
 {
@@ -1341,6 +1438,27 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
     _this_network_func = _sproutlet_tsx->get_network_function();
   }
 
+  // If this network function has a different name to the upstream one, then
+  // we're obviously at a network function boundary.  We're also on a boundary
+  // between two instances of the same network function if the service name
+  // matches the upstream network function (i.e. the two network function names
+  // match, but we're entering the first Sproutlet in the network function).
+  _network_func_boundary = (_this_network_func != _upstream_network_func) ||
+                           (_service_name == _upstream_network_func);
+
+  // An internal network function boundary doesn't involve an external hop.
+  _internal_network_func_boundary =
+                      _network_func_boundary &&
+                      (_upstream_network_func != EXTERNAL_NETWORK_FUNCTION) &&
+                      (_this_network_func != EXTERNAL_NETWORK_FUNCTION);
+
+  TRC_DEBUG("Network function boundary: %s%s ('%s'->'%s'/'%s')",
+            _network_func_boundary ? "yes" : "no",
+            _internal_network_func_boundary ? " (internal)" : "",
+            _upstream_network_func.c_str(),
+            _this_network_func.c_str(),
+            _service_name.c_str());
+
   // Initialize the Tsx
   _sproutlet_tsx->set_helper(this);
 
@@ -1363,6 +1481,21 @@ SproutletWrapper::SproutletWrapper(SproutletProxy* proxy,
               _id.c_str(), pjsip_tx_data_get_info(req));
 }
 
+void* SproutletWrapper::operator new(size_t size, TsxArena* arena)
+{
+  return arena->alloc(size);
+}
+
+void SproutletWrapper::operator delete(void* ptr, TsxArena* arena)
+{
+  // The memory is released with the arena.
+}
+
+void SproutletWrapper::operator delete(void* ptr)
+{
+  // The memory is released with the arena.
+}
+
 SproutletWrapper::~SproutletWrapper()
 {
   // Destroy the SproutletTsx.
@@ -1379,6 +1512,11 @@ SproutletWrapper::~SproutletWrapper()
     pjsip_tx_data_dec_ref(_req);
   }
 
+  if (_shared_req != NULL)
+  {
+    pjsip_tx_data_dec_ref(_shared_req);
+  }
+
   if (!_packets.empty())
   {
     TRC_WARNING("Sproutlet %s leaked %d messages - reclaiming", _id.c_str(), _packets.size());
@@ -1418,6 +1556,8 @@ pjsip_msg* SproutletWrapper::original_request()
     //LCOV_EXCL_STOP
   }
 
+  _proxy_tsx->record_msg_copy(clone);
+
   // Remove the top Route header from the request if it refers to this node or
   // this Sproutlet.  The Sproutlet can inspect the route_hdr API if required
   // using the route_hdr() API, but cannot manipulate it.
@@ -1435,6 +1575,55 @@ pjsip_msg* SproutletWrapper::original_request()
   return clone->msg;
 }
 
+/// Returns a view of the original request, without the top Route header as
+/// for original_request().  The view has its own header list, but the
+/// headers in it share their contents with the original request, as does the
+/// body, so the Sproutlet must call modify_msg() before changing it.
+pjsip_msg* SproutletWrapper::shared_original_request()
+{
+  pjsip_tx_data* view;
+  pj_status_t status = pjsip_endpt_create_tdata(stack_data.endpt, &view);
+
+  if (status != PJ_SUCCESS)
+  {
+    //LCOV_EXCL_START
+    TRC_ERROR("Failed to create view of original request for Sproutlet %s",
+              _service_name.c_str());
+    return NULL;
+    //LCOV_EXCL_STOP
+  }
+
+  pjsip_tx_data_add_ref(view);
+
+  view->msg = pjsip_msg_create(view->pool, PJSIP_REQUEST_MSG);
+  view->msg->line = _req->msg->line;
+  view->msg->body = _req->msg->body;
+
+  const pjsip_hdr* top_route = (const pjsip_hdr*)route_hdr();
+  for (pjsip_hdr* hdr = _req->msg->hdr.next;
+       hdr != &_req->msg->hdr;
+       hdr = hdr->next)
+  {
+    if (hdr != top_route)
+    {
+      pjsip_msg_add_hdr(view->msg,
+                        (pjsip_hdr*)pjsip_hdr_shallow_clone(view->pool, hdr));
+    }
+  }
+
+  set_trail(view, get_trail(_req));
+  _proxy_tsx->record_msg_copy(view, false);
+
+  register_tdata(view);
+
+  // Keep our own reference to the view, as it may still be referenced after
+  // the Sproutlet has freed it or replaced it with a copy.
+  pjsip_tx_data_add_ref(view);
+  _shared_req = view;
+
+  return view->msg;
+}
+
 // Sets the transport on this request to be the same as on the original.
 void SproutletWrapper::copy_original_transport(pjsip_msg* req)
 {
@@ -1556,11 +1745,57 @@ pjsip_msg* SproutletWrapper::clone_msg(pjsip_msg* msg)
     //LCOV_EXCL_STOP
   }
 
+  _proxy_tsx->record_msg_copy(new_tdata);
+
   register_tdata(new_tdata);
 
   return new_tdata->msg;
 }
 
+void SproutletWrapper::modify_msg(pjsip_msg*& msg)
+{
+  if ((_shared_req == NULL) || (msg != _shared_req->msg))
+  {
+    // The message isn't shared, so can be modified as it is.
+    return;
+  }
+
+  if (_packets.find(msg) == _packets.end())
+  {
+    TRC_WARNING("Sproutlet attempted to modify a freed message");
+    return;
+  }
+
+  TRC_DEBUG("Copy shared request %s for modification", _shared_req->obj_name);
+
+  // Copying the view copies the contents of its headers and body, so the copy
+  // shares nothing with the original request.
+  pjsip_tx_data* copy = PJUtils::clone_msg(stack_data.endpt, _shared_req);
+
+  if (copy == NULL)
+  {
+    //LCOV_EXCL_START
+    TRC_ERROR("Failed to copy shared request for Sproutlet %s",
+              _service_name.c_str());
+    return;
+    //LCOV_EXCL_STOP
+  }
+
+  _proxy_tsx->record_msg_copy(copy);
+
+  if (_shared_req->tp_sel.type != PJSIP_TPSELECTOR_NONE)
+  {
+    // The transport has been copied from the original request onto the view.
+    pjsip_tx_data_set_transport(copy, &_shared_req->tp_sel);
+  }
+
+  deregister_tdata(_shared_req);
+  pjsip_tx_data_dec_ref(_shared_req);
+  register_tdata(copy);
+
+  msg = copy->msg;
+}
+
 pjsip_msg* SproutletWrapper::create_response(pjsip_msg* req,
                                              pjsip_status_code status_code,
                                              const std::string& status_text)
@@ -1614,6 +1849,18 @@ int SproutletWrapper::send_request(pjsip_msg*& req, int allowed_host_state)
     return -1;
   }
 
+  // The request will be modified by downstream Sproutlets and the transport
+  // layer, so mustn't share its contents with the original request.
+  modify_msg(req);
+  if ((_shared_req != NULL) && (req == _shared_req->msg))
+  {
+    //LCOV_EXCL_START
+    TRC_ERROR("Sproutlet attempted to forward a shared request");
+    return -1;
+    //LCOV_EXCL_STOP
+  }
+  it = _packets.find(req);
+
   if ((_sproutlet != NULL) &&
       (_sproutlet->_outgoing_sip_transactions_tbl != NULL))
   {
@@ -1794,6 +2041,16 @@ bool SproutletWrapper::timer_running(TimerID id)
   return _proxy_tsx->timer_running(id);
 }
 
+bool SproutletWrapper::run_async(AsyncWork* work)
+{
+  bool running = _proxy_tsx->run_async(this, work);
+  if (running)
+  {
+    ++_pending_async;
+  }
+  return running;
+}
+
 SAS::TrailId SproutletWrapper::trail() const
 {
   return _trail_id;
@@ -1888,8 +2145,10 @@ void SproutletWrapper::rx_request(pjsip_tx_data* req, int allowed_host_state)
     pj_strdup2(req->pool, &hvia->transport, "TCP");
   }
 
-  // Clone the request to get a mutable copy to pass to the Sproutlet.
-  pjsip_msg* clone = original_request();
+  // Clone the request to get a mutable copy to pass to the Sproutlet, unless
+  // it only copies the request when it modifies it.
+  pjsip_msg* clone = _sproutlet_tsx->copy_on_write() ?
+                       shared_original_request() : original_request();
   if (clone == NULL)
   {
     // @TODO
@@ -2061,6 +2320,14 @@ void SproutletWrapper::on_timer_pop(TimerID id, void* context)
   process_actions(false);
 }
 
+void SproutletWrapper::on_async_complete(AsyncWork* work)
+{
+  TRC_DEBUG("Processing completion of asynchronous work %p", work);
+  --_pending_async;
+  _sproutlet_tsx->on_async_complete(work);
+  process_actions(false);
+}
+
 void SproutletWrapper::register_tdata(pjsip_tx_data* tdata)
 {
   TRC_DEBUG("Adding message %p => txdata %p mapping",
@@ -2153,10 +2420,12 @@ void SproutletWrapper::process_actions(bool complete_after_actions)
   if ((_complete) &&
       (_pending_responses == 0) &&
       (_pending_timers.empty()) &&
+      (_pending_async == 0) &&
       (_process_actions_entered == 0))
   {
     // Sproutlet has sent a final response, has no downstream forks waiting
-    // a response, and has no pending timers, so should destroy itself.
+    // a response, and has no pending timers or asynchronous work, so should
+    // destroy itself.
     TRC_VERBOSE("%s suiciding", _id.c_str());
     delete this;
   }
@@ -2406,34 +2675,12 @@ void SproutletWrapper::log_inter_sproutlet(pjsip_tx_data* tdata,
 
 bool SproutletWrapper::is_network_func_boundary() const
 {
-  // If this network function has a different name to the upstream one, then
-  // we're obviously at a network function boundary.  We're also on a boundary
-  // between two instances of the same network function if the service name
-  // matches the upstream network function (i.e. the two network function names
-  // match, but we're entering the first Sproutlet in the network function).
-  bool network_func_boundary = (_this_network_func != _upstream_network_func) ||
-                               (_service_name == _upstream_network_func);
-
-  TRC_DEBUG("Network function boundary: %s ('%s'->'%s'/'%s')",
-            network_func_boundary ? "yes" : "no",
-            _upstream_network_func.c_str(),
-            _this_network_func.c_str(),
-            _service_name.c_str());
-
-  return network_func_boundary;
+  return _network_func_boundary;
 }
 
 bool SproutletWrapper::is_internal_network_func_boundary() const
 {
-  // An internal network function boundary doesn't involve an external hop.
-  bool internal_boundary = is_network_func_boundary() &&
-                           (_upstream_network_func != EXTERNAL_NETWORK_FUNCTION) &&
-                           (_this_network_func != EXTERNAL_NETWORK_FUNCTION);
-
-  TRC_DEBUG("Internal network function boundary: %s",
-            internal_boundary ? "yes" : "no");
-
-  return internal_boundary;
+  return _internal_network_func_boundary;
 }
 
 // Get the overall error state for this wrapper.  This is used when passing
@@ -20,9 +20,11 @@ extern "C" {
 
 #include <pthread.h>
 #include <sched.h>
+#include <errno.h>
 
 // Common STL includes.
 #include <cassert>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <set>
@@ -33,6 +35,7 @@ extern "C" {
 #include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 
 #include "constants.h"
 #include "eventq.h"
@@ -150,18 +153,21 @@ static void on_io_started(const std::string& msg)
 }
 
 /// PJSIP threads are donated to PJSIP to handle receiving at transport level
-/// and timers.
+/// and timers.  If there are several transport threads they all poll the
+/// endpoint's ioqueue, and the first one also tracks the quiescing state.
 static int pjsip_thread_func(void *p)
 {
   pj_time_val delay = {0, 10};
 
-  PJ_UNUSED_ARG(p);
+  int thread_index = (int)(intptr_t)p;
 
   // Get the Kernel's ID for this thread so we can log it out.
   pid_t tid;
   tid = syscall(SYS_gettid);
 
-  TRC_STATUS("PJSIP transport thread started with kernel thread ID %d", tid);
+  TRC_STATUS("PJSIP transport thread %d started with kernel thread ID %d",
+             thread_index,
+             tid);
 
   // Increase the priority of the transport thread (by giving it a real-time
   // scheduling policy and a non-zero priority). This means that the transport
@@ -181,8 +187,8 @@ static int pjsip_thread_func(void *p)
 
   pj_bool_t curr_quiescing = PJ_FALSE;
 
-  // Log whenever we do any I/O on this thread. There is only one transport
-  // thread so blocking on it is a really bad idea!
+  // Log whenever we do any I/O on this thread. There are very few transport
+  // threads so blocking on one is a really bad idea!
   Utils::IOHook io_hook(&on_io_started,
                         Utils::IOHook::NOOP_ON_COMPLETE);
 
@@ -190,6 +196,11 @@ static int pjsip_thread_func(void *p)
   {
     pjsip_endpt_handle_events(stack_data.endpt, &delay);
 
+    if (thread_index != 0)
+    {
+      continue;
+    }
+
     // Check if our quiescing state has changed, and act appropriately
     pj_bool_t new_quiescing = quiescing;
     if (curr_quiescing != new_quiescing)
@@ -292,6 +303,240 @@ pj_status_t fill_transport_details(int port,
 }
 
 
+// Creates a UDP socket bound with SO_REUSEPORT, so that several sockets can
+// listen on the same address and port.  The kernel spreads received datagrams
+// across the sockets, so the transport threads can read from them in
+// parallel.
+static pj_status_t create_reuseport_udp_socket(pj_sockaddr* addr,
+                                               pj_sock_t* sock)
+{
+  pj_status_t status = pj_sock_socket(addr->addr.sa_family,
+                                      pj_SOCK_DGRAM(),
+                                      0,
+                                      sock);
+  if (status != PJ_SUCCESS)
+  {
+    return status;
+  }
+
+  int enable = 1;
+  if (setsockopt(*sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0)
+  {
+    status = PJ_RETURN_OS_ERROR(errno);
+    pj_sock_close(*sock);
+    return status;
+  }
+
+  status = pj_sock_bind(*sock, addr, pj_sockaddr_get_len(addr));
+  if (status != PJ_SUCCESS)
+  {
+    pj_sock_close(*sock);
+  }
+
+  return status;
+}
+
+
+/// An extra SO_REUSEPORT socket that shares the address of a UDP transport.
+/// PJSIP only knows about the transport, which is used to send all messages.
+/// Datagrams read from the extra socket are passed to PJSIP as though the
+/// transport had read them.
+struct ReuseportUdpReader
+{
+  pj_pool_t* pool;
+  pjsip_transport* transport;
+  pj_ioqueue_key_t* key;
+  pjsip_rx_data* rdata;
+};
+
+static std::vector<ReuseportUdpReader*> reuseport_udp_readers;
+
+static void on_reuseport_udp_read_complete(pj_ioqueue_key_t* key,
+                                           pj_ioqueue_op_key_t* op_key,
+                                           pj_ssize_t bytes_read);
+
+static const pj_ioqueue_callback reuseport_udp_callback =
+{
+  &on_reuseport_udp_read_complete,
+  NULL,
+  NULL,
+  NULL
+};
+
+// Starts an asynchronous read on an extra reuseport socket, using a fresh
+// rdata from the reader's pool.
+static pj_status_t start_reuseport_udp_read(ReuseportUdpReader* reader)
+{
+  pj_pool_reset(reader->pool);
+
+  pjsip_rx_data* rdata = PJ_POOL_ZALLOC_T(reader->pool, pjsip_rx_data);
+  rdata->tp_info.pool = reader->pool;
+  rdata->tp_info.transport = reader->transport;
+  rdata->tp_info.op_key.rdata = rdata;
+  pj_ioqueue_op_key_init(&rdata->tp_info.op_key.op_key,
+                         sizeof(pj_ioqueue_op_key_t));
+  reader->rdata = rdata;
+
+  pj_ssize_t size = sizeof(rdata->pkt_info.packet);
+  rdata->pkt_info.src_addr_len = sizeof(rdata->pkt_info.src_addr);
+
+  pj_status_t status = pj_ioqueue_recvfrom(reader->key,
+                                           &rdata->tp_info.op_key.op_key,
+                                           rdata->pkt_info.packet,
+                                           &size,
+                                           PJ_IOQUEUE_ALWAYS_ASYNC,
+                                           &rdata->pkt_info.src_addr,
+                                           &rdata->pkt_info.src_addr_len);
+
+  return (status == PJ_EPENDING) ? PJ_SUCCESS : status;
+}
+
+static void on_reuseport_udp_read_complete(pj_ioqueue_key_t* key,
+                                           pj_ioqueue_op_key_t* op_key,
+                                           pj_ssize_t bytes_read)
+{
+  ReuseportUdpReader* reader =
+                      (ReuseportUdpReader*)pj_ioqueue_get_user_data(key);
+  pjsip_rx_data* rdata = reader->rdata;
+
+  if (bytes_read > 0)
+  {
+    rdata->pkt_info.len = bytes_read;
+    rdata->pkt_info.zero = 0;
+    pj_gettimeofday(&rdata->pkt_info.timestamp);
+    pj_sockaddr_print(&rdata->pkt_info.src_addr,
+                      rdata->pkt_info.src_name,
+                      sizeof(rdata->pkt_info.src_name),
+                      0);
+    rdata->pkt_info.src_port = pj_sockaddr_get_port(&rdata->pkt_info.src_addr);
+
+    pjsip_tpmgr_receive_packet(pjsip_endpt_get_tpmgr(stack_data.endpt), rdata);
+  }
+  else if (bytes_read < 0)
+  {
+    TRC_DEBUG("Error reading from UDP socket (%s)",
+              PJUtils::pj_status_to_string((pj_status_t)-bytes_read).c_str());
+  }
+
+  if (bytes_read == -PJ_ECANCELLED)
+  {
+    // The socket is being unregistered, so don't read from it again.
+    return;
+  }
+
+  pj_status_t status = start_reuseport_udp_read(reader);
+  if (status != PJ_SUCCESS)
+  {
+    TRC_ERROR("Failed to restart read on UDP socket (%s)",
+              PJUtils::pj_status_to_string(status).c_str());
+  }
+}
+
+// Adds an extra reuseport socket on the address of the given UDP transport,
+// which feeds the datagrams it reads into that transport.
+static pj_status_t add_reuseport_udp_reader(pj_sockaddr* addr,
+                                            pjsip_transport* transport)
+{
+  pj_sock_t sock;
+  pj_status_t status = create_reuseport_udp_socket(addr, &sock);
+  if (status != PJ_SUCCESS)
+  {
+    return status;
+  }
+
+  ReuseportUdpReader* reader = new ReuseportUdpReader();
+  reader->pool = pjsip_endpt_create_pool(stack_data.endpt,
+                                         "rtd%p",
+                                         PJSIP_POOL_RDATA_LEN,
+                                         PJSIP_POOL_RDATA_INC);
+  reader->transport = transport;
+  reader->key = NULL;
+  reader->rdata = NULL;
+
+  // Keep the transport alive for as long as this socket feeds it.
+  pjsip_transport_add_ref(transport);
+
+  status = pj_ioqueue_register_sock(reader->pool,
+                                    pjsip_endpt_get_ioqueue(stack_data.endpt),
+                                    sock,
+                                    reader,
+                                    &reuseport_udp_callback,
+                                    &reader->key);
+  if (status != PJ_SUCCESS)
+  {
+    pj_sock_close(sock);
+    pjsip_transport_dec_ref(transport);
+    pj_pool_release(reader->pool);
+    delete reader;
+    return status;
+  }
+
+  // The reader is recorded before its read starts so that it is always
+  // cleaned up.
+  reuseport_udp_readers.push_back(reader);
+
+  return start_reuseport_udp_read(reader);
+}
+
+// Creates a single UDP transport, plus an extra reuseport socket for each
+// additional transport thread that feeds the datagrams it reads into the
+// transport.  PJSIP only sees the one transport, so sending, quiescing and
+// destroying the transport work exactly as for a single socket.
+static pj_status_t create_reuseport_udp_transport(pj_sockaddr* addr,
+                                                  pjsip_host_port* published_name)
+{
+  pj_sock_t sock;
+  pj_status_t status = create_reuseport_udp_socket(addr, &sock);
+  if (status != PJ_SUCCESS)
+  {
+    return status;
+  }
+
+  pjsip_transport* transport = NULL;
+  pjsip_transport_type_e type = (addr->addr.sa_family == PJ_AF_INET6) ?
+                                  PJSIP_TRANSPORT_UDP6 : PJSIP_TRANSPORT_UDP;
+  status = pjsip_udp_transport_attach2(stack_data.endpt,
+                                       type,
+                                       sock,
+                                       published_name,
+                                       50,
+                                       &transport);
+  if (status != PJ_SUCCESS)
+  {
+    pj_sock_close(sock);
+    return status;
+  }
+
+  for (int ii = 1;
+       (ii < stack_data.num_pjsip_threads) && (status == PJ_SUCCESS);
+       ++ii)
+  {
+    status = add_reuseport_udp_reader(addr, transport);
+  }
+
+  return status;
+}
+
+// Unregisters the extra reuseport sockets (which closes them) and releases
+// their references on the UDP transports.  This must be called once the
+// transport threads have stopped and before the endpoint is destroyed.
+static void destroy_reuseport_udp_readers()
+{
+  for (std::vector<ReuseportUdpReader*>::iterator ii = reuseport_udp_readers.begin();
+       ii != reuseport_udp_readers.end();
+       ++ii)
+  {
+    ReuseportUdpReader* reader = *ii;
+    pj_ioqueue_unregister(reader->key);
+    pjsip_transport_dec_ref(reader->transport);
+    pj_pool_release(reader->pool);
+    delete reader;
+  }
+
+  reuseport_udp_readers.clear();
+}
+
+
 pj_status_t create_udp_transport(int port, pj_str_t& host)
 {
   pj_status_t status;
@@ -309,7 +554,14 @@ pj_status_t create_udp_transport(int port, pj_str_t& host)
 
   // The UDP function call depends on the address type, which should be IPv4
   // or IPv6, otherwise something has gone wrong so don't try to start transport.
-  if (addr.addr.sa_family == PJ_AF_INET)
+  // If there are several transport threads, give each one a socket to read.
+  if (((addr.addr.sa_family == PJ_AF_INET) ||
+       (addr.addr.sa_family == PJ_AF_INET6)) &&
+      (stack_data.num_pjsip_threads > 1))
+  {
+    status = create_reuseport_udp_transport(&addr, &published_name);
+  }
+  else if (addr.addr.sa_family == PJ_AF_INET)
   {
     status = pjsip_udp_transport_start(stack_data.endpt,
                                        &addr.ipv4,
@@ -584,16 +836,41 @@ pj_status_t start_pjsip_thread()
 {
   pj_status_t status = PJ_SUCCESS;
 
-  status = pj_thread_create(stack_data.pool, "pjsip", &pjsip_thread_func,
-                            NULL, 0, 0, &stack_data.pjsip_transport_thread);
-  if (status != PJ_SUCCESS)
+  // The threads are created suspended and only resumed once the vector of
+  // transport threads is complete, as is_pjsip_transport_thread() reads the
+  // vector from the running threads.
+  stack_data.pjsip_transport_threads.resize(stack_data.num_pjsip_threads);
+
+  for (int ii = 0; ii < stack_data.num_pjsip_threads; ++ii)
   {
-    TRC_ERROR("Error creating PJSIP thread, %s",
-              PJUtils::pj_status_to_string(status).c_str());
-    return 1;
+    status = pj_thread_create(stack_data.pool, "pjsip", &pjsip_thread_func,
+                              (void*)(intptr_t)ii, 0, PJ_THREAD_SUSPENDED,
+                              &stack_data.pjsip_transport_threads[ii]);
+    if (status != PJ_SUCCESS)
+    {
+      TRC_ERROR("Error creating PJSIP thread, %s",
+                PJUtils::pj_status_to_string(status).c_str());
+
+      // Only keep the threads we managed to create, so that they still run
+      // (and can be joined when the stack is stopped).
+      stack_data.pjsip_transport_threads.resize(ii);
+      break;
+    }
   }
 
-  return PJ_SUCCESS;
+  if (!stack_data.pjsip_transport_threads.empty())
+  {
+    stack_data.pjsip_transport_thread = stack_data.pjsip_transport_threads[0];
+  }
+
+  for (std::vector<pj_thread_t*>::iterator ii = stack_data.pjsip_transport_threads.begin();
+       ii != stack_data.pjsip_transport_threads.end();
+       ++ii)
+  {
+    pj_thread_resume(*ii);
+  }
+
+  return (status == PJ_SUCCESS) ? PJ_SUCCESS : 1;
 }
 
 
@@ -620,7 +897,8 @@ pj_status_t init_stack(const std::string& system_name,
                        QuiescingManager *quiescing_mgr_arg,
                        const std::string& cdf_domain,
                        std::vector<std::string> sproutlet_uris,
-                       bool enable_orig_sip_to_tel_coerce)
+                       bool enable_orig_sip_to_tel_coerce,
+                       int num_pjsip_threads)
 {
   pj_status_t status;
   pj_sockaddr pri_addr;
@@ -651,6 +929,7 @@ pj_status_t init_stack(const std::string& system_name,
   stack_data.sip_tcp_connect_timeout = sip_tcp_connect_timeout;
   stack_data.sip_tcp_send_timeout = sip_tcp_send_timeout;
   stack_data.enable_orig_sip_to_tel_coerce = enable_orig_sip_to_tel_coerce;
+  stack_data.num_pjsip_threads = std::max(num_pjsip_threads, 1);
 
   // Work out local and public hostnames and cluster domain names.
   stack_data.local_host = (local_host != "") ? pj_str(local_host_cstr) : *pj_gethostname();
@@ -932,12 +1211,18 @@ pj_status_t init_stack(const std::string& system_name,
 
 pj_status_t stop_pjsip_thread()
 {
-  // Set the quit flag to signal the PJSIP thread to exit, then wait
+  // Set the quit flag to signal the PJSIP threads to exit, then wait
   // for them to exit.
   quit_flag = PJ_TRUE;
 
-  pj_thread_join(stack_data.pjsip_transport_thread);
+  for (std::vector<pj_thread_t*>::iterator ii = stack_data.pjsip_transport_threads.begin();
+       ii != stack_data.pjsip_transport_threads.end();
+       ++ii)
+  {
+    pj_thread_join(*ii);
+  }
 
+  stack_data.pjsip_transport_threads.clear();
   stack_data.pjsip_transport_thread = NULL;
 
   return PJ_SUCCESS;
@@ -953,6 +1238,7 @@ void term_pjsip()
 
 void stop_stack()
 {
+  destroy_reuseport_udp_readers();
   PJUtils::term();
   pjsip_tsx_layer_destroy();
   pjsip_endpt_unregister_module(stack_data.endpt, &mod_connection_tracking);
@@ -75,11 +75,13 @@ NotifyUtils::ContactEvent determine_contact_event(
 SubscriberDataManager::SubscriberDataManager(AoRStore* aor_store,
                                              ChronosConnection* chronos_connection,
                                              AnalyticsLogger* analytics_logger,
-                                             bool is_primary) :
+                                             bool is_primary,
+                                             ChronosTimerBatcher* timer_batcher) :
   _primary_sdm(is_primary)
 {
   _aor_store = aor_store;
-  _chronos_timer_request_sender = new ChronosTimerRequestSender(chronos_connection);
+  _chronos_timer_request_sender = new ChronosTimerRequestSender(chronos_connection,
+                                                                timer_batcher);
   _notify_sender = new NotifySender();
   _analytics = analytics_logger;
 }
@@ -420,7 +422,7 @@ void SubscriberDataManager::expire_subscriptions(AoRPair* aor_pair,
         *s_copy = *i->second;
       }
 
-      delete i->second;
+      AoR::release(i->second);
       aor_pair->get_current()->_subscriptions.erase(i++);
     }
     else
@@ -462,7 +464,7 @@ int SubscriberDataManager::expire_bindings(AoR* aor_data,
         SAS::report_event(event);
       }
 
-      delete i->second;
+      AoR::release(i->second);
       aor_data->_bindings.erase(i++);
     }
     else
@@ -483,8 +485,10 @@ int SubscriberDataManager::expire_bindings(AoR* aor_data,
 /// ChronosTimerRequestSender Methods
 
 SubscriberDataManager::ChronosTimerRequestSender::
-     ChronosTimerRequestSender(ChronosConnection* chronos_conn) :
-  _chronos_conn(chronos_conn)
+     ChronosTimerRequestSender(ChronosConnection* chronos_conn,
+                               ChronosTimerBatcher* timer_batcher) :
+  _chronos_conn(chronos_conn),
+  _timer_batcher(timer_batcher)
 {
 }
 
@@ -521,7 +525,14 @@ void SubscriberDataManager::ChronosTimerRequestSender::send_timers(
   {
     if (timer_id != "")
     {
-      _chronos_conn->send_delete(timer_id, trail);
+      if (_timer_batcher != NULL)
+      {
+        _timer_batcher->delete_timer(aor_id, timer_id, trail);
+      }
+      else
+      {
+        _chronos_conn->send_delete(timer_id, trail);
+      }
     }
   return;
   }
@@ -544,11 +555,23 @@ void SubscriberDataManager::ChronosTimerRequestSender::send_timers(
     // Set the expiry time to be relative to now.
     int expiry = (new_next_expires > now) ? (new_next_expires - now) : (now);
 
-    set_timer(aor_id,
-              timer_id,
-              expiry,
-              new_tags,
-              trail);
+    if (_timer_batcher != NULL)
+    {
+      // The batcher writes the timer ID back to the AoR if it changes.
+      _timer_batcher->set_timer(aor_id,
+                                timer_id,
+                                expiry,
+                                new_tags,
+                                trail);
+    }
+    else
+    {
+      set_timer(aor_id,
+                timer_id,
+                expiry,
+                new_tags,
+                trail);
+    }
   }
 }
 
@@ -790,7 +813,9 @@ void SubscriberDataManager::NotifySender::send_notifys(
 
         if (status == PJ_SUCCESS)
         {
-          subscription->_refreshed = false;
+          // The subscription may be shared with the original AoR, so get it
+          // through the AoR to change it.
+          aor_pair->get_current()->get_subscription(s_id)->_refreshed = false;
         }
         else
         {
@@ -885,7 +910,10 @@ void SubscriberDataManager::NotifySender::send_notifys_for_expired_subscriptions
 
       pjsip_tx_data* tdata_notify = NULL;
 
-      // This is a terminated subscription - set the expiry time to now
+      // This is a terminated subscription - set the expiry time to now.  The
+      // subscription may be shared with other copies of the AoR, so get it
+      // through the AoR to change it.
+      s = aor_pair->get_orig()->get_subscription(s_id);
       s->_expires = now;
       pj_status_t status = NotifyUtils::create_subscription_notify(
                                           &tdata_notify,
@@ -45,10 +45,12 @@ SubscriptionSproutlet::SubscriptionSproutlet(const std::string& name,
                                              HSSConnection* hss_connection,
                                              ACRFactory* acr_factory,
                                              AnalyticsLogger* analytics_logger,
-                                             int cfg_max_expires) :
+                                             int cfg_max_expires,
+                                             AoRReplicator* aor_replicator) :
   Sproutlet(name, port, uri, "", {}, NULL, NULL, network_function),
   _sdm(sdm),
   _remote_sdms(remote_sdms),
+  _aor_replicator(aor_replicator),
   _hss(hss_connection),
   _acr_factory(acr_factory),
   _analytics(analytics_logger),
@@ -555,64 +557,76 @@ Store::Status SubscriptionSproutletTsx::update_subscription_in_stores(
 
   log_subscriptions(aor, local_aor_pair->get_current());
 
-  for (SubscriberDataManager* sdm: subscription->_remote_sdms)
+  if (subscription->_aor_replicator != NULL)
   {
-    // Using a different rc for the remote stores, as their success/failure does
-    // not impact whether we determine the overall process a success
-    Store::Status rc;
-
-    AoRPair* remote_aor_pair = NULL;
-    // Check if we have done the remote read for this SDM yet, and do it if not
-    // Saves us from doing a re-read if we had to get the AoRs previously
-    if ((_cached_aors.find(sdm) == _cached_aors.end()) &&
-        (sdm->has_servers()))
-    {
-      TRC_DEBUG("No cached AoR data found for AoR %s from remote sdm %p",
-                  aor.c_str(), sdm);
-      remote_aor_pair = read_and_cache_from_store(sdm, aor, _cached_aors);
-    }
-    else
+    // Leave the replicator to write the change to the remote stores, after
+    // any changes to the AoR that it has already queued.
+    subscription->_aor_replicator->replicate(aor,
+                                             SubscriberDataManager::EventTrigger::USER,
+                                             local_aor_pair,
+                                             trail());
+  }
+  else
+  {
+    for (SubscriberDataManager* sdm: subscription->_remote_sdms)
     {
-      TRC_DEBUG("Reading cached AoR data for AoR %s, cached from remote sdm %p",
-                  aor.c_str(), sdm);
-      remote_aor_pair = _cached_aors[sdm];
-    }
+      // Using a different rc for the remote stores, as their success/failure does
+      // not impact whether we determine the overall process a success
+      Store::Status rc;
 
-    do
-    {
-      if (remote_aor_pair == NULL)
+      AoRPair* remote_aor_pair = NULL;
+      // Check if we have done the remote read for this SDM yet, and do it if not
+      // Saves us from doing a re-read if we had to get the AoRs previously
+      if ((_cached_aors.find(sdm) == _cached_aors.end()) &&
+          (sdm->has_servers()))
       {
-        // LCOV_EXCL_START
-        TRC_DEBUG("Hit an error reading AoR %s from the remote store, unable to update subscription %s",
-                    aor.c_str(), new_subscription._to_tag.c_str());
-        rc = Store::Status::ERROR;
-        // LCOV_EXCL_STOP
+        TRC_DEBUG("No cached AoR data found for AoR %s from remote sdm %p",
+                    aor.c_str(), sdm);
+        remote_aor_pair = read_and_cache_from_store(sdm, aor, _cached_aors);
       }
       else
       {
-        update_subscription(subscription, new_subscription, aor, remote_aor_pair, _cached_aors);
-        remote_aor_pair->get_current()->_associated_uris = *associated_uris;
+        TRC_DEBUG("Reading cached AoR data for AoR %s, cached from remote sdm %p",
+                    aor.c_str(), sdm);
+        remote_aor_pair = _cached_aors[sdm];
+      }
 
-        rc = sdm->set_aor_data(aor, SubscriberDataManager::EventTrigger::USER, remote_aor_pair, trail());
-        if (rc == Store::DATA_CONTENTION)
+      do
+      {
+        if (remote_aor_pair == NULL)
         {
-          TRC_DEBUG("Hit data contention attempting to write AoR %s to remote store", aor.c_str());
-          remote_aor_pair = read_and_cache_from_store(sdm, aor, _cached_aors);
-          if (remote_aor_pair == NULL)
+          // LCOV_EXCL_START
+          TRC_DEBUG("Hit an error reading AoR %s from the remote store, unable to update subscription %s",
+                      aor.c_str(), new_subscription._to_tag.c_str());
+          rc = Store::Status::ERROR;
+          // LCOV_EXCL_STOP
+        }
+        else
+        {
+          update_subscription(subscription, new_subscription, aor, remote_aor_pair, _cached_aors);
+          remote_aor_pair->get_current()->_associated_uris = *associated_uris;
+
+          rc = sdm->set_aor_data(aor, SubscriberDataManager::EventTrigger::USER, remote_aor_pair, trail());
+          if (rc == Store::DATA_CONTENTION)
           {
-            // LCOV_EXCL_START We test behaviour on store error elsewhere,
-            // and UT-ing this case is more effort than it's worth
-
-            // We've hit an error in reading from the remote store, but we don't
-            // take any action on this. Bail out and try the next store.
-            TRC_DEBUG("Failed to read AoR from remote store");
-            break;
-            // LCOV_EXCL_STOP
+            TRC_DEBUG("Hit data contention attempting to write AoR %s to remote store", aor.c_str());
+            remote_aor_pair = read_and_cache_from_store(sdm, aor, _cached_aors);
+            if (remote_aor_pair == NULL)
+            {
+              // LCOV_EXCL_START We test behaviour on store error elsewhere,
+              // and UT-ing this case is more effort than it's worth
+
+              // We've hit an error in reading from the remote store, but we don't
+              // take any action on this. Bail out and try the next store.
+              TRC_DEBUG("Failed to read AoR from remote store");
+              break;
+              // LCOV_EXCL_STOP
+            }
           }
         }
       }
+      while (rc == Store::DATA_CONTENTION);
     }
-    while (rc == Store::DATA_CONTENTION);
   }
 
   // Clear out the cached AoR data
@@ -680,8 +694,13 @@ void SubscriptionSproutletTsx::update_subscription(
     {
       // We want to read the remote AoR only once at this stage, so we check
       // if there's already an entry in the cache for it.
+      // If the replicator has changes to the AoR that it hasn't yet
+      // written to this site, the site's copy is older than ours, so
+      // mustn't be copied.
       if ((_cached_aors.find(sdm) == _cached_aors.end()) &&
-          (sdm->has_servers()))
+          (sdm->has_servers()) &&
+          ((subscription->_aor_replicator == NULL) ||
+           (!subscription->_aor_replicator->site_behind(aor, sdm))))
       {
         read_and_cache_from_store(sdm, aor, _cached_aors);
       }
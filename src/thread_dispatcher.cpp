@@ -19,12 +19,15 @@ extern "C" {
 
 // Common STL includes.
 #include <cassert>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <set>
 #include <list>
 #include <queue>
 #include <string>
+#include <atomic>
+#include <unordered_map>
 
 #include "constants.h"
 #include "eventq.h"
@@ -51,12 +54,125 @@ extern "C" {
 static std::vector<pj_thread_t*> worker_threads;
 
 // Queue for incoming events.
-static PriorityEventQueueBackend* sip_event_queue_backend =
-  new PriorityEventQueueBackend(); // LCOV_EXCL_LINE
+static MultiLevelEventQueueBackend* sip_event_queue_backend =
+  new MultiLevelEventQueueBackend(); // LCOV_EXCL_LINE
 static eventq<struct SipEvent> sip_event_queue(0,
                                                true,
                                                sip_event_queue_backend);
 
+// By default all worker threads share sip_event_queue.  If per-worker queues
+// are enabled, each worker thread owns one of these queues (the first being
+// sip_event_queue) and steals from the others when its own queue is empty.
+// If fair queueing or more priority levels are configured, all the queues
+// (including the first) are created with a suitable backend instead.
+static std::vector<eventq<struct SipEvent>*> sip_event_queues(1, &sip_event_queue);
+
+// Number of events on all the queues.
+static std::atomic_int queued_events(0);
+
+// With per-worker queues, whether the worker that owns each queue is idle,
+// waiting for work on that queue.  A worker that queues work for a busy worker
+// wakes one of the idle workers to steal it.
+static std::vector<std::atomic_bool> idle_workers;
+
+static bool sharded_queues = false;
+
+const char* const SIP_MESSAGE_CLASS_NAMES[SipMessageClass::NUM_CLASSES] =
+{
+  "response",
+  "options",
+  "cancel_bye_ack",
+  "in_dialog",
+  "initial",
+  "registration"
+};
+
+const int METHOD_AWARE_MESSAGE_PRIORITIES[SipMessageClass::NUM_CLASSES] =
+{
+  0, // RESPONSE
+  0, // OPTIONS
+  1, // CANCEL_BYE_ACK
+  2, // IN_DIALOG
+  3, // INITIAL
+  4  // REGISTRATION
+};
+
+// By default, only OPTIONS are prioritised.  Monit probes Sprout using OPTIONS
+// polls, so these are prioritised to prevent Monit killing Sprout during
+// overload.
+static const int DEFAULT_MESSAGE_PRIORITIES[SipMessageClass::NUM_CLASSES] =
+{
+  SipEventPriorityLevel::NORMAL_PRIORITY, // RESPONSE
+  SipEventPriorityLevel::HIGH_PRIORITY,   // OPTIONS
+  SipEventPriorityLevel::NORMAL_PRIORITY, // CANCEL_BYE_ACK
+  SipEventPriorityLevel::NORMAL_PRIORITY, // IN_DIALOG
+  SipEventPriorityLevel::NORMAL_PRIORITY, // INITIAL
+  SipEventPriorityLevel::NORMAL_PRIORITY  // REGISTRATION
+};
+
+// The priority level each message class is queued at, and the number of
+// priority levels the queues need.
+static std::vector<int> message_priorities(DEFAULT_MESSAGE_PRIORITIES,
+                                           DEFAULT_MESSAGE_PRIORITIES +
+                                             SipMessageClass::NUM_CLASSES);
+static int num_priority_levels = SipEventPriorityLevel::NUM_PRIORITY_LEVELS;
+
+// If set, the event queues share the worker threads fairly between the
+// sources of received messages, and a source can be limited to a maximum
+// number of queued requests.
+static bool fair_queueing = false;
+static int max_queue_depth_per_source = 0;
+
+// The number of messages queued from each source, when fair queueing.  The
+// sources are spread across shards by a hash of their address, so that
+// transport and worker threads handling different sources rarely contend for
+// a lock.
+struct SipEventSourceHash
+{
+  size_t operator()(const SipEventSource& source) const
+  {
+    return pj_hash_calc(0, source.addr, sizeof(source.addr));
+  }
+};
+
+struct SourceDepthShard
+{
+  pthread_mutex_t lock;
+  std::unordered_map<SipEventSource, int, SipEventSourceHash> depths;
+
+  SourceDepthShard()
+  {
+    pthread_mutex_init(&lock, NULL);
+  }
+};
+
+static const int NUM_SOURCE_DEPTH_SHARDS = 32;
+static SourceDepthShard source_depth_shards[NUM_SOURCE_DEPTH_SHARDS];
+
+// The weight of each source configured with a weight, when fair queueing.
+static std::map<SipEventSource, int> source_weights;
+
+// If set, the transport thread only copies the raw bytes of each received
+// message, and the worker thread that picks it up parses the copy.  This
+// takes the cost of cloning the parsed message off the transport thread.
+static bool deferred_rx_parse = false;
+
+// If set, requests are rejected on the transport thread, before they are
+// cloned, if the predicted time they would wait on the queue exceeds
+// request_on_queue_timeout_us.
+static bool queue_wait_reject = false;
+
+// Smoothed time (in microseconds) that a worker thread spends processing each
+// message, used to predict how long a new message would wait on the queue.
+// Updates are not locked - a lost update only makes the estimate slightly
+// less smooth.
+static std::atomic_ulong avg_service_time_us(0);
+
+// Weight given to each new service time sample in avg_service_time_us, as a
+// reciprocal (so each sample contributes 1/SERVICE_TIME_SMOOTHING).
+static const unsigned long SERVICE_TIME_SMOOTHING = 16;
+static std::atomic_uint next_callback_queue(0);
+
 // Deadlock detection threshold for the message queue (in milliseconds).  This
 // is set to roughly twice the expected maximum service time for each message
 // (currently four seconds, allowing for four Homestead/Homer interactions
@@ -66,11 +182,18 @@ static const int MSG_Q_DEADLOCK_TIME = 4000;
 static int num_worker_threads = 1;
 
 static SNMP::EventAccumulatorByScopeTable* latency_table = NULL;
+static std::vector<SNMP::EventAccumulatorByScopeTable*> class_latency_tables(SipMessageClass::NUM_CLASSES);
 static SNMP::EventAccumulatorByScopeTable* queue_size_table = NULL;
 
 static LoadMonitor* load_monitor = NULL;
 
 static SNMP::CounterByScopeTable* overload_counter = NULL;
+static SNMP::CounterByScopeTable* queue_wait_reject_counter = NULL;
+// With fair queueing, the depth of the queue of each message's source when it
+// is queued, and the number of requests rejected because their source's
+// queue was full.  Both cover all sources together.
+static SNMP::EventAccumulatorByScopeTable* source_queue_depth_table = NULL;
+static SNMP::CounterByScopeTable* source_reject_counter = NULL;
 
 static ExceptionHandler* exception_handler = NULL;
 static unsigned long request_on_queue_timeout_us = 1;
@@ -150,150 +273,362 @@ static void dump_message_details(pjsip_rx_data* rdata)
   }
 }
 
-bool process_queue_element()
+// Pops a single element off another worker's queue without waiting, starting
+// with the neighbour of the specified worker.
+static bool steal_sip_event(int worker_index, SipEvent& qe)
 {
-  TRC_DEBUG("Attempting to process queue element");
-  bool rc;
-  SipEvent qe;
+  size_t num_queues = sip_event_queues.size();
 
-  unsigned long target_latency_us = load_monitor->get_target_latency_us();
+  for (size_t ii = 1; ii < num_queues; ++ii)
+  {
+    size_t victim = (worker_index + ii) % num_queues;
+
+    if ((sip_event_queues[victim]->size() > 0) &&
+        (sip_event_queues[victim]->pop(qe, 0)))
+    {
+      TRC_DEBUG("Worker %d stole event from queue %d", worker_index, (int)victim);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Pops a single element off the event queue for the specified worker thread,
+// waiting if necessary.  If per-worker queues are enabled, the worker only
+// looks at the other workers' queues if its own queue is empty but work is
+// queued elsewhere, or if it is woken to steal work queued for a busy worker.
+// Otherwise it waits on its own queue.
+// Returns false if the queues have been terminated.
+static bool pop_sip_event(int worker_index, SipEvent& qe)
+{
+  if (!sharded_queues)
+  {
+    return sip_event_queues[0]->pop(qe);
+  }
 
-  rc = sip_event_queue.pop(qe);
+  size_t own_index = worker_index % sip_event_queues.size();
+  eventq<struct SipEvent>* own_queue = sip_event_queues[own_index];
+  std::atomic_bool& idle = idle_workers[own_index];
 
-  if (rc)
+  while (true)
   {
-    if (qe.type == MESSAGE)
+    // Mark this worker as idle before checking for work on the other queues.
+    // Work queued after the check then sees the worker as idle and wakes it.
+    idle = true;
+
+    if ((queued_events > 0) &&
+        (own_queue->size() == 0) &&
+        (steal_sip_event(worker_index, qe)))
     {
-      pjsip_rx_data* rdata = qe.event_data.rdata;
+      idle = false;
+      return true;
+    }
 
-      // Create an IO hook that pauses the stopwatch while blocked on IO.
-      Utils::IOHook io_hook(std::bind(pause_stopwatch, std::ref(qe.stop_watch), std::placeholders::_1),
-                            std::bind(resume_stopwatch, std::ref(qe.stop_watch), std::placeholders::_1));
+    bool rc = own_queue->pop(qe);
+    idle = false;
 
-      if (rdata)
-      {
-        TRC_DEBUG("Worker thread dequeue message %p", rdata);
+    if ((!rc) || (qe.type != WAKE))
+    {
+      return rc;
+    }
 
-        unsigned long latency_us = 0;
-        if (qe.stop_watch.read(latency_us))
-        {
-          TRC_DEBUG("Request latency so far = %ldus", latency_us);
-        }
-        else
-        {
-          TRC_ERROR("Failed to get timestamp: %s", strerror(errno)); // LCOV_EXCL_LINE
-        }
+    // This worker was woken because work was queued for a busy worker.
+    if (steal_sip_event(worker_index, qe))
+    {
+      return true;
+    }
+  }
+}
+
+// Wakes an idle worker to steal an event just pushed to the specified queue,
+// if the worker that owns that queue is busy.
+static void wake_idle_worker(size_t queue_index)
+{
+  if ((!sharded_queues) || (idle_workers[queue_index]))
+  {
+    return;
+  }
+
+  size_t num_queues = sip_event_queues.size();
+
+  for (size_t ii = 1; ii < num_queues; ++ii)
+  {
+    size_t worker = (queue_index + ii) % num_queues;
+    bool was_idle = true;
+
+    // Clearing the idle flag means only one event is queued to wake each idle
+    // worker.
+    if (idle_workers[worker].compare_exchange_strong(was_idle, false))
+    {
+      SipEvent qe;
+      qe.type = WAKE;
+      qe.priority = SipEventPriorityLevel::HIGH_PRIORITY;
+      qe.stamp_enqueue_time();
+      sip_event_queues[worker]->push(qe);
+      return;
+    }
+  }
+}
+
+static uint64_t get_monotonic_time_us()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// Folds the time a worker thread spent processing a message into the smoothed
+// service time.
+static void record_service_time(unsigned long service_time_us)
+{
+  unsigned long avg_us = avg_service_time_us;
+
+  if (avg_us == 0)
+  {
+    avg_us = service_time_us;
+  }
+  else
+  {
+    avg_us = avg_us - (avg_us / SERVICE_TIME_SMOOTHING) +
+                      (service_time_us / SERVICE_TIME_SMOOTHING);
+  }
+
+  avg_service_time_us = avg_us;
+}
+
+// Predicts how long (in microseconds) a message queued now would wait before
+// a worker thread picks it up.
+static unsigned long predict_queue_wait_us()
+{
+  return ((unsigned long)queued_events * avg_service_time_us) /
+         num_worker_threads;
+}
+
+// Returns the shard holding the queued message count for the specified source.
+static SourceDepthShard& get_source_depth_shard(const SipEventSource& source)
+{
+  return source_depth_shards[SipEventSourceHash()(source) %
+                             NUM_SOURCE_DEPTH_SHARDS];
+}
+
+// Returns the number of messages from the specified source currently queued.
+static int get_source_depth(const SipEventSource& source)
+{
+  SourceDepthShard& shard = get_source_depth_shard(source);
+
+  pthread_mutex_lock(&shard.lock);
+  std::unordered_map<SipEventSource, int, SipEventSourceHash>::const_iterator it =
+                                                      shard.depths.find(source);
+  int depth = (it != shard.depths.end()) ? it->second : 0;
+  pthread_mutex_unlock(&shard.lock);
 
-        SAS::TrailId trail = get_trail(rdata);
+  return depth;
+}
+
+// Records that a message from the specified source has been queued, and
+// returns the new number of messages queued from that source.
+static int increment_source_depth(const SipEventSource& source)
+{
+  SourceDepthShard& shard = get_source_depth_shard(source);
+
+  pthread_mutex_lock(&shard.lock);
+  int depth = ++shard.depths[source];
+  pthread_mutex_unlock(&shard.lock);
+
+  return depth;
+}
+
+// Records that a message from the specified source has been dequeued.
+static void decrement_source_depth(const SipEventSource& source)
+{
+  SourceDepthShard& shard = get_source_depth_shard(source);
+
+  pthread_mutex_lock(&shard.lock);
+  std::unordered_map<SipEventSource, int, SipEventSourceHash>::iterator it =
+                                                      shard.depths.find(source);
+  if ((it != shard.depths.end()) && (--it->second <= 0))
+  {
+    shard.depths.erase(it);
+  }
+  pthread_mutex_unlock(&shard.lock);
+}
+
+// Processes a single event taken off the queue.
+static void process_sip_event(SipEvent& qe, unsigned long target_latency_us)
+{
+  if (qe.type == MESSAGE)
+  {
+    pjsip_rx_data* rdata = qe.event_data.rdata;
+    uint64_t dequeue_time_us = get_monotonic_time_us();
+
+    if (fair_queueing)
+    {
+      decrement_source_depth(qe.source);
+    }
+
+    if ((deferred_rx_parse) &&
+        (PJUtils::parse_rx_data_clone(rdata) != PJ_SUCCESS))
+    {
+      // LCOV_EXCL_START
+      // The message parsed cleanly on the transport thread, so this should
+      // never happen.
+      TRC_ERROR("Failed to parse queued message %p - dropping it", rdata);
+      pjsip_rx_data_free_cloned(rdata);
+      return;
+      // LCOV_EXCL_STOP
+    }
+
+    // Create an IO hook that pauses the stopwatch while blocked on IO.
+    Utils::IOHook io_hook(std::bind(pause_stopwatch, std::ref(qe.stop_watch), std::placeholders::_1),
+                          std::bind(resume_stopwatch, std::ref(qe.stop_watch), std::placeholders::_1));
+
+    if (rdata)
+    {
+      TRC_DEBUG("Worker thread dequeue message %p", rdata);
 
-        if ((latency_us > (request_on_queue_timeout_us)) &&
-            (rdata->msg_info.msg->type == PJSIP_REQUEST_MSG))
+      unsigned long latency_us = 0;
+      if (qe.stop_watch.read(latency_us))
+      {
+        TRC_DEBUG("Request latency so far = %ldus", latency_us);
+      }
+      else
+      {
+        TRC_ERROR("Failed to get timestamp: %s", strerror(errno)); // LCOV_EXCL_LINE
+      }
+
+      SAS::TrailId trail = get_trail(rdata);
+
+      if ((latency_us > (request_on_queue_timeout_us)) &&
+          (rdata->msg_info.msg->type == PJSIP_REQUEST_MSG))
+      {
+        if (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD)
         {
-          if (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD)
-          {
-            // Discard non-ACK requests if the request has been on the queue for
-            // too long.
-            // Respond statelessly with a 503 Service Unavailable, including a
-            // Retry-After header with a zero length timeout.
-            TRC_DEBUG("Request has been on the queue too long (%dus, max is %dus)");
+          // Discard non-ACK requests if the request has been on the queue for
+          // too long.
+          // Respond statelessly with a 503 Service Unavailable, including a
+          // Retry-After header with a zero length timeout.
+          TRC_DEBUG("Request has been on the queue too long (%dus, max is %dus)");
 
-            SAS::Marker start_marker(trail, MARKER_ID_START, 2u);
-            SAS::report_marker(start_marker);
+          SAS::Marker start_marker(trail, MARKER_ID_START, 2u);
+          SAS::report_marker(start_marker);
 
-            SAS::Event event(trail, SASEvent::SIP_TOO_LONG_IN_QUEUE, 0);
-            event.add_static_param(latency_us/1000);
-            event.add_static_param(request_on_queue_timeout_us/1000);
-            SAS::report_event(event);
+          SAS::Event event(trail, SASEvent::SIP_TOO_LONG_IN_QUEUE, 0);
+          event.add_static_param(latency_us/1000);
+          event.add_static_param(request_on_queue_timeout_us/1000);
+          SAS::report_event(event);
 
-            SAS::Marker end_marker(trail, MARKER_ID_END, 2u);
-            SAS::report_marker(end_marker);
+          SAS::Marker end_marker(trail, MARKER_ID_END, 2u);
+          SAS::report_marker(end_marker);
 
-            reject_with_retry_header(rdata, PJSIP_SC_SERVICE_UNAVAILABLE);
-            pjsip_rx_data_free_cloned(rdata);
-          }
+          reject_with_retry_header(rdata, PJSIP_SC_SERVICE_UNAVAILABLE);
+          pjsip_rx_data_free_cloned(rdata);
         }
-        else
+      }
+      else
+      {
+        CW_TRY
+        {
+          pjsip_endpt_process_rx_data(stack_data.endpt,
+                                      rdata,
+                                      &pjsip_entry_point,
+                                      NULL);
+        }
+        // LCOV_EXCL_START
+        CW_EXCEPT(exception_handler)
         {
-          CW_TRY
+          // Dump details about the exception.  Be defensive about reading these
+          // as we don't know much about the state we're in.
+          TRC_ERROR("Hit exception handling message in worker thread. Details of probable cause follow");
+          dump_message_details(rdata);
+
+          // Make a 500 response to the rdata with a retry-after header of
+          // 10 mins if it's a request other than an ACK
+          if ((rdata->msg_info.msg->type == PJSIP_REQUEST_MSG) &&
+             (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD))
           {
-            pjsip_endpt_process_rx_data(stack_data.endpt,
-                                        rdata,
-                                        &pjsip_entry_point,
-                                        NULL);
+            TRC_DEBUG("Returning 500 response following exception");
+            reject_with_retry_header(rdata, PJSIP_SC_INTERNAL_SERVER_ERROR);
           }
-          // LCOV_EXCL_START
-          CW_EXCEPT(exception_handler)
-          {
-            // Dump details about the exception.  Be defensive about reading these
-            // as we don't know much about the state we're in.
-            TRC_ERROR("Hit exception handling message in worker thread. Details of probable cause follow");
-            dump_message_details(rdata);
 
-            // Make a 500 response to the rdata with a retry-after header of
-            // 10 mins if it's a request other than an ACK
-            if ((rdata->msg_info.msg->type == PJSIP_REQUEST_MSG) &&
-               (rdata->msg_info.msg->line.req.method.id != PJSIP_ACK_METHOD))
-            {
-              TRC_DEBUG("Returning 500 response following exception");
-              reject_with_retry_header(rdata, PJSIP_SC_INTERNAL_SERVER_ERROR);
-            }
-
-            if (num_worker_threads == 1)
-            {
-              // There's only one worker thread, so we can't sensibly proceed.
-              exit(1);
-            }
+          if (num_worker_threads == 1)
+          {
+            // There's only one worker thread, so we can't sensibly proceed.
+            exit(1);
           }
-          CW_END
-          // LCOV_EXCL_STOP
+        }
+        CW_END
+        // LCOV_EXCL_STOP
 
-          TRC_DEBUG("Worker thread completed processing message %p", rdata);
+        TRC_DEBUG("Worker thread completed processing message %p", rdata);
 
-          unsigned long latency_us = 0;
-          if (qe.stop_watch.read(latency_us))
+        unsigned long latency_us = 0;
+        if (qe.stop_watch.read(latency_us))
+        {
+          if ((50L * target_latency_us) < latency_us)
           {
-            if ((50L * target_latency_us) < latency_us)
-            {
-              TRC_WARNING("SIP Message took %ldus - vastly exceeding target of %ldus",
-                          latency_us,
-                          target_latency_us);
-              dump_message_details(rdata);
-            }
-            else
-            {
-              TRC_DEBUG("Request latency = %ldus", latency_us);
-            }
-
-            if (latency_table)
-            {
-              latency_table->accumulate(latency_us); // LCOV_EXCL_LINE
-            }
-            load_monitor->request_complete(latency_us, trail);
+            TRC_WARNING("SIP Message took %ldus - vastly exceeding target of %ldus",
+                        latency_us,
+                        target_latency_us);
+            dump_message_details(rdata);
           }
           else
           {
-            TRC_ERROR("Failed to get done timestamp: %s", strerror(errno)); // LCOV_EXCL_LINE
+            TRC_DEBUG("Request latency = %ldus", latency_us);
           }
 
-          pjsip_rx_data_free_cloned(rdata);
+          if (latency_table)
+          {
+            latency_table->accumulate(latency_us); // LCOV_EXCL_LINE
+          }
+
+          if (class_latency_tables[qe.message_class])
+          {
+            class_latency_tables[qe.message_class]->accumulate(latency_us); // LCOV_EXCL_LINE
+          }
+          load_monitor->request_complete(latency_us, trail);
+        }
+        else
+        {
+          TRC_ERROR("Failed to get done timestamp: %s", strerror(errno)); // LCOV_EXCL_LINE
         }
+
+        pjsip_rx_data_free_cloned(rdata);
+
+        // Unlike the latency above, the service time includes any time
+        // spent blocked on IO, as the worker thread can't process other
+        // messages while it is blocked.
+        record_service_time(get_monotonic_time_us() - dequeue_time_us);
       }
     }
-    else
-    {
-      // If this is a Callback, we just run it and then delete it.
-      PJUtils::Callback* cb = qe.event_data.callback;
-      cb->run();
-      delete cb; cb = nullptr;
-      TRC_DEBUG("Ran callback %p", cb);
-    }
   }
   else
+  {
+    // If this is a Callback, we just run it and then delete it.
+    PJUtils::Callback* cb = qe.event_data.callback;
+    cb->run();
+    delete cb; cb = nullptr;
+    TRC_DEBUG("Ran callback %p", cb);
+  }
+}
+
+bool process_queue_element(int worker_index)
+{
+  TRC_DEBUG("Attempting to process queue element");
+  SipEvent qe;
+
+  unsigned long target_latency_us = load_monitor->get_target_latency_us();
+
+  if (!pop_sip_event(worker_index, qe))
   {
     TRC_DEBUG("Unable to process queue element: queue has been terminated"); // LCOV_EXCL_LINE
+    return false;                                                             // LCOV_EXCL_LINE
   }
 
-  return rc;
+  --queued_events;
+  process_sip_event(qe, target_latency_us);
+
+  return true;
 }
 
 // LCOV_EXCL_START
@@ -302,12 +637,13 @@ bool process_queue_element()
 /// Worker threads handle most SIP message processing.
 int worker_thread(void* p)
 {
-  TRC_DEBUG("Worker thread started");
+  int worker_index = (int)(intptr_t)p;
+  TRC_DEBUG("Worker thread %d started", worker_index);
 
   bool rc = true;
 
   while (rc) {
-    rc = process_queue_element();
+    rc = process_queue_element(worker_index);
   }
 
   TRC_DEBUG("Worker thread ended");
@@ -355,18 +691,118 @@ static bool ignore_load_monitor(pjsip_rx_data* rdata)
   return false;
 }
 
-// Determines the priority value of a SIP message based on its method.
-static int get_rx_msg_priority(pjsip_rx_data* rdata)
+// Determines the SipMessageClass of a received SIP message.
+static int get_rx_msg_class(pjsip_rx_data* rdata)
+{
+  pjsip_msg* msg = rdata->msg_info.msg;
+
+  if (msg->type != PJSIP_REQUEST_MSG)
+  {
+    return SipMessageClass::RESPONSE;
+  }
+
+  const pjsip_method& method = msg->line.req.method;
+
+  if (method.id == PJSIP_OPTIONS_METHOD)
+  {
+    return SipMessageClass::OPTIONS;
+  }
+
+  if ((method.id == PJSIP_CANCEL_METHOD) ||
+      (method.id == PJSIP_BYE_METHOD) ||
+      (method.id == PJSIP_ACK_METHOD))
+  {
+    return SipMessageClass::CANCEL_BYE_ACK;
+  }
+
+  pjsip_to_hdr* to_hdr = PJSIP_MSG_TO_HDR(msg);
+  if ((to_hdr != NULL) && (to_hdr->tag.slen != 0))
+  {
+    return SipMessageClass::IN_DIALOG;
+  }
+
+  if ((method.id == PJSIP_REGISTER_METHOD) ||
+      (pjsip_method_cmp(&method, pjsip_get_subscribe_method()) == 0))
+  {
+    return SipMessageClass::REGISTRATION;
+  }
+
+  return SipMessageClass::INITIAL;
+}
+
+// Identifies the source of a received message for fair queueing.  Messages
+// are grouped by the IP address of the node that sent them, so a node's
+// connections are treated as a single source.
+static SipEventSource get_rx_msg_source(pjsip_rx_data* rdata)
+{
+  SipEventSource source;
+  const pj_sockaddr& addr = rdata->pkt_info.src_addr;
+
+  if (addr.addr.sa_family == pj_AF_INET6())
+  {
+    memcpy(source.addr, &addr.ipv6.sin6_addr, sizeof(source.addr));
+  }
+  else if (addr.addr.sa_family == pj_AF_INET())
+  {
+    source.addr[10] = 0xff;
+    source.addr[11] = 0xff;
+    memcpy(source.addr + 12, &addr.ipv4.sin_addr, 4);
+  }
+
+  return source;
+}
+
+bool SipEventSource::parse(const std::string& address)
+{
+  memset(addr, 0, sizeof(addr));
+
+  if (inet_pton(AF_INET6, address.c_str(), addr) == 1)
+  {
+    return true;
+  }
+
+  if (inet_pton(AF_INET, address.c_str(), addr + 12) == 1)
+  {
+    addr[10] = 0xff;
+    addr[11] = 0xff;
+    return true;
+  }
+
+  memset(addr, 0, sizeof(addr));
+  return false;
+}
+
+// Selects the event queue for a received message.  If there are per-worker
+// queues, messages are assigned to them by Call-ID so that all the messages in
+// a dialog are normally processed by the same worker thread.
+static size_t get_rx_msg_queue_index(pjsip_rx_data* rdata)
+{
+  if (sip_event_queues.size() == 1)
+  {
+    return 0;
+  }
+
+  pj_uint32_t hash = 0;
+  if (rdata->msg_info.cid != NULL)
+  {
+    hash = pj_hash_calc(0,
+                        rdata->msg_info.cid->id.ptr,
+                        rdata->msg_info.cid->id.slen);
+  }
+
+  return hash % sip_event_queues.size();
+}
+
+// Selects the event queue for a callback.  Callbacks have no dialog affinity,
+// so are spread across the per-worker queues round robin.
+static size_t get_callback_queue_index()
 {
-  // Monit probes Sprout using OPTIONS polls, so these are prioritised to
-  // prevent Monit killing Sprout during overload.
-  if (rdata->msg_info.msg->type == PJSIP_REQUEST_MSG &&
-      rdata->msg_info.msg->line.req.method.id == PJSIP_OPTIONS_METHOD)
+  if (sip_event_queues.size() == 1)
   {
-    return SipEventPriorityLevel::HIGH_PRIORITY;
+    return 0;
   }
 
-  return SipEventPriorityLevel::NORMAL_PRIORITY;
+  return next_callback_queue++ % sip_event_queues.size();
 }
 
 static pj_status_t reject_with_retry_header(pjsip_rx_data* rdata,
@@ -421,6 +857,79 @@ static void reject_rx_msg_overload(pjsip_rx_data* rdata, SAS::TrailId trail)
   }
 }
 
+static void reject_rx_msg_queue_wait(pjsip_rx_data* rdata,
+                                     SAS::TrailId trail,
+                                     unsigned long predicted_wait_us)
+{
+  // Respond statelessly with a 503 Service Unavailable, including a
+  // Retry-After header with a zero length timeout.
+  TRC_DEBUG("Rejected request as predicted queue wait is too long (%ldus, max is %ldus)",
+            predicted_wait_us,
+            request_on_queue_timeout_us);
+
+  SAS::Marker start_marker(trail, MARKER_ID_START, 1u);
+  SAS::report_marker(start_marker);
+
+  SAS::Event event(trail, SASEvent::SIP_PREDICTED_TOO_LONG_IN_QUEUE, 0);
+  event.add_static_param(predicted_wait_us / 1000);
+  event.add_static_param(request_on_queue_timeout_us / 1000);
+  SAS::report_event(event);
+
+  SAS::Marker end_marker(trail, MARKER_ID_END, 1u);
+  SAS::report_marker(end_marker);
+
+  pj_status_t status = reject_with_retry_header(rdata, PJSIP_SC_SERVICE_UNAVAILABLE);
+  if (status != PJ_SUCCESS)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to send 503 response: %s",
+            PJUtils::pj_status_to_string(status).c_str());
+    // LCOV_EXCL_STOP
+  }
+
+  if (queue_wait_reject_counter)
+  {
+    queue_wait_reject_counter->increment(); // LCOV_EXCL_LINE
+  }
+}
+
+static void reject_rx_msg_source_queue_full(pjsip_rx_data* rdata,
+                                            SAS::TrailId trail,
+                                            int source_depth)
+{
+  // Respond statelessly with a 503 Service Unavailable, including a
+  // Retry-After header with a zero length timeout.
+  TRC_DEBUG("Rejected request as source %s has too many queued messages (%d)",
+            rdata->pkt_info.src_name,
+            source_depth);
+
+  SAS::Marker start_marker(trail, MARKER_ID_START, 1u);
+  SAS::report_marker(start_marker);
+
+  SAS::Event event(trail, SASEvent::SIP_SOURCE_QUEUE_FULL, 0);
+  event.add_static_param(source_depth);
+  event.add_static_param(max_queue_depth_per_source);
+  event.add_var_param(rdata->pkt_info.src_name);
+  SAS::report_event(event);
+
+  SAS::Marker end_marker(trail, MARKER_ID_END, 1u);
+  SAS::report_marker(end_marker);
+
+  pj_status_t status = reject_with_retry_header(rdata, PJSIP_SC_SERVICE_UNAVAILABLE);
+  if (status != PJ_SUCCESS)
+  {
+    // LCOV_EXCL_START
+    TRC_ERROR("Failed to send 503 response: %s",
+            PJUtils::pj_status_to_string(status).c_str());
+    // LCOV_EXCL_STOP
+  }
+
+  if (source_reject_counter)
+  {
+    source_reject_counter->increment(); // LCOV_EXCL_LINE
+  }
+}
+
 static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
 {
   TRC_DEBUG("Recieved message %p on worker thread", rdata);
@@ -430,18 +939,55 @@ static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
   SAS::Event event(trail, SASEvent::BEGIN_THREAD_DISPATCHER, 0);
   SAS::report_event(event);
 
-  // Check whether the request should be rejected due to overload
-  if (!(ignore_load_monitor(rdata)) &&
-      !(load_monitor->admit_request(trail)))
+  SipEventSource source = get_rx_msg_source(rdata);
+
+  if (!ignore_load_monitor(rdata))
   {
-    reject_rx_msg_overload(rdata, trail);
-    return PJ_TRUE;
+    // Check whether the source of the request already has as many messages
+    // queued as it is allowed.  This stops a single source from building up
+    // an unbounded backlog on the queue.
+    if ((fair_queueing) && (max_queue_depth_per_source > 0))
+    {
+      int source_depth = get_source_depth(source);
+
+      if (source_depth >= max_queue_depth_per_source)
+      {
+        reject_rx_msg_source_queue_full(rdata, trail, source_depth);
+        return PJ_TRUE;
+      }
+    }
+
+    // Check whether the request would wait on the queue for so long that a
+    // worker thread would just reject it.  If so, reject it now, before
+    // spending any effort cloning it.
+    if (queue_wait_reject)
+    {
+      unsigned long predicted_wait_us = predict_queue_wait_us();
+
+      if (predicted_wait_us > request_on_queue_timeout_us)
+      {
+        reject_rx_msg_queue_wait(rdata, trail, predicted_wait_us);
+        return PJ_TRUE;
+      }
+    }
+
+    // Check whether the request should be rejected due to overload
+    if (!load_monitor->admit_request(trail))
+    {
+      reject_rx_msg_overload(rdata, trail);
+      return PJ_TRUE;
+    }
   }
 
   TRC_DEBUG("Admitted request %p on worker thread", rdata);
 
-  // Check that the worker threads are not all deadlocked.
-  if (sip_event_queue.is_deadlocked())
+  size_t queue_index = get_rx_msg_queue_index(rdata);
+  eventq<struct SipEvent>* queue = sip_event_queues[queue_index];
+
+  // Check that the worker threads are not all deadlocked.  With per-worker
+  // queues, other workers steal from the queue of a stuck worker, so the
+  // target queue only goes unserviced if all the workers are stuck.
+  if (queue->is_deadlocked())
   {
     // LCOV_EXCL_START
     // The queue has not been serviced for sufficiently long to imply that
@@ -457,10 +1003,14 @@ static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
   // receiving a message to forwarding it on (or rejecting it).
   SipEvent qe;
   qe.stop_watch.start();
+  qe.stamp_enqueue_time();
 
-  // Clone the message and queue it to a scheduler thread.
+  // Clone the message and queue it to a scheduler thread.  If parsing is
+  // deferred, the clone is only parsed when a worker thread picks it up.
   pjsip_rx_data* clone_rdata;
-  pj_status_t status = pjsip_rx_data_clone(rdata, 0, &clone_rdata);
+  pj_status_t status = (deferred_rx_parse) ?
+                         PJUtils::clone_rx_data_unparsed(rdata, &clone_rdata) :
+                         pjsip_rx_data_clone(rdata, 0, &clone_rdata);
 
   if (status != PJ_SUCCESS)
   {
@@ -488,9 +1038,12 @@ static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
   // Set up a SipEvent struct
   qe.event_data.rdata = clone_rdata;
   qe.type = MESSAGE;
+  qe.source = source;
 
-  // Set the message priority and log to SAS
-  qe.priority = get_rx_msg_priority(clone_rdata);
+  // Set the message priority and log to SAS.  Use the original message, as
+  // the clone may not have been parsed yet.
+  qe.message_class = get_rx_msg_class(rdata);
+  qe.priority = message_priorities[qe.message_class];
   TRC_DEBUG("Queuing cloned received message %p for worker threads with priority %d",
             clone_rdata, qe.priority);
   SAS::Event priority_event(trail, SASEvent::THREAD_DISPATCHER_SET_PRIORITY_LEVEL, 0);
@@ -500,9 +1053,21 @@ static pj_bool_t threads_on_rx_msg(pjsip_rx_data* rdata)
   // Track the current queue size
   if (queue_size_table)
   {
-    queue_size_table->accumulate(sip_event_queue.size()); // LCOV_EXCL_LINE
+    queue_size_table->accumulate(queued_events); // LCOV_EXCL_LINE
+  }
+  if (fair_queueing)
+  {
+    int source_depth = increment_source_depth(source);
+
+    if (source_queue_depth_table)
+    {
+      source_queue_depth_table->accumulate(source_depth); // LCOV_EXCL_LINE
+    }
   }
-  sip_event_queue.push(qe);
+
+  ++queued_events;
+  queue->push(qe);
+  wake_idle_worker(queue_index);
 
   // return TRUE to flag that we have absorbed the incoming message.
   return PJ_TRUE;
@@ -514,14 +1079,150 @@ pj_status_t init_thread_dispatcher(int num_worker_threads_arg,
                                    SNMP::CounterByScopeTable* overload_counter_arg,
                                    LoadMonitor* load_monitor_arg,
                                    ExceptionHandler* exception_handler_arg,
-                                   unsigned long request_on_queue_timeout_ms_arg)
+                                   unsigned long request_on_queue_timeout_ms_arg,
+                                   bool sharded_queues_arg,
+                                   bool deferred_rx_parse_arg,
+                                   bool queue_wait_reject_arg,
+                                   SNMP::CounterByScopeTable* queue_wait_reject_counter_arg,
+                                   bool fair_queueing_arg,
+                                   int max_queue_depth_per_source_arg,
+                                   SNMP::EventAccumulatorByScopeTable* source_queue_depth_table_arg,
+                                   SNMP::CounterByScopeTable* source_reject_counter_arg,
+                                   const std::vector<int>& message_priorities_arg,
+                                   const std::vector<SNMP::EventAccumulatorByScopeTable*>& class_latency_tables_arg,
+                                   const std::map<std::string, int>& source_weights_arg)
 {
   // Set up the vectors of threads.  The threads don't get created until
   // start_worker_threads is called.
   worker_threads.resize(num_worker_threads_arg);
 
-  // Enable deadlock detection on the message queue.
-  sip_event_queue.set_deadlock_threshold(MSG_Q_DEADLOCK_TIME);
+  // Set up the priority level of each message class.
+  if (message_priorities_arg.size() == (size_t)SipMessageClass::NUM_CLASSES)
+  {
+    message_priorities = message_priorities_arg;
+  }
+  else
+  {
+    message_priorities.assign(DEFAULT_MESSAGE_PRIORITIES,
+                              DEFAULT_MESSAGE_PRIORITIES + SipMessageClass::NUM_CLASSES);
+  }
+
+  // Callbacks are always queued at NORMAL_PRIORITY, so there must be at
+  // least the standard number of levels.
+  num_priority_levels = SipEventPriorityLevel::NUM_PRIORITY_LEVELS;
+  for (int ii = 0; ii < SipMessageClass::NUM_CLASSES; ++ii)
+  {
+    TRC_STATUS("Queueing %s messages at priority level %d",
+               SIP_MESSAGE_CLASS_NAMES[ii],
+               message_priorities[ii]);
+    num_priority_levels = std::max(num_priority_levels, message_priorities[ii] + 1);
+  }
+
+  class_latency_tables = class_latency_tables_arg;
+  class_latency_tables.resize(SipMessageClass::NUM_CLASSES, NULL);
+
+  // Set up the event queues, tidying up any queues left over from a previous
+  // initialization.  Worker 0 owns sip_event_queue, unless that has the wrong
+  // backend for the configuration (as the backend of sip_event_queue can't be
+  // replaced).
+  for (size_t ii = 0; ii < sip_event_queues.size(); ++ii)
+  {
+    if (sip_event_queues[ii] != &sip_event_queue)
+    {
+      delete sip_event_queues[ii];
+    }
+  }
+  sip_event_queues.clear();
+
+  sharded_queues = (sharded_queues_arg) && (num_worker_threads_arg > 1);
+  fair_queueing = fair_queueing_arg;
+  max_queue_depth_per_source = max_queue_depth_per_source_arg;
+
+  source_weights.clear();
+  for (std::map<std::string, int>::const_iterator it = source_weights_arg.begin();
+       it != source_weights_arg.end();
+       ++it)
+  {
+    SipEventSource source;
+    if (source.parse(it->first))
+    {
+      source_weights[source] = std::max(1, it->second);
+    }
+    else
+    {
+      TRC_ERROR("Ignoring fair queueing weight for invalid address %s",
+                it->first.c_str());
+    }
+  }
+
+  if (sharded_queues)
+  {
+    TRC_STATUS("Using per-worker event queues for %d worker threads",
+               num_worker_threads_arg);
+  }
+
+  if (fair_queueing)
+  {
+    TRC_STATUS("Using fair queueing between message sources (max queued per source %d)",
+               max_queue_depth_per_source);
+  }
+
+  int num_queues = (sharded_queues) ? num_worker_threads_arg : 1;
+
+  bool use_sip_event_queue =
+    ((!fair_queueing) &&
+     (num_priority_levels == SipEventPriorityLevel::NUM_PRIORITY_LEVELS));
+
+  for (int ii = 0; ii < num_queues; ++ii)
+  {
+    if ((ii == 0) && (use_sip_event_queue))
+    {
+      sip_event_queues.push_back(&sip_event_queue);
+    }
+    else if (fair_queueing)
+    {
+      sip_event_queues.push_back(
+                  new eventq<struct SipEvent>(0,
+                                              true,
+                                              new FairEventQueueBackend(num_priority_levels,
+                                                                        source_weights)));
+    }
+    else
+    {
+      sip_event_queues.push_back(
+                  new eventq<struct SipEvent>(0,
+                                              true,
+                                              new MultiLevelEventQueueBackend(num_priority_levels)));
+    }
+  }
+
+  for (int ii = 0; ii < NUM_SOURCE_DEPTH_SHARDS; ++ii)
+  {
+    pthread_mutex_lock(&source_depth_shards[ii].lock);
+    source_depth_shards[ii].depths.clear();
+    pthread_mutex_unlock(&source_depth_shards[ii].lock);
+  }
+
+  queued_events = 0;
+
+  idle_workers = std::vector<std::atomic_bool>(num_queues);
+  for (int ii = 0; ii < num_queues; ++ii)
+  {
+    idle_workers[ii] = false;
+  }
+
+  deferred_rx_parse = deferred_rx_parse_arg;
+  queue_wait_reject = queue_wait_reject_arg;
+  queue_wait_reject_counter = queue_wait_reject_counter_arg;
+  source_queue_depth_table = source_queue_depth_table_arg;
+  source_reject_counter = source_reject_counter_arg;
+  avg_service_time_us = 0;
+
+  // Enable deadlock detection on the message queues.
+  for (size_t ii = 0; ii < sip_event_queues.size(); ++ii)
+  {
+    sip_event_queues[ii]->set_deadlock_threshold(MSG_Q_DEADLOCK_TIME);
+  }
 
   num_worker_threads = num_worker_threads_arg;
   latency_table = latency_table_arg;
@@ -556,7 +1257,7 @@ pj_status_t start_worker_threads()
   {
     pj_thread_t* thread;
     status = pj_thread_create(stack_data.pool, "worker", &worker_thread,
-                              NULL, 0, 0, &thread);
+                              (void*)(intptr_t)ii, 0, 0, &thread);
     if (status != PJ_SUCCESS)
     {
       TRC_ERROR("Error creating worker thread, %s",
@@ -578,9 +1279,14 @@ void stop_worker_threads()
   // Now it is safe to signal the worker threads to exit via the queue and to
   // wait for them to terminate.
 
-  // Terminate the queue and delete all elements remaining on it
+  // Terminate the queues and delete all elements remaining on them
   std::vector<SipEvent> remaining_elts;
-  sip_event_queue.terminate(remaining_elts);
+  for (size_t ii = 0; ii < sip_event_queues.size(); ++ii)
+  {
+    std::vector<SipEvent> queue_elts;
+    sip_event_queues[ii]->terminate(queue_elts);
+    remaining_elts.insert(remaining_elts.end(), queue_elts.begin(), queue_elts.end());
+  }
   for (std::vector<SipEvent>::iterator qe = remaining_elts.begin();
        qe != remaining_elts.end();
        ++qe)
@@ -618,6 +1324,7 @@ void add_callback_to_queue(PJUtils::Callback* cb)
   SipEvent qe;
   qe.type = CALLBACK;
   qe.event_data.callback = cb;
+  qe.stamp_enqueue_time();
   // This maintains the previous behaviour with respect to callbacks, but in
   // future we may want to look at prioritizing them
   qe.priority = SipEventPriorityLevel::NORMAL_PRIORITY;
@@ -625,12 +1332,95 @@ void add_callback_to_queue(PJUtils::Callback* cb)
   // Track the current queue size
   if (queue_size_table)
   {
-    queue_size_table->accumulate(sip_event_queue.size()); // LCOV_EXCL_LINE
+    queue_size_table->accumulate(queued_events); // LCOV_EXCL_LINE
   }
 
   // Add the SipEvent
   TRC_DEBUG("Queuing callback %p for worker threads with priority %d",
             cb,
             qe.priority);
-  sip_event_queue.push(qe);
+  ++queued_events;
+  size_t queue_index = get_callback_queue_index();
+  sip_event_queues[queue_index]->push(qe);
+  wake_idle_worker(queue_index);
+}
+
+// Adds an event to a FIFO of events that is kept in time order.
+static void push_in_time_order(std::deque<SipEvent>& fifo,
+                               const SipEvent& value)
+{
+  if ((fifo.empty()) || (fifo.back().enqueue_time_us <= value.enqueue_time_us))
+  {
+    fifo.push_back(value);
+  }
+  else
+  {
+    // The event is older than the newest event in the FIFO, so search back
+    // from the newest event for the right place for it.
+    std::deque<SipEvent>::iterator it = fifo.end();
+    while ((it != fifo.begin()) &&
+           ((it - 1)->enqueue_time_us > value.enqueue_time_us))
+    {
+      --it;
+    }
+    fifo.insert(it, value);
+  }
+}
+
+// Maps an event's priority to a level, clamping out of range priorities to the
+// lowest priority level.
+static size_t priority_to_level(int priority, size_t num_levels)
+{
+  return std::min((size_t)std::max(priority, 0), num_levels - 1);
+}
+
+void MultiLevelEventQueueBackend::push(const SipEvent& value)
+{
+  push_in_time_order(_levels[priority_to_level(value.priority, _levels.size())],
+                     value);
+  ++_size;
+}
+
+void FairEventQueueBackend::push(const SipEvent& value)
+{
+  Level& level = _levels[priority_to_level(value.priority, _levels.size())];
+  Flow& flow = level.flows[value.source];
+
+  if (flow.events.empty())
+  {
+    // The source has no other events at this level, so joins the back of the
+    // queue of sources waiting for a turn.
+    std::map<SipEventSource, int>::const_iterator weight =
+                                                   _weights.find(value.source);
+    flow.weight = (weight != _weights.end()) ? weight->second : 1;
+    flow.turn_events = 0;
+    level.active.push_back(value.source);
+  }
+
+  push_in_time_order(flow.events, value);
+  ++_size;
+}
+
+void FairEventQueueBackend::pop()
+{
+  Level& level = _levels[highest_level()];
+  SipEventSource source = level.active.front();
+
+  std::map<SipEventSource, Flow>::iterator flow = level.flows.find(source);
+  flow->second.events.pop_front();
+  ++flow->second.turn_events;
+  --_size;
+
+  if (flow->second.events.empty())
+  {
+    level.active.pop_front();
+    level.flows.erase(flow);
+  }
+  else if (flow->second.turn_events >= flow->second.weight)
+  {
+    // The source has had its turn, so goes to the back of the queue.
+    flow->second.turn_events = 0;
+    level.active.pop_front();
+    level.active.push_back(source);
+  }
 }
@@ -0,0 +1,113 @@
+/**
+ * @file tsx_arena.cpp Arena for the state of a single SIP transaction.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "tsx_arena.h"
+#include "stack.h"
+#include "log.h"
+
+// Alignment of memory handed out by the arena.  PJSIP pools only align to
+// PJ_POOL_ALIGNMENT, which can be less than C++ objects need.
+static const size_t ARENA_ALIGNMENT = 16;
+
+// Size of each block the arena grows by once its first block is used up.
+static const size_t ARENA_INCREMENT = 4096;
+
+const size_t TsxArenaStats::MIN_INITIAL_SIZE;
+const size_t TsxArenaStats::MAX_INITIAL_SIZE;
+
+TsxArenaStats::TsxArenaStats() :
+  _arenas(0),
+  _allocations(0),
+  _bytes(0),
+  _overflows(0),
+  _high_water_bytes(0),
+  _average_bytes(0)
+{
+}
+
+size_t TsxArenaStats::initial_size() const
+{
+  // Allow a quarter again on top of the average, rounded up to a multiple
+  // of the alignment.
+  size_t size = _average_bytes + (_average_bytes / 4);
+  size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+  if (size < MIN_INITIAL_SIZE)
+  {
+    size = MIN_INITIAL_SIZE;
+  }
+  else if (size > MAX_INITIAL_SIZE)
+  {
+    size = MAX_INITIAL_SIZE;
+  }
+
+  return size;
+}
+
+void TsxArenaStats::record(int allocations, size_t used_bytes, bool overflowed)
+{
+  ++_arenas;
+  _allocations += allocations;
+  _bytes += used_bytes;
+
+  if (overflowed)
+  {
+    ++_overflows;
+  }
+
+  size_t high_water = _high_water_bytes;
+  while ((used_bytes > high_water) &&
+         (!_high_water_bytes.compare_exchange_weak(high_water, used_bytes)))
+  {
+  }
+
+  // Move the average an eighth of the way towards this arena's use.
+  size_t average = _average_bytes;
+  _average_bytes = average - (average / 8) + (used_bytes / 8);
+}
+
+TsxArena::TsxArena(TsxArenaStats* stats) :
+  _stats(stats),
+  _initial_size(stats->initial_size()),
+  _pool(pj_pool_create(&stack_data.cp.factory,
+                       "tsx-arena",
+                       _initial_size,
+                       ARENA_INCREMENT,
+                       NULL)),
+  _allocations(0)
+{
+}
+
+TsxArena::~TsxArena()
+{
+  size_t used = used_bytes();
+  bool overflowed = (pj_pool_get_capacity(_pool) > _initial_size);
+  TRC_DEBUG("Release transaction arena - %d allocations, %zu bytes%s",
+            _allocations, used, overflowed ? " (grew)" : "");
+  _stats->record(_allocations, used, overflowed);
+
+  pj_pool_release(_pool); _pool = NULL;
+}
+
+void* TsxArena::alloc(size_t size)
+{
+  ++_allocations;
+
+  // pj_pool_alloc calls the pool's failure callback rather than returning
+  // NULL if it can't get more memory.
+  char* ptr = (char*)pj_pool_alloc(_pool, size + ARENA_ALIGNMENT - 1);
+  return (void*)(((uintptr_t)ptr + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1));
+}
+
+size_t TsxArena::used_bytes() const
+{
+  return pj_pool_get_used_size(_pool);
+}
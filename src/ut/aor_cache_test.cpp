@@ -0,0 +1,198 @@
+/**
+ * @file aor_cache_test.cpp UT for the AoR cache in front of the AoR store.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+#include "aor_cache.h"
+#include "astaire_aor_store.h"
+#include "mock_store.h"
+#include "fakesnmp.hpp"
+#include "test_interposer.hpp"
+
+using ::testing::_;
+using ::testing::DoAll;
+using ::testing::InvokeWithoutArgs;
+using ::testing::Return;
+using ::testing::SetArgReferee;
+
+static const std::string AOR_ID = "sip:6505550231@homedomain";
+static const std::string AOR_JSON =
+  "{\"bindings\": {\"<urn:uuid:00000000-0000-0000-0000-b4dd32817622>:1\":"
+  "{\"uri\":\"sip:6505550231@192.91.191.29:59934;transport=tcp;ob\","
+  "\"cid\":\"gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq\",\"cseq\":10000,\"expires\":1000,"
+  "\"priority\":0,\"params\":{},\"paths\":[],\"private_id\":\"\","
+  "\"emergency_reg\":false}},"
+  "\"subscriptions\": {}, \"notify_cseq\": 1}";
+
+/// Fixture for AoRCacheTest.
+class AoRCacheTest : public ::testing::Test
+{
+  void SetUp()
+  {
+    cwtest_completely_control_time();
+    _datastore = new MockStore();
+    _cache = new AoRCache(1000, 1024 * 1024, &_hits, &_misses, &_stale);
+    _aor_store = new AstaireAoRStore(_datastore, _cache);
+  }
+
+  void TearDown()
+  {
+    delete _aor_store; _aor_store = NULL;
+    delete _cache; _cache = NULL;
+    delete _datastore; _datastore = NULL;
+    cwtest_reset_time();
+  }
+
+public:
+  void expect_get(uint64_t cas)
+  {
+    EXPECT_CALL(*_datastore, get_data("reg", AOR_ID, _, _, _))
+      .WillOnce(DoAll(SetArgReferee<2>(AOR_JSON),
+                      SetArgReferee<3>(cas),
+                      Return(Store::OK)));
+  }
+
+  SNMP::FakeCounterTable _hits;
+  SNMP::FakeCounterTable _misses;
+  SNMP::FakeCounterTable _stale;
+  MockStore* _datastore;
+  AoRCache* _cache;
+  AstaireAoRStore* _aor_store;
+};
+
+// A second read of an AoR is served from the cache.
+TEST_F(AoRCacheTest, ReadThrough)
+{
+  expect_get(5);
+
+  AoR* aor1 = _aor_store->get_aor_data(AOR_ID, 0);
+  ASSERT_TRUE(aor1 != NULL);
+  AoR* aor2 = _aor_store->get_aor_data(AOR_ID, 0);
+  ASSERT_TRUE(aor2 != NULL);
+
+  EXPECT_EQ(5u, aor2->_cas);
+  EXPECT_EQ(1u, aor2->get_bindings_count());
+  EXPECT_NE(aor1, aor2);
+  EXPECT_EQ(1, _misses._count);
+  EXPECT_EQ(1, _hits._count);
+
+  delete aor1;
+  delete aor2;
+}
+
+// Cached AoRs are only used for the TTL.
+TEST_F(AoRCacheTest, Expiry)
+{
+  expect_get(5);
+  delete _aor_store->get_aor_data(AOR_ID, 0);
+
+  cwtest_advance_time_ms(1001);
+
+  expect_get(6);
+  AoR* aor = _aor_store->get_aor_data(AOR_ID, 0);
+  ASSERT_TRUE(aor != NULL);
+  EXPECT_EQ(6u, aor->_cas);
+  EXPECT_EQ(0, _hits._count);
+  delete aor;
+}
+
+// Writing an AoR invalidates it, so the next read goes to the store.
+TEST_F(AoRCacheTest, WriteInvalidates)
+{
+  expect_get(5);
+  AoR* aor = _aor_store->get_aor_data(AOR_ID, 0);
+  AoRPair* aor_pair = new AoRPair(new AoR(*aor), aor);
+
+  EXPECT_CALL(*_datastore, set_data("reg", AOR_ID, _, 5, _, _))
+    .WillOnce(Return(Store::OK));
+  EXPECT_EQ(Store::OK, _aor_store->set_aor_data(AOR_ID, aor_pair, 300, 0));
+  EXPECT_EQ(0u, _cache->size());
+  EXPECT_EQ(0, _stale._count);
+
+  expect_get(6);
+  aor = _aor_store->get_aor_data(AOR_ID, 0);
+  EXPECT_EQ(6u, aor->_cas);
+
+  delete aor;
+  delete aor_pair;
+}
+
+// A write that fails on a CAS served from the cache is counted as stale.
+TEST_F(AoRCacheTest, StaleWrite)
+{
+  expect_get(5);
+  delete _aor_store->get_aor_data(AOR_ID, 0);
+  AoR* aor = _aor_store->get_aor_data(AOR_ID, 0);
+  AoRPair* aor_pair = new AoRPair(new AoR(*aor), aor);
+
+  EXPECT_CALL(*_datastore, set_data("reg", AOR_ID, _, 5, _, _))
+    .WillOnce(Return(Store::DATA_CONTENTION));
+  EXPECT_EQ(Store::DATA_CONTENTION,
+            _aor_store->set_aor_data(AOR_ID, aor_pair, 300, 0));
+  EXPECT_EQ(1, _stale._count);
+  EXPECT_EQ(0u, _cache->size());
+
+  delete aor_pair;
+}
+
+// An AoR that is written while it is being read from the store isn't cached,
+// as the read may have returned the data from before the write.
+TEST_F(AoRCacheTest, WriteDuringRead)
+{
+  AoRCache* cache = _cache;
+  EXPECT_CALL(*_datastore, get_data("reg", AOR_ID, _, _, _))
+    .WillOnce(DoAll(InvokeWithoutArgs([cache]()
+                                      {
+                                        cache->invalidate(AOR_ID, 5, false);
+                                      }),
+                    SetArgReferee<2>(AOR_JSON),
+                    SetArgReferee<3>(5),
+                    Return(Store::OK)));
+
+  AoR* aor = _aor_store->get_aor_data(AOR_ID, 0);
+  ASSERT_TRUE(aor != NULL);
+  EXPECT_EQ(0u, _cache->size());
+  delete aor;
+
+  // Reads that don't race with a write are cached as usual.
+  expect_get(6);
+  delete _aor_store->get_aor_data(AOR_ID, 0);
+  EXPECT_EQ(1u, _cache->size());
+}
+
+// Failed reads aren't cached.
+TEST_F(AoRCacheTest, ReadFailureNotCached)
+{
+  EXPECT_CALL(*_datastore, get_data("reg", AOR_ID, _, _, _))
+    .WillOnce(Return(Store::ERROR));
+  EXPECT_TRUE(_aor_store->get_aor_data(AOR_ID, 0) == NULL);
+  EXPECT_EQ(0u, _cache->size());
+}
+
+// The least recently used AoRs are evicted to stay within the memory limit.
+TEST_F(AoRCacheTest, MemoryLimit)
+{
+  AoR aor(AOR_ID);
+  size_t size = AoRCache::estimate_size("sip:1@homedomain", &aor);
+  AoRCache cache(1000, AoRCache::NUM_SHARDS * size * 2);
+
+  // Fill the cache with far more AoRs than it can hold.
+  for (int ii = 0; ii < 100 * AoRCache::NUM_SHARDS; ++ii)
+  {
+    std::string aor_id = "sip:" + std::to_string(ii) + "@homedomain";
+    cache.put(aor_id, &aor, cache.get_generation(aor_id));
+  }
+
+  EXPECT_LE(cache.size(), (size_t)AoRCache::NUM_SHARDS * 2);
+  EXPECT_GT(cache.size(), 0u);
+}
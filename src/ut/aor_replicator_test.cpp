@@ -0,0 +1,453 @@
+/**
+ * @file aor_replicator_test.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <string>
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "siptest.hpp"
+#include "localstore.h"
+#include "astaire_aor_store.h"
+#include "subscriber_data_manager.h"
+#include "aor_replicator.h"
+#include "fakechronosconnection.hpp"
+#include "fakesnmp.hpp"
+#include "mock_store.h"
+
+using ::testing::_;
+using ::testing::Invoke;
+
+/// Fixture for AoRReplicatorTest.  Sets up a local site and one remote site,
+/// each with its own store.
+class AoRReplicatorTest : public SipTest
+{
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  AoRReplicatorTest()
+  {
+    _chronos_connection = new FakeChronosConnection();
+    _local_datastore = new LocalStore();
+    _local_aor_store = new AstaireAoRStore(_local_datastore);
+    _local_sdm = new SubscriberDataManager(_local_aor_store,
+                                           _chronos_connection,
+                                           NULL,
+                                           true);
+    _remote_datastore = new LocalStore();
+    _remote_aor_store = new AstaireAoRStore(_remote_datastore);
+    _remote_sdm = new SubscriberDataManager(_remote_aor_store,
+                                            _chronos_connection,
+                                            NULL,
+                                            false);
+    _site_stats.lag_tbl = &_lag_tbl;
+    _site_stats.failures_tbl = &_failures_tbl;
+  }
+
+  virtual ~AoRReplicatorTest()
+  {
+    delete _remote_sdm; _remote_sdm = NULL;
+    delete _remote_aor_store; _remote_aor_store = NULL;
+    delete _remote_datastore; _remote_datastore = NULL;
+    delete _local_sdm; _local_sdm = NULL;
+    delete _local_aor_store; _local_aor_store = NULL;
+    delete _local_datastore; _local_datastore = NULL;
+    delete _chronos_connection; _chronos_connection = NULL;
+  }
+
+  /// Adds or refreshes a binding in the AoR at the local site, returning the
+  /// AoR pair written.
+  AoRPair* register_binding(const std::string& aor_id,
+                            const std::string& binding_id,
+                            int expires)
+  {
+    AoRPair* aor_pair = _local_sdm->get_aor_data(aor_id, 0);
+    AoR::Binding* b = aor_pair->get_current()->get_binding(binding_id);
+    b->_uri = "<sip:" + binding_id + "@192.91.191.29:59934;transport=tcp;ob>";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = 17038;
+    b->_expires = time(NULL) + expires;
+    b->_priority = 0;
+    b->_emergency_registration = false;
+    EXPECT_EQ(Store::OK,
+              _local_sdm->set_aor_data(aor_id,
+                                       SubscriberDataManager::EventTrigger::USER,
+                                       aor_pair,
+                                       0));
+    return aor_pair;
+  }
+
+  /// Waits for the remote site to hold the given number of bindings for an
+  /// AoR, returning the AoR pair read.
+  AoRPair* wait_for_remote_bindings(const std::string& aor_id,
+                                    size_t num_bindings)
+  {
+    AoRPair* aor_pair = NULL;
+
+    for (int ii = 0; ii < 100; ++ii)
+    {
+      delete aor_pair;
+      aor_pair = _remote_sdm->get_aor_data(aor_id, 0);
+
+      if (aor_pair->get_current()->bindings().size() == num_bindings)
+      {
+        break;
+      }
+
+      usleep(10000);
+    }
+
+    return aor_pair;
+  }
+
+  FakeChronosConnection* _chronos_connection;
+  LocalStore* _local_datastore;
+  AstaireAoRStore* _local_aor_store;
+  SubscriberDataManager* _local_sdm;
+  LocalStore* _remote_datastore;
+  AstaireAoRStore* _remote_aor_store;
+  SubscriberDataManager* _remote_sdm;
+  SNMP::FakeEventAccumulatorTable _lag_tbl;
+  SNMP::FakeCounterTable _failures_tbl;
+  SNMP::FakeCounterTable _dropped_tbl;
+  AoRReplicator::SiteStats _site_stats;
+};
+
+// Check that only the local changes are applied to the remote AoR.
+TEST_F(AoRReplicatorTest, ApplyChange)
+{
+  AoR* orig = new AoR("sip:6505550231@homedomain");
+  orig->get_binding("b1")->_expires = 100;
+  orig->get_binding("b2")->_expires = 100;
+  orig->get_subscription("s1")->_expires = 100;
+  orig->get_subscription("s2")->_expires = 100;
+
+  // Refresh b1, remove b2, add b3, remove s1 and leave s2 alone.
+  AoR* current = new AoR(*orig);
+  current->get_binding("b1")->_expires = 200;
+  current->remove_binding("b2");
+  current->get_binding("b3")->_expires = 300;
+  current->remove_subscription("s1");
+  current->_scscf_uri = "sip:scscf.homedomain";
+  AoRPair local_aor_pair(orig, current);
+
+  // The remote AoR has its own version of s2, and a binding the local site
+  // doesn't have.
+  AoR remote("sip:6505550231@homedomain");
+  remote.get_binding("b1")->_expires = 100;
+  remote.get_binding("b2")->_expires = 100;
+  remote.get_binding("b4")->_expires = 400;
+  remote.get_subscription("s1")->_expires = 100;
+  remote.get_subscription("s2")->_expires = 150;
+
+  AoRReplicator::apply_change(&local_aor_pair, &remote);
+
+  EXPECT_EQ(3u, remote.bindings().size());
+  EXPECT_EQ(200, remote.bindings().at("b1")->_expires);
+  EXPECT_EQ(0u, remote.bindings().count("b2"));
+  EXPECT_EQ(300, remote.bindings().at("b3")->_expires);
+  EXPECT_EQ(400, remote.bindings().at("b4")->_expires);
+  EXPECT_EQ(1u, remote.subscriptions().size());
+  EXPECT_EQ(150, remote.subscriptions().at("s2")->_expires);
+  EXPECT_EQ("sip:scscf.homedomain", remote._scscf_uri);
+
+  // The remote AoR has its own copies of the changed bindings.
+  EXPECT_NE(current->bindings().at("b1"), remote.bindings().at("b1"));
+}
+
+// Check that changes are written to the remote site in the background.
+TEST_F(AoRReplicatorTest, ReplicateToRemoteSite)
+{
+  AoRReplicator* replicator = new AoRReplicator({_remote_sdm},
+                                                {_site_stats},
+                                                &_dropped_tbl,
+                                                NULL,
+                                                1,
+                                                100);
+  std::string aor_id = "sip:6505550231@homedomain";
+
+  // The remote site doesn't have the AoR yet, so it gets all of it.
+  AoRPair* aor_pair = register_binding(aor_id, "b1", 300);
+  replicator->replicate(aor_id,
+                        SubscriberDataManager::EventTrigger::USER,
+                        aor_pair,
+                        0);
+  delete aor_pair; aor_pair = NULL;
+
+  AoRPair* remote_aor_pair = wait_for_remote_bindings(aor_id, 1);
+  EXPECT_EQ(1u, remote_aor_pair->get_current()->bindings().count("b1"));
+  delete remote_aor_pair; remote_aor_pair = NULL;
+
+  // A second binding is added to the remote AoR.
+  aor_pair = register_binding(aor_id, "b2", 300);
+  replicator->replicate(aor_id,
+                        SubscriberDataManager::EventTrigger::USER,
+                        aor_pair,
+                        0);
+  delete aor_pair; aor_pair = NULL;
+
+  remote_aor_pair = wait_for_remote_bindings(aor_id, 2);
+  EXPECT_EQ(1u, remote_aor_pair->get_current()->bindings().count("b2"));
+  delete remote_aor_pair; remote_aor_pair = NULL;
+
+  delete replicator; replicator = NULL;
+
+  EXPECT_EQ(2, _lag_tbl._count);
+  EXPECT_EQ(0, _failures_tbl._count);
+  EXPECT_EQ(0, _dropped_tbl._count);
+}
+
+// Check that changes are dropped when the queue is full.
+TEST_F(AoRReplicatorTest, QueueFull)
+{
+  AoRReplicator* replicator = new AoRReplicator({_remote_sdm},
+                                                {_site_stats},
+                                                &_dropped_tbl,
+                                                NULL,
+                                                1,
+                                                0);
+  std::string aor_id = "sip:6505550231@homedomain";
+
+  AoRPair* aor_pair = register_binding(aor_id, "b1", 300);
+  replicator->replicate(aor_id,
+                        SubscriberDataManager::EventTrigger::USER,
+                        aor_pair,
+                        0);
+  delete aor_pair; aor_pair = NULL;
+  delete replicator; replicator = NULL;
+
+  EXPECT_EQ(1, _dropped_tbl._count);
+  EXPECT_EQ(0, _lag_tbl._count);
+
+  AoRPair* remote_aor_pair = _remote_sdm->get_aor_data(aor_id, 0);
+  EXPECT_TRUE(remote_aor_pair->get_current()->bindings().empty());
+  delete remote_aor_pair; remote_aor_pair = NULL;
+}
+
+// Check that a change dropped because the queue was full is written to the
+// remote site with the next change to the AoR.
+TEST_F(AoRReplicatorTest, DroppedChangeResynced)
+{
+  // The remote site's store holds up reads until it is released, so that the
+  // queue can be filled.
+  std::atomic<bool> read_started(false);
+  std::atomic<bool> released(false);
+  MockStore gated_datastore;
+  EXPECT_CALL(gated_datastore, get_data(_, _, _, _, _))
+    .WillRepeatedly(Invoke([&](const std::string& table,
+                               const std::string& key,
+                               std::string& data,
+                               uint64_t& cas,
+                               SAS::TrailId trail)
+    {
+      read_started = true;
+
+      while (!released)
+      {
+        usleep(1000);
+      }
+
+      return _remote_datastore->get_data(table, key, data, cas, trail);
+    }));
+  EXPECT_CALL(gated_datastore, set_data(_, _, _, _, _, _))
+    .WillRepeatedly(Invoke([&](const std::string& table,
+                               const std::string& key,
+                               const std::string& data,
+                               uint64_t cas,
+                               int expiry,
+                               SAS::TrailId trail)
+    {
+      return _remote_datastore->set_data(table, key, data, cas, expiry, trail);
+    }));
+  AstaireAoRStore gated_aor_store(&gated_datastore);
+  SubscriberDataManager gated_sdm(&gated_aor_store,
+                                  _chronos_connection,
+                                  NULL,
+                                  false);
+
+  AoRReplicator* replicator = new AoRReplicator({&gated_sdm},
+                                                {_site_stats},
+                                                &_dropped_tbl,
+                                                NULL,
+                                                1,
+                                                1);
+  std::string aor_id = "sip:6505550231@homedomain";
+
+  // The first change is being written, the second is queued and the third
+  // doesn't fit.
+  AoRPair* aor_pair = register_binding(aor_id, "b1", 300);
+  replicator->replicate(aor_id,
+                        SubscriberDataManager::EventTrigger::USER,
+                        aor_pair,
+                        0);
+  delete aor_pair; aor_pair = NULL;
+
+  while (!read_started)
+  {
+    usleep(1000);
+  }
+
+  const char* binding_ids[] = {"b2", "b3"};
+  for (const char* binding_id : binding_ids)
+  {
+    aor_pair = register_binding(aor_id, binding_id, 300);
+    replicator->replicate(aor_id,
+                          SubscriberDataManager::EventTrigger::USER,
+                          aor_pair,
+                          0);
+    delete aor_pair; aor_pair = NULL;
+  }
+
+  EXPECT_EQ(1, _dropped_tbl._count);
+
+  released = true;
+  AoRPair* remote_aor_pair = wait_for_remote_bindings(aor_id, 2);
+  EXPECT_EQ(0u, remote_aor_pair->get_current()->bindings().count("b3"));
+  delete remote_aor_pair; remote_aor_pair = NULL;
+
+  // The next change only adds b4, but the whole AoR is written, so the
+  // remote site gets b3 too.
+  aor_pair = register_binding(aor_id, "b4", 300);
+  replicator->replicate(aor_id,
+                        SubscriberDataManager::EventTrigger::USER,
+                        aor_pair,
+                        0);
+  delete aor_pair; aor_pair = NULL;
+
+  remote_aor_pair = wait_for_remote_bindings(aor_id, 4);
+  EXPECT_EQ(1u, remote_aor_pair->get_current()->bindings().count("b3"));
+  EXPECT_EQ(1u, remote_aor_pair->get_current()->bindings().count("b4"));
+  delete remote_aor_pair; remote_aor_pair = NULL;
+
+  delete replicator; replicator = NULL;
+
+  EXPECT_EQ(3, _lag_tbl._count);
+  EXPECT_EQ(0, _failures_tbl._count);
+}
+
+// Check that the remote site is reported as behind while a change to the AoR
+// is queued for it, or after a change has been dropped.
+TEST_F(AoRReplicatorTest, SiteBehind)
+{
+  std::atomic<bool> released(false);
+  MockStore gated_datastore;
+  EXPECT_CALL(gated_datastore, get_data(_, _, _, _, _))
+    .WillRepeatedly(Invoke([&](const std::string& table,
+                               const std::string& key,
+                               std::string& data,
+                               uint64_t& cas,
+                               SAS::TrailId trail)
+    {
+      while (!released)
+      {
+        usleep(1000);
+      }
+
+      return _remote_datastore->get_data(table, key, data, cas, trail);
+    }));
+  EXPECT_CALL(gated_datastore, set_data(_, _, _, _, _, _))
+    .WillRepeatedly(Invoke([&](const std::string& table,
+                               const std::string& key,
+                               const std::string& data,
+                               uint64_t cas,
+                               int expiry,
+                               SAS::TrailId trail)
+    {
+      return _remote_datastore->set_data(table, key, data, cas, expiry, trail);
+    }));
+  AstaireAoRStore gated_aor_store(&gated_datastore);
+  SubscriberDataManager gated_sdm(&gated_aor_store,
+                                  _chronos_connection,
+                                  NULL,
+                                  false);
+
+  AoRReplicator* replicator = new AoRReplicator({&gated_sdm},
+                                                {_site_stats},
+                                                &_dropped_tbl,
+                                                NULL,
+                                                1,
+                                                100);
+  std::string aor_id = "sip:6505550231@homedomain";
+
+  EXPECT_FALSE(replicator->site_behind(aor_id, &gated_sdm));
+
+  AoRPair* aor_pair = register_binding(aor_id, "b1", 300);
+  replicator->replicate(aor_id,
+                        SubscriberDataManager::EventTrigger::USER,
+                        aor_pair,
+                        0);
+  delete aor_pair; aor_pair = NULL;
+
+  EXPECT_TRUE(replicator->site_behind(aor_id, &gated_sdm));
+  EXPECT_FALSE(replicator->site_behind("sip:6505550232@homedomain", &gated_sdm));
+  EXPECT_FALSE(replicator->site_behind(aor_id, _remote_sdm));
+
+  released = true;
+
+  for (int ii = 0;
+       (ii < 100) && (replicator->site_behind(aor_id, &gated_sdm));
+       ++ii)
+  {
+    usleep(10000);
+  }
+
+  EXPECT_FALSE(replicator->site_behind(aor_id, &gated_sdm));
+  delete replicator; replicator = NULL;
+
+  // A dropped change leaves the site behind.
+  replicator = new AoRReplicator({_remote_sdm},
+                                 {_site_stats},
+                                 &_dropped_tbl,
+                                 NULL,
+                                 1,
+                                 0);
+  aor_pair = register_binding(aor_id, "b2", 300);
+  replicator->replicate(aor_id,
+                        SubscriberDataManager::EventTrigger::USER,
+                        aor_pair,
+                        0);
+  delete aor_pair; aor_pair = NULL;
+
+  EXPECT_TRUE(replicator->site_behind(aor_id, _remote_sdm));
+  delete replicator; replicator = NULL;
+}
+
+// Check that a full write makes the remote AoR match the local one.
+TEST_F(AoRReplicatorTest, ApplyFull)
+{
+  AoR local("sip:6505550231@homedomain");
+  local.get_binding("b1")->_expires = 200;
+  local.get_binding("b3")->_expires = 300;
+  local.get_subscription("s2")->_expires = 200;
+  local._scscf_uri = "sip:scscf.homedomain";
+
+  AoR remote("sip:6505550231@homedomain");
+  remote.get_binding("b1")->_expires = 100;
+  remote.get_binding("b2")->_expires = 100;
+  remote.get_subscription("s1")->_expires = 100;
+
+  AoRReplicator::apply_full(&local, &remote);
+
+  EXPECT_EQ(2u, remote.bindings().size());
+  EXPECT_EQ(200, remote.bindings().at("b1")->_expires);
+  EXPECT_EQ(300, remote.bindings().at("b3")->_expires);
+  EXPECT_EQ(1u, remote.subscriptions().size());
+  EXPECT_EQ(200, remote.subscriptions().at("s2")->_expires);
+  EXPECT_EQ("sip:scscf.homedomain", remote._scscf_uri);
+  EXPECT_NE(local.bindings().at("b1"), remote.bindings().at("b1"));
+}
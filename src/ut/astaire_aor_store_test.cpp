@@ -0,0 +1,534 @@
+/**
+ * @file astaire_aor_store_test.cpp UT for the AoR store serialization formats.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <memory>
+#include <string>
+#include <sys/resource.h>
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "astaire_aor_store.h"
+#include "localstore.h"
+#include "mock_store.h"
+
+using ::testing::_;
+using ::testing::Invoke;
+
+static const std::string AOR_ID = "sip:6505550231@homedomain";
+
+/// Build an AoR with the given number of bindings, filled in the same way as
+/// a PBX registering many contacts through the same P-CSCF.
+static AoR* build_aor(int num_bindings)
+{
+  AoR* aor = new AoR(AOR_ID);
+
+  for (int ii = 0; ii < num_bindings; ++ii)
+  {
+    std::string id = "<urn:uuid:00000000-0000-0000-0000-b4dd32817622>:" + std::to_string(ii);
+    AoR::Binding* b = aor->get_binding(id);
+    b->_uri = "sip:6505550231@192.91.191.29:" + std::to_string(50000 + ii) + ";transport=tcp;ob";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq" + std::to_string(ii);
+    b->_cseq = 17038 + ii;
+    b->_expires = 1500000000 + ii;
+    b->_priority = 0;
+    b->_params["+sip.instance"] = "\"<urn:uuid:00000000-0000-0000-0000-b4dd32817622>\"";
+    b->_params["reg-id"] = "1";
+    b->_params["+sip.ice"] = "";
+    b->_path_headers.push_back("<sip:abcdefgh@bono-1.cw-ngv.com;lr>");
+    b->_path_uris.push_back("sip:abcdefgh@bono-1.cw-ngv.com;lr");
+    b->_private_id = "6505550231@homedomain";
+    b->_emergency_registration = (ii == 0);
+  }
+
+  AoR::Subscription* s = aor->get_subscription("1234");
+  s->_req_uri = "sip:5102175698@192.91.191.29:59934;transport=tcp";
+  s->_from_uri = "<sip:5102175698@cw-ngv.com>";
+  s->_from_tag = "4321";
+  s->_to_uri = "<sip:5102175698@cw-ngv.com>";
+  s->_to_tag = "1234";
+  s->_cid = "xyzabc@192.91.191.29";
+  s->_route_uris.push_back("<sip:abcdefgh@bono-1.cw-ngv.com;lr>");
+  s->_expires = -300;
+
+  aor->_associated_uris.add_uri(AOR_ID, false);
+  aor->_associated_uris.add_uri("sip:6505550232@homedomain", true);
+  aor->_associated_uris.add_wildcard_mapping("sip:6505550232@homedomain",
+                                             "sip:65055502!.*!@homedomain");
+  aor->_notify_cseq = 20;
+  aor->_timer_id = "123456";
+  aor->_scscf_uri = "sip:scscf.sprout.homedomain:5058;transport=TCP";
+
+  return aor;
+}
+
+static void expect_aors_equal(AoR* expected, AoR* actual)
+{
+  ASSERT_TRUE(actual != NULL);
+  ASSERT_EQ(expected->bindings().size(), actual->bindings().size());
+
+  for (AoR::Bindings::const_iterator it = expected->bindings().begin();
+       it != expected->bindings().end();
+       ++it)
+  {
+    AoR::Binding* b = actual->bindings().at(it->first);
+    EXPECT_EQ(it->second->_uri, b->_uri);
+    EXPECT_EQ(it->second->_cid, b->_cid);
+    EXPECT_EQ(it->second->_cseq, b->_cseq);
+    EXPECT_EQ(it->second->_expires, b->_expires);
+    EXPECT_EQ(it->second->_priority, b->_priority);
+    EXPECT_EQ(it->second->_params, b->_params);
+    EXPECT_EQ(it->second->_path_headers, b->_path_headers);
+    EXPECT_EQ(it->second->_path_uris, b->_path_uris);
+    EXPECT_EQ(it->second->_private_id, b->_private_id);
+    EXPECT_EQ(it->second->_emergency_registration, b->_emergency_registration);
+  }
+
+  ASSERT_EQ(expected->subscriptions().size(), actual->subscriptions().size());
+
+  for (AoR::Subscriptions::const_iterator it = expected->subscriptions().begin();
+       it != expected->subscriptions().end();
+       ++it)
+  {
+    AoR::Subscription* s = actual->subscriptions().at(it->first);
+    EXPECT_EQ(it->second->_req_uri, s->_req_uri);
+    EXPECT_EQ(it->second->_from_uri, s->_from_uri);
+    EXPECT_EQ(it->second->_from_tag, s->_from_tag);
+    EXPECT_EQ(it->second->_to_uri, s->_to_uri);
+    EXPECT_EQ(it->second->_to_tag, s->_to_tag);
+    EXPECT_EQ(it->second->_cid, s->_cid);
+    EXPECT_EQ(it->second->_route_uris, s->_route_uris);
+    EXPECT_EQ(it->second->_expires, s->_expires);
+  }
+
+  EXPECT_TRUE(expected->_associated_uris == actual->_associated_uris);
+  EXPECT_EQ(expected->_associated_uris.get_wildcard_mapping(),
+            actual->_associated_uris.get_wildcard_mapping());
+  EXPECT_EQ(expected->_notify_cseq, actual->_notify_cseq);
+  EXPECT_EQ(expected->_timer_id, actual->_timer_id);
+  EXPECT_EQ(expected->_scscf_uri, actual->_scscf_uri);
+}
+
+TEST(AstaireAoRStoreBinaryTest, RoundTrip)
+{
+  AstaireAoRStore::BinarySerializerDeserializer binary;
+  AoR* aor = build_aor(3);
+
+  std::string data = binary.serialize_aor(aor);
+  EXPECT_TRUE(binary.handles_data(data));
+
+  AoR* decoded = binary.deserialize_aor(AOR_ID, data);
+  expect_aors_equal(aor, decoded);
+
+  delete decoded;
+  delete aor;
+}
+
+TEST(AstaireAoRStoreBinaryTest, EmptyAoR)
+{
+  AstaireAoRStore::BinarySerializerDeserializer binary;
+  AoR* aor = new AoR(AOR_ID);
+
+  AoR* decoded = binary.deserialize_aor(AOR_ID, binary.serialize_aor(aor));
+  expect_aors_equal(aor, decoded);
+
+  delete decoded;
+  delete aor;
+}
+
+// Truncated or corrupted binary data isn't deserialized.
+TEST(AstaireAoRStoreBinaryTest, CorruptData)
+{
+  AstaireAoRStore::BinarySerializerDeserializer binary;
+  AoR* aor = build_aor(2);
+  std::string data = binary.serialize_aor(aor);
+
+  for (size_t length = 0; length < data.size(); ++length)
+  {
+    EXPECT_TRUE(binary.deserialize_aor(AOR_ID, data.substr(0, length)) == NULL);
+  }
+
+  std::string trailing = data + "x";
+  EXPECT_TRUE(binary.deserialize_aor(AOR_ID, trailing) == NULL);
+
+  std::string bad_version = data;
+  bad_version[1] = 99;
+  EXPECT_TRUE(binary.deserialize_aor(AOR_ID, bad_version) == NULL);
+
+  delete aor;
+}
+
+// Stores writing either format can read AoRs written in the other.
+TEST(AstaireAoRStoreBinaryTest, ReadsBothFormats)
+{
+  LocalStore local_store;
+  AstaireAoRStore json_store(&local_store, NULL, AstaireAoRStore::JSON);
+  AstaireAoRStore binary_store(&local_store, NULL, AstaireAoRStore::BINARY);
+  AoR* aor = build_aor(2);
+
+  AoR* new_aor = json_store.get_aor_data(AOR_ID, 0);
+  AoRPair* aor_pair = new AoRPair(new_aor, new AoR(*aor));
+  EXPECT_EQ(Store::OK, json_store.set_aor_data(AOR_ID, aor_pair, 300, 0));
+  delete aor_pair;
+
+  AoR* from_json = binary_store.get_aor_data(AOR_ID, 0);
+  expect_aors_equal(aor, from_json);
+
+  aor_pair = new AoRPair(new AoR(*from_json), from_json);
+  EXPECT_EQ(Store::OK, binary_store.set_aor_data(AOR_ID, aor_pair, 300, 0));
+  delete aor_pair;
+
+  AoR* from_binary = json_store.get_aor_data(AOR_ID, 0);
+  expect_aors_equal(aor, from_binary);
+
+  delete from_binary;
+  delete aor;
+}
+
+/// Reads an AoR and returns it paired with a copy to update, as the
+/// subscriber data manager does.
+static AoRPair* get_aor_pair(AstaireAoRStore& store)
+{
+  AoR* aor = store.get_aor_data(AOR_ID, 0);
+  EXPECT_TRUE(aor != NULL);
+  return new AoRPair(aor, new AoR(*aor));
+}
+
+static Store::Status set_aor_pair(AstaireAoRStore& store, AoRPair* aor_pair)
+{
+  Store::Status status = store.set_aor_data(AOR_ID, aor_pair, 300, 0);
+  delete aor_pair;
+  return status;
+}
+
+/// Writes an AoR to an empty store.
+static void write_aor(AstaireAoRStore& store, AoR* aor)
+{
+  AoR* orig = store.get_aor_data(AOR_ID, 0);
+  AoR* current = new AoR(*aor);
+  current->_cas = orig->_cas;
+  EXPECT_EQ(Store::OK, set_aor_pair(store, new AoRPair(orig, current)));
+}
+
+// An AoR written as deltas reads back the same, with either setting.
+TEST(AstaireAoRStoreDeltaTest, RoundTrip)
+{
+  LocalStore local_store;
+  AstaireAoRStore delta_store(&local_store, NULL, AstaireAoRStore::JSON, true);
+  AstaireAoRStore whole_store(&local_store);
+  AoR* aor = build_aor(3);
+
+  write_aor(delta_store, aor);
+
+  AoR* read_aor = delta_store.get_aor_data(AOR_ID, 0);
+  expect_aors_equal(aor, read_aor);
+  EXPECT_EQ(3u, read_aor->_binding_cas.size());
+  EXPECT_EQ(1u, read_aor->_subscription_cas.size());
+  delete read_aor;
+
+  read_aor = whole_store.get_aor_data(AOR_ID, 0);
+  expect_aors_equal(aor, read_aor);
+  delete read_aor;
+
+  delete aor;
+}
+
+// Concurrent refreshes of different bindings only rewrite their own binding
+// records, and don't rewrite the index.
+TEST(AstaireAoRStoreDeltaTest, ConcurrentRefreshes)
+{
+  LocalStore local_store;
+  AstaireAoRStore delta_store(&local_store, NULL, AstaireAoRStore::BINARY, true);
+  AoR* aor = build_aor(2);
+  aor->remove_subscription("1234");
+  write_aor(delta_store, aor);
+
+  std::string index_data;
+  uint64_t index_cas;
+  local_store.get_data("reg", AOR_ID, index_data, index_cas, 0);
+
+  std::string id0 = aor->bindings().begin()->first;
+  std::string id1 = aor->bindings().rbegin()->first;
+
+  AoRPair* pair0 = get_aor_pair(delta_store);
+  AoRPair* pair1 = get_aor_pair(delta_store);
+  pair0->get_current()->get_binding(id0)->_expires += 300;
+  pair0->get_current()->_notify_cseq++;
+  pair1->get_current()->get_binding(id1)->_expires += 600;
+  pair1->get_current()->_notify_cseq++;
+
+  EXPECT_EQ(Store::OK, set_aor_pair(delta_store, pair0));
+  EXPECT_EQ(Store::OK, set_aor_pair(delta_store, pair1));
+
+  AoR* read_aor = delta_store.get_aor_data(AOR_ID, 0);
+  EXPECT_EQ(aor->bindings().at(id0)->_expires + 300,
+            read_aor->bindings().at(id0)->_expires);
+  EXPECT_EQ(aor->bindings().at(id1)->_expires + 600,
+            read_aor->bindings().at(id1)->_expires);
+  EXPECT_EQ(aor->_notify_cseq + 1, read_aor->_notify_cseq);
+  EXPECT_EQ(index_cas, read_aor->_cas);
+  delete read_aor;
+
+  // Concurrent updates to the same binding still contend.
+  pair0 = get_aor_pair(delta_store);
+  pair1 = get_aor_pair(delta_store);
+  pair0->get_current()->get_binding(id0)->_expires += 300;
+  pair1->get_current()->get_binding(id0)->_expires += 600;
+
+  EXPECT_EQ(Store::OK, set_aor_pair(delta_store, pair0));
+  EXPECT_EQ(Store::DATA_CONTENTION, set_aor_pair(delta_store, pair1));
+
+  delete aor;
+}
+
+// Concurrent refreshes of different bindings of an AoR with subscriptions
+// contend on the subscription records, as each increments the notify CSeq
+// that NOTIFYs to them are sent with.
+TEST(AstaireAoRStoreDeltaTest, ConcurrentRefreshesWithSubscriptions)
+{
+  LocalStore local_store;
+  AstaireAoRStore delta_store(&local_store, NULL, AstaireAoRStore::BINARY, true);
+  AoR* aor = build_aor(2);
+  write_aor(delta_store, aor);
+
+  std::string id0 = aor->bindings().begin()->first;
+  std::string id1 = aor->bindings().rbegin()->first;
+
+  AoRPair* pair0 = get_aor_pair(delta_store);
+  AoRPair* pair1 = get_aor_pair(delta_store);
+  pair0->get_current()->get_binding(id0)->_expires += 300;
+  pair0->get_current()->_notify_cseq++;
+  pair1->get_current()->get_binding(id1)->_expires += 600;
+  pair1->get_current()->_notify_cseq++;
+
+  EXPECT_EQ(Store::OK, set_aor_pair(delta_store, pair0));
+  EXPECT_EQ(Store::DATA_CONTENTION, set_aor_pair(delta_store, pair1));
+
+  // The retried update picks up the first update's CSeq.
+  pair1 = get_aor_pair(delta_store);
+  pair1->get_current()->get_binding(id1)->_expires += 600;
+  pair1->get_current()->_notify_cseq++;
+  EXPECT_EQ(Store::OK, set_aor_pair(delta_store, pair1));
+
+  AoR* read_aor = delta_store.get_aor_data(AOR_ID, 0);
+  EXPECT_EQ(aor->bindings().at(id1)->_expires + 600,
+            read_aor->bindings().at(id1)->_expires);
+  EXPECT_EQ(aor->_notify_cseq + 2, read_aor->_notify_cseq);
+  delete read_aor;
+
+  delete aor;
+}
+
+// Adding and removing bindings updates the index.
+TEST(AstaireAoRStoreDeltaTest, AddAndRemoveBindings)
+{
+  LocalStore local_store;
+  AstaireAoRStore delta_store(&local_store, NULL, AstaireAoRStore::JSON, true);
+  AoR* aor = build_aor(2);
+  write_aor(delta_store, aor);
+
+  std::string removed_id = aor->bindings().begin()->first;
+
+  AoRPair* aor_pair = get_aor_pair(delta_store);
+  aor_pair->get_current()->remove_binding(removed_id);
+  AoR::Binding* b = aor_pair->get_current()->get_binding("new-binding");
+  *b = *aor->bindings().begin()->second;
+  EXPECT_EQ(Store::OK, set_aor_pair(delta_store, aor_pair));
+
+  AoR* read_aor = delta_store.get_aor_data(AOR_ID, 0);
+  EXPECT_EQ(2u, read_aor->bindings().size());
+  EXPECT_TRUE(read_aor->bindings().find(removed_id) == read_aor->bindings().end());
+  EXPECT_TRUE(read_aor->bindings().find("new-binding") != read_aor->bindings().end());
+  delete read_aor;
+
+  // Adding a binding contends with a concurrent change to the index.
+  AoRPair* pair0 = get_aor_pair(delta_store);
+  AoRPair* pair1 = get_aor_pair(delta_store);
+  pair0->get_current()->remove_binding("new-binding");
+  *pair1->get_current()->get_binding("another-binding") =
+                                            *aor->bindings().begin()->second;
+
+  EXPECT_EQ(Store::OK, set_aor_pair(delta_store, pair0));
+  EXPECT_EQ(Store::DATA_CONTENTION, set_aor_pair(delta_store, pair1));
+
+  delete aor;
+}
+
+/// Sets up a mock store that reads from the local store, but calls the given
+/// function the first time a binding record is read.
+template <class F>
+static void read_through(MockStore& mock_store, LocalStore& local_store, F on_first_binding_read)
+{
+  std::shared_ptr<bool> called(new bool(false));
+
+  EXPECT_CALL(mock_store, get_data(_, _, _, _, _))
+    .WillRepeatedly(Invoke([&local_store, on_first_binding_read, called]
+                           (const std::string& table,
+                            const std::string& key,
+                            std::string& data,
+                            uint64_t& cas,
+                            SAS::TrailId trail)
+    {
+      if ((!*called) && (key.find("\\b\\") != std::string::npos))
+      {
+        *called = true;
+        on_first_binding_read(table, key);
+      }
+
+      return local_store.get_data(table, key, data, cas, trail);
+    }));
+}
+
+// A binding removed while the AoR is being read is treated as a failed read,
+// and the AoR is read again.
+TEST(AstaireAoRStoreDeltaTest, RecordRemovedDuringRead)
+{
+  LocalStore local_store;
+  MockStore mock_store;
+  AstaireAoRStore delta_store(&local_store, NULL, AstaireAoRStore::JSON, true);
+  AstaireAoRStore reading_store(&mock_store, NULL, AstaireAoRStore::JSON, true);
+  AoR* aor = build_aor(2);
+  write_aor(delta_store, aor);
+
+  std::string removed_id = aor->bindings().begin()->first;
+
+  read_through(mock_store,
+               local_store,
+               [&delta_store, removed_id](const std::string& table,
+                                          const std::string& key)
+  {
+    AoRPair* aor_pair = get_aor_pair(delta_store);
+    aor_pair->get_current()->remove_binding(removed_id);
+    aor_pair->get_current()->_notify_cseq++;
+    EXPECT_EQ(Store::OK, set_aor_pair(delta_store, aor_pair));
+  });
+
+  AoR* read_aor = reading_store.get_aor_data(AOR_ID, 0);
+  ASSERT_TRUE(read_aor != NULL);
+  EXPECT_EQ(1u, read_aor->bindings().size());
+  EXPECT_TRUE(read_aor->bindings().find(removed_id) == read_aor->bindings().end());
+  EXPECT_EQ(aor->_notify_cseq + 1, read_aor->_notify_cseq);
+  delete read_aor;
+
+  delete aor;
+}
+
+// A binding record that is missing while the index is unchanged has expired,
+// so the AoR is read without it.
+TEST(AstaireAoRStoreDeltaTest, RecordExpired)
+{
+  LocalStore local_store;
+  MockStore mock_store;
+  AstaireAoRStore delta_store(&local_store, NULL, AstaireAoRStore::JSON, true);
+  AstaireAoRStore reading_store(&mock_store, NULL, AstaireAoRStore::JSON, true);
+  AoR* aor = build_aor(2);
+  write_aor(delta_store, aor);
+
+  read_through(mock_store,
+               local_store,
+               [&local_store](const std::string& table, const std::string& key)
+  {
+    local_store.delete_data(table, key, 0);
+  });
+
+  AoR* read_aor = reading_store.get_aor_data(AOR_ID, 0);
+  ASSERT_TRUE(read_aor != NULL);
+  EXPECT_EQ(1u, read_aor->bindings().size());
+  delete read_aor;
+
+  delete aor;
+}
+
+// An AoR written as a single record is converted to deltas when it is next
+// written, and back again.
+TEST(AstaireAoRStoreDeltaTest, ChangeSetting)
+{
+  LocalStore local_store;
+  AstaireAoRStore delta_store(&local_store, NULL, AstaireAoRStore::JSON, true);
+  AstaireAoRStore whole_store(&local_store);
+  AoR* aor = build_aor(2);
+  write_aor(whole_store, aor);
+
+  EXPECT_EQ(Store::OK, set_aor_pair(delta_store, get_aor_pair(delta_store)));
+
+  AoR* read_aor = delta_store.get_aor_data(AOR_ID, 0);
+  expect_aors_equal(aor, read_aor);
+  EXPECT_FALSE(read_aor->_delta_index.empty());
+  delete read_aor;
+
+  EXPECT_EQ(Store::OK, set_aor_pair(whole_store, get_aor_pair(whole_store)));
+
+  read_aor = whole_store.get_aor_data(AOR_ID, 0);
+  expect_aors_equal(aor, read_aor);
+  EXPECT_TRUE(read_aor->_delta_index.empty());
+  delete read_aor;
+
+  // Converting to deltas again overwrites the records left behind.
+  EXPECT_EQ(Store::OK, set_aor_pair(delta_store, get_aor_pair(delta_store)));
+
+  read_aor = delta_store.get_aor_data(AOR_ID, 0);
+  expect_aors_equal(aor, read_aor);
+  delete read_aor;
+
+  delete aor;
+}
+
+static long thread_cpu_time_us()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return (usage.ru_utime.tv_sec * 1000000L) + usage.ru_utime.tv_usec;
+}
+
+// Compares the size of each format, and the time to encode and decode it, for
+// AoRs of 1, 10 and 500 bindings.  Disabled by default - run with
+// --gtest_also_run_disabled_tests.
+TEST(AstaireAoRStoreBinaryTest, DISABLED_FormatBenchmark)
+{
+  const int ITERATIONS = 200;
+  int binding_counts[] = {1, 10, 500};
+  AstaireAoRStore::JsonSerializerDeserializer json;
+  AstaireAoRStore::BinarySerializerDeserializer binary;
+  AstaireAoRStore::SerializerDeserializer* formats[] = {&json, &binary};
+  const char* format_names[] = {"JSON", "binary"};
+
+  for (size_t ii = 0; ii < sizeof(binding_counts) / sizeof(binding_counts[0]); ++ii)
+  {
+    AoR* aor = build_aor(binding_counts[ii]);
+
+    for (size_t jj = 0; jj < 2; ++jj)
+    {
+      std::string data;
+
+      long start = thread_cpu_time_us();
+      for (int kk = 0; kk < ITERATIONS; ++kk)
+      {
+        data = formats[jj]->serialize_aor(aor);
+      }
+      long encode_us = thread_cpu_time_us() - start;
+
+      start = thread_cpu_time_us();
+      for (int kk = 0; kk < ITERATIONS; ++kk)
+      {
+        delete formats[jj]->deserialize_aor(AOR_ID, data);
+      }
+      long decode_us = thread_cpu_time_us() - start;
+
+      printf("%3d bindings, %-6s: %6zu bytes, encode %5.1f us, decode %5.1f us\n",
+             binding_counts[ii],
+             format_names[jj],
+             data.size(),
+             (double)encode_us / ITERATIONS,
+             (double)decode_us / ITERATIONS);
+    }
+
+    delete aor;
+  }
+}
@@ -0,0 +1,122 @@
+/**
+ * @file async_work_pool_test.cpp UT for the pool that runs blocking work off
+ * the worker threads.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <unistd.h>
+#include "gtest/gtest.h"
+
+#include "async_work_pool.h"
+
+/// Callbacks run so far.  The test callback queue runs callbacks straight
+/// away on the pool's thread.
+static std::atomic_int callbacks_run(0);
+
+static void run_callback(PJUtils::Callback* callback)
+{
+  callback->run();
+  delete callback;
+  ++callbacks_run;
+}
+
+/// Work that records whether it ran.
+class TestWork : public AsyncWork
+{
+public:
+  TestWork() : _ran(false) {}
+
+  void run() override
+  {
+    _ran = true;
+  }
+
+  std::atomic_bool _ran;
+};
+
+/// Callback that records the work it was called for.
+class TestCallback : public PJUtils::Callback
+{
+public:
+  TestCallback(AsyncWork* work, AsyncWork** completed) :
+    _work(work),
+    _completed(completed)
+  {}
+
+  void run() override
+  {
+    *_completed = _work;
+  }
+
+  AsyncWork* _work;
+  AsyncWork** _completed;
+};
+
+/// Fixture for AsyncWorkPoolTest.
+class AsyncWorkPoolTest : public ::testing::Test
+{
+  void SetUp()
+  {
+    callbacks_run = 0;
+    _pool = new AsyncWorkPool(NULL, 2, &run_callback);
+  }
+
+  void TearDown()
+  {
+    delete _pool; _pool = NULL;
+  }
+
+public:
+  // Waits for the given number of callbacks to have run.
+  void wait_for_callbacks(int count)
+  {
+    for (int ii = 0; (ii < 1000) && (callbacks_run < count); ++ii)
+    {
+      usleep(1000);
+    }
+  }
+
+  AsyncWorkPool* _pool;
+};
+
+// Work runs on the pool, and its callback is queued once it has run.
+TEST_F(AsyncWorkPoolTest, RunWork)
+{
+  TestWork work;
+  AsyncWork* completed = NULL;
+  _pool->run(&work, new TestCallback(&work, &completed));
+
+  wait_for_callbacks(1);
+  EXPECT_EQ(1, callbacks_run);
+  EXPECT_TRUE(work._ran);
+  EXPECT_EQ(&work, completed);
+}
+
+// Lots of work can be outstanding at once, and each piece gets its callback.
+TEST_F(AsyncWorkPoolTest, RunLotsOfWork)
+{
+  const int NUM_WORK = 100;
+  TestWork work[NUM_WORK];
+  AsyncWork* completed[NUM_WORK] = {};
+
+  for (int ii = 0; ii < NUM_WORK; ++ii)
+  {
+    _pool->run(&work[ii], new TestCallback(&work[ii], &completed[ii]));
+  }
+
+  wait_for_callbacks(NUM_WORK);
+  EXPECT_EQ(NUM_WORK, callbacks_run);
+
+  for (int ii = 0; ii < NUM_WORK; ++ii)
+  {
+    EXPECT_TRUE(work[ii]._ran);
+    EXPECT_EQ(&work[ii], completed[ii]);
+  }
+}
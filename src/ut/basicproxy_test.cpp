@@ -10,6 +10,8 @@
  */
 
 #include <string>
+#include <mutex>
+#include <unistd.h>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include <boost/lexical_cast.hpp>
@@ -24,6 +26,7 @@
 #include "faketransport_tcp.hpp"
 #include "test_interposer.hpp"
 #include "testingcommon.h"
+#include "fakesnmp.hpp"
 
 using namespace std;
 using testing::StrEq;
@@ -97,12 +100,17 @@ public:
     friend class BasicProxyUT;
   };
 
-  BasicProxyUT(pjsip_endpoint* endpt, int priority) :
+  BasicProxyUT(pjsip_endpoint* endpt,
+               int priority,
+               AsyncWorkPool* resolver_pool=NULL,
+               SNMP::EventAccumulatorTable* fork_latency_tbl=NULL) :
     BasicProxy(endpt,
                "UTProxy",
                priority,
                false,
-               std::set<std::string>({"stateless-proxy.awaydomain"}))
+               std::set<std::string>({"stateless-proxy.awaydomain"}),
+               resolver_pool,
+               fork_latency_tbl)
   {
   }
 
@@ -4403,3 +4411,227 @@ TEST_F(BasicProxyTest, TransportFailureWithCancelPending)
 
   delete tp;
 }
+
+
+/// Callbacks queued by the resolver pool, waiting to be run by the test.
+static std::mutex resolve_callbacks_lock;
+static std::list<PJUtils::Callback*> resolve_callbacks;
+
+static void queue_resolve_callback(PJUtils::Callback* callback)
+{
+  std::unique_lock<std::mutex> lock(resolve_callbacks_lock);
+  resolve_callbacks.push_back(callback);
+}
+
+/// Fixture for tests where the next hops of forked requests are resolved on a
+/// resolver pool.  The pool has a single thread, so the resolutions complete
+/// in the order the forks were created.
+class BasicProxyAsyncResolveTest : public BasicProxyTestBase
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+
+    _resolver_pool = new AsyncWorkPool(NULL, 1, &queue_resolve_callback);
+    _fork_latency_tbl = new SNMP::FakeEventAccumulatorTable();
+    _basic_proxy = new BasicProxyUT(stack_data.endpt,
+                                    PJSIP_MOD_PRIORITY_UA_PROXY_LAYER+1,
+                                    _resolver_pool,
+                                    _fork_latency_tbl);
+    SipTest::poll();
+
+    add_host_mapping("proxy1.homedomain", "10.10.10.1");
+    add_host_mapping("proxy2.homedomain", "10.10.10.2");
+  }
+
+  static void TearDownTestCase()
+  {
+    BasicProxyTestBase::TearDownTestCase();
+    delete _resolver_pool; _resolver_pool = NULL;
+    delete _fork_latency_tbl; _fork_latency_tbl = NULL;
+  }
+
+  /// Waits for the given number of resolutions to complete on the pool, then
+  /// runs their callbacks, as the worker threads would.
+  void run_resolve_callbacks(size_t count)
+  {
+    std::list<PJUtils::Callback*> callbacks;
+
+    for (int ii = 0; (ii < 1000) && (callbacks.size() < count); ++ii)
+    {
+      {
+        std::unique_lock<std::mutex> lock(resolve_callbacks_lock);
+        callbacks.splice(callbacks.end(), resolve_callbacks);
+      }
+
+      if (callbacks.size() < count)
+      {
+        usleep(1000);
+      }
+    }
+
+    ASSERT_EQ(count, callbacks.size());
+
+    for (PJUtils::Callback* callback : callbacks)
+    {
+      callback->run();
+      delete callback;
+    }
+  }
+
+  /// Injects an INVITE for bob@homedomain, which forks to three targets
+  /// reached through proxies that have to be resolved.
+  Message inject_forked_invite(TransportFlow* tp)
+  {
+    _basic_proxy->add_test_target("sip:bob@homedomain",
+                                  "sip:bob@node1.homedomain;transport=TCP",
+                                  std::list<std::string>(1, "sip:proxy1.homedomain;transport=TCP;lr"));
+    _basic_proxy->add_test_target("sip:bob@homedomain",
+                                  "sip:bob@node2.homedomain;transport=TCP",
+                                  std::list<std::string>(1, "sip:proxy2.homedomain;transport=TCP;lr"));
+    _basic_proxy->add_test_target("sip:bob@homedomain",
+                                  "sip:bob@node3.homedomain;transport=TCP",
+                                  std::list<std::string>(1, "sip:proxy2.homedomain;transport=TCP;lr"));
+
+    Message msg;
+    msg._first_hop = true;
+    msg._method = "INVITE";
+    msg._requri = "sip:bob@homedomain;transport=TCP";
+    msg._from = "alice";
+    msg._to = "bob";
+    msg._todomain = "awaydomain";
+    msg._via = tp->to_string(false);
+    msg._route = "Route: <sip:127.0.0.1;transport=TCP;lr>";
+    inject_msg(msg.get_request(), tp);
+
+    return msg;
+  }
+
+  static AsyncWorkPool* _resolver_pool;
+  static SNMP::FakeEventAccumulatorTable* _fork_latency_tbl;
+};
+
+AsyncWorkPool* BasicProxyAsyncResolveTest::_resolver_pool;
+SNMP::FakeEventAccumulatorTable* BasicProxyAsyncResolveTest::_fork_latency_tbl;
+
+// The forks of a request are all resolved on the pool at once, and each is
+// sent when its resolution completes.
+TEST_F(BasicProxyAsyncResolveTest, ForkedRequest)
+{
+  pjsip_tx_data* tdata;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+  int fork_latencies = _fork_latency_tbl->_count;
+  Message msg1 = inject_forked_invite(tp);
+
+  // Only the 100 Trying is sent while the next hops are resolved.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+  EXPECT_EQ(fork_latencies, _fork_latency_tbl->_count);
+
+  // Once all three resolutions complete, the three INVITEs are sent, and the
+  // latency of each fork is recorded.
+  run_resolve_callbacks(3);
+  ASSERT_EQ(3, txdata_count());
+  EXPECT_EQ(fork_latencies + 3, _fork_latency_tbl->_count);
+
+  pjsip_tx_data* tdata1 = pop_txdata();
+  expect_target("TCP", "10.10.10.1", 5060, tdata1);
+  ReqMatcher("INVITE").matches(tdata1->msg);
+  EXPECT_EQ("sip:bob@node1.homedomain;transport=TCP",
+            str_uri(tdata1->msg->line.req.uri));
+
+  pjsip_tx_data* tdata2 = pop_txdata();
+  expect_target("TCP", "10.10.10.2", 5060, tdata2);
+  ReqMatcher("INVITE").matches(tdata2->msg);
+  EXPECT_EQ("sip:bob@node2.homedomain;transport=TCP",
+            str_uri(tdata2->msg->line.req.uri));
+
+  pjsip_tx_data* tdata3 = pop_txdata();
+  expect_target("TCP", "10.10.10.2", 5060, tdata3);
+  ReqMatcher("INVITE").matches(tdata3->msg);
+  EXPECT_EQ("sip:bob@node3.homedomain;transport=TCP",
+            str_uri(tdata3->msg->line.req.uri));
+
+  // Fail two of the forks and answer the third.
+  inject_msg(respond_to_txdata(tdata1, 480));
+  ASSERT_EQ(1, txdata_count());
+  ReqMatcher("ACK").matches(current_txdata()->msg);
+  free_txdata();
+
+  inject_msg(respond_to_txdata(tdata3, 480));
+  ASSERT_EQ(1, txdata_count());
+  ReqMatcher("ACK").matches(current_txdata()->msg);
+  free_txdata();
+
+  inject_msg(respond_to_txdata(tdata2, 200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  _basic_proxy->remove_test_targets("sip:bob@homedomain");
+
+  delete tp;
+}
+
+// A request CANCELled while its forks are being resolved is never sent, and
+// the originator gets a 487.
+TEST_F(BasicProxyAsyncResolveTest, CancelWhileResolving)
+{
+  pjsip_tx_data* tdata;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+  Message msg1 = inject_forked_invite(tp);
+
+  ASSERT_EQ(1, txdata_count());
+  RespMatcher(100).matches(current_txdata()->msg);
+  free_txdata();
+
+  // Send a CANCEL from the originator before any resolution completes.
+  Message msg2;
+  msg2._first_hop = true;
+  msg2._method = "CANCEL";
+  msg2._requri = "sip:bob@homedomain;transport=TCP";
+  msg2._from = "alice";
+  msg2._to = "bob";
+  msg2._todomain = "awaydomain";
+  msg2._via = tp->to_string(false);
+  msg2._unique = msg1._unique;
+  inject_msg(msg2.get_request(), tp);
+
+  // The CANCEL is answered, and as no fork has been sent, the INVITE fails
+  // with a 487 straight away.
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(487).matches(tdata->msg);
+  free_txdata();
+
+  // Nothing is sent when the resolutions complete.
+  run_resolve_callbacks(3);
+  ASSERT_EQ(0, txdata_count());
+
+  msg1._method = "ACK";
+  inject_msg(msg1.get_request(), tp);
+
+  _basic_proxy->remove_test_targets("sip:bob@homedomain");
+
+  delete tp;
+}
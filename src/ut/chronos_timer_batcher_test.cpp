@@ -0,0 +1,223 @@
+/**
+ * @file chronos_timer_batcher_test.cpp
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <string>
+#include "gtest/gtest.h"
+
+#include "basetest.hpp"
+#include "localstore.h"
+#include "astaire_aor_store.h"
+#include "chronos_timer_batcher.h"
+#include "fakesnmp.hpp"
+#include "test_interposer.hpp"
+
+/// ChronosConnection that counts the requests sent to it.  New timers are
+/// given IDs "timer1", "timer2" and so on.
+class CountingChronosConnection : public ChronosConnection
+{
+public:
+  CountingChronosConnection() :
+    ChronosConnection("localhost", "localhost:9888", NULL, NULL),
+    _posts(0),
+    _puts(0),
+    _deletes(0)
+  {}
+
+  HTTPCode send_delete(const std::string& delete_identity,
+                       SAS::TrailId trail)
+  {
+    ++_deletes;
+    return HTTP_OK;
+  }
+
+  HTTPCode send_post(std::string& post_identity,
+                     uint32_t timer_interval,
+                     const std::string& callback_uri,
+                     const std::string& opaque_data,
+                     SAS::TrailId trail,
+                     const std::map<std::string, uint32_t>& tags)
+  {
+    post_identity = "timer" + std::to_string(++_posts);
+    _last_interval = timer_interval;
+    return HTTP_OK;
+  }
+
+  HTTPCode send_put(std::string& put_identity,
+                    uint32_t timer_interval,
+                    const std::string& callback_uri,
+                    const std::string& opaque_data,
+                    SAS::TrailId trail,
+                    const std::map<std::string, uint32_t>& tags)
+  {
+    ++_puts;
+    _last_interval = timer_interval;
+    return HTTP_OK;
+  }
+
+  std::atomic<int> _posts;
+  std::atomic<int> _puts;
+  std::atomic<int> _deletes;
+  std::atomic<uint32_t> _last_interval;
+};
+
+class ChronosTimerBatcherTest : public BaseTest
+{
+  ChronosTimerBatcherTest()
+  {
+    _chronos_connection = new CountingChronosConnection();
+    _datastore = new LocalStore();
+    _aor_store = new AstaireAoRStore(_datastore);
+
+    // Use a long window, so the tests control when timers are sent.
+    _batcher = new ChronosTimerBatcher(_chronos_connection,
+                                       _aor_store,
+                                       60000,
+                                       &_batch_size_tbl,
+                                       &_delay_tbl,
+                                       NULL,
+                                       2);
+  }
+
+  virtual ~ChronosTimerBatcherTest()
+  {
+    delete _batcher; _batcher = NULL;
+    delete _aor_store; _aor_store = NULL;
+    delete _datastore; _datastore = NULL;
+    delete _chronos_connection; _chronos_connection = NULL;
+  }
+
+  /// Writes an AoR with one binding to the store.
+  void write_aor(const std::string& aor_id, const std::string& timer_id)
+  {
+    AoRPair aor_pair(aor_id);
+    AoR::Binding* b = aor_pair.get_current()->get_binding("binding1");
+    b->_uri = "<sip:6505550231@192.91.191.29:59934;transport=tcp;ob>";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = 17038;
+    b->_expires = time(NULL) + 300;
+    b->_priority = 0;
+    b->_emergency_registration = false;
+    aor_pair.get_current()->_timer_id = timer_id;
+    EXPECT_EQ(Store::OK, _aor_store->set_aor_data(aor_id, &aor_pair, 300, 0));
+  }
+
+  /// Reads the timer ID from the AoR in the store.
+  std::string read_timer_id(const std::string& aor_id)
+  {
+    AoR* aor = _aor_store->get_aor_data(aor_id, 0);
+    std::string timer_id = aor->_timer_id;
+    delete aor;
+    return timer_id;
+  }
+
+  CountingChronosConnection* _chronos_connection;
+  LocalStore* _datastore;
+  AstaireAoRStore* _aor_store;
+  SNMP::FakeEventAccumulatorTable _batch_size_tbl;
+  SNMP::FakeEventAccumulatorTable _delay_tbl;
+  ChronosTimerBatcher* _batcher;
+};
+
+// Check that requests for the same AoR within a window are sent as one, and
+// that requests for different AoRs are sent in one batch.
+TEST_F(ChronosTimerBatcherTest, Coalesce)
+{
+  std::map<std::string, uint32_t> tags;
+  write_aor("sip:6505550231@homedomain", "");
+  write_aor("sip:6505550232@homedomain", "existing");
+
+  _batcher->set_timer("sip:6505550231@homedomain", "", 100, tags, 0);
+  _batcher->set_timer("sip:6505550231@homedomain", "", 200, tags, 0);
+  _batcher->set_timer("sip:6505550231@homedomain", "", 300, tags, 0);
+  _batcher->set_timer("sip:6505550232@homedomain", "existing", 300, tags, 0);
+
+  // Deleting the batcher sends everything waiting.
+  delete _batcher; _batcher = NULL;
+
+  EXPECT_EQ(1, _chronos_connection->_posts);
+  EXPECT_EQ(1, _chronos_connection->_puts);
+  EXPECT_EQ(0, _chronos_connection->_deletes);
+  EXPECT_EQ(1, _batch_size_tbl._count);
+  EXPECT_EQ(2, _delay_tbl._count);
+}
+
+// Check that the ID of a new timer is written back to the AoR.
+TEST_F(ChronosTimerBatcherTest, WriteBackTimerId)
+{
+  std::map<std::string, uint32_t> tags;
+  write_aor("sip:6505550231@homedomain", "");
+
+  _batcher->set_timer("sip:6505550231@homedomain", "", 300, tags, 0);
+  delete _batcher; _batcher = NULL;
+
+  EXPECT_EQ(1, _chronos_connection->_posts);
+  EXPECT_EQ("timer1", read_timer_id("sip:6505550231@homedomain"));
+}
+
+// Check that a request made while a new timer is being created for the AoR
+// updates that timer rather than creating another.
+TEST_F(ChronosTimerBatcherTest, UpdateNewTimer)
+{
+  std::map<std::string, uint32_t> tags;
+  write_aor("sip:6505550231@homedomain", "");
+
+  _batcher->set_timer("sip:6505550231@homedomain", "", 300, tags, 0);
+  _batcher->flush();
+  _batcher->set_timer("sip:6505550231@homedomain", "", 600, tags, 0);
+  delete _batcher; _batcher = NULL;
+
+  EXPECT_EQ(1, _chronos_connection->_posts);
+  EXPECT_EQ(1, _chronos_connection->_puts);
+  EXPECT_EQ(600u, _chronos_connection->_last_interval);
+  EXPECT_EQ("timer1", read_timer_id("sip:6505550231@homedomain"));
+}
+
+// Check that a new timer is deleted if the AoR has gone by the time it is
+// created.
+TEST_F(ChronosTimerBatcherTest, AoRRemoved)
+{
+  std::map<std::string, uint32_t> tags;
+
+  _batcher->set_timer("sip:6505550231@homedomain", "", 300, tags, 0);
+  delete _batcher; _batcher = NULL;
+
+  EXPECT_EQ(1, _chronos_connection->_posts);
+  EXPECT_EQ(1, _chronos_connection->_deletes);
+}
+
+// Check that deleting a timer is sent.
+TEST_F(ChronosTimerBatcherTest, DeleteTimer)
+{
+  _batcher->delete_timer("sip:6505550231@homedomain", "timer1", 0);
+  delete _batcher; _batcher = NULL;
+
+  EXPECT_EQ(0, _chronos_connection->_posts);
+  EXPECT_EQ(1, _chronos_connection->_deletes);
+}
+
+// Check that the time a request waits to be sent is taken off the timer
+// length, rounded so the timer doesn't pop early.
+TEST_F(ChronosTimerBatcherTest, WaitTakenOffExpiry)
+{
+  std::map<std::string, uint32_t> tags;
+  write_aor("sip:6505550231@homedomain", "existing");
+
+  cwtest_completely_control_time();
+  _batcher->set_timer("sip:6505550231@homedomain", "existing", 300, tags, 0);
+  cwtest_advance_time_ms(10500);
+  _batcher->flush();
+  delete _batcher; _batcher = NULL;
+  cwtest_reset_time();
+
+  EXPECT_EQ(1, _chronos_connection->_puts);
+  EXPECT_EQ(290u, _chronos_connection->_last_interval);
+}
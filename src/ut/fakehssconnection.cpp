@@ -227,7 +227,7 @@ long FakeHSSConnection::get_xml_object(const std::string& path,
     root = new rapidxml::xml_document<>;
     try
     {
-      root->parse<0>(root->allocate_string(i->second.c_str()));
+      root->parse<HSSConnection::XML_PARSE_FLAGS>(root->allocate_string(i->second.c_str()));
       http_code = HTTP_OK;
     }
     catch (rapidxml::parse_error& err)
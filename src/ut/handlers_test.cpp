@@ -1179,6 +1179,64 @@ TEST_F(DeleteImpuTaskTest, BadMethod)
   task->run();
 }
 
+//
+// Test reading the transaction arena statistics.
+//
+
+class GetTsxArenaStatsTest : public TestWithMockSdms
+{
+};
+
+TEST_F(GetTsxArenaStatsTest, Mainline)
+{
+  TsxArenaStats stats;
+  stats.record(10, 2000, false);
+  stats.record(20, 3000, true);
+
+  MockHttpStack::Request req(stack, "/tsx-arenas", "");
+  GetTsxArenaStatsTask::Config config(&stats);
+  GetTsxArenaStatsTask* task = new GetTsxArenaStatsTask(req, &config, 0);
+
+  EXPECT_CALL(*stack, send_reply(_, 200, _));
+  task->run();
+
+  rapidjson::Document document;
+  document.Parse(req.content().c_str());
+  ASSERT_TRUE(document.IsObject());
+  EXPECT_EQ(2u, document["arenas"].GetUint64());
+  EXPECT_EQ(30u, document["allocations"].GetUint64());
+  EXPECT_EQ(5000u, document["bytes"].GetUint64());
+  EXPECT_EQ(3000u, document["high_water_bytes"].GetUint64());
+  EXPECT_EQ(1u, document["overflows"].GetUint64());
+  EXPECT_EQ(stats.initial_size(), document["initial_size"].GetUint64());
+}
+
+TEST_F(GetTsxArenaStatsTest, NoSproutletProxy)
+{
+  MockHttpStack::Request req(stack, "/tsx-arenas", "");
+  GetTsxArenaStatsTask::Config config(NULL);
+  GetTsxArenaStatsTask* task = new GetTsxArenaStatsTask(req, &config, 0);
+
+  EXPECT_CALL(*stack, send_reply(_, 404, _));
+  task->run();
+}
+
+TEST_F(GetTsxArenaStatsTest, BadMethod)
+{
+  TsxArenaStats stats;
+  MockHttpStack::Request req(stack,
+                             "/tsx-arenas",
+                             "",
+                             "",
+                             "",
+                             htp_method_PUT);
+  GetTsxArenaStatsTask::Config config(&stats);
+  GetTsxArenaStatsTask* task = new GetTsxArenaStatsTask(req, &config, 0);
+
+  EXPECT_CALL(*stack, send_reply(_, 405, _));
+  task->run();
+}
+
 
 
 
@@ -0,0 +1,178 @@
+/**
+ * @file hss_cache_test.cpp UT for the cache of subscriber data read from
+ * Homestead.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "hss_cache.h"
+#include "xml_utils.h"
+#include "fakesnmp.hpp"
+#include "test_interposer.hpp"
+
+static const std::string IMPU = "sip:6505550231@homedomain";
+
+/// Fixture for HSSCacheTest.
+class HSSCacheTest : public ::testing::Test
+{
+  void SetUp()
+  {
+    cwtest_completely_control_time();
+    _cache = new HSSCache(1000, 1024 * 1024, &_hits, &_misses);
+  }
+
+  void TearDown()
+  {
+    delete _cache; _cache = NULL;
+    cwtest_reset_time();
+  }
+
+public:
+  static HSSConnection::irs_info registered_irs_info()
+  {
+    HSSConnection::irs_info irs_info;
+    irs_info._regstate = RegDataXMLUtils::STATE_REGISTERED;
+    irs_info._associated_uris.add_uri(IMPU, false);
+    irs_info._associated_uris.add_uri("tel:6505550231", false);
+    irs_info._ccfs.push_back("ccf1");
+    return irs_info;
+  }
+
+  HSSCache* _cache;
+  SNMP::FakeCounterTable _hits;
+  SNMP::FakeCounterTable _misses;
+};
+
+// Data put in the cache is returned until it expires.
+TEST_F(HSSCacheTest, PutGet)
+{
+  HSSConnection::irs_info irs_info;
+  EXPECT_FALSE(_cache->get(IMPU, irs_info));
+  EXPECT_EQ(1, _misses._count);
+
+  _cache->put(IMPU, registered_irs_info(), NULL, 0);
+  EXPECT_EQ(1u, _cache->size());
+
+  EXPECT_TRUE(_cache->get(IMPU, irs_info));
+  EXPECT_EQ(1, _hits._count);
+  EXPECT_EQ(RegDataXMLUtils::STATE_REGISTERED, irs_info._regstate);
+  EXPECT_EQ(2u, irs_info._associated_uris.get_all_uris().size());
+  ASSERT_EQ(1u, irs_info._ccfs.size());
+  EXPECT_EQ("ccf1", irs_info._ccfs.front());
+}
+
+// Entries aren't returned once their TTL has passed.
+TEST_F(HSSCacheTest, Expiry)
+{
+  HSSConnection::irs_info irs_info;
+  _cache->put(IMPU, registered_irs_info(), NULL, 0);
+
+  cwtest_advance_time_ms(1001);
+
+  EXPECT_FALSE(_cache->get(IMPU, irs_info));
+  EXPECT_EQ(0, _hits._count);
+  EXPECT_EQ(1, _misses._count);
+  EXPECT_EQ(0u, _cache->size());
+  EXPECT_EQ(0u, _cache->bytes());
+}
+
+// Invalidating an entry removes it.
+TEST_F(HSSCacheTest, Invalidate)
+{
+  HSSConnection::irs_info irs_info;
+  _cache->put(IMPU, registered_irs_info(), NULL, 0);
+  _cache->put("sip:6505550232@homedomain", registered_irs_info(), NULL, 0);
+
+  _cache->invalidate(IMPU);
+
+  EXPECT_FALSE(_cache->get(IMPU, irs_info));
+  EXPECT_TRUE(_cache->get("sip:6505550232@homedomain", irs_info));
+  EXPECT_EQ(1u, _cache->size());
+}
+
+// Data read before the public ID was invalidated isn't cached, as it may
+// predate the change.
+TEST_F(HSSCacheTest, InvalidateDuringRead)
+{
+  uint64_t generation = _cache->get_generation(IMPU);
+  _cache->invalidate(IMPU);
+  _cache->put(IMPU, registered_irs_info(), NULL, generation);
+  EXPECT_EQ(0u, _cache->size());
+
+  // Other public IDs are still cached.
+  _cache->put("sip:6505550232@homedomain",
+              registered_irs_info(),
+              NULL,
+              _cache->get_generation("sip:6505550232@homedomain"));
+  EXPECT_EQ(1u, _cache->size());
+
+  // Data read after the invalidation is cached.
+  _cache->put(IMPU, registered_irs_info(), NULL, _cache->get_generation(IMPU));
+  EXPECT_EQ(2u, _cache->size());
+}
+
+// Putting data for a public ID again replaces the cached entry.
+TEST_F(HSSCacheTest, Replace)
+{
+  HSSConnection::irs_info irs_info = registered_irs_info();
+  _cache->put(IMPU, irs_info, NULL, 0);
+
+  irs_info._regstate = RegDataXMLUtils::STATE_UNREGISTERED;
+  _cache->put(IMPU, irs_info, NULL, 0);
+  EXPECT_EQ(1u, _cache->size());
+
+  HSSConnection::irs_info cached;
+  EXPECT_TRUE(_cache->get(IMPU, cached));
+  EXPECT_EQ(RegDataXMLUtils::STATE_UNREGISTERED, cached._regstate);
+}
+
+// The size estimate accounts for the XML the data was parsed from.
+TEST_F(HSSCacheTest, EstimateSize)
+{
+  std::string xml_str = "<ClearwaterRegData><RegistrationState>REGISTERED"
+                        "</RegistrationState><IMSSubscription><ServiceProfile>"
+                        "<PublicIdentity><Identity>" + IMPU + "</Identity>"
+                        "</PublicIdentity></ServiceProfile></IMSSubscription>"
+                        "</ClearwaterRegData>";
+  rapidxml::xml_document<> xml;
+  xml.parse<0>(xml.allocate_string(xml_str.c_str()));
+
+  HSSConnection::irs_info irs_info = registered_irs_info();
+  EXPECT_GT(HSSCache::estimate_size(IMPU, irs_info, &xml),
+            HSSCache::estimate_size(IMPU, irs_info, NULL) + xml_str.size());
+}
+
+// The least recently used entries are evicted to stay within the memory
+// limit, and the memory statistic tracks the entries held.
+TEST_F(HSSCacheTest, MemoryLimit)
+{
+  SNMP::U32Scalar kb_scalar("", "");
+  HSSConnection::irs_info irs_info = registered_irs_info();
+  size_t size = HSSCache::estimate_size("sip:1@homedomain", irs_info, NULL);
+  HSSCache cache(1000, HSSCache::NUM_SHARDS * size * 2, NULL, NULL, &kb_scalar);
+
+  // Fill the cache with far more entries than it can hold.
+  for (int ii = 0; ii < 100 * HSSCache::NUM_SHARDS; ++ii)
+  {
+    cache.put("sip:" + std::to_string(ii) + "@homedomain", irs_info, NULL, 0);
+  }
+
+  EXPECT_LE(cache.size(), (size_t)HSSCache::NUM_SHARDS * 2);
+  EXPECT_GT(cache.size(), 0u);
+  EXPECT_LE(cache.bytes(), (size_t)HSSCache::NUM_SHARDS * size * 2);
+  EXPECT_EQ(cache.bytes() / 1024, kb_scalar.value);
+
+  // The most recently added entry is still cached.
+  HSSConnection::irs_info cached;
+  EXPECT_TRUE(cache.get("sip:" + std::to_string(100 * HSSCache::NUM_SHARDS - 1) +
+                        "@homedomain",
+                        cached));
+}
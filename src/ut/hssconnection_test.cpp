@@ -14,6 +14,12 @@
 
 #include <string>
 #include <algorithm>
+#include <atomic>
+#include <climits>
+#include <stdexcept>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include "gtest/gtest.h"
 
 #include "utils.h"
@@ -796,6 +802,365 @@ TEST_F(HssConnectionTest, CacheNotAllowed)
   EXPECT_EQ(rc, 200);
 }
 
+/// Builds the reg-data Homestead returns for an implicit registration set of
+/// num_impus public identities, in service profiles of up to 10 identities,
+/// each with two iFCs.
+static std::string build_reg_data_xml(int num_impus)
+{
+  std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                    "<ClearwaterRegData>"
+                      "<RegistrationState>REGISTERED</RegistrationState>"
+                      "<IMSSubscription>";
+
+  for (int sp = 0; sp * 10 < num_impus; ++sp)
+  {
+    xml += "<ServiceProfile>";
+
+    for (int impu = sp * 10; (impu < num_impus) && (impu < (sp + 1) * 10); ++impu)
+    {
+      xml += "<PublicIdentity>"
+               "<Identity>sip:" + std::to_string(6505550000 + impu) + "@example.com</Identity>"
+             "</PublicIdentity>";
+    }
+
+    for (int ifc = 0; ifc < 2; ++ifc)
+    {
+      xml += "<InitialFilterCriteria>"
+               "<Priority>" + std::to_string(ifc) + "</Priority>"
+               "<TriggerPoint>"
+                 "<ConditionTypeCNF>0</ConditionTypeCNF>"
+                 "<SPT>"
+                   "<ConditionNegated>0</ConditionNegated>"
+                   "<Group>0</Group>"
+                   "<Method>INVITE</Method>"
+                   "<Extension></Extension>"
+                 "</SPT>"
+               "</TriggerPoint>"
+               "<ApplicationServer>"
+                 "<ServerName>sip:as" + std::to_string(ifc) + ".example.com</ServerName>"
+                 "<DefaultHandling>0</DefaultHandling>"
+               "</ApplicationServer>"
+             "</InitialFilterCriteria>";
+    }
+
+    xml += "</ServiceProfile>";
+  }
+
+  xml += "</IMSSubscription>"
+         "<ChargingAddresses>"
+           "<CCF priority=\"1\">ccf1</CCF>"
+         "</ChargingAddresses>"
+       "</ClearwaterRegData>";
+  return xml;
+}
+
+// Check that every identity in a large implicit registration set gets the
+// iFCs of its own service profile.
+TEST_F(HssConnectionTest, LargeImplicitRegistrationSet)
+{
+  fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/sip%3A6505550000%40example.com/reg-data", "{\"reqtype\": \"call\", \"server_name\": \"server_name\"}")] =
+    build_reg_data_xml(100);
+
+  HSSConnection::irs_query irs_query;
+  irs_query._public_id = "sip:6505550000@example.com";
+  irs_query._req_type = HSSConnection::CALL;
+  irs_query._server_name = "server_name";
+  HSSConnection::irs_info irs_info;
+
+  EXPECT_EQ(HTTP_OK, _hss.update_registration_state(irs_query, irs_info, 0));
+  EXPECT_EQ("REGISTERED", irs_info._regstate);
+  EXPECT_EQ(100u, irs_info._associated_uris.get_unbarred_uris().size());
+  EXPECT_EQ(100u, irs_info._service_profiles.size());
+  EXPECT_EQ(10u, irs_info._aliases.size());
+  ASSERT_EQ(1u, irs_info._ccfs.size());
+  EXPECT_EQ("ccf1", irs_info._ccfs[0]);
+
+  const Ifcs& ifcs = irs_info._service_profiles["sip:6505550099@example.com"];
+  ASSERT_EQ(2u, ifcs.size());
+  EXPECT_STREQ("sip:as1.example.com",
+               ifcs[1]._ifc->first_node("ApplicationServer")->first_node("ServerName")->value());
+}
+
+// Measures the time to fetch and decode the subscriber data for implicit
+// registration sets of 1, 10 and 100 identities.  Disabled by default - run
+// with --gtest_also_run_disabled_tests.
+TEST_F(HssConnectionTest, DISABLED_RegDataBenchmark)
+{
+  const int ITERATIONS = 200;
+  int impu_counts[] = {1, 10, 100};
+
+  for (size_t ii = 0; ii < sizeof(impu_counts) / sizeof(impu_counts[0]); ++ii)
+  {
+    std::string xml = build_reg_data_xml(impu_counts[ii]);
+    fakecurl_responses_with_body[std::make_pair("http://10.42.42.42:80/impu/sip%3A6505550000%40example.com/reg-data", "{\"reqtype\": \"call\", \"server_name\": \"server_name\"}")] =
+      xml;
+
+    HSSConnection::irs_query irs_query;
+    irs_query._public_id = "sip:6505550000@example.com";
+    irs_query._req_type = HSSConnection::CALL;
+    irs_query._server_name = "server_name";
+
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    long start_us = (usage.ru_utime.tv_sec * 1000000L) + usage.ru_utime.tv_usec;
+
+    for (int jj = 0; jj < ITERATIONS; ++jj)
+    {
+      HSSConnection::irs_info irs_info;
+      _hss.update_registration_state(irs_query, irs_info, 0);
+    }
+
+    getrusage(RUSAGE_THREAD, &usage);
+    long elapsed_us = (usage.ru_utime.tv_sec * 1000000L) + usage.ru_utime.tv_usec - start_us;
+
+    printf("%3d IMPUs: %6zu bytes, %7.1f us per request\n",
+           impu_counts[ii],
+           xml.size(),
+           (double)elapsed_us / ITERATIONS);
+  }
+}
+
+/// HSSConnection whose requests to Homestead block until released, and
+/// count how many were sent.  Only the first _max_blocked requests block,
+/// and released requests throw if _throw is set.
+class BlockingHSSConnection : public HSSConnection
+{
+public:
+  BlockingHSSConnection(HttpResolver* resolver,
+                        SNMP::CounterTable* coalesced_tbl,
+                        long homestead_timeout_ms = 500) :
+    HSSConnection("narcissus",
+                  resolver,
+                  NULL,
+                  &SNMP::FAKE_IP_COUNT_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  &SNMP::FAKE_EVENT_ACCUMULATOR_TABLE,
+                  NULL,
+                  NULL,
+                  homestead_timeout_ms,
+                  NULL,
+                  coalesced_tbl),
+    _requests(0),
+    _released(false),
+    _max_blocked(INT_MAX),
+    _throw(false)
+  {}
+
+  long put_for_xml_object(const std::string& path,
+                          std::string body,
+                          const bool& cache_allowed,
+                          rapidxml::xml_document<>*& root,
+                          SAS::TrailId trail)
+  {
+    int request = ++_requests;
+
+    while ((!_released) && (request <= _max_blocked))
+    {
+      usleep(1000);
+    }
+
+    if (_throw)
+    {
+      throw std::runtime_error("Homestead request failed");
+    }
+
+    root = parse_xml(build_reg_data_xml(1), path);
+    return HTTP_OK;
+  }
+
+  std::atomic_int _requests;
+  std::atomic_bool _released;
+  std::atomic_int _max_blocked;
+  std::atomic_bool _throw;
+};
+
+/// A call lookup run on its own thread.
+struct LookupThread
+{
+  pthread_t thread;
+  BlockingHSSConnection* hss;
+  HTTPCode rc;
+  bool threw;
+  HSSConnection::irs_info irs_info;
+
+  static void* run(void* arg)
+  {
+    LookupThread* lookup = (LookupThread*)arg;
+    HSSConnection::irs_query irs_query;
+    irs_query._public_id = "sip:6505550000@example.com";
+    irs_query._req_type = HSSConnection::CALL;
+    irs_query._server_name = "server_name";
+    lookup->rc = 0;
+    lookup->threw = false;
+
+    try
+    {
+      lookup->rc = lookup->hss->update_registration_state(irs_query,
+                                                          lookup->irs_info,
+                                                          0);
+    }
+    catch (std::runtime_error& e)
+    {
+      lookup->threw = true;
+    }
+
+    return NULL;
+  }
+};
+
+// Concurrent identical call lookups share one request to Homestead, and all
+// get its result.
+TEST_F(HssConnectionTest, CoalesceConcurrentLookups)
+{
+  const int NUM_LOOKUPS = 5;
+  SNMP::FakeCounterTable coalesced;
+  BlockingHSSConnection hss(&_resolver, &coalesced);
+  LookupThread lookups[NUM_LOOKUPS];
+
+  // Start one lookup, and wait for its request to be sent.
+  lookups[0].hss = &hss;
+  pthread_create(&lookups[0].thread, NULL, &LookupThread::run, &lookups[0]);
+
+  for (int ii = 0; (ii < 1000) && (hss._requests == 0); ++ii)
+  {
+    usleep(1000);
+  }
+
+  // Start the rest, and wait for them all to be waiting on the first.
+  for (int ii = 1; ii < NUM_LOOKUPS; ++ii)
+  {
+    lookups[ii].hss = &hss;
+    pthread_create(&lookups[ii].thread, NULL, &LookupThread::run, &lookups[ii]);
+  }
+
+  for (int ii = 0; (ii < 1000) && (coalesced._count < NUM_LOOKUPS - 1); ++ii)
+  {
+    usleep(1000);
+  }
+
+  hss._released = true;
+
+  for (int ii = 0; ii < NUM_LOOKUPS; ++ii)
+  {
+    pthread_join(lookups[ii].thread, NULL);
+    EXPECT_EQ(HTTP_OK, lookups[ii].rc);
+    EXPECT_EQ("REGISTERED", lookups[ii].irs_info._regstate);
+    EXPECT_EQ(1u, lookups[ii].irs_info._service_profiles.size());
+  }
+
+  EXPECT_EQ(1, hss._requests);
+  EXPECT_EQ(NUM_LOOKUPS - 1, coalesced._count);
+}
+
+// If the shared request to Homestead fails with an exception, the lookups
+// waiting on it fail rather than hanging, and later lookups send a new
+// request.
+TEST_F(HssConnectionTest, CoalescedRequestThrows)
+{
+  const int NUM_LOOKUPS = 3;
+  SNMP::FakeCounterTable coalesced;
+  BlockingHSSConnection hss(&_resolver, &coalesced);
+  LookupThread lookups[NUM_LOOKUPS];
+
+  lookups[0].hss = &hss;
+  pthread_create(&lookups[0].thread, NULL, &LookupThread::run, &lookups[0]);
+
+  for (int ii = 0; (ii < 1000) && (hss._requests == 0); ++ii)
+  {
+    usleep(1000);
+  }
+
+  for (int ii = 1; ii < NUM_LOOKUPS; ++ii)
+  {
+    lookups[ii].hss = &hss;
+    pthread_create(&lookups[ii].thread, NULL, &LookupThread::run, &lookups[ii]);
+  }
+
+  for (int ii = 0; (ii < 1000) && (coalesced._count < NUM_LOOKUPS - 1); ++ii)
+  {
+    usleep(1000);
+  }
+
+  hss._throw = true;
+  hss._released = true;
+
+  pthread_join(lookups[0].thread, NULL);
+  EXPECT_TRUE(lookups[0].threw);
+
+  for (int ii = 1; ii < NUM_LOOKUPS; ++ii)
+  {
+    pthread_join(lookups[ii].thread, NULL);
+    EXPECT_FALSE(lookups[ii].threw);
+    EXPECT_EQ(HTTP_SERVER_ERROR, lookups[ii].rc);
+  }
+
+  hss._throw = false;
+  LookupThread lookup;
+  lookup.hss = &hss;
+  LookupThread::run(&lookup);
+  EXPECT_EQ(HTTP_OK, lookup.rc);
+  EXPECT_EQ(2, hss._requests);
+}
+
+// A lookup waiting on a request to Homestead that never completes gives up
+// after a few Homestead timeouts and sends its own request.
+TEST_F(HssConnectionTest, CoalescedRequestLost)
+{
+  SNMP::FakeCounterTable coalesced;
+  BlockingHSSConnection hss(&_resolver, &coalesced, 10);
+  hss._max_blocked = 1;
+  LookupThread stuck;
+
+  stuck.hss = &hss;
+  pthread_create(&stuck.thread, NULL, &LookupThread::run, &stuck);
+
+  for (int ii = 0; (ii < 1000) && (hss._requests == 0); ++ii)
+  {
+    usleep(1000);
+  }
+
+  LookupThread lookup;
+  lookup.hss = &hss;
+  LookupThread::run(&lookup);
+  EXPECT_EQ(HTTP_OK, lookup.rc);
+  EXPECT_EQ("REGISTERED", lookup.irs_info._regstate);
+  EXPECT_EQ(2, hss._requests);
+  EXPECT_EQ(1, coalesced._count);
+
+  // Later lookups don't wait on the lost request either.
+  LookupThread later;
+  later.hss = &hss;
+  LookupThread::run(&later);
+  EXPECT_EQ(HTTP_OK, later.rc);
+  EXPECT_EQ(3, hss._requests);
+
+  hss._released = true;
+  pthread_join(stuck.thread, NULL);
+  EXPECT_EQ(HTTP_OK, stuck.rc);
+}
+
+// Lookups that change the registration state are never shared.
+TEST_F(HssConnectionTest, DontCoalesceRegistrations)
+{
+  SNMP::FakeCounterTable coalesced;
+  BlockingHSSConnection hss(&_resolver, &coalesced);
+  hss._released = true;
+
+  HSSConnection::irs_query irs_query;
+  irs_query._public_id = "sip:6505550000@example.com";
+  irs_query._req_type = HSSConnection::REG;
+  irs_query._server_name = "server_name";
+  HSSConnection::irs_info irs_info;
+
+  EXPECT_EQ(HTTP_OK, hss.update_registration_state(irs_query, irs_info, 0));
+  EXPECT_EQ(HTTP_OK, hss.update_registration_state(irs_query, irs_info, 0));
+  EXPECT_EQ(2, hss._requests);
+  EXPECT_EQ(0, coalesced._count);
+}
+
 /// Fake iFCs to use to test Shared iFCs.
 std::string ifc_priority_one = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
                                "<InitialFilterCriteria>\n"
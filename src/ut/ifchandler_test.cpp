@@ -1026,6 +1026,25 @@ TEST_F(IfcHandlerTest, HeaderMatch)
          true);
 }
 
+// A Header that is a plain header name is matched without the regex engine,
+// but must still match case-insensitively anywhere in the header name.
+TEST_F(IfcHandlerTest, HeaderMatchPlainNameSubstring)
+{
+  doTest("",
+         "    <TriggerPoint>\n"
+         "    <ConditionTypeCNF>1</ConditionTypeCNF>\n"
+         "    <SPT>\n"
+         "      <ConditionNegated>0</ConditionNegated>\n"
+         "      <Group>0</Group>\n"
+         "      <SIPHeader><Header>FORWARDS</Header></SIPHeader>\n"
+         "      <Extension></Extension>\n"
+         "    </SPT>\n"
+         "  </TriggerPoint>\n",
+         true,
+         SessionCase::Originating,
+         true);
+}
+
 TEST_F(IfcHandlerTest, HeaderMatchCaseInsensitive)
 {
   doTest("",
@@ -2317,6 +2336,77 @@ TEST_F(IfcHandlerTest, SDPNoEqualsSign)
 }
 
 
+// Benchmark of iFC evaluation for service profiles with 10 to 50 iFCs, each
+// with a mix of SPT classes.  Disabled by default - run with
+// --gtest_also_run_disabled_tests.
+TEST_F(IfcHandlerTest, DISABLED_EvaluationBenchmark)
+{
+  const int ITERATIONS = 2000;
+  int profile_sizes[] = {10, 20, 50};
+
+  for (size_t ii = 0; ii < sizeof(profile_sizes) / sizeof(profile_sizes[0]); ++ii)
+  {
+    int num_ifcs = profile_sizes[ii];
+    std::string xml = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<ServiceProfile>\n";
+
+    for (int jj = 0; jj < num_ifcs; ++jj)
+    {
+      xml += "  <InitialFilterCriteria>\n"
+             "    <Priority>" + std::to_string(jj) + "</Priority>\n"
+             "    <TriggerPoint>\n"
+             "    <ConditionTypeCNF>0</ConditionTypeCNF>\n"
+             "    <SPT><ConditionNegated>0</ConditionNegated><Group>0</Group><Method>INVITE</Method></SPT>\n"
+             "    <SPT><ConditionNegated>0</ConditionNegated><Group>0</Group><SessionCase>0</SessionCase></SPT>\n"
+             "    <SPT><ConditionNegated>0</ConditionNegated><Group>0</Group><SIPHeader><Header>Accept</Header><Content>quux</Content></SIPHeader></SPT>\n"
+             "    <SPT><ConditionNegated>0</ConditionNegated><Group>0</Group><RequestURI>homedomain</RequestURI></SPT>\n"
+             "    <SPT><ConditionNegated>1</ConditionNegated><Group>1</Group><SIPHeader><Header>P-.*-Identity</Header></SIPHeader></SPT>\n"
+             "    <SPT><ConditionNegated>0</ConditionNegated><Group>1</Group><SessionDescription><Line>m</Line><Content>video</Content></SessionDescription></SPT>\n"
+             "    </TriggerPoint>\n"
+             "    <ApplicationServer>\n"
+             "      <ServerName>sip:as" + std::to_string(jj) + ".homedomain</ServerName>\n"
+             "      <DefaultHandling>0</DefaultHandling>\n"
+             "    </ApplicationServer>\n"
+             "  </InitialFilterCriteria>\n";
+    }
+
+    xml += "</ServiceProfile>";
+
+    std::shared_ptr<rapidxml::xml_document<> > root(new rapidxml::xml_document<>);
+    char* cstr_ifc = root->allocate_string(xml.c_str());
+    root->parse<0>(cstr_ifc);
+    Ifcs ifcs(root, root->first_node("ServiceProfile"), NULL, 0);
+    ASSERT_EQ((size_t)num_ifcs, ifcs.size());
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int jj = 0; jj < ITERATIONS; ++jj)
+    {
+      std::vector<AsInvocation> application_servers;
+      bool found_match;
+      RegistrationUtils::interpret_ifcs(ifcs,
+                                        {},
+                                        IFCConfiguration(false, false, "", NULL, NULL),
+                                        SessionCase::Originating,
+                                        true,
+                                        false,
+                                        TEST_MSG,
+                                        application_servers,
+                                        found_match,
+                                        0);
+      EXPECT_EQ((size_t)num_ifcs, application_servers.size());
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long elapsed_us = (end.tv_sec - start.tv_sec) * 1000000 +
+                      (end.tv_nsec - start.tv_nsec) / 1000;
+    printf("%d iFCs: %ld us per evaluation of the service profile\n",
+           num_ifcs,
+           elapsed_us / ITERATIONS);
+  }
+}
+
 // @@@ iFC XML parse error
 // @@@ lookup_ifcs gets no served user
 // @@@ lookup_ifcs finds empty iFCs
@@ -0,0 +1,95 @@
+/**
+ * @file pjstr_index_test.cpp UT for the index searched with pj_str_t keys.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <string>
+#include "gtest/gtest.h"
+
+#include "pjstr_index.h"
+
+static pj_str_t to_pj_str(const char* str)
+{
+  return pj_str((char*)str);
+}
+
+// Entries can be found with pj_str_t keys, including ones that point into a
+// larger string, as the parts of a URI do.
+TEST(PjStrIndexTest, InsertFind)
+{
+  PjStrIndex<int> index(false);
+  EXPECT_TRUE(index.insert("scscf", 1));
+  EXPECT_TRUE(index.insert("icscf", 2));
+  EXPECT_TRUE(index.insert("", 3));
+
+  pj_str_t key = to_pj_str("scscf");
+  ASSERT_TRUE(index.find(&key) != NULL);
+  EXPECT_EQ(1, *index.find(&key));
+
+  pj_str_t host = to_pj_str("icscf.sprout.homedomain");
+  pj_str_t label = {host.ptr, 5};
+  ASSERT_TRUE(index.find(&label) != NULL);
+  EXPECT_EQ(2, *index.find(&label));
+
+  pj_str_t empty = {NULL, 0};
+  ASSERT_TRUE(index.find(&empty) != NULL);
+  EXPECT_EQ(3, *index.find(&empty));
+
+  key = to_pj_str("bgcf");
+  EXPECT_TRUE(index.find(&key) == NULL);
+  EXPECT_EQ(3u, index.size());
+}
+
+// Inserting a key that's already there fails, and leaves the original entry.
+TEST(PjStrIndexTest, Duplicate)
+{
+  PjStrIndex<int> index(false);
+  EXPECT_TRUE(index.insert("scscf", 1));
+  EXPECT_FALSE(index.insert("scscf", 2));
+
+  pj_str_t key = to_pj_str("scscf");
+  EXPECT_EQ(1, *index.find(&key));
+  EXPECT_EQ(1u, index.size());
+}
+
+// Case insensitive indexes match keys whatever their case; case sensitive
+// ones don't.
+TEST(PjStrIndexTest, Case)
+{
+  PjStrIndex<int> hosts(true);
+  PjStrIndex<int> services(false);
+  hosts.insert("sprout.homedomain", 1);
+  services.insert("scscf", 1);
+
+  pj_str_t host = to_pj_str("Sprout.HomeDomain");
+  EXPECT_TRUE(hosts.find(&host) != NULL);
+  EXPECT_FALSE(hosts.insert("SPROUT.homedomain", 2));
+
+  pj_str_t service = to_pj_str("SCSCF");
+  EXPECT_TRUE(services.find(&service) == NULL);
+}
+
+// The index grows as entries are added, and every entry can still be found.
+TEST(PjStrIndexTest, Grow)
+{
+  PjStrIndex<int> index(false);
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    EXPECT_TRUE(index.insert("service" + std::to_string(ii), ii));
+  }
+
+  for (int ii = 0; ii < 1000; ++ii)
+  {
+    std::string name = "service" + std::to_string(ii);
+    pj_str_t key = {(char*)name.data(), (pj_ssize_t)name.size()};
+    ASSERT_TRUE(index.find(&key) != NULL);
+    EXPECT_EQ(ii, *index.find(&key));
+  }
+}
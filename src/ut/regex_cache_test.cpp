@@ -0,0 +1,85 @@
+/**
+ * @file regex_cache_test.cpp UT for the regex cache.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+
+#include "regex_cache.h"
+#include "fakesnmp.hpp"
+
+class RegexCacheTest : public ::testing::Test
+{
+public:
+  RegexCacheTest() :
+    _cache(2, &_hits, &_misses, &_evictions)
+  {
+  }
+
+  SNMP::FakeCounterTable _hits;
+  SNMP::FakeCounterTable _misses;
+  SNMP::FakeCounterTable _evictions;
+  RegexCache _cache;
+};
+
+// Repeated lookups of a pattern compile it once.
+TEST_F(RegexCacheTest, HitAfterMiss)
+{
+  boost::regex first = _cache.get("^sip:.*@example\\.com$");
+  boost::regex second = _cache.get("^sip:.*@example\\.com$");
+
+  EXPECT_EQ(1, _misses._count);
+  EXPECT_EQ(1, _hits._count);
+  EXPECT_EQ(1u, _cache.size());
+  EXPECT_TRUE(boost::regex_match(std::string("sip:alice@example.com"), second));
+}
+
+// The same pattern with different flags is a different entry.
+TEST_F(RegexCacheTest, FlagsAreInKey)
+{
+  boost::regex sensitive = _cache.get("contact");
+  boost::regex insensitive = _cache.get("contact", boost::regex::icase);
+
+  EXPECT_EQ(2, _misses._count);
+  EXPECT_EQ(0, _hits._count);
+  EXPECT_FALSE(boost::regex_search(std::string("Contact"), sensitive));
+  EXPECT_TRUE(boost::regex_search(std::string("Contact"), insensitive));
+}
+
+// The least recently used entry is evicted when the cache is full.
+TEST_F(RegexCacheTest, EvictsLeastRecentlyUsed)
+{
+  _cache.get("a");
+  _cache.get("b");
+  _cache.get("a");
+  boost::regex c = _cache.get("c");
+
+  EXPECT_EQ(1, _evictions._count);
+  EXPECT_EQ(2u, _cache.size());
+
+  // "a" was used more recently than "b", so is still cached.
+  _cache.get("a");
+  EXPECT_EQ(2, _hits._count);
+  _cache.get("b");
+  EXPECT_EQ(4, _misses._count);
+
+  // Evicted regexes remain usable.
+  EXPECT_TRUE(boost::regex_match(std::string("c"), c));
+}
+
+// Invalid patterns throw and aren't cached, unless no_except is set.
+TEST_F(RegexCacheTest, InvalidPattern)
+{
+  EXPECT_THROW(_cache.get("(unterminated"), boost::regex_error);
+  EXPECT_EQ(0u, _cache.size());
+
+  boost::regex invalid = _cache.get("(unterminated", boost::regex::no_except);
+  EXPECT_NE(0u, invalid.status());
+  EXPECT_EQ(1u, _cache.size());
+}
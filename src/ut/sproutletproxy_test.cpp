@@ -20,6 +20,7 @@
 #include "boost/algorithm/string_regex.hpp"
 
 #include <mutex>
+#include <sys/resource.h>
 
 using namespace std;
 using testing::InSequence;
@@ -747,6 +748,49 @@ public:
   }
 };
 
+class FakeSproutletTsxCopyOnWrite : public SproutletTsx
+{
+public:
+  FakeSproutletTsxCopyOnWrite(Sproutlet* sproutlet) :
+    SproutletTsx(sproutlet)
+  {
+  }
+
+  bool copy_on_write() const { return true; }
+
+  void on_rx_initial_request(pjsip_msg* req)
+  {
+    // The Route header referencing this Sproutlet is hidden, as it would be
+    // from a copy of the request.
+    pjsip_route_hdr* route = (pjsip_route_hdr*)
+                                 pjsip_msg_find_hdr(req, PJSIP_H_ROUTE, NULL);
+    ASSERT_NE((pjsip_route_hdr*)NULL, route);
+    EXPECT_FALSE(is_uri_reflexive(route->name_addr.uri));
+
+    if (req->line.req.method.id != PJSIP_INVITE_METHOD)
+    {
+      // Reject the request without modifying it.
+      pjsip_msg* rsp = create_response(req, PJSIP_SC_FORBIDDEN);
+      free_msg(req);
+      send_response(rsp);
+      return;
+    }
+
+    // Add a header before forwarding the request.
+    pjsip_msg* shared_req = req;
+    modify_msg(req);
+    EXPECT_NE(shared_req, req);
+
+    pj_str_t name = pj_str((char*)"X-Modified");
+    pj_str_t value = pj_str((char*)"yes");
+    pjsip_msg_add_hdr(req,
+                      (pjsip_hdr*)pjsip_generic_string_hdr_create(get_pool(req),
+                                                                  &name,
+                                                                  &value));
+    send_request(req);
+  }
+};
+
 class SproutletProxyTest : public SipTest
 {
 public:
@@ -796,6 +840,7 @@ public:
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletForkErrors>("forkerr", 0, "sip:forkerr.homedomain;transport=tcp", "", "", NULL, NULL, "fork-nf", ""));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxNextHop>("teltest1", 44555, "sip:teltest1.homedomain;transport=tcp", "", "", NULL, NULL, "teltest-nf", "teltest2"));
     _sproutlets.push_back(new FakeSproutlet<FakeSproutletURIForwarder>("teltest2", 0, "sip:teltest2.homedomain;transport=tcp", "", "", NULL, NULL, "teltest-nf", ""));
+    _sproutlets.push_back(new FakeSproutlet<FakeSproutletTsxCopyOnWrite>("cow", 0, "sip:cow.homedomain;transport=tcp", ""));
 
     // Create a host alias.
     std::unordered_set<std::string> host_aliases;
@@ -2371,6 +2416,60 @@ TEST_F(SproutletProxyTest, CompositeNetworkFunction)
   delete tp;
 }
 
+// Tests that requests are routed through a chain of Sproutlets in the same
+// way when the routing between local Sproutlets isn't logged to SAS.
+TEST_F(SproutletProxyTest, SkipLocalSelectionLogs)
+{
+  pjsip_tx_data* tdata;
+  _proxy->_log_local_selection = false;
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@proxy1.awaydomain:5060;transport=TCP";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:composite1.proxy1.homedomain;transport=TCP;lr>";
+  msg1._forwards = "100";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and the INVITE forwarded through all three
+  // Sproutlets, with the Via header added by the internal Network Function
+  // boundary.
+  ASSERT_EQ(2, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  free_txdata();
+
+  pjsip_tx_data* req = pop_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, req);
+  ReqMatcher("INVITE").matches(req->msg);
+  EXPECT_EQ("Max-Forwards: 98", get_headers(req->msg, "Max-Forwards"));
+  EXPECT_EQ("", get_headers(req->msg, "Route"));
+  EXPECT_NE(string::npos,
+            get_headers(req->msg, "Via").find("Via: SIP/2.0/TCP cmp-nf.sprout.homedomain"));
+
+  // The 200 OK makes it back through the chain, without the internal Via.
+  inject_msg(respond_to_txdata(req, 200));
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  RespMatcher(200).matches(tdata->msg);
+  tp->expect_target(tdata);
+  EXPECT_EQ(string::npos,
+            get_headers(tdata->msg, "Via").find("cmp-nf.sprout.homedomain"));
+  free_txdata();
+
+  ASSERT_EQ(0, txdata_count());
+
+  _proxy->_log_local_selection = true;
+  delete tp;
+}
+
 TEST_F(SproutletProxyTest, CompositeNetworkFunctionTelURI)
 {
   // Tests passing a request through a Network Function composed of multiple
@@ -3040,6 +3139,106 @@ TEST_F(SproutletProxyTest, SproutletSelection)
   ASSERT_EQ("b2bua", service_name);
 }
 
+static long thread_cpu_time_us()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return (usage.ru_utime.tv_sec * 1000000L) + usage.ru_utime.tv_usec;
+}
+
+// Measures the cost of picking the Sproutlet for a hop, for each way of
+// selecting one, with and without logging the selection to SAS.  Disabled by default - run
+// with --gtest_also_run_disabled_tests.
+TEST_F(SproutletProxyTest, DISABLED_RoutingBenchmark)
+{
+  const int ITERATIONS = 100000;
+  const char* routes[] = {"sip:proxy1.homedomain;transport=TCP;lr;service=fwd",
+                          "sip:scscf.proxy1.homedomain;transport=TCP;lr",
+                          "sip:b2bua@proxy1.homedomain;transport=TCP;lr",
+                          "sip:proxy1.homedomain:44444;transport=TCP;lr",
+                          "sip:proxy1.awaydomain;transport=TCP;lr"};
+  bool logs[] = {false, true};
+
+  for (size_t ii = 0; ii < sizeof(routes) / sizeof(routes[0]); ++ii)
+  {
+    Message msg;
+    msg._method = "INVITE";
+    msg._requri = "sip:bob@awaydomain";
+    msg._from = "sip:alice@homedomain";
+    msg._to = "sip:bob@awaydomain";
+    msg._route = std::string("Route: <") + routes[ii] + ">";
+    std::string msg_str = msg.get_request();
+    char* buf = (char*)pj_pool_alloc(stack_data.pool, msg_str.size() + 1);
+    strcpy(buf, msg_str.c_str());
+    pjsip_msg* req = pjsip_parse_msg(stack_data.pool, buf, msg_str.size(), NULL);
+    ASSERT_TRUE(req != NULL);
+
+    for (size_t jj = 0; jj < sizeof(logs) / sizeof(logs[0]); ++jj)
+    {
+      std::string alias;
+      long start = thread_cpu_time_us();
+      for (int kk = 0; kk < ITERATIONS; ++kk)
+      {
+        _proxy->target_sproutlet(req, 0, alias, 1, logs[jj]);
+      }
+      long elapsed_us = thread_cpu_time_us() - start;
+
+      printf("%-55s log %-3s: %6.3f us per hop (%s)\n",
+             routes[ii],
+             logs[jj] ? "on" : "off",
+             (double)elapsed_us / ITERATIONS,
+             alias.empty() ? "no match" : alias.c_str());
+    }
+  }
+}
+
+// Compares the time to pass calls through a chain of three co-located
+// Sproutlets with and without logging the routing between them to SAS.
+// Disabled by default - run with --gtest_also_run_disabled_tests.
+TEST_F(SproutletProxyTest, DISABLED_LocalSelectionLogsBenchmark)
+{
+  const int CALLS = 2000;
+  bool modes[] = {true, false};
+
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  for (size_t ii = 0; ii < sizeof(modes) / sizeof(modes[0]); ++ii)
+  {
+    _proxy->_log_local_selection = modes[ii];
+    long start = thread_cpu_time_us();
+
+    for (int jj = 0; jj < CALLS; ++jj)
+    {
+      Message msg;
+      msg._method = "INVITE";
+      msg._requri = "sip:bob@proxy1.awaydomain:5060;transport=TCP";
+      msg._from = "sip:alice@homedomain";
+      msg._to = "sip:bob@awaydomain";
+      msg._via = tp->to_string(false);
+      msg._route = "Route: <sip:composite1.proxy1.homedomain;transport=TCP;lr>";
+      inject_msg(msg.get_request(), tp);
+
+      // Drop the 100 Trying, answer the INVITE and drop the 200 OK.
+      free_txdata();
+      pjsip_tx_data* req = pop_txdata();
+      inject_msg(respond_to_txdata(req, 200));
+      free_txdata();
+    }
+
+    long elapsed_us = thread_cpu_time_us() - start;
+    printf("Local selection logs %-3s: %6.1f us per call, %6.0f calls/s\n",
+           modes[ii] ? "on" : "off",
+           (double)elapsed_us / CALLS,
+           (elapsed_us > 0) ? (1000000.0 * CALLS / elapsed_us) : 0.0);
+  }
+
+  _proxy->_log_local_selection = true;
+  delete tp;
+}
+
 // Tests that it's not possible to register more than one Sproutlet for the
 // same service name or port.
 TEST_F(SproutletProxyTest, ConflictingSproutlets)
@@ -3121,3 +3320,96 @@ TEST_F(SproutletProxyTest, SproutletCopiesOriginalTransport)
   delete tp1;
   delete tp2;
 }
+
+TEST_F(SproutletProxyTest, CopyOnWriteForwarder)
+{
+  // Tests routing of a request through a Sproutlet that copies the request
+  // on write, and modifies it before forwarding it.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  // Inject a request with two Route headers - the first referencing the
+  // copy-on-write Sproutlet and the second referencing an external node.
+  Message msg1;
+  msg1._method = "INVITE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:cow.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // Expecting 100 Trying and forwarded INVITE
+  ASSERT_EQ(2, txdata_count());
+
+  // Check the 100 Trying.
+  tdata = current_txdata();
+  RespMatcher(100).matches(tdata->msg);
+  tp->expect_target(tdata);
+  free_txdata();
+
+  // Request is forwarded to the node in the second Route header, with the
+  // first Route header removed and the header the Sproutlet added.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  expect_target("TCP", "10.10.20.1", 5060, tdata);
+  ReqMatcher("INVITE").matches(tdata->msg);
+  EXPECT_EQ("Route: <sip:proxy1.awaydomain;transport=TCP;lr>",
+            get_headers(tdata->msg, "Route"));
+  EXPECT_EQ("X-Modified: yes", get_headers(tdata->msg, "X-Modified"));
+
+  // Send a 200 OK response.
+  inject_msg(respond_to_current_txdata(200));
+
+  // Check the response is forwarded back to the source.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(200).matches(tdata->msg);
+  free_txdata();
+
+  // All done!
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
+
+TEST_F(SproutletProxyTest, CopyOnWriteReject)
+{
+  // Tests a Sproutlet that copies the request on write rejecting a request
+  // without modifying it.
+  pjsip_tx_data* tdata;
+
+  // Create a TCP connection to the listening port.
+  TransportFlow* tp = new TransportFlow(TransportFlow::Protocol::TCP,
+                                        stack_data.scscf_port,
+                                        "1.2.3.4",
+                                        49152);
+
+  Message msg1;
+  msg1._method = "MESSAGE";
+  msg1._requri = "sip:bob@awaydomain";
+  msg1._from = "sip:alice@homedomain";
+  msg1._to = "sip:bob@awaydomain";
+  msg1._via = tp->to_string(false);
+  msg1._route = "Route: <sip:cow.proxy1.homedomain;transport=TCP;lr>\r\nRoute: <sip:proxy1.awaydomain;transport=TCP;lr>";
+  inject_msg(msg1.get_request(), tp);
+
+  // The request is rejected with a response built from the shared request.
+  ASSERT_EQ(1, txdata_count());
+  tdata = current_txdata();
+  tp->expect_target(tdata);
+  RespMatcher(403).matches(tdata->msg);
+  EXPECT_EQ("CSeq: 16567 MESSAGE", get_headers(tdata->msg, "CSeq"));
+  free_txdata();
+
+  // All done!
+  ASSERT_EQ(0, txdata_count());
+
+  delete tp;
+}
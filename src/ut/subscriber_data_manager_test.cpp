@@ -10,6 +10,7 @@
  */
 
 
+#include <new>
 #include <string>
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -37,6 +38,33 @@ using ::testing::Return;
 using ::testing::SetArgReferee;
 using ::testing::AtLeast;
 
+// Counts the heap allocations made on this thread while enabled, for the
+// allocation benchmark below.
+static __thread bool count_allocations = false;
+static __thread uint64_t allocation_count = 0;
+
+void* operator new(size_t size)
+{
+  if (count_allocations)
+  {
+    ++allocation_count;
+  }
+
+  void* p = malloc((size != 0) ? size : 1);
+
+  if (p == NULL)
+  {
+    throw std::bad_alloc();
+  }
+
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
 /// Fixture for BasicSubscriberDataManagerTest.
 class BasicSubscriberDataManagerTest : public SipTest
 {
@@ -655,6 +683,58 @@ TEST_F(BasicSubscriberDataManagerTest, CopyTests)
   delete aor_data1; aor_data1 = NULL;
 }
 
+// Copies of an AoR share bindings and subscriptions until one of them
+// changes them.
+TEST_F(BasicSubscriberDataManagerTest, CopyOnWriteTests)
+{
+  AoR* aor = new AoR("5102175698@cw-ngv.com");
+  AoR::Binding* b1 = aor->get_binding("binding1");
+  b1->_uri = "<sip:5102175698@192.91.191.29:59934;transport=tcp;ob>";
+  b1->_expires = 300;
+  AoR::Binding* b2 = aor->get_binding("binding2");
+  b2->_uri = "<sip:5102175698@192.91.191.42:59934;transport=tcp;ob>";
+  b2->_expires = 300;
+  AoR::Subscription* s1 = aor->get_subscription("1234");
+  s1->_req_uri = "sip:5102175698@192.91.191.29:59934;transport=tcp";
+  s1->_expires = 300;
+
+  // The copy holds the same bindings and subscriptions.
+  AoR* copy = new AoR(*aor);
+  EXPECT_EQ(b1, copy->bindings().at("binding1"));
+  EXPECT_EQ(b2, copy->bindings().at("binding2"));
+  EXPECT_EQ(s1, copy->subscriptions().at("1234"));
+
+  // Changing a binding in the copy leaves the original alone.
+  AoR::Binding* copy_b1 = copy->get_binding("binding1");
+  EXPECT_NE(b1, copy_b1);
+  copy_b1->_expires = 600;
+  EXPECT_EQ(300, aor->bindings().at("binding1")->_expires);
+  EXPECT_EQ(600, copy->bindings().at("binding1")->_expires);
+
+  // Once it isn't shared, a binding is changed in place.
+  EXPECT_EQ(copy_b1, copy->get_binding("binding1"));
+
+  AoR::Subscription* copy_s1 = copy->get_subscription("1234");
+  EXPECT_NE(s1, copy_s1);
+  copy_s1->_expires = 600;
+  EXPECT_EQ(300, aor->subscriptions().at("1234")->_expires);
+
+  // Removing a binding from one AoR leaves the other's intact.
+  copy->remove_binding("binding2");
+  EXPECT_EQ(1u, copy->bindings().size());
+  EXPECT_EQ(b2, aor->bindings().at("binding2"));
+
+  // Deleting the original leaves the copy intact.
+  AoR* copy2 = new AoR(*aor);
+  delete aor; aor = NULL;
+  EXPECT_EQ(b2, copy2->bindings().at("binding2"));
+  EXPECT_EQ(300, copy2->bindings().at("binding2")->_expires);
+  EXPECT_EQ(300, copy2->subscriptions().at("1234")->_expires);
+
+  delete copy2; copy2 = NULL;
+  delete copy; copy = NULL;
+}
+
 TEST_F(BasicSubscriberDataManagerTest, ExpiryTests)
 {
   // The expiry tests require pjsip, so initialise for this test
@@ -1757,3 +1837,79 @@ TEST_F(BasicSubscriberDataManagerTest, AoRComparisonUnchangedSubscription)
 
   delete aor_pair; aor_pair = NULL;
 }
+
+// Counts the heap allocations of a read-only lookup of an AoR, as done for a
+// terminating request: read the AoR pair, look through its bindings and
+// delete it.  The store read (deserializing the AoR) is counted separately
+// from the cost of the AoR pair.  Disabled by default - run with
+// --gtest_also_run_disabled_tests.
+TEST_F(BasicSubscriberDataManagerTest, DISABLED_ReadOnlyLookupAllocationBenchmark)
+{
+  const int ITERATIONS = 100;
+  int binding_counts[] = {1, 10, 100};
+  int now = time(NULL);
+
+  for (size_t ii = 0; ii < sizeof(binding_counts) / sizeof(binding_counts[0]); ++ii)
+  {
+    std::string aor_id = "sip:650555" + std::to_string(ii) + "@homedomain";
+    AoRPair* aor_pair = this->_store->get_aor_data(aor_id, 0);
+    ASSERT_TRUE(aor_pair != NULL);
+
+    for (int jj = 0; jj < binding_counts[ii]; ++jj)
+    {
+      AoR::Binding* b = aor_pair->get_current()->get_binding("binding" + std::to_string(jj));
+      b->_uri = "<sip:" + aor_id.substr(4) + ":" + std::to_string(jj) + ";transport=tcp;ob>";
+      b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+      b->_cseq = 17038;
+      b->_expires = now + 300;
+      b->_priority = 0;
+      b->_path_uris.push_back("sip:abcdefgh@bono-1.homedomain;lr");
+      b->_path_headers.push_back("<sip:abcdefgh@bono-1.homedomain;lr>");
+      b->_params["+sip.instance"] = "\"<urn:uuid:00000000-0000-0000-0000-b4dd32817622>\"";
+      b->_params["reg-id"] = "1";
+      b->_private_id = "6505550000@homedomain";
+      b->_emergency_registration = false;
+    }
+
+    bool all_bindings_expired;
+    ASSERT_EQ(Store::OK,
+              this->_store->set_aor_data(aor_id,
+                                         SubscriberDataManager::EventTrigger::USER,
+                                         aor_pair,
+                                         0,
+                                         all_bindings_expired));
+    delete aor_pair; aor_pair = NULL;
+
+    // Store read alone.
+    allocation_count = 0;
+    count_allocations = true;
+    for (int jj = 0; jj < ITERATIONS; ++jj)
+    {
+      delete this->_aor_store->get_aor_data(aor_id, 0);
+    }
+    count_allocations = false;
+    uint64_t store_allocations = allocation_count;
+
+    // Read-only lookup through the SDM.
+    int targets = 0;
+    allocation_count = 0;
+    count_allocations = true;
+    for (int jj = 0; jj < ITERATIONS; ++jj)
+    {
+      aor_pair = this->_store->get_aor_data(aor_id, 0);
+      for (const AoR::Bindings::value_type& binding :
+             aor_pair->get_current()->bindings())
+      {
+        targets += (binding.second->_expires > now) ? 1 : 0;
+      }
+      delete aor_pair; aor_pair = NULL;
+    }
+    count_allocations = false;
+
+    EXPECT_EQ(ITERATIONS * binding_counts[ii], targets);
+    printf("%3d bindings: %7.1f allocations per lookup, of which %7.1f for the AoR pair\n",
+           binding_counts[ii],
+           (double)allocation_count / ITERATIONS,
+           (double)(allocation_count - store_allocations) / ITERATIONS);
+  }
+}
@@ -26,6 +26,8 @@ using ::testing::_;
 using ::testing::ResultOf;
 using ::testing::Expectation;
 using ::testing::InvokeWithoutArgs;
+using ::testing::AllOf;
+using ::testing::DoAll;
 
 // Should be at least 5 to avoid causing problems with some of the UTs
 static const int REQUEST_ON_QUEUE_TIMEOUT_MS = 10;
@@ -41,19 +43,34 @@ class ThreadDispatcherTest : public SipTest
 {
 public:
 
-  ThreadDispatcherTest()
+  ThreadDispatcherTest(int num_worker_threads = 1,
+                       bool sharded_queues = false,
+                       bool deferred_rx_parse = false,
+                       bool queue_wait_reject = false,
+                       bool fair_queueing = false,
+                       int max_queue_depth_per_source = 0,
+                       const std::vector<int>& message_priorities = std::vector<int>())
   {
     mod_mock = new StrictMock<MockPJSipModule>(stack_data.endpt,
                                                "test-module",
                                                PJSIP_MOD_PRIORITY_TRANSPORT_LAYER);
 
-    init_thread_dispatcher(1,
+    init_thread_dispatcher(num_worker_threads,
                            NULL,
                            NULL,
                            NULL,
                            &load_monitor,
                            NULL,
-                           REQUEST_ON_QUEUE_TIMEOUT_MS);
+                           REQUEST_ON_QUEUE_TIMEOUT_MS,
+                           sharded_queues,
+                           deferred_rx_parse,
+                           queue_wait_reject,
+                           NULL,
+                           fair_queueing,
+                           max_queue_depth_per_source,
+                           NULL,
+                           NULL,
+                           message_priorities);
     mod_thread_dispatcher = get_mod_thread_dispatcher();
 
     cwtest_completely_control_time();
@@ -340,6 +357,557 @@ TEST_F(ThreadDispatcherTest, PrioritiseOptionsOverOlderTest)
   process_queue_element();
 }
 
+class ShardedThreadDispatcherTest : public ThreadDispatcherTest
+{
+public:
+  ShardedThreadDispatcherTest() : ThreadDispatcherTest(2, true) {}
+};
+
+// Messages should be processed regardless of which worker's queue they were
+// assigned to - a worker with an empty queue steals from the other queue.
+TEST_F(ShardedThreadDispatcherTest, WorkStealingTest)
+{
+  TestingCommon::Message msg1;
+  msg1._method = "INVITE";
+
+  TestingCommon::Message msg2;
+  msg2._method = "INVITE";
+
+  EXPECT_CALL(load_monitor, admit_request(_)).Times(2).WillRepeatedly(Return(true));
+  EXPECT_CALL(*mod_mock, on_rx_request(_)).Times(2).WillRepeatedly(Return(PJ_TRUE));
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(2);
+
+  inject_msg_thread(msg1.get_request());
+  inject_msg_thread(msg2.get_request());
+
+  // Both messages can be processed by worker 0, whichever queues they were
+  // assigned to.
+  process_queue_element(0);
+  process_queue_element(0);
+}
+
+// Messages in the same dialog should always be assigned to the same queue, so
+// the messages are processed in order by either worker.
+TEST_F(ShardedThreadDispatcherTest, CallIdAffinityTest)
+{
+  TestingCommon::Message msg;
+  msg._method = "INVITE";
+
+  EXPECT_CALL(load_monitor, admit_request(_)).Times(2).WillRepeatedly(Return(true));
+
+  Expectation first_exp = EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg.get_call_id()), true)))
+    .WillOnce(Return(PJ_TRUE));
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg.get_call_id()), true)))
+    .After(first_exp)
+    .WillOnce(Return(PJ_TRUE));
+
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(2);
+
+  inject_msg_thread(msg.get_request());
+  cwtest_advance_time_ms(1);
+  inject_msg_thread(msg.get_request());
+
+  process_queue_element(1);
+  process_queue_element(0);
+}
+
+// Callbacks are spread across the queues, and should be run by whichever
+// worker picks them up.
+TEST_F(ShardedThreadDispatcherTest, CallbackTest)
+{
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+
+  StrictMock<MockCallback>* cb1 = new StrictMock<MockCallback>();
+  StrictMock<MockCallback>* cb2 = new StrictMock<MockCallback>();
+  add_callback_to_queue(cb1);
+  add_callback_to_queue(cb2);
+
+  EXPECT_CALL(*cb1, run());
+  EXPECT_CALL(*cb1, destruct());
+  EXPECT_CALL(*cb2, run());
+  EXPECT_CALL(*cb2, destruct());
+
+  process_queue_element(1);
+  process_queue_element(1);
+}
+
+// Runs worker 1 on its own thread, registered with PJSIP.
+static void* run_worker_1(void* unused)
+{
+  pj_thread_desc desc;
+  pj_bzero(desc, sizeof(pj_thread_desc));
+  pj_thread_t* thread = NULL;
+  pj_thread_register("worker1", desc, &thread);
+
+  process_queue_element(1);
+  return NULL;
+}
+
+// A message queued for a busy worker should wake an idle worker waiting on its
+// own (empty) queue, which steals the message.
+TEST_F(ShardedThreadDispatcherTest, WakeIdleWorkerTest)
+{
+  // Find a message that is assigned to worker 0's queue.
+  TestingCommon::Message msg;
+  msg._method = "INVITE";
+  std::string call_id = msg.get_call_id();
+  while (pj_hash_calc(0, call_id.c_str(), call_id.length()) % 2 != 0)
+  {
+    msg._unique++;
+    call_id = msg.get_call_id();
+  }
+
+  EXPECT_CALL(load_monitor, admit_request(_)).WillOnce(Return(true));
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(call_id), true)))
+    .WillOnce(Return(PJ_TRUE));
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _));
+
+  // Worker 1 waits for work on its own queue.
+  pthread_t worker;
+  pthread_create(&worker, NULL, &run_worker_1, NULL);
+  usleep(10000);
+
+  inject_msg_thread(msg.get_request());
+
+  pthread_join(worker, NULL);
+}
+
+class DeferredParseThreadDispatcherTest : public ThreadDispatcherTest
+{
+public:
+  DeferredParseThreadDispatcherTest() : ThreadDispatcherTest(1, false, true) {}
+
+  // Returns true if the top Via of the given rdata has the received
+  // parameter that the transport manager would have added.
+  static bool rx_via_has_received(pjsip_rx_data* rdata)
+  {
+    return ((rdata->msg_info.via != NULL) &&
+            (rdata->msg_info.via->recvd_param.slen > 0));
+  }
+};
+
+// Messages queued as raw bytes should be parsed before they are passed on.
+TEST_F(DeferredParseThreadDispatcherTest, StandardInviteTest)
+{
+  TestingCommon::Message msg;
+  msg._method = "INVITE";
+
+  EXPECT_CALL(load_monitor, admit_request(_)).WillOnce(Return(true));
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(AllOf(ResultOf(rx_call_id_matches(msg.get_call_id()), true),
+                        ResultOf(rx_via_has_received, true))))
+    .WillOnce(Return(PJ_TRUE));
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillOnce(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _));
+
+  inject_msg_thread(msg.get_request());
+  process_queue_element();
+}
+
+// Responses queued as raw bytes should be parsed before they are passed on.
+TEST_F(DeferredParseThreadDispatcherTest, StandardResponseTest)
+{
+  TestingCommon::Message msg;
+  msg._method = "INVITE";
+  msg._status = "200 OK";
+
+  EXPECT_CALL(*mod_mock, on_rx_response(ResultOf(rx_call_id_matches(msg.get_call_id()), true)))
+    .WillOnce(Return(PJ_TRUE));
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillOnce(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _));
+
+  inject_msg_thread(msg.get_response());
+  process_queue_element();
+}
+
+// Old requests are still rejected when parsing is deferred, which relies on
+// the message having been parsed by the worker thread.
+TEST_F(DeferredParseThreadDispatcherTest, RejectOldInviteTest)
+{
+  TestingCommon::Message msg;
+  msg._method = "INVITE";
+
+  EXPECT_CALL(load_monitor, admit_request(_)).WillOnce(Return(true));
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillOnce(Return(100000));
+  EXPECT_CALL(*mod_mock, on_tx_response(ResultOf(get_tx_status_code, 503)));
+
+  inject_msg_thread(msg.get_request());
+  cwtest_advance_time_ms(REQUEST_ON_QUEUE_TIMEOUT_MS + 5);
+  process_queue_element();
+}
+
+// OPTIONS are still prioritised when parsing is deferred, as the priority is
+// taken from the original message.
+TEST_F(DeferredParseThreadDispatcherTest, PrioritiseOptionsTest)
+{
+  TestingCommon::Message msg1;
+  msg1._method = "INVITE";
+
+  TestingCommon::Message msg2;
+  msg2._method = "OPTIONS";
+
+  EXPECT_CALL(load_monitor, admit_request(_)).WillOnce(Return(true));
+
+  Expectation options_exp = EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg2.get_call_id()), true)))
+    .WillOnce(Return(PJ_TRUE));
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg1.get_call_id()), true)))
+    .After(options_exp)
+    .WillOnce(Return(PJ_TRUE));
+
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(2);
+
+  inject_msg_thread(msg1.get_request());
+  inject_msg_thread(msg2.get_request());
+  process_queue_element();
+  process_queue_element();
+}
+
+class PredictiveRejectThreadDispatcherTest : public ThreadDispatcherTest
+{
+public:
+  PredictiveRejectThreadDispatcherTest() : ThreadDispatcherTest(1, false, false, true) {}
+};
+
+// Requests should be rejected before they are queued if the predicted wait on
+// the queue (from the queue depth and the time taken to process previous
+// messages) exceeds the request-on-queue timeout.
+TEST_F(PredictiveRejectThreadDispatcherTest, RejectPredictedOldInviteTest)
+{
+  TestingCommon::Message msg1;
+  msg1._method = "INVITE";
+  TestingCommon::Message msg2;
+  msg2._method = "INVITE";
+  TestingCommon::Message msg3;
+  msg3._method = "INVITE";
+
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(2);
+
+  // The first message takes twice the request-on-queue timeout to process.
+  EXPECT_CALL(load_monitor, admit_request(_)).Times(2).WillRepeatedly(Return(true));
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg1.get_call_id()), true)))
+    .WillOnce(DoAll(
+      InvokeWithoutArgs([](){ cwtest_advance_time_ms(2 * REQUEST_ON_QUEUE_TIMEOUT_MS); }),
+      Return(PJ_TRUE)));
+  inject_msg_thread(msg1.get_request());
+  process_queue_element();
+
+  // The queue is empty, so the second message is queued.  The third message
+  // would have to wait for the second to be processed, so is rejected without
+  // consulting the load monitor.
+  EXPECT_CALL(*mod_mock, on_tx_response(ResultOf(get_tx_status_code, 503)));
+  inject_msg_thread(msg2.get_request());
+  inject_msg_thread(msg3.get_request());
+
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg2.get_call_id()), true)))
+    .WillOnce(Return(PJ_TRUE));
+  process_queue_element();
+}
+
+// Requests that the load monitor never rejects are also never rejected based
+// on the predicted queue wait.
+TEST_F(PredictiveRejectThreadDispatcherTest, NeverRejectOptionsTest)
+{
+  TestingCommon::Message msg1;
+  msg1._method = "INVITE";
+  TestingCommon::Message msg2;
+  msg2._method = "INVITE";
+  TestingCommon::Message msg3;
+  msg3._method = "OPTIONS";
+
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(3);
+  EXPECT_CALL(load_monitor, admit_request(_)).Times(2).WillRepeatedly(Return(true));
+
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg1.get_call_id()), true)))
+    .WillOnce(DoAll(
+      InvokeWithoutArgs([](){ cwtest_advance_time_ms(2 * REQUEST_ON_QUEUE_TIMEOUT_MS); }),
+      Return(PJ_TRUE)));
+  inject_msg_thread(msg1.get_request());
+  process_queue_element();
+
+  Expectation options_exp = EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg3.get_call_id()), true)))
+    .WillOnce(Return(PJ_TRUE));
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg2.get_call_id()), true)))
+    .After(options_exp)
+    .WillOnce(Return(PJ_TRUE));
+
+  inject_msg_thread(msg2.get_request());
+  inject_msg_thread(msg3.get_request());
+  process_queue_element();
+  process_queue_element();
+}
+
+class FairQueueingThreadDispatcherTest : public ThreadDispatcherTest
+{
+public:
+  // Allow one queued message per source.
+  FairQueueingThreadDispatcherTest() :
+    ThreadDispatcherTest(1, false, false, false, true, 1)
+  {}
+};
+
+// Requests should be rejected if their source already has the maximum number
+// of messages queued, and accepted again once the source's queue has drained.
+TEST_F(FairQueueingThreadDispatcherTest, RejectSourceQueueFullTest)
+{
+  TestingCommon::Message msg1;
+  msg1._method = "INVITE";
+  TestingCommon::Message msg2;
+  msg2._method = "INVITE";
+  TestingCommon::Message msg3;
+  msg3._method = "INVITE";
+
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(2);
+  EXPECT_CALL(load_monitor, admit_request(_)).Times(2).WillRepeatedly(Return(true));
+
+  // The second request is rejected without consulting the load monitor.
+  EXPECT_CALL(*mod_mock, on_tx_response(ResultOf(get_tx_status_code, 503)));
+  inject_msg_thread(msg1.get_request());
+  inject_msg_thread(msg2.get_request());
+
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg1.get_call_id()), true)))
+    .WillOnce(Return(PJ_TRUE));
+  process_queue_element();
+
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(msg3.get_call_id()), true)))
+    .WillOnce(Return(PJ_TRUE));
+  inject_msg_thread(msg3.get_request());
+  process_queue_element();
+}
+
+// Responses are never rejected, even if their source is at its limit.
+TEST_F(FairQueueingThreadDispatcherTest, NeverRejectResponseTest)
+{
+  TestingCommon::Message msg1;
+  msg1._method = "INVITE";
+  TestingCommon::Message msg2;
+  msg2._method = "INVITE";
+  msg2._status = "200 OK";
+
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(2);
+  EXPECT_CALL(load_monitor, admit_request(_)).WillOnce(Return(true));
+  EXPECT_CALL(*mod_mock, on_rx_request(_)).WillOnce(Return(PJ_TRUE));
+  EXPECT_CALL(*mod_mock, on_rx_response(_)).WillOnce(Return(PJ_TRUE));
+
+  inject_msg_thread(msg1.get_request());
+  inject_msg_thread(msg2.get_response());
+  process_queue_element();
+  process_queue_element();
+}
+
+class MethodAwarePriorityThreadDispatcherTest : public ThreadDispatcherTest
+{
+public:
+  MethodAwarePriorityThreadDispatcherTest() :
+    ThreadDispatcherTest(1,
+                         false,
+                         false,
+                         false,
+                         false,
+                         0,
+                         std::vector<int>(METHOD_AWARE_MESSAGE_PRIORITIES,
+                                          METHOD_AWARE_MESSAGE_PRIORITIES +
+                                            SipMessageClass::NUM_CLASSES))
+  {}
+};
+
+// Work on existing dialogs should be processed before new work, whatever
+// order the messages were received in.
+TEST_F(MethodAwarePriorityThreadDispatcherTest, PrioritiseExistingWorkTest)
+{
+  TestingCommon::Message register_msg;
+  register_msg._method = "REGISTER";
+
+  TestingCommon::Message invite_msg;
+  invite_msg._method = "INVITE";
+
+  TestingCommon::Message update_msg;
+  update_msg._method = "UPDATE";
+  update_msg._in_dialog = true;
+
+  TestingCommon::Message bye_msg;
+  bye_msg._method = "BYE";
+  bye_msg._in_dialog = true;
+
+  TestingCommon::Message rsp_msg;
+  rsp_msg._method = "INVITE";
+  rsp_msg._status = "200 OK";
+
+  // Only the out-of-dialog requests go through the load monitor.
+  EXPECT_CALL(load_monitor, admit_request(_)).Times(2).WillRepeatedly(Return(true));
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(5);
+
+  Expectation rsp_exp = EXPECT_CALL(*mod_mock,
+    on_rx_response(ResultOf(rx_call_id_matches(rsp_msg.get_call_id()), true)))
+    .WillOnce(Return(PJ_TRUE));
+  Expectation bye_exp = EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(bye_msg.get_call_id()), true)))
+    .After(rsp_exp)
+    .WillOnce(Return(PJ_TRUE));
+  Expectation update_exp = EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(update_msg.get_call_id()), true)))
+    .After(bye_exp)
+    .WillOnce(Return(PJ_TRUE));
+  Expectation invite_exp = EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(invite_msg.get_call_id()), true)))
+    .After(update_exp)
+    .WillOnce(Return(PJ_TRUE));
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(register_msg.get_call_id()), true)))
+    .After(invite_exp)
+    .WillOnce(Return(PJ_TRUE));
+
+  inject_msg_thread(register_msg.get_request());
+  inject_msg_thread(invite_msg.get_request());
+  inject_msg_thread(update_msg.get_request());
+  inject_msg_thread(bye_msg.get_request());
+  inject_msg_thread(rsp_msg.get_response());
+
+  for (int ii = 0; ii < 5; ++ii)
+  {
+    process_queue_element();
+  }
+}
+
+// OPTIONS polls are still processed ahead of new work.
+TEST_F(MethodAwarePriorityThreadDispatcherTest, PrioritiseOptionsTest)
+{
+  TestingCommon::Message invite_msg;
+  invite_msg._method = "INVITE";
+
+  TestingCommon::Message options_msg;
+  options_msg._method = "OPTIONS";
+
+  EXPECT_CALL(load_monitor, admit_request(_)).WillOnce(Return(true));
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _)).Times(2);
+
+  Expectation options_exp = EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(options_msg.get_call_id()), true)))
+    .WillOnce(Return(PJ_TRUE));
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(invite_msg.get_call_id()), true)))
+    .After(options_exp)
+    .WillOnce(Return(PJ_TRUE));
+
+  inject_msg_thread(invite_msg.get_request());
+  inject_msg_thread(options_msg.get_request());
+  process_queue_element();
+  process_queue_element();
+}
+
+// Callbacks are queued behind responses, but ahead of new work.
+TEST_F(MethodAwarePriorityThreadDispatcherTest, PrioritiseCallbackTest)
+{
+  TestingCommon::Message invite_msg;
+  invite_msg._method = "INVITE";
+
+  EXPECT_CALL(load_monitor, admit_request(_)).WillOnce(Return(true));
+  EXPECT_CALL(load_monitor, get_target_latency_us()).WillRepeatedly(Return(100000));
+  EXPECT_CALL(load_monitor, request_complete(_, _));
+
+  StrictMock<MockCallback>* cb = new StrictMock<MockCallback>();
+
+  Expectation cb_exp = EXPECT_CALL(*cb, run());
+  EXPECT_CALL(*cb, destruct());
+  EXPECT_CALL(*mod_mock,
+    on_rx_request(ResultOf(rx_call_id_matches(invite_msg.get_call_id()), true)))
+    .After(cb_exp)
+    .WillOnce(Return(PJ_TRUE));
+
+  inject_msg_thread(invite_msg.get_request());
+  add_callback_to_queue(cb);
+  process_queue_element();
+  process_queue_element();
+}
+
+class RxDataCloneBenchmark : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+};
+
+// Micro-benchmark comparing the cost to the transport thread of handing a
+// received message to the worker threads, by cloning the parsed message or
+// by copying the raw bytes.  The cost of parsing the raw copy on the worker
+// thread is shown separately.  This is disabled by default - run it with
+// --gtest_also_run_disabled_tests.
+TEST_F(RxDataCloneBenchmark, DISABLED_CompareHandoff)
+{
+  const int iterations = 20000;
+
+  TestingCommon::Message msg;
+  msg._method = "INVITE";
+  pjsip_rx_data* rdata = build_rxdata(msg.get_request());
+  parse_rxdata(rdata);
+
+  struct timespec start;
+  struct timespec end;
+
+  double clone_ns = 0;
+  double unparsed_ns = 0;
+  double parse_ns = 0;
+
+  for (int ii = 0; ii < iterations; ++ii)
+  {
+    pjsip_rx_data* clone_rdata;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pjsip_rx_data_clone(rdata, 0, &clone_rdata);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    clone_ns += ((end.tv_sec - start.tv_sec) * 1000000000.0) +
+                (end.tv_nsec - start.tv_nsec);
+    pjsip_rx_data_free_cloned(clone_rdata);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    PJUtils::clone_rx_data_unparsed(rdata, &clone_rdata);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    unparsed_ns += ((end.tv_sec - start.tv_sec) * 1000000000.0) +
+                   (end.tv_nsec - start.tv_nsec);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    EXPECT_EQ(PJ_SUCCESS, PJUtils::parse_rx_data_clone(clone_rdata));
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    parse_ns += ((end.tv_sec - start.tv_sec) * 1000000000.0) +
+                (end.tv_nsec - start.tv_nsec);
+    pjsip_rx_data_free_cloned(clone_rdata);
+  }
+
+  printf("Transport thread: pjsip_rx_data_clone %10.1fns/msg, "
+         "clone_rx_data_unparsed %10.1fns/msg\n",
+         clone_ns / iterations, unparsed_ns / iterations);
+  printf("Worker thread: parse_rx_data_clone %10.1fns/msg\n",
+         parse_ns / iterations);
+}
+
 class SipEventQueueTest : public ::testing::Test
 {
 public:
@@ -355,8 +923,7 @@ public:
     e2.type = MESSAGE;
     e2.event_data = event_data;
 
-    PriorityEventQueueBackend* q_backend = new PriorityEventQueueBackend();
-    q = new eventq<struct SipEvent>(0, true, q_backend);
+    q = new eventq<struct SipEvent>(0, true, new MultiLevelEventQueueBackend());
 
     cwtest_completely_control_time();
   }
@@ -378,109 +945,344 @@ public:
   eventq<struct SipEvent>* q;
 };
 
-// Test that higher priority SipEvents are 'larger' than lower priority ones.
-// 'Larger' SipEvents are returned sooner by the priority queue.
-TEST_F(SipEventQueueTest, PriorityOrdering)
+// Test that higher priority SipEvents are returned before lower priority ones.
+TEST_F(SipEventQueueTest, QueuePriorityOrdering)
 {
   // Lower the priority of e2
   e2.priority = 1;
 
-  // e1 should be 'larger' than e2
-  EXPECT_TRUE(SipEvent::compare(e2, e1));
-  EXPECT_TRUE(SipEvent::compare(e2, e1));
+  q->push(e2);
+  q->push(e1);
+
+  SipEvent e;
+
+  // e1 is higher priority, so should be returned first
+  q->pop(e);
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
+}
+
+// Test that SipEvents at the same priority level are returned in the order they
+// were pushed if they were stamped in that order.
+TEST_F(SipEventQueueTest, QueueFifoOrdering)
+{
+  e1.stamp_enqueue_time();
+  cwtest_advance_time_ms(1);
+  e2.stamp_enqueue_time();
+
+  q->push(e1);
+  q->push(e2);
+
+  SipEvent e;
+
+  q->pop(e);
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
 }
 
-// Test that older SipEvents are 'larger' than newer ones at the same priority
-// level.
-TEST_F(SipEventQueueTest, TimeOrdering)
+// Test that older SipEvents are returned before newer ones at the same priority
+// level, even if they are pushed out of order.
+TEST_F(SipEventQueueTest, QueueTimeOrdering)
 {
   // Set e1 to be older than e2
-  e1.stop_watch.start();
+  e1.stamp_enqueue_time();
   cwtest_advance_time_ms(1);
-  e2.stop_watch.start();
+  e2.stamp_enqueue_time();
+
+  q->push(e2);
+  q->push(e1);
 
-  // e1 should be 'larger' than e2
-  EXPECT_TRUE(SipEvent::compare(e2, e1));
-  EXPECT_TRUE(SipEvent::compare(e2, e1));
+  SipEvent e;
+
+  // e1 is older, so should be returned first
+  q->pop(e);
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
 }
 
-// Test that SipEvents are ordered by priority before time.
-TEST_F(SipEventQueueTest, PriorityAndTimeOrdering)
+// Test that SipEvents are returned from the queue in priority, then time, order.
+TEST_F(SipEventQueueTest, QueuePriorityAndTimeOrdering)
 {
   // Lower the priority of e2
   e2.priority = 1;
 
   // Set e2 to be older than e1
-  e1.stop_watch.start();
+  e2.stamp_enqueue_time();
   cwtest_advance_time_ms(1);
-  e2.stop_watch.start();
+  e1.stamp_enqueue_time();
+
+  q->push(e2);
+  q->push(e1);
+
+  SipEvent e;
 
-  // e1 should be 'larger' than e2
-  EXPECT_TRUE(SipEvent::compare(e2, e1));
-  EXPECT_TRUE(SipEvent::compare(e2, e1));
+  // e1 is higher priority, so should be returned first despite e2 being older
+  q->pop(e);
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
 }
 
-// Test that higher priority SipEvents are returned before lower priority ones.
-TEST_F(SipEventQueueTest, QueuePriorityOrdering)
+// Test that out of range priorities are treated as the lowest priority.
+TEST_F(SipEventQueueTest, QueueOutOfRangePriority)
 {
-  // Lower the priority of e2
-  e2.priority = 1;
+  e1.priority = SipEventPriorityLevel::NUM_PRIORITY_LEVELS + 5;
+  e2.priority = SipEventPriorityLevel::NORMAL_PRIORITY;
+
+  e1.stamp_enqueue_time();
+  cwtest_advance_time_ms(1);
+  e2.stamp_enqueue_time();
 
   q->push(e2);
   q->push(e1);
 
   SipEvent e;
 
-  // e1 is higher priority, so should be returned first
   q->pop(e);
   EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
 
   q->pop(e);
-  EXPECT_EQ(e2.priority, e.priority);
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
 }
 
-// Test that older SipEvents are returned before newer ones at the same priority
-// level.
-TEST_F(SipEventQueueTest, QueueTimeOrdering)
+class FairSipEventQueueTest : public SipEventQueueTest
 {
-  // Set e1 to be older than e2
-  e1.stop_watch.start();
+public:
+  FairSipEventQueueTest()
+  {
+    delete q;
+    q = new eventq<struct SipEvent>(0, true, new FairEventQueueBackend());
+
+    SipEventData event_data;
+    event_data.rdata = &rdata_3;
+    e3.type = MESSAGE;
+    e3.event_data = event_data;
+  }
+
+  // Returns the source with the specified address.
+  static SipEventSource source(const std::string& address)
+  {
+    SipEventSource source;
+    EXPECT_TRUE(source.parse(address));
+    return source;
+  }
+
+  SipEvent e3;
+  pjsip_rx_data rdata_3;
+};
+
+// Test that sources take it in turns, so a source with several queued events
+// doesn't hold up the events from other sources.
+TEST_F(FairSipEventQueueTest, QueueSourceFairness)
+{
+  e1.source = source("10.0.0.1");
+  e2.source = source("10.0.0.1");
+  e3.source = source("10.0.0.2");
+
+  e1.stamp_enqueue_time();
+  cwtest_advance_time_ms(1);
+  e2.stamp_enqueue_time();
   cwtest_advance_time_ms(1);
-  e2.stop_watch.start();
+  e3.stamp_enqueue_time();
 
+  q->push(e1);
   q->push(e2);
+  q->push(e3);
+
+  SipEvent e;
+
+  q->pop(e);
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e3.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
+
+  EXPECT_EQ(0, q->size());
+}
+
+// Test that a source with a weight has that many events in each turn.
+TEST_F(FairSipEventQueueTest, QueueSourceWeights)
+{
+  std::map<SipEventSource, int> weights;
+  weights[source("10.0.0.1")] = 2;
+  delete q;
+  q = new eventq<struct SipEvent>(0, true, new FairEventQueueBackend(2, weights));
+
+  SipEvent e4;
+  pjsip_rx_data rdata_4;
+  e4.type = MESSAGE;
+  e4.event_data.rdata = &rdata_4;
+
+  e1.source = source("10.0.0.1");
+  e2.source = source("10.0.0.1");
+  e4.source = source("10.0.0.1");
+  e3.source = source("10.0.0.2");
+
+  e1.stamp_enqueue_time();
+  cwtest_advance_time_ms(1);
+  e2.stamp_enqueue_time();
+  cwtest_advance_time_ms(1);
+  e4.stamp_enqueue_time();
+  cwtest_advance_time_ms(1);
+  e3.stamp_enqueue_time();
+
   q->push(e1);
+  q->push(e2);
+  q->push(e4);
+  q->push(e3);
 
   SipEvent e;
 
-  // e1 is older, so should be returned first
   q->pop(e);
   EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
 
   q->pop(e);
   EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e3.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e4.event_data.rdata, e.event_data.rdata);
+
+  EXPECT_EQ(0, q->size());
 }
 
-// Test that SipEvents are returned from the queue in priority, then time, order.
-TEST_F(SipEventQueueTest, QueuePriorityAndTimeOrdering)
+// Test that IPv4 and IPv6 addresses are parsed into sources, with an IPv4
+// address and its IPv4-mapped IPv6 form being the same source.
+TEST(SipEventSourceTest, Parse)
 {
-  // Lower the priority of e2
+  SipEventSource v4;
+  SipEventSource mapped;
+  SipEventSource v6;
+  SipEventSource other;
+
+  EXPECT_TRUE(v4.parse("10.0.0.1"));
+  EXPECT_TRUE(mapped.parse("::ffff:10.0.0.1"));
+  EXPECT_TRUE(v6.parse("2001:db8::1"));
+  EXPECT_TRUE(other.parse("10.0.0.2"));
+  EXPECT_FALSE(SipEventSource().parse("10.0.0.1:5060"));
+  EXPECT_FALSE(SipEventSource().parse("not-an-address"));
+
+  EXPECT_TRUE(v4 == mapped);
+  EXPECT_FALSE(v4 == v6);
+  EXPECT_FALSE(v4 == other);
+  EXPECT_TRUE(v4 < other);
+}
+
+// Test that higher priority SipEvents are returned before lower priority ones,
+// whichever source they come from.
+TEST_F(FairSipEventQueueTest, QueuePriorityOrdering)
+{
+  e1.source = source("10.0.0.1");
+  e2.source = source("10.0.0.1");
+  e3.source = source("10.0.0.2");
+
+  // Lower the priority of e1 and e2
+  e1.priority = 1;
   e2.priority = 1;
 
-  // Set e2 to be older than e1
-  e1.stop_watch.start();
+  q->push(e1);
+  q->push(e2);
+  q->push(e3);
+
+  SipEvent e;
+
+  q->pop(e);
+  EXPECT_EQ(e3.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
+
+  q->pop(e);
+  EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
+}
+
+// Test that older SipEvents from a source are returned before newer ones, even
+// if they are pushed out of order.
+TEST_F(FairSipEventQueueTest, QueueTimeOrdering)
+{
+  e1.source = source("10.0.0.1");
+  e2.source = source("10.0.0.1");
+
+  e1.stamp_enqueue_time();
   cwtest_advance_time_ms(1);
-  e2.stop_watch.start();
+  e2.stamp_enqueue_time();
 
   q->push(e2);
   q->push(e1);
 
   SipEvent e;
 
-  // e1 is higher priority, so should be returned first despite e2 being older
   q->pop(e);
   EXPECT_EQ(e1.event_data.rdata, e.event_data.rdata);
 
   q->pop(e);
   EXPECT_EQ(e2.event_data.rdata, e.event_data.rdata);
 }
+
+// Times pushing and then popping the specified number of SipEvents through a
+// queue backend, with one in ten events at high priority.  Returns the mean
+// time per event in nanoseconds.
+static double time_queue_backend(eventq<SipEvent>::Backend* backend, int depth)
+{
+  std::vector<SipEvent> events(depth);
+  for (int ii = 0; ii < depth; ++ii)
+  {
+    events[ii].priority = (ii % 10 == 0) ?
+                            SipEventPriorityLevel::HIGH_PRIORITY :
+                            SipEventPriorityLevel::NORMAL_PRIORITY;
+    events[ii].stop_watch.start();
+    events[ii].stamp_enqueue_time();
+  }
+
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (int ii = 0; ii < depth; ++ii)
+  {
+    backend->push(events[ii]);
+  }
+
+  while (!backend->empty())
+  {
+    backend->pop();
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double elapsed_ns = ((end.tv_sec - start.tv_sec) * 1000000000.0) +
+                      (end.tv_nsec - start.tv_nsec);
+  return elapsed_ns / depth;
+}
+
+// Micro-benchmark comparing the queue backends at various queue depths.  This
+// is disabled by default - run it with --gtest_also_run_disabled_tests.
+TEST(SipEventQueueBenchmark, DISABLED_CompareBackends)
+{
+  int depths[] = {10, 100, 1000, 20000};
+
+  for (int depth : depths)
+  {
+    MultiLevelEventQueueBackend multi_level_backend;
+    FairEventQueueBackend fair_backend;
+
+    double multi_level_ns = time_queue_backend(&multi_level_backend, depth);
+    double fair_ns = time_queue_backend(&fair_backend, depth);
+
+    printf("Depth %6d: MultiLevelEventQueueBackend %10.1fns/event, "
+           "FairEventQueueBackend %10.1fns/event\n",
+           depth, multi_level_ns, fair_ns);
+  }
+}
@@ -0,0 +1,149 @@
+/**
+ * @file tsx_arena_test.cpp UT for the per-transaction arena.
+ *
+ * Copyright (C) Metaswitch Networks 2017
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <map>
+#include <set>
+#include <string>
+#include "gtest/gtest.h"
+
+#include "stack.h"
+#include "tsx_arena.h"
+#include "siptest.hpp"
+
+/// Fixture for TsxArenaTest.  This is a SipTest so that the stack's caching
+/// pool is available for the arenas' pools.
+class TsxArenaTest : public SipTest
+{
+public:
+  static void SetUpTestCase()
+  {
+    SipTest::SetUpTestCase();
+  }
+
+  static void TearDownTestCase()
+  {
+    SipTest::TearDownTestCase();
+  }
+
+  TsxArenaStats _stats;
+};
+
+// Memory from the arena is aligned for any type, and every allocation is
+// counted.
+TEST_F(TsxArenaTest, Alloc)
+{
+  TsxArena arena(&_stats);
+
+  for (size_t size = 1; size < 40; ++size)
+  {
+    void* ptr = arena.alloc(size);
+    ASSERT_TRUE(ptr != NULL);
+    EXPECT_EQ(0u, (uintptr_t)ptr % 16);
+  }
+
+  EXPECT_EQ(39, arena.allocations());
+  EXPECT_GT(arena.used_bytes(), 0u);
+}
+
+// Objects created in the arena are value-initialized.
+TEST_F(TsxArenaTest, Create)
+{
+  TsxArena arena(&_stats);
+
+  pj_timer_entry* entry = arena.create<pj_timer_entry>();
+  EXPECT_EQ(0, entry->id);
+  EXPECT_TRUE(entry->user_data == NULL);
+  EXPECT_EQ(1, arena.allocations());
+}
+
+// Standard containers can keep their nodes in the arena.
+TEST_F(TsxArenaTest, Containers)
+{
+  TsxArena arena(&_stats);
+
+  typedef std::map<int, std::string, std::less<int>,
+                   TsxArenaAllocator<std::pair<const int, std::string>>> Map;
+  Map map(Map::key_compare(), Map::allocator_type(&arena));
+
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    map[ii] = std::to_string(ii);
+  }
+  map.erase(50);
+
+  EXPECT_EQ(99u, map.size());
+  EXPECT_EQ("99", map[99]);
+  EXPECT_GE(arena.allocations(), 100);
+
+  typedef std::set<int, std::less<int>, TsxArenaAllocator<int>> Set;
+  Set set(Set::key_compare(), Set::allocator_type(&arena));
+  set.insert(1);
+  EXPECT_EQ(1u, set.count(1));
+}
+
+// Arenas record their use in the stats when they are released.
+TEST_F(TsxArenaTest, Stats)
+{
+  size_t used;
+  {
+    TsxArena arena(&_stats);
+    arena.alloc(100);
+    arena.alloc(200);
+    used = arena.used_bytes();
+  }
+
+  EXPECT_EQ(1u, _stats.arenas());
+  EXPECT_EQ(2u, _stats.allocations());
+  EXPECT_EQ(used, _stats.bytes());
+  EXPECT_EQ(used, _stats.high_water_bytes());
+  EXPECT_EQ(0u, _stats.overflows());
+
+  // An arena that outgrows its first block is counted as an overflow.
+  {
+    TsxArena arena(&_stats);
+    for (int ii = 0; ii < 10; ++ii)
+    {
+      arena.alloc(TsxArenaStats::MAX_INITIAL_SIZE);
+    }
+  }
+
+  EXPECT_EQ(2u, _stats.arenas());
+  EXPECT_EQ(1u, _stats.overflows());
+  EXPECT_GT(_stats.high_water_bytes(), used);
+}
+
+// New arenas are sized from the memory recent arenas used, within limits.
+TEST_F(TsxArenaTest, InitialSize)
+{
+  EXPECT_EQ(TsxArenaStats::MIN_INITIAL_SIZE, _stats.initial_size());
+
+  // Arenas that use lots of memory grow the initial size, up to the maximum.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    _stats.record(1, 10 * TsxArenaStats::MAX_INITIAL_SIZE, true);
+  }
+  EXPECT_EQ(TsxArenaStats::MAX_INITIAL_SIZE, _stats.initial_size());
+
+  // Arenas that use little memory shrink it again, down to the minimum.
+  for (int ii = 0; ii < 100; ++ii)
+  {
+    _stats.record(1, 16, false);
+  }
+  EXPECT_EQ(TsxArenaStats::MIN_INITIAL_SIZE, _stats.initial_size());
+
+  // In between, the size is a bit more than the average use.
+  for (int ii = 0; ii < 200; ++ii)
+  {
+    _stats.record(1, 4096, false);
+  }
+  EXPECT_GT(_stats.initial_size(), 4096u);
+  EXPECT_LE(_stats.initial_size(), 4096u + 4096u / 4 + 16);
+}